@@ -0,0 +1,433 @@
+/*
+ * bench_at_replay.c
+ *
+ * Replays recorded AG transcripts into a live session, one end of a
+ * socketpair handed to new_rfcomm_connection() as BlueZ would, and
+ * checks every byte the daemon sends back. Reports lines per second,
+ * per-command handling latency and heap allocations per command.
+ *
+ * A transcript has one record per line, '#' starts a comment:
+ *
+ *   <usec> < <bytes>	sent by the AG
+ *   <usec> > <bytes>	expected from us
+ *
+ *   @sdp <version> <features>	AG SDP record, else there is none
+ *
+ * Bytes use C escapes (\r, \n, \\, \xHH). Each replay runs on a fresh
+ * connection; timestamps are only honored with -p. With -z any heap
+ * allocation while handling input after the first replay is a failure,
+ * the AT path is meant to run allocation free once warmed up.
+ *
+ * Build: make CFLAGS=-O2 bench_at_replay (from src/)
+ * Usage: bench_at_replay [-n iterations] [-p] [-z] transcript...
+ */
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "main.h"
+#include "session.h"
+
+#define REPLAY_PATH	"/org/bluez/hci0/dev_00_11_22_33_44_55"
+
+struct step {
+	uint64_t time;
+	bool inbound;
+	char *data;
+	size_t len;
+	unsigned int lines;
+};
+
+struct transcript {
+	const char *name;
+	struct step *steps;
+	unsigned int count;
+	size_t expected_len;
+	struct slc_sdp sdp;
+	bool has_sdp;
+};
+
+/*
+ * Every heap allocation in the process, libell's included, goes through
+ * these, so the count covers the whole command path.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+#define ALLOCATIONS()	__atomic_load_n(&allocations, __ATOMIC_RELAXED)
+#else
+#define ALLOCATIONS()	0
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t unescape(const char *in, char *out)
+{
+	size_t len = 0;
+	unsigned int hex;
+
+	while (*in) {
+		if (*in != '\\') {
+			out[len++] = *in++;
+			continue;
+		}
+
+		switch (*++in) {
+		case 'r':
+			out[len++] = '\r';
+			break;
+		case 'n':
+			out[len++] = '\n';
+			break;
+		case 't':
+			out[len++] = '\t';
+			break;
+		case 'x':
+			if (sscanf(in + 1, "%2x", &hex) == 1) {
+				out[len++] = hex;
+				in += 2;
+			}
+			break;
+		case '\0':
+			return len;
+		default:
+			out[len++] = *in;
+			break;
+		}
+
+		in++;
+	}
+
+	return len;
+}
+
+static unsigned int count_lines(const char *data, size_t len)
+{
+	unsigned int lines = 0;
+	bool in_line = false;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] == '\r' || data[i] == '\n') {
+			lines += in_line;
+			in_line = false;
+		} else {
+			in_line = true;
+		}
+	}
+
+	return lines;
+}
+
+static bool transcript_load(struct transcript *t, const char *path)
+{
+	char buf[4096], *line, dir;
+	unsigned long long time;
+	unsigned int size = 0, version, features;
+	struct step *step;
+	FILE *fp;
+	int pos;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	while ((line = fgets(buf, sizeof(buf), fp))) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (*line == '#' || *line == '\0')
+			continue;
+
+		if (sscanf(line, "@sdp %i %i", &version, &features) == 2) {
+			t->sdp.version = version;
+			t->sdp.features = features;
+			t->has_sdp = true;
+			continue;
+		}
+
+		if (sscanf(line, "%llu %c %n", &time, &dir, &pos) != 2 ||
+				(dir != '<' && dir != '>')) {
+			fprintf(stderr, "%s: bad record: %s\n", path, line);
+			fclose(fp);
+			return false;
+		}
+
+		if (t->count == size) {
+			size = size ? size * 2 : 64;
+			t->steps = l_realloc(t->steps, size * sizeof(*step));
+		}
+
+		step = &t->steps[t->count++];
+		step->time = time;
+		step->inbound = dir == '<';
+		step->data = l_malloc(strlen(line + pos) + 1);
+		step->len = unescape(line + pos, step->data);
+		step->lines = count_lines(step->data, step->len);
+
+		if (!step->inbound)
+			t->expected_len += step->len;
+	}
+
+	fclose(fp);
+	return true;
+}
+
+static void transcript_free(struct transcript *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->count; i++)
+		l_free(t->steps[i].data);
+
+	l_free(t->steps);
+}
+
+/* Runs the loop until the session consumed its input and sent its reply. */
+static void pump(struct hfp_session *session, int fd)
+{
+	int pending;
+
+	do {
+		l_main_iterate(0);
+
+		if (ioctl(fd, FIONREAD, &pending) < 0)
+			pending = 0;
+	} while (pending || session->txq.head != session->txq.tail);
+}
+
+static size_t collect(int fd, char *got, size_t len, size_t size)
+{
+	ssize_t n;
+
+	while (len < size && (n = read(fd, got + len, size - len)) > 0)
+		len += n;
+
+	return len;
+}
+
+static void print_context(const char *label, const char *data, size_t len,
+								size_t off)
+{
+	size_t i = off > 32 ? off - 32 : 0, end = L_MIN(len, off + 32);
+
+	fprintf(stderr, "  %-8s ", label);
+
+	for (; i < end; i++) {
+		if (data[i] == '\r')
+			fputs("\\r", stderr);
+		else if (data[i] == '\n')
+			fputs("\\n", stderr);
+		else
+			fputc(data[i], stderr);
+	}
+
+	fputc('\n', stderr);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool replay(struct transcript *t, unsigned int iterations, bool pace,
+							bool zero_alloc)
+{
+	uint64_t *samples, total_ns = 0, allocs = 0, start, begin, lines = 0;
+	uint64_t warm_allocs = 0;
+	unsigned int iter, i, nsamples = 0, ninbound = 0;
+	char *expected, *got;
+	size_t got_len, exp_len, size;
+	struct hfp_session *session;
+	bool ok = true;
+	int sv[2];
+
+	for (i = 0; i < t->count; i++)
+		ninbound += t->steps[i].inbound;
+
+	samples = l_new(uint64_t, (size_t) ninbound * iterations + 1);
+
+	size = t->expected_len + 4096;
+	expected = l_malloc(size);
+	got = l_malloc(size);
+
+	for (iter = 0; iter < iterations && ok; iter++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+			perror("socketpair");
+			return false;
+		}
+
+		new_rfcomm_connection(REPLAY_PATH, sv[0],
+					t->has_sdp ? &t->sdp : NULL);
+		session = session_lookup(REPLAY_PATH);
+		pump(session, sv[0]);
+
+		got_len = collect(sv[1], got, 0, size);
+		exp_len = 0;
+		begin = now_ns();
+
+		for (i = 0; i < t->count; i++) {
+			struct step *step = &t->steps[i];
+			uint64_t before;
+
+			if (!step->inbound) {
+				memcpy(expected + exp_len, step->data,
+								step->len);
+				exp_len += step->len;
+				continue;
+			}
+
+			while (pace && now_ns() - begin < step->time * 1000)
+				usleep(100);
+
+			if (write(sv[1], step->data, step->len) !=
+						(ssize_t) step->len) {
+				perror("write");
+				ok = false;
+				break;
+			}
+
+			before = ALLOCATIONS();
+			start = now_ns();
+			pump(session, sv[0]);
+			samples[nsamples] = now_ns() - start;
+			allocs += ALLOCATIONS() - before;
+			if (iter > 0)
+				warm_allocs += ALLOCATIONS() - before;
+
+			total_ns += samples[nsamples];
+			/* Latency per command when a step carries several. */
+			if (step->lines > 1)
+				samples[nsamples] /= step->lines;
+			nsamples++;
+			lines += step->lines;
+
+			got_len = collect(sv[1], got, got_len, size);
+		}
+
+		if (got_len != exp_len || memcmp(got, expected, exp_len)) {
+			size_t off = 0;
+
+			while (off < got_len && off < exp_len &&
+						got[off] == expected[off])
+				off++;
+
+			fprintf(stderr, "%s: responses differ at byte %zu "
+					"(got %zu, expected %zu bytes)\n",
+					t->name, off, got_len, exp_len);
+			print_context("got", got, got_len, off);
+			print_context("expected", expected, exp_len, off);
+			ok = false;
+		}
+
+		session_destroy(session);
+		close(sv[1]);
+	}
+
+	qsort(samples, nsamples, sizeof(*samples), cmp_u64);
+
+	printf("%-16s %4u x %5u lines  %9.0f lines/s  p50 %6.2f us  "
+			"p99 %6.2f us  %5.2f allocs/cmd  %s\n",
+			t->name, iter, (unsigned int) (lines / L_MAX(iter, 1u)),
+			total_ns ? lines * 1e9 / total_ns : 0.0,
+			nsamples ? samples[nsamples / 2] / 1e3 : 0.0,
+			nsamples ? samples[nsamples * 99 / 100] / 1e3 : 0.0,
+			lines ? (double) allocs / lines : 0.0,
+			ok ? "responses ok" : "RESPONSES DIFFER");
+
+	if (zero_alloc && warm_allocs) {
+		fprintf(stderr, "%s: %llu heap allocations after warmup\n",
+				t->name, (unsigned long long) warm_allocs);
+		ok = false;
+	}
+
+	l_free(samples);
+	l_free(expected);
+	l_free(got);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iterations = 200;
+	struct transcript t;
+	bool pace = false, zero_alloc = false, ok = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:pz")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			pace = true;
+			break;
+		case 'z':
+			zero_alloc = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind == argc)
+		goto usage;
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	for (; optind < argc; optind++) {
+		if (!transcript_load(&t, argv[optind])) {
+			ok = false;
+			continue;
+		}
+
+		ok &= replay(&t, iterations, pace, zero_alloc);
+		transcript_free(&t);
+	}
+
+	session_cleanup();
+	l_main_exit();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n iterations] [-p] [-z] transcript...\n",
+									argv[0]);
+	return EXIT_FAILURE;
+}
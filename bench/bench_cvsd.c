@@ -0,0 +1,74 @@
+/*
+ * bench_cvsd.c
+ *
+ * CVSD decoder throughput, reported as the number of 64 kbit/s calls
+ * one core could decode in real time. Also checks that the selected
+ * implementation is bit exact against the scalar reference.
+ *
+ * Build: make CFLAGS=-O2 bench_cvsd (from src/)
+ * Usage: bench_cvsd [seconds of audio]
+ */
+
+#include <time.h>
+
+#include "main.h"
+#include "cvsd.h"
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* SCO packets carry 60 bytes of CVSD in transparent mode. */
+static double run(cvsd_decode_func_t decode, const uint8_t *in, size_t len,
+							int16_t *pcm)
+{
+	struct cvsd_decoder dec;
+	double start;
+	size_t n;
+
+	cvsd_decoder_init(&dec);
+	start = cpu_seconds();
+
+	for (n = 0; n < len; n += 60)
+		decode(&dec, in + n, L_MIN(len - n, (size_t) 60), pcm + n);
+
+	return cpu_seconds() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seconds = argc > 1 ? strtoul(argv[1], NULL, 10) : 600;
+	size_t len = (size_t) seconds * CVSD_RATE, n, mismatches = 0;
+	cvsd_decode_func_t fast = cvsd_decode_select();
+	int16_t *ref_pcm, *fast_pcm;
+	uint8_t *in;
+	double cpu;
+
+	in = l_malloc(len);
+	ref_pcm = l_malloc(len * sizeof(int16_t));
+	fast_pcm = l_malloc(len * sizeof(int16_t));
+
+	for (n = 0; n < len; n++)
+		in[n] = random();
+
+	cpu = run(cvsd_decode_scalar, in, len, ref_pcm);
+	printf("%-9s %u s audio in %.3f s cpu: %.0f calls per core\n",
+			"scalar", seconds, cpu, seconds / cpu);
+
+	cpu = run(fast, in, len, fast_pcm);
+	printf("%-9s %u s audio in %.3f s cpu: %.0f calls per core\n",
+			cvsd_decode_name(fast), seconds, cpu, seconds / cpu);
+
+	for (n = 0; n < len; n++)
+		if (ref_pcm[n] != fast_pcm[n])
+			mismatches++;
+
+	printf("cross-check %s vs scalar: %zu samples, %zu mismatches\n",
+			cvsd_decode_name(fast), len, mismatches);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,721 @@
+/*
+ * bench_dbus.c
+ *
+ * The daemon's D-Bus path end to end, without bluetoothd or an adapter.
+ * Starts a private dbus-daemon, plays org.bluez on it with a
+ * ProfileManager1 and an ObjectManager listing synthetic Device1
+ * objects, and runs the daemon against it. Once the daemon registered
+ * its profile, connections go to it through Profile1.NewConnection,
+ * each with one end of a socketpair standing in for RFCOMM, and end as
+ * soon as the first AT command arrives: by RequestDisconnection for
+ * the given share of them, by hanging up otherwise. Release is called
+ * every so often and once at the end.
+ *
+ * Reports daemon startup to RegisterProfile, NewConnection to its reply
+ * and to the first AT byte, and the connections per second the daemon
+ * sustained, as fast as it goes with -c connections in flight or at a
+ * fixed rate with -r.
+ *
+ * Build: make CFLAGS=-O2 bench_dbus hfp_recorder (from src/)
+ * Usage: bench_dbus [-n connections] [-c concurrent] [-r per second]
+ *	[-d percent by RequestDisconnection] [-R release every]
+ *	[-b dbus-daemon] [-v] [daemon]
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "main.h"
+
+/* Where the daemon's org.bluez client looks for objects. */
+#define BLUEZ_ROOT		"/org/bluez"
+#define DEVICE_PATH		BLUEZ_ROOT "/hci0/dev_00_11_22_33_%02X_%02X"
+#define DEVICE_ADDRESS		"00:11:22:33:%02X:%02X"
+#define MAX_LINKS		256
+/* Seconds without progress before giving up. */
+#define STALL_TIMEOUT		10
+/* Let the daemon digest the reply to RegisterProfile first. */
+#define SETTLE_MS		100
+
+struct link {
+	char path[64];
+	char address[18];
+	struct l_io *io;		/* our end, NULL while idle */
+	uint64_t sent;			/* l_time_now(), NewConnection */
+	bool disconnecting;		/* RequestDisconnection in flight */
+};
+
+static struct link links[MAX_LINKS];
+static unsigned int nlinks = 8;
+static unsigned int total = 1000;
+static unsigned int rate;		/* per second, 0 as fast as it goes */
+static unsigned int disconnect_share = 50;	/* percent */
+static unsigned int release_every;
+static bool verbose;
+
+static const char *daemon_path = "./hfp_recorder";
+static const char *bus_daemon = "dbus-daemon";
+static char tmpdir[] = "/tmp/bench_dbus.XXXXXX";
+static char *bus_address;
+static pid_t bus_pid, daemon_pid;
+
+static struct l_dbus *bus;
+static struct l_signal *child_signal;
+static struct l_timeout *stall, *ticker;
+static char *profile_owner, *profile_path;
+
+static uint64_t daemon_started, profile_registered, begun, finished;
+static unsigned int started, ended, disconnects, releases, errors, missed;
+static uint64_t *reply_times, *first_byte_times;
+static unsigned int replies, first_bytes;
+static bool failed;
+
+static void stop(bool failure)
+{
+	failed |= failure;
+	if (!finished)
+		finished = l_time_now();
+	l_main_quit();
+}
+
+static void stall_timeout(struct l_timeout *timeout, void *user_data)
+{
+	fprintf(stderr, "no progress in %u seconds: %u of %u connections "
+				"done\n", STALL_TIMEOUT, ended, total);
+	stop(true);
+}
+
+static void progress(void)
+{
+	l_timeout_modify(stall, STALL_TIMEOUT);
+}
+
+static void child_exited(void *user_data)
+{
+	int status;
+
+	if (waitpid(daemon_pid, &status, WNOHANG) != daemon_pid)
+		return;
+
+	fprintf(stderr, "daemon exited with status %d\n",
+			WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	daemon_pid = 0;
+	stop(true);
+}
+
+static struct l_dbus_message *get_managed_objects(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	bool connected = false;
+	unsigned int i;
+
+	reply = l_dbus_message_new_method_return(message);
+
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "{oa{sa{sv}}}");
+
+	l_dbus_message_builder_enter_dict(builder, "oa{sa{sv}}");
+	l_dbus_message_builder_append_basic(builder, 'o', BLUEZ_ROOT);
+	l_dbus_message_builder_enter_array(builder, "{sa{sv}}");
+	l_dbus_message_builder_enter_dict(builder, "sa{sv}");
+	l_dbus_message_builder_append_basic(builder, 's',
+						"org.bluez.ProfileManager1");
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_dict(builder);
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_dict(builder);
+
+	for (i = 0; i < nlinks; i++) {
+		l_dbus_message_builder_enter_dict(builder, "oa{sa{sv}}");
+		l_dbus_message_builder_append_basic(builder, 'o',
+							links[i].path);
+		l_dbus_message_builder_enter_array(builder, "{sa{sv}}");
+		l_dbus_message_builder_enter_dict(builder, "sa{sv}");
+		l_dbus_message_builder_append_basic(builder, 's',
+							"org.bluez.Device1");
+		l_dbus_message_builder_enter_array(builder, "{sv}");
+
+		l_dbus_message_builder_enter_dict(builder, "sv");
+		l_dbus_message_builder_append_basic(builder, 's', "Address");
+		l_dbus_message_builder_enter_variant(builder, "s");
+		l_dbus_message_builder_append_basic(builder, 's',
+							links[i].address);
+		l_dbus_message_builder_leave_variant(builder);
+		l_dbus_message_builder_leave_dict(builder);
+
+		l_dbus_message_builder_enter_dict(builder, "sv");
+		l_dbus_message_builder_append_basic(builder, 's', "Alias");
+		l_dbus_message_builder_enter_variant(builder, "s");
+		l_dbus_message_builder_append_basic(builder, 's', "bench AG");
+		l_dbus_message_builder_leave_variant(builder);
+		l_dbus_message_builder_leave_dict(builder);
+
+		l_dbus_message_builder_enter_dict(builder, "sv");
+		l_dbus_message_builder_append_basic(builder, 's', "Connected");
+		l_dbus_message_builder_enter_variant(builder, "b");
+		l_dbus_message_builder_append_basic(builder, 'b', &connected);
+		l_dbus_message_builder_leave_variant(builder);
+		l_dbus_message_builder_leave_dict(builder);
+
+		l_dbus_message_builder_leave_array(builder);
+		l_dbus_message_builder_leave_dict(builder);
+		l_dbus_message_builder_leave_array(builder);
+		l_dbus_message_builder_leave_dict(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static void object_manager_setup(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "GetManagedObjects", 0,
+				get_managed_objects, "a{oa{sa{sv}}}", "",
+				"objects");
+}
+
+static void release_reply(struct l_dbus_message *reply, void *user_data)
+{
+	if (l_dbus_message_is_error(reply))
+		errors++;
+
+	/* The last one, sent once every connection ended. */
+	if (user_data)
+		stop(false);
+}
+
+static void send_release(bool last)
+{
+	struct l_dbus_message *msg;
+
+	msg = l_dbus_message_new_method_call(bus, profile_owner, profile_path,
+					"org.bluez.Profile1", "Release");
+	l_dbus_message_set_arguments(msg, "");
+	l_dbus_send_with_reply(bus, msg, release_reply,
+					last ? (void *) 1 : NULL, NULL);
+	releases++;
+}
+
+static void link_connect(struct link *link);
+
+/* Every connection ended or, at a fixed rate, never got a link. */
+static bool finish(void)
+{
+	if (finished || ended + missed < total)
+		return false;
+
+	finished = l_time_now();
+	send_release(true);
+	return true;
+}
+
+static struct link *idle_link(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nlinks; i++) {
+		if (!links[i].io)
+			return &links[i];
+	}
+
+	return NULL;
+}
+
+static void link_end(struct link *link)
+{
+	l_io_destroy(link->io);
+	link->io = NULL;
+	link->disconnecting = false;
+	ended++;
+	progress();
+
+	if (release_every && !(ended % release_every))
+		send_release(false);
+
+	if (!finish() && !rate && started < total)
+		link_connect(link);
+}
+
+static void disconnection_reply(struct l_dbus_message *reply,
+							void *user_data)
+{
+	if (l_dbus_message_is_error(reply))
+		errors++;
+
+	link_end(user_data);
+}
+
+static void request_disconnection(struct link *link)
+{
+	struct l_dbus_message *msg;
+
+	msg = l_dbus_message_new_method_call(bus, profile_owner, profile_path,
+					"org.bluez.Profile1",
+					"RequestDisconnection");
+	l_dbus_message_set_arguments(msg, "o", link->path);
+	l_dbus_send_with_reply(bus, msg, disconnection_reply, link, NULL);
+	link->disconnecting = true;
+	disconnects++;
+}
+
+static bool link_read(struct l_io *io, void *user_data)
+{
+	struct link *link = user_data;
+	char buf[256];
+	ssize_t len;
+
+	len = read(l_io_get_fd(io), buf, sizeof(buf));
+	if (len <= 0)
+		return true;
+
+	first_byte_times[first_bytes++] = l_time_now() - link->sent;
+
+	/* The first AT command is all this is after, the rest is dropped. */
+	if (disconnects * 100 < (ended + 1) * disconnect_share) {
+		request_disconnection(link);
+		return false;
+	}
+
+	link_end(link);
+	return true;
+}
+
+static void link_hangup(struct l_io *io, void *user_data)
+{
+	struct link *link = user_data;
+
+	/* Asked for, the reply to RequestDisconnection ends the link. */
+	if (link->disconnecting)
+		return;
+
+	fprintf(stderr, "daemon hung up on %s\n", link->path);
+	errors++;
+	link_end(link);
+}
+
+static void new_connection_reply(struct l_dbus_message *reply,
+							void *user_data)
+{
+	struct link *link = user_data;
+	const char *name, *text;
+
+	if (l_dbus_message_get_error(reply, &name, &text)) {
+		fprintf(stderr, "NewConnection: %s: %s\n", name, text);
+		errors++;
+		return;
+	}
+
+	reply_times[replies++] = l_time_now() - link->sent;
+}
+
+static void link_connect(struct link *link)
+{
+	struct l_dbus_message *msg;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+								sv) < 0) {
+		perror("socketpair");
+		stop(true);
+		return;
+	}
+
+	msg = l_dbus_message_new_method_call(bus, profile_owner, profile_path,
+					"org.bluez.Profile1", "NewConnection");
+	/* As BlueZ passes the AG's SDP record: HFP 1.7, codec negotiation. */
+	l_dbus_message_set_arguments(msg, "oha{sv}", link->path, sv[1], 2,
+					"Version", "q", 0x0107,
+					"Features", "q", 0x0020);
+
+	link->io = l_io_new(sv[0]);
+	l_io_set_close_on_destroy(link->io, true);
+	l_io_set_read_handler(link->io, link_read, link, NULL);
+	l_io_set_disconnect_handler(link->io, link_hangup, link, NULL);
+
+	link->sent = l_time_now();
+	l_dbus_send_with_reply(bus, msg, new_connection_reply, link, NULL);
+	started++;
+
+	/* The message holds a duplicate for the daemon. */
+	close(sv[1]);
+}
+
+/* Fixed rate: whatever is due goes out, if a link is free for it. */
+static void tick(struct l_timeout *timeout, void *user_data)
+{
+	uint64_t due = (l_time_now() - begun) * rate / 1000000;
+	struct link *link;
+
+	while (started + missed < due && started + missed < total) {
+		link = idle_link();
+		if (!link) {
+			missed++;
+			continue;
+		}
+
+		link_connect(link);
+	}
+
+	if (started + missed < total)
+		l_timeout_modify_ms(timeout, 1);
+	else
+		finish();
+}
+
+static void begin(struct l_timeout *timeout, void *user_data)
+{
+	unsigned int i;
+
+	l_timeout_remove(timeout);
+	begun = l_time_now();
+
+	if (rate) {
+		ticker = l_timeout_create_ms(1, tick, NULL, NULL);
+		return;
+	}
+
+	for (i = 0; i < nlinks && started < total; i++)
+		link_connect(&links[i]);
+}
+
+static struct l_dbus_message *register_profile(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_message_iter options, variant;
+	const char *path, *uuid, *key;
+	uint16_t channel = 0, version = 0;
+
+	if (!l_dbus_message_get_arguments(message, "osa{sv}", &path, &uuid,
+								&options))
+		return l_dbus_message_new_error(message,
+					"org.bluez.Error.InvalidArguments",
+					"Invalid arguments");
+
+	/* The daemon asks for a fixed RFCOMM channel and its HFP version. */
+	while (l_dbus_message_iter_next_entry(&options, &key, &variant)) {
+		if (!strcmp(key, "Channel"))
+			l_dbus_message_iter_get_variant(&variant, "q", &channel);
+		else if (!strcmp(key, "Version"))
+			l_dbus_message_iter_get_variant(&variant, "q", &version);
+	}
+
+	if (!channel || !version)
+		return l_dbus_message_new_error(message,
+					"org.bluez.Error.InvalidArguments",
+					"Invalid arguments");
+
+	if (profile_owner)
+		return l_dbus_message_new_error(message,
+					"org.bluez.Error.AlreadyExists",
+					"Already Exists");
+
+	profile_registered = l_time_now();
+	profile_owner = l_strdup(l_dbus_message_get_sender(message));
+	profile_path = l_strdup(path);
+
+	if (verbose)
+		fprintf(stderr, "profile %s %s channel %u version 0x%04x "
+				"registered by %s\n", uuid, path, channel,
+				version, profile_owner);
+
+	progress();
+	l_timeout_create_ms(SETTLE_MS, begin, NULL, NULL);
+
+	return l_dbus_message_new_method_return(message);
+}
+
+static struct l_dbus_message *unregister_profile(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	return l_dbus_message_new_method_return(message);
+}
+
+static void profile_manager_setup(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "RegisterProfile", 0,
+				register_profile, "", "osa{sv}",
+				"profile", "UUID", "options");
+	l_dbus_interface_method(interface, "UnregisterProfile", 0,
+				unregister_profile, "", "o", "profile");
+}
+
+/* The daemon finds the bus in its environment, the system bus for it. */
+static void start_daemon(void)
+{
+	char *journal = l_strdup_printf("%s/events.journal", tmpdir);
+	char *argv[] = { (char *) daemon_path, NULL };
+	int null;
+
+	daemon_started = l_time_now();
+
+	daemon_pid = fork();
+	if (!daemon_pid) {
+		setenv("DBUS_SYSTEM_BUS_ADDRESS", bus_address, 1);
+		setenv("HFP_RECORDER_DIR", tmpdir, 1);
+		setenv("HFP_RECORDER_JOURNAL", journal, 1);
+
+		if (!verbose) {
+			null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+
+		execv(daemon_path, argv);
+		_exit(127);
+	}
+
+	l_free(journal);
+
+	if (daemon_pid < 0) {
+		perror("fork");
+		stop(true);
+	}
+}
+
+static void name_acquired(struct l_dbus *dbus, bool success, bool queued,
+							void *user_data)
+{
+	if (!success) {
+		fprintf(stderr, "failed to own org.bluez\n");
+		stop(true);
+		return;
+	}
+
+	start_daemon();
+}
+
+static void bus_ready(void *user_data)
+{
+	if (!l_dbus_register_interface(bus,
+				"org.freedesktop.DBus.ObjectManager",
+				object_manager_setup, NULL, false) ||
+			!l_dbus_register_interface(bus,
+				"org.bluez.ProfileManager1",
+				profile_manager_setup, NULL, false) ||
+			!l_dbus_object_add_interface(bus, BLUEZ_ROOT,
+				"org.freedesktop.DBus.ObjectManager", NULL) ||
+			!l_dbus_object_add_interface(bus, BLUEZ_ROOT,
+				"org.bluez.ProfileManager1", NULL)) {
+		fprintf(stderr, "failed to export org.bluez objects\n");
+		stop(true);
+		return;
+	}
+
+	l_dbus_name_acquire(bus, "org.bluez", false, false, false,
+						name_acquired, NULL);
+}
+
+/* A private bus, its address comes back through a pipe. */
+static bool start_bus(void)
+{
+	char listen[64], print[32], buf[256];
+	char *argv[] = { (char *) bus_daemon, "--session", "--nofork",
+				listen, print, NULL };
+	ssize_t len;
+	int fds[2];
+
+	if (pipe(fds) < 0)
+		return false;
+
+	snprintf(listen, sizeof(listen), "--address=unix:dir=%s", tmpdir);
+	snprintf(print, sizeof(print), "--print-address=%d", fds[1]);
+
+	bus_pid = fork();
+	if (!bus_pid) {
+		close(fds[0]);
+		if (!verbose) {
+			int null = open("/dev/null", O_WRONLY);
+
+			dup2(null, STDERR_FILENO);
+		}
+
+		execvp(bus_daemon, argv);
+		_exit(127);
+	}
+
+	close(fds[1]);
+
+	len = bus_pid > 0 ? read(fds[0], buf, sizeof(buf) - 1) : -1;
+	close(fds[0]);
+
+	if (len <= 0) {
+		fprintf(stderr, "%s did not start\n", bus_daemon);
+		return false;
+	}
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	bus_address = l_strdup(buf);
+
+	return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *name, uint64_t *times,
+						unsigned int count)
+{
+	if (!count) {
+		printf("%s: none\n", name);
+		return;
+	}
+
+	qsort(times, count, sizeof(*times), compare_u64);
+	printf("%s: p50 %llu us, p99 %llu us, max %llu us\n", name,
+			(unsigned long long) times[count / 2],
+			(unsigned long long) times[count * 99 / 100],
+			(unsigned long long) times[count - 1]);
+}
+
+static void report(void)
+{
+	double seconds;
+
+	if (!profile_registered) {
+		printf("startup: profile never registered\n");
+		return;
+	}
+
+	printf("startup: %.1f ms to RegisterProfile\n",
+			(profile_registered - daemon_started) / 1000.0);
+
+	print_latency("NewConnection reply", reply_times, replies);
+	print_latency("NewConnection to first AT byte", first_byte_times,
+								first_bytes);
+
+	seconds = begun && finished > begun ?
+				(finished - begun) / 1000000.0 : 0;
+	printf("%u connections in %.2f s: %.0f/s, %u by "
+			"RequestDisconnection, %u Release, %u errors, "
+			"%u missed\n", ended, seconds,
+			seconds ? ended / seconds : 0, disconnects, releases,
+			errors, missed);
+}
+
+static void cleanup(void)
+{
+	char *path;
+
+	if (daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+	}
+
+	if (bus_pid > 0) {
+		kill(bus_pid, SIGTERM);
+		waitpid(bus_pid, NULL, 0);
+	}
+
+	path = l_strdup_printf("%s/events.journal", tmpdir);
+	unlink(path);
+	l_free(path);
+	rmdir(tmpdir);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:r:d:R:b:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			total = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			nlinks = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			disconnect_share = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			release_every = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			bus_daemon = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n connections] "
+				"[-c concurrent] [-r per second] "
+				"[-d percent by RequestDisconnection] "
+				"[-R release every] [-b dbus-daemon] [-v] "
+				"[daemon]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		daemon_path = argv[optind];
+
+	if (!total || !nlinks || nlinks > MAX_LINKS ||
+			disconnect_share > 100 || !mkdtemp(tmpdir))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < nlinks; i++) {
+		snprintf(links[i].path, sizeof(links[i].path), DEVICE_PATH,
+						(i >> 8) & 0xff, i & 0xff);
+		snprintf(links[i].address, sizeof(links[i].address),
+				DEVICE_ADDRESS, (i >> 8) & 0xff, i & 0xff);
+	}
+
+	reply_times = l_new(uint64_t, total);
+	first_byte_times = l_new(uint64_t, total);
+
+	if (!l_main_init() || !start_bus()) {
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
+	child_signal = l_signal_create(SIGCHLD, child_exited, NULL, NULL);
+	stall = l_timeout_create(STALL_TIMEOUT, stall_timeout, NULL, NULL);
+
+	bus = l_dbus_new(bus_address);
+	if (!bus) {
+		fprintf(stderr, "failed to connect to %s\n", bus_address);
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
+	l_dbus_set_ready_handler(bus, bus_ready, NULL, NULL);
+
+	l_main_run();
+
+	report();
+
+	l_timeout_remove(ticker);
+	l_timeout_remove(stall);
+	l_signal_remove(child_signal);
+	l_dbus_destroy(bus);
+	cleanup();
+	l_main_exit();
+
+	l_free(profile_owner);
+	l_free(profile_path);
+	l_free(bus_address);
+	l_free(reply_times);
+	l_free(first_byte_times);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+/*
+ * bench_encode.c
+ *
+ * Recording compression throughput. First each encoder alone on one
+ * core, reported as the number of calls that core could compress in
+ * real time, then the worker pool compressing many calls at once the
+ * way the SCO writer feeds it. The pool's output is checked against a
+ * straight single threaded encode, so reordering within a stream shows
+ * up as a mismatch; ADPCM output is also decoded for its SNR.
+ *
+ * Build: make CFLAGS=-O2 bench_encode (from src/)
+ * Usage: bench_encode [-e encoder] [-r rate] [-n calls] [-t threads]
+ *		[-s seconds]
+ */
+
+#include <endian.h>
+#include <math.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "main.h"
+#include "adpcm.h"
+#include "encoder.h"
+#include "encode_pool.h"
+
+/* What the writer hands over per record at most. */
+#define RUN_SAMPLES		960
+
+struct call {
+	struct encode_stream *stream;
+	uint8_t *out;
+	size_t len;
+};
+
+static double now_seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void synthesize(int16_t *pcm, size_t samples, unsigned int rate)
+{
+	double phase = 0, v;
+	size_t n;
+	int h;
+
+	for (n = 0; n < samples; n++) {
+		phase += 2 * M_PI * (120 + 40 * sin(n * 2.0 / rate)) / rate;
+		for (v = 0, h = 1; h <= 10; h++)
+			v += sin(h * phase) / h;
+
+		pcm[n] = 5000 * v + (random() % 200 - 100);
+	}
+}
+
+static void collect(enum rec_type type, enum rec_codec codec,
+			uint64_t timestamp, const void *data, size_t len,
+			void *user_data)
+{
+	struct call *call = user_data;
+
+	memcpy(call->out + call->len, data, len);
+	call->len += len;
+}
+
+/* Reference: the same runs through one encoder state, in order. */
+static size_t encode_alone(const struct encoder *encoder, unsigned int rate,
+				const int16_t *pcm, size_t samples,
+				uint8_t *out, double *cpu)
+{
+	void *state = encoder->create(rate);
+	double start = now_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	size_t n, len = 0;
+	int ret;
+
+	for (n = 0; n < samples; n += RUN_SAMPLES) {
+		ret = encoder->encode(state, pcm + n,
+				L_MIN(samples - n, (size_t) RUN_SAMPLES),
+				out + len, ENCODE_JOB_MAX);
+		if (ret > 0)
+			len += ret;
+	}
+
+	*cpu = now_seconds(CLOCK_PROCESS_CPUTIME_ID) - start;
+	encoder->destroy(state);
+
+	return len;
+}
+
+static double adpcm_snr(const uint8_t *data, size_t len, const int16_t *ref)
+{
+	const struct rec_encoded *hdr;
+	struct adpcm_state state;
+	int16_t pcm[RUN_SAMPLES];
+	double signal = 0, noise = 0, d;
+	unsigned int samples, i;
+	size_t pos = 0;
+
+	while (pos + sizeof(*hdr) <= len) {
+		hdr = (const void *) (data + pos);
+		samples = le32toh(hdr->samples);
+		state.predictor = (int16_t) le16toh(hdr->predictor);
+		state.index = hdr->index;
+
+		adpcm_decode(&state, data + pos + sizeof(*hdr), samples, pcm);
+
+		for (i = 0; i < samples; i++, ref++) {
+			d = *ref - pcm[i];
+			signal += (double) *ref * *ref;
+			noise += d * d;
+		}
+
+		pos += sizeof(*hdr) + ADPCM_BYTES(samples);
+	}
+
+	return 10 * log10(signal / (noise + 1));
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = "adpcm";
+	const struct encoder *encoder;
+	unsigned int rate = 8000, ncalls = 8, seconds = 60, i;
+	struct encode_pool *pool;
+	struct encode_stats stats;
+	struct call *calls;
+	size_t samples, n, ref_len;
+	int16_t *pcm;
+	uint8_t *ref;
+	double cpu, wall;
+	bool busy;
+	int opt, fd, mismatches = 0;
+	char threads[8] = "2";
+
+	while ((opt = getopt(argc, argv, "e:r:n:t:s:")) != -1) {
+		switch (opt) {
+		case 'e':
+			name = optarg;
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			ncalls = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			snprintf(threads, sizeof(threads), "%s", optarg);
+			break;
+		case 's':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	encoder = encoder_find(name);
+	if (!encoder || !ncalls)
+		goto usage;
+
+	samples = (size_t) rate * seconds;
+	pcm = l_malloc(samples * sizeof(int16_t));
+	ref = l_malloc(samples * sizeof(int16_t));
+	synthesize(pcm, samples, rate);
+
+	ref_len = encode_alone(encoder, rate, pcm, samples, ref, &cpu);
+	printf("%s %u Hz, one core: %.0f calls, ratio %.2f", encoder->name,
+				rate, seconds / cpu,
+				samples * 2.0 / ref_len);
+	if (encoder == &encoder_adpcm)
+		printf(", SNR %.1f dB", adpcm_snr(ref, ref_len, pcm));
+	printf("\n");
+
+	/* Every call sends the same audio, so all match the reference. */
+	fd = eventfd(0, EFD_CLOEXEC);
+	setenv("HFP_RECORDER_ENCODE_THREADS", threads, 1);
+	pool = encode_pool_new(encoder, fd);
+	if (!pool)
+		return EXIT_FAILURE;
+
+	calls = l_new(struct call, ncalls);
+	for (i = 0; i < ncalls; i++) {
+		calls[i].out = l_malloc(samples * sizeof(int16_t));
+		calls[i].stream = encode_stream_new(pool, rate, collect,
+								&calls[i]);
+	}
+
+	wall = now_seconds(CLOCK_MONOTONIC);
+
+	for (n = 0; n < samples; n += RUN_SAMPLES) {
+		for (i = 0; i < ncalls; i++)
+			encode_stream_audio(calls[i].stream, n, pcm + n,
+				L_MIN(samples - n, (size_t) RUN_SAMPLES));
+	}
+
+	do {
+		busy = false;
+		for (i = 0; i < ncalls; i++) {
+			encode_stream_reap(calls[i].stream);
+			busy |= !encode_stream_idle(calls[i].stream);
+		}
+	} while (busy && !usleep(1000));
+
+	wall = now_seconds(CLOCK_MONOTONIC) - wall;
+	encode_pool_get_stats(pool, &stats);
+
+	for (i = 0; i < ncalls; i++) {
+		if (calls[i].len != ref_len ||
+				memcmp(calls[i].out, ref, ref_len))
+			mismatches++;
+
+		encode_stream_free(calls[i].stream);
+		l_free(calls[i].out);
+	}
+
+	encode_pool_free(pool);
+	close(fd);
+
+	printf("pool, %u threads: %u calls of %u s in %.3f s, "
+			"%llu x real time per core, %llu stalls\n",
+			stats.threads, ncalls, seconds, wall,
+			(unsigned long long) (stats.cpu_time ?
+				stats.audio_time / stats.cpu_time : 0),
+			(unsigned long long) stats.stalls);
+	printf("cross-check pool vs one thread: %u calls, %d mismatches\n",
+			ncalls, mismatches);
+
+	l_free(calls);
+	l_free(pcm);
+	l_free(ref);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-e encoder] [-r rate] [-n calls] "
+			"[-t threads] [-s seconds]\n", argv[0]);
+	return EXIT_FAILURE;
+}
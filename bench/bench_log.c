@@ -0,0 +1,96 @@
+/*
+ * bench_log.c
+ *
+ * What a log call costs the thread making it, through ELL's stderr
+ * handler and through the deferred backend, for a few messages shaped
+ * like the daemon's. Messages go out in bursts small enough for a log
+ * ring, with pauses for the log thread to catch up, and stderr goes to
+ * /dev/null so the terminal is not what gets measured.
+ *
+ * Build: make CFLAGS=-O2 bench_log (from src/)
+ * Usage: bench_log [-n bursts] [-b messages per burst]
+ */
+
+#include <time.h>
+
+#include "main.h"
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One round of what a call brings: SLC, CIND, SCO. */
+static void log_call(unsigned int i)
+{
+	static const char features[] = "1023,OK";
+
+	log_info("Service Level Connection with %s up in %llu ms",
+			"/org/bluez/hci0/dev_00_11_22_33_44_55",
+			(unsigned long long) i % 300);
+	log_info("BRSF command supported features %.*s", 4, features);
+	log_info("service index: %d, callsetup index: %d, call index: %d",
+								1, 3, 2);
+	log_info("call recording %s: %llu frames, %llu concealed (%.1f%%)",
+			"/org/bluez/hci0/dev_00_11_22_33_44_55",
+			(unsigned long long) i * 50, 3ull, 0.2);
+	log_debug("Unknown command %s", "+XAPL=iPhone,7");
+}
+
+static double run(unsigned int bursts, unsigned int burst)
+{
+	struct timespec pause = { 0, 20 * 1000000 };
+	double busy = 0, t;
+	unsigned int i, j;
+
+	for (i = 0; i < bursts; i++) {
+		t = now_seconds();
+		for (j = 0; j < burst; j++)
+			log_call(j);
+		busy += now_seconds() - t;
+
+		nanosleep(&pause, NULL);
+	}
+
+	/* Four messages per call, the debug one is compiled out. */
+	return busy * 1e9 / (bursts * burst * 4.0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int bursts = 50, burst = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			bursts = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			burst = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n bursts] "
+					"[-b messages per burst]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!bursts || !burst || !freopen("/dev/null", "w", stderr))
+		return EXIT_FAILURE;
+
+	l_log_set_stderr();
+
+	printf("ell: %.0f ns per message\n", run(bursts, burst));
+
+	if (!log_init(true))
+		return EXIT_FAILURE;
+
+	printf("deferred: %.0f ns per message\n", run(bursts, burst));
+	log_exit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,363 @@
+/*
+ * bench_msbc.c
+ *
+ * mSBC decoder throughput, in seconds of 16 kHz audio decoded per
+ * second of CPU time. Also cross-checks the vector synthesis filterbank
+ * against the scalar reference on the same frames, and both against the
+ * output of an independent SBC decoder on a known-good vector with a
+ * dropped and a corrupted frame.
+ *
+ * Build: make CFLAGS=-O2 bench_msbc (from src/)
+ * Usage: bench_msbc [frames]
+ */
+
+#include <time.h>
+
+#include "main.h"
+#include "msbc.h"
+
+static uint8_t crc8(const uint8_t *data, unsigned int len)
+{
+	uint8_t crc = 0x0f;
+	unsigned int i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x1d : crc << 1;
+	}
+
+	return crc;
+}
+
+/* Random payload behind a valid header; decodes to noise. */
+static void make_packet(uint8_t *pkt, unsigned int seq)
+{
+	uint8_t *frame = pkt + 2, crc_data[6];
+	int i;
+
+	pkt[0] = 0x01;
+	pkt[1] = (const uint8_t []) { 0x08, 0x38, 0xc8, 0xf8 }[seq & 3];
+
+	frame[0] = MSBC_SYNCWORD;
+	frame[1] = 0;
+	frame[2] = 0;
+	for (i = 4; i < MSBC_FRAME_LEN; i++)
+		frame[i] = random();
+
+	crc_data[0] = 0;
+	crc_data[1] = 0;
+	memcpy(crc_data + 2, frame + 4, 4);
+	frame[3] = crc8(crc_data, sizeof(crc_data));
+
+	pkt[MSBC_PACKET_LEN - 1] = 0;
+}
+
+/*
+ * Known-good vector: 8 mSBC frames of a 440 Hz to 2 kHz sweep plus a
+ * 5 kHz partial, encoded by the FFmpeg 8.1 SBC encoder (msbc=1) bundled
+ * in PyAV 18.1. vector_pcm is what the FFmpeg SBC decoder makes of the
+ * same frames with VECTOR_DROPPED and VECTOR_CORRUPT left out, those are
+ * the ones the H2 path below has to conceal.
+ */
+#define VECTOR_FRAMES		8
+#define VECTOR_DROPPED		3
+#define VECTOR_CORRUPT		5
+/* Bytes of garbage ahead of the packet after the dropped one. */
+#define VECTOR_GARBAGE		5
+/* FFmpeg synthesizes in fixed point, a few LSB off the float result. */
+#define VECTOR_TOLERANCE	4
+
+static const uint8_t vector_frames[VECTOR_FRAMES * MSBC_FRAME_LEN] = {
+	0xad, 0x00, 0x00, 0x00, 0xd9, 0x78, 0xba, 0x88, 0x7e, 0xd6, 0xee, 0xdf,
+	0xb5, 0xbb, 0xb8, 0x51, 0x6e, 0xee, 0x1a, 0x9b, 0xc2, 0xaf, 0x90, 0xc6,
+	0xf2, 0x15, 0x5a, 0xd5, 0x51, 0x67, 0x4c, 0xa3, 0x5e, 0x1b, 0x98, 0xd6,
+	0x56, 0xf6, 0x35, 0xe1, 0xb6, 0x8d, 0x65, 0x6c, 0x93, 0x5e, 0x1b, 0x9a,
+	0xd6, 0x56, 0xf5, 0x35, 0xe1, 0xb5, 0x0d, 0x65, 0x6c, 0xad, 0x00, 0x00,
+	0x92, 0xd9, 0x10, 0xba, 0x00, 0x36, 0x3f, 0x33, 0xb1, 0x91, 0x2f, 0x0a,
+	0xcb, 0xb3, 0x38, 0x94, 0xd2, 0xf0, 0x82, 0xcb, 0x33, 0xb5, 0xef, 0x2f,
+	0x04, 0x3a, 0xb3, 0x39, 0x4f, 0x32, 0xf0, 0xdd, 0x4b, 0x33, 0x97, 0x87,
+	0x2f, 0x04, 0x1d, 0x33, 0x3b, 0x6d, 0x42, 0xf0, 0x61, 0x0f, 0x33, 0x91,
+	0xb9, 0x2f, 0x0d, 0xcc, 0xb3, 0x38, 0xad, 0x00, 0x00, 0xb5, 0xdb, 0x10,
+	0xba, 0x00, 0x4b, 0x5c, 0xbc, 0x19, 0x29, 0xcc, 0xed, 0x47, 0x0b, 0xc0,
+	0xad, 0x8c, 0xce, 0x9f, 0xb4, 0xbc, 0x29, 0x11, 0xcc, 0xe2, 0xc9, 0x4b,
+	0xc3, 0x5e, 0x6c, 0xce, 0x49, 0x34, 0xbc, 0x1f, 0xf6, 0xcc, 0xeb, 0x22,
+	0xcb, 0xc0, 0xb6, 0x8c, 0xce, 0xd7, 0x90, 0xbc, 0x0e, 0x0b, 0xcc, 0xea,
+	0x6f, 0x8b, 0xc0, 0xad, 0x00, 0x00, 0x59, 0xdc, 0x00, 0xba, 0x00, 0x7c,
+	0x37, 0x99, 0xd8, 0x31, 0x17, 0x7b, 0x84, 0x59, 0x9c, 0xda, 0x91, 0x77,
+	0xcf, 0x71, 0x99, 0xcb, 0xdd, 0x17, 0x7c, 0x9a, 0x19, 0x9c, 0xf5, 0x19,
+	0x77, 0xb7, 0xc9, 0x99, 0xd4, 0x09, 0x97, 0x7a, 0x7e, 0x39, 0x9d, 0x74,
+	0x49, 0x77, 0x9d, 0xf1, 0x99, 0xd8, 0x82, 0x17, 0x79, 0xcf, 0x99, 0x9c,
+	0xad, 0x00, 0x00, 0xf9, 0xcd, 0x10, 0xba, 0x00, 0x42, 0x42, 0x5d, 0xf0,
+	0xae, 0x66, 0x73, 0x44, 0x65, 0xdf, 0x4a, 0xbe, 0x67, 0x24, 0x58, 0x5d,
+	0xf7, 0xa5, 0xe6, 0x72, 0x07, 0xa5, 0xdf, 0x5d, 0xb6, 0x67, 0x35, 0xa8,
+	0x5d, 0xed, 0x0f, 0x66, 0x76, 0x6c, 0xe5, 0xdd, 0xe8, 0xa6, 0x67, 0xa0,
+	0xc8, 0x5d, 0xd2, 0xd4, 0x66, 0x7b, 0x98, 0x25, 0xdc, 0xad, 0x00, 0x00,
+	0x02, 0xbd, 0x10, 0xba, 0x00, 0x1d, 0x57, 0x33, 0xac, 0x98, 0x2f, 0x08,
+	0x5b, 0x33, 0x39, 0x21, 0xe2, 0xf0, 0xcb, 0x1b, 0x33, 0x90, 0x57, 0x2f,
+	0x09, 0x44, 0xf3, 0x3a, 0x56, 0x72, 0xf0, 0x4e, 0xcf, 0x33, 0xaa, 0x26,
+	0x2f, 0x07, 0x3b, 0x73, 0x39, 0xa1, 0xe2, 0xf0, 0x9e, 0xe7, 0x33, 0x9b,
+	0x68, 0x2f, 0x07, 0x65, 0xf3, 0x38, 0xad, 0x00, 0x00, 0x30, 0x9d, 0x40,
+	0xba, 0x00, 0xd2, 0x03, 0x2d, 0xd2, 0xce, 0xf2, 0x76, 0x8c, 0x32, 0xde,
+	0xc7, 0x2f, 0x27, 0x63, 0x63, 0x2d, 0xda, 0x46, 0xf2, 0x79, 0xd3, 0x32,
+	0xdd, 0xed, 0x8f, 0x27, 0x69, 0xf3, 0x2d, 0xe2, 0x24, 0xf2, 0x78, 0x2a,
+	0x42, 0xdd, 0xcc, 0x8f, 0x27, 0x7c, 0xf2, 0x2d, 0xe1, 0x44, 0xf2, 0x77,
+	0xb3, 0x52, 0xdc, 0xad, 0x00, 0x00, 0x14, 0x4d, 0x80, 0xba, 0x00, 0x1a,
+	0xef, 0xc9, 0xf4, 0xbb, 0x8b, 0x79, 0x4e, 0xec, 0x9c, 0xf3, 0x40, 0xb7,
+	0x6b, 0x91, 0xc9, 0xe8, 0xf3, 0xcb, 0x77, 0x34, 0xcc, 0x9d, 0x6a, 0x38,
+	0xb7, 0x7d, 0x92, 0xc9, 0xe1, 0xfd, 0x0b, 0x77, 0x24, 0xec, 0x9d, 0x92,
+	0x9c, 0xb7, 0x7b, 0x6a, 0xc9, 0xdf, 0x65, 0x8b, 0x77, 0x8d, 0xcc, 0x9c,
+};
+
+static const int16_t vector_pcm[(VECTOR_FRAMES - 2) * MSBC_SAMPLES] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, -1, -1, 0,
+	0, -1, 0, 2, 5, 8, 9, 12, 7, 0,
+	3, -7, -4, 3, 5, 5, 7, 11, 6, 31,
+	64, 56, 28, 13, -89, -149, -168, -210, -142, -59,
+	31, -50, -44, -41, -145, -171, -95, 141, -94, 10,
+	420, 219, 11, 116, 60, -122, 0, -516, -305, 70,
+	-569, 345, -250, 2176, 7272, 3635, 5820, 13429, 8974, 8787,
+	15515, 12052, 8443, 13956, 11921, 5091, 8912, 8190, 161, 1863,
+	3066, -5450, -6043, -2368, -10268, -12800, -6868, -11807, -15913, -8830,
+	-9682, -14623, -7659, -4687, -9542, -3737, 2348, -2057, 1502, 9436,
+	5674, 5981, 14149, 11353, 8009, 14889, 13287, 6719, 11220, 11091,
+	2423, 4075, 5695, -3441, -4542, -1009, -8777, -11979, -6584, -11353,
+	-15788, -9064, -9892, -14786, -7754, -4609, -9380, -3360, 2971, -1308,
+	2375, 10434, 6766, 6998, 14989, 11954, 8227, 14598, 12455, 5269,
+	9126, 8509, -612, 548, 1972, -7103, -8261, -4590, -11689, -14240,
+	-8284, -11951, -15104, -7496, -7222, -10735, -2862, 947, -2933, 3427,
+	9571, 5206, 8317, 15121, 10292, 9171, 15214, 10435, 5211, 9710,
+	5963, -2157, 677, -777, -9798, -8249, -6364, -14123, -13397, -7896,
+	-12812, -12801, -4502, -6006, -7071, 2237, 3704, 926, 8926, 12190,
+	7175, 11798, 15656, 8665, 8913, 12709, 4947, 1122, 4801, -1853,
+	-8308, -4320, -7796, -14852, -10200, -9171, -15167, -10219, -4757, -8959,
+	-4902, 3508, 903, 2489, 11507, 9799, 7584, 14833, 13437, 7144,
+	11191, 10299, 1185, 2006, 2601, -6907, -8271, -5063, -12319, -14550,
+	-8262, -11425, -13731, -5195, -4006, -6569, 2106, 6444, 2799, 8969,
+	14420, 8943, 10524, 15397, 8425, 5089, 8960, 2206, -4606, -1189,
+	-5393, -13259, -9412, -9096, -15650, -11054, -5743, -9919, -5690, 2986,
+	687, 2557, 11782, 10151, 7850, 14839, 13020, 6186, 9639, 8171,
+	-1435, -966, -532, -9972, -11002, -7172, -13518, -14579, -6933, -8655,
+	-9581, 123, 2138, -48, 8496, 12171, 7363, 11924, 15429, 7803,
+	7175, 9947, 1152, -3561, -470, -7283, -13377, -8468, -10477, -15592,
+	-8657, -5169, -8744, -1624, 5536, 2363, 6629, 14335, 10089, 9155,
+	14916, 9422, 3184, 6501, 1592, -7465, -5155, -6558, -14850, -11866,
+	-7894, -13041, -9365, -816, -2866, -448, 9516, 8702, 7175, 14798,
+	13392, 6710, 10050, 8250, -1817, -1811, -1724, -11284, -12144, -7833,
+	-13428, -13546, -4870, -5601, -5670, 4645, 6908, 4506, 12302, 14689,
+	8121, 10600, 11901, 2254, -86, 1542, -7470, -11679, -7400, -12047,
+	-15326, -7362, -6045, -7950, 1380, 6600, 3914, 9770, 14868, 9915,
+	9747, 12263, 5188, 0, 959, -5687, -12161, -8766, -9533, -13508,
+	-8869, -3350, -2989, -2531, 3510, 10532, 7218, 6178, 15191, 10342,
+	-1407, 1712, -712, -13440, -12770, -7663, -11679, -8963, 1163, 2339,
+	3537, 12616, 12647, 7432, 11120, 8468, -2697, -3706, -4435, -13863,
+	-13634, -7195, -9613, -6671, 4542, 5668, 5744, 14316, 13278, 6032,
+	8063, 4812, -6595, -7409, -6901, -14761, -12854, -4715, -6037, -2412,
+	8970, 9322, 7964, 14711, 11617, 2458, 3130, -617, -11548, -10946,
+	-8310, -13699, -9427, 522, 103, 3527, 13612, 11782, 7749, 11806,
+	6499, -3997, -3538, -6322, -15260, -11938, -6307, -8945, -2673, 8106,
+	7122, 8622, 15739, 10425, 3080, 4662, -1775, -11809, -9366, -9018,
+	-14276, -7420, 929, -275, 5748, 14658, 10696, 8390, 11530, 3180,
+	-5859, -4461, -9222, -16070, -9838, -5367, -6874, 1492, 10004, 8369,
+	10584, 14491, 7745, 1889, 1896, -5475, -12420, -8921, -8816, -11613,
+	-5638, 1259, 2116, 1727, 5711, 9473, 2554, -765, 8403, 6533,
+	178, 9565, 12113, 1173, -154, -227, -11123, -14706, -8422, -8089,
+	-4981, 7776, 11611, 9133, 14115, 11201, -1368, -3872, -5454, -14740,
+	-12978, -3870, -3502, 1459, 13052, 11995, 7412, 9892, 2592, -9356,
+	-8661, -9213, -14250, -6039, 4015, 3638, 9168, 15988, 8238, 1834,
+	2054, -7471, -14960, -8882, -7206, -7372, 4572, 11496, 7952, 11242,
+	11355, -1120, -6335, -5775, -13461, -13465, -2351, 335, 2815, 13690,
+	13545, 5441, 5623, 424, -12012, -11706, -7736, -10620, -3353, 8839,
+	8428, 9118, 14097, 5645, -4667, -4361, -9620, -15807, -7220, -76,
+	5, 9173, 15603, 7993, 4778, 3961, -7975, -13747, -8136, -9040,
+	-7205, 6070, 10542, 7794, 12412, 9401, -3671, -6543, -7208, -14707,
+	-10606, 785, 2099, 6401, 15683, 10869, 2408, 2280, -5465, -15308,
+	-10343, -5639, -6114, 4453, 13673, 9271, 8642, 9018, -3386, -11008,
+	-7941, -11234, -10901, 2152, 7641, 6713, 13310, 11805, -667, -3938,
+	-5770, -14733, -11891, -1166, 209, 5163, 15358, 11354, 3343, 3227,
+	-4825, -15071, -10392, -5754, -6105, 4632, 13891, 9287, 8242, 8158,
+	-4509, -11980, -8284, -10618, -9334, 4252, 9550, 7643, 12736, 9719,
+	-3673, -6834, -7440, -14411, -9485, 2638, 4136, 7765, 15551, 8835,
+	-1193, -1812, -8539, -15985, -7962, -644, -7, 9538, 15727, 7177,
+	2715, 1047, -10655, -14828, -6603, -4797, -1332, 11580, 13466, 6554,
+	6817, 937, -12207, -11940, -7071, -8462, 58, 12351, 10371, 8046,
+};
+
+struct sink {
+	int16_t *pcm;
+	size_t samples;
+};
+
+static void collect(const int16_t *pcm, unsigned int samples, void *user_data)
+{
+	struct sink *sink = user_data;
+
+	if (sink->pcm && pcm)
+		memcpy(sink->pcm + sink->samples, pcm, samples * 2);
+	else if (sink->pcm)
+		memset(sink->pcm + sink->samples, 0, samples * 2);
+
+	sink->samples += samples;
+}
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct msbc_decoder *dec, const uint8_t *stream,
+			unsigned int frames, struct sink *sink)
+{
+	double start = cpu_seconds();
+	unsigned int i;
+
+	/* 60 byte SCO packets, as most controllers deliver them. */
+	for (i = 0; i < frames; i++)
+		msbc_decode_stream(dec, stream + i * MSBC_PACKET_LEN,
+					MSBC_PACKET_LEN, collect, sink);
+
+	return cpu_seconds() - start;
+}
+
+/* Feeds the vector through the H2 path, in 7 byte reads. */
+static bool check_vector(sbc_synth_func_t synth_func)
+{
+	uint8_t stream[VECTOR_FRAMES * MSBC_PACKET_LEN + VECTOR_GARBAGE];
+	/* A broken decoder may report up to 3 lost frames per packet. */
+	int16_t pcm[4 * VECTOR_FRAMES * MSBC_SAMPLES];
+	struct sink out = { .pcm = pcm };
+	struct msbc_decoder dec;
+	const int16_t *expect = vector_pcm;
+	size_t len = 0, i;
+	unsigned int f;
+	int err, max_err = 0;
+	bool ok;
+
+	for (f = 0; f < VECTOR_FRAMES; f++) {
+		uint8_t *pkt;
+
+		if (f == VECTOR_DROPPED)
+			continue;
+
+		if (f == VECTOR_DROPPED + 1) {
+			memset(stream + len, 0, VECTOR_GARBAGE);
+			len += VECTOR_GARBAGE;
+		}
+
+		pkt = stream + len;
+		pkt[0] = 0x01;
+		pkt[1] = (const uint8_t []) { 0x08, 0x38, 0xc8, 0xf8 }[f & 3];
+		memcpy(pkt + 2, vector_frames + f * MSBC_FRAME_LEN,
+							MSBC_FRAME_LEN);
+		pkt[MSBC_PACKET_LEN - 1] = 0;
+
+		/* A flipped scale factor bit, caught by the CRC. */
+		if (f == VECTOR_CORRUPT)
+			pkt[2 + 4] ^= 0x10;
+
+		len += MSBC_PACKET_LEN;
+	}
+
+	msbc_decoder_init(&dec);
+	dec.synth_func = synth_func;
+
+	for (i = 0; i < len; i += 7)
+		msbc_decode_stream(&dec, stream + i, L_MIN(len - i, (size_t) 7),
+							collect, &out);
+
+	ok = out.samples == VECTOR_FRAMES * MSBC_SAMPLES && dec.lost == 1 &&
+		dec.crc_errors == 1 && dec.sync_losses == VECTOR_GARBAGE;
+
+	for (f = 0; f < VECTOR_FRAMES; f++) {
+		const int16_t *got = pcm + f * MSBC_SAMPLES;
+
+		for (i = 0; i < MSBC_SAMPLES; i++) {
+			/* Concealed frames reach the sink as NULL. */
+			if (f == VECTOR_DROPPED || f == VECTOR_CORRUPT)
+				err = abs(got[i]);
+			else
+				err = abs(got[i] - expect[i]);
+
+			max_err = L_MAX(max_err, err);
+		}
+
+		if (f != VECTOR_DROPPED && f != VECTOR_CORRUPT)
+			expect += MSBC_SAMPLES;
+	}
+
+	if (max_err > VECTOR_TOLERANCE)
+		ok = false;
+
+	printf("vector %s: %zu samples, max error %d LSB, lost %llu, "
+			"crc errors %llu, sync losses %llu: %s\n",
+			sbc_synth_name(synth_func), out.samples, max_err,
+			(unsigned long long) dec.lost,
+			(unsigned long long) dec.crc_errors,
+			(unsigned long long) dec.sync_losses,
+			ok ? "ok" : "FAIL");
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int frames = argc > 1 ? strtoul(argv[1], NULL, 10) : 50000;
+	struct msbc_decoder fast, ref;
+	struct sink fast_out = { 0 }, ref_out = { 0 };
+	uint8_t *stream;
+	double audio, cpu;
+	size_t i, mismatches = 0;
+	unsigned int f;
+	bool vector_ok;
+
+	vector_ok = check_vector(sbc_synth_scalar);
+	vector_ok &= check_vector(sbc_synth_select());
+
+	stream = l_malloc((size_t) frames * MSBC_PACKET_LEN);
+	for (f = 0; f < frames; f++)
+		make_packet(stream + f * MSBC_PACKET_LEN, f);
+
+	audio = (double) frames * MSBC_SAMPLES / MSBC_RATE;
+
+	/* Cross-check on the first 1000 frames. */
+	f = L_MIN(frames, 1000u);
+	fast_out.pcm = l_malloc(f * MSBC_SAMPLES * 2);
+	ref_out.pcm = l_malloc(f * MSBC_SAMPLES * 2);
+
+	msbc_decoder_init(&fast);
+	msbc_decoder_init(&ref);
+	ref.synth_func = sbc_synth_scalar;
+	run(&fast, stream, f, &fast_out);
+	run(&ref, stream, f, &ref_out);
+
+	/* Float summation order differs, allow one LSB. */
+	for (i = 0; i < ref_out.samples; i++)
+		if (abs(fast_out.pcm[i] - ref_out.pcm[i]) > 1)
+			mismatches++;
+
+	printf("cross-check %s vs scalar: %zu samples, %zu mismatches\n",
+			sbc_synth_name(fast.synth_func), ref_out.samples,
+			mismatches);
+
+	fast_out.pcm = ref_out.pcm = NULL;
+	fast_out.samples = ref_out.samples = 0;
+
+	msbc_decoder_init(&ref);
+	ref.synth_func = sbc_synth_scalar;
+	cpu = run(&ref, stream, frames, &ref_out);
+	printf("%-6s %u frames, %.1f s audio in %.3f s cpu: %.0f x realtime\n",
+			"scalar", frames, audio, cpu, audio / cpu);
+
+	msbc_decoder_init(&fast);
+	cpu = run(&fast, stream, frames, &fast_out);
+	printf("%-6s %u frames, %.1f s audio in %.3f s cpu: %.0f x realtime\n",
+			sbc_synth_name(fast.synth_func), frames, audio, cpu,
+			audio / cpu);
+
+	return mismatches || !vector_ok ? EXIT_FAILURE : EXIT_SUCCESS;
+}
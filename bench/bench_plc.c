@@ -0,0 +1,170 @@
+/*
+ * bench_plc.c
+ *
+ * Sends a synthetic voiced signal over a simulated 8 kHz PCM link, with
+ * arrival jitter, lost and duplicated packets, through the jitter buffer
+ * and concealment the SCO writer uses. Reports how many losses and
+ * duplicates were placed correctly, whether the output stayed the
+ * length of the call, and the SNR against the sent signal with
+ * concealment and with the holes left silent.
+ *
+ * Build: make CFLAGS=-O2 bench_plc (from src/)
+ * Usage: bench_plc [-l loss %] [-d duplicate %] [-j jitter us] [-s seconds]
+ */
+
+#include <math.h>
+
+#include "main.h"
+#include "jitter.h"
+#include "plc.h"
+
+#define RATE		8000
+#define PACKET_SAMPLES	24			/* 48 bytes, 3 ms */
+#define PACKET_LEN	(PACKET_SAMPLES * 2)
+#define PACKET_USEC	(PACKET_SAMPLES * 1000000 / RATE)
+
+static double uniform(void)
+{
+	return random() / (RAND_MAX + 1.0);
+}
+
+/* Vowel-like: harmonics of a slowly gliding pitch. */
+static void synthesize(int16_t *pcm, size_t samples)
+{
+	double phase = 0, f0, v;
+	size_t n;
+	int h;
+
+	for (n = 0; n < samples; n++) {
+		f0 = 140 + 30 * sin(2 * M_PI * n / (RATE * 1.7));
+		phase += 2 * M_PI * f0 / RATE;
+
+		for (v = 0, h = 1; h <= 8; h++)
+			v += sin(h * phase) / h;
+
+		pcm[n] = 6000 * v;
+	}
+}
+
+static double snr(const int16_t *ref, const int16_t *out, size_t samples)
+{
+	double signal = 0, noise = 0, d;
+	size_t n;
+
+	for (n = 0; n < samples; n++) {
+		d = ref[n] - out[n];
+		signal += (double) ref[n] * ref[n];
+		noise += d * d;
+	}
+
+	return 10 * log10(signal / (noise + 1));
+}
+
+int main(int argc, char *argv[])
+{
+	double loss = 5, dup = 1, jitter = 800;
+	unsigned int seconds = 60;
+	size_t packets, samples, n, out_len = 0, silent_len = 0;
+	size_t lost = 0, dups = 0, dup_wrong = 0;
+	int16_t *ref, *out, *silent;
+	struct jitter_buffer jb;
+	struct plc plc;
+	uint64_t now;
+	long gap;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:d:j:s:")) != -1) {
+		switch (opt) {
+		case 'l':
+			loss = atof(optarg);
+			break;
+		case 'd':
+			dup = atof(optarg);
+			break;
+		case 'j':
+			jitter = atof(optarg);
+			break;
+		case 's':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l loss %%] "
+					"[-d duplicate %%] [-j jitter us] "
+					"[-s seconds]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	packets = (size_t) seconds * RATE / PACKET_SAMPLES;
+	samples = packets * PACKET_SAMPLES;
+	ref = l_malloc(samples * 2);
+	out = l_new(int16_t, samples + PACKET_SAMPLES * 64);
+	silent = l_new(int16_t, samples);
+
+	synthesize(ref, samples);
+	jitter_buffer_init(&jb, RATE * 2);
+	plc_init(&plc, RATE);
+
+	for (n = 0; n < packets; n++) {
+		const int16_t *pcm = ref + n * PACKET_SAMPLES;
+		unsigned int copies = 1;
+
+		/* The first packet anchors the timeline, keep it. */
+		if (n && uniform() * 100 < loss) {
+			lost++;
+			continue;
+		}
+
+		if (uniform() * 100 < dup) {
+			copies = 2;
+			dups++;
+		}
+
+		now = 1000000 + (uint64_t) n * PACKET_USEC +
+						uniform() * jitter;
+
+		while (copies--) {
+			gap = jitter_buffer_put(&jb, now, PACKET_LEN);
+			if (gap < 0)
+				continue;
+
+			if (out_len + gap / 2 + PACKET_SAMPLES > samples +
+							PACKET_SAMPLES * 64)
+				break;
+
+			plc_conceal(&plc, out + out_len, gap / 2);
+			out_len += gap / 2;
+
+			/* A duplicate taken for new audio shifts the rest. */
+			if (out_len != n * PACKET_SAMPLES)
+				dup_wrong++;
+
+			memcpy(out + out_len, pcm, PACKET_LEN);
+			plc_good(&plc, out + out_len, PACKET_SAMPLES);
+			out_len += PACKET_SAMPLES;
+
+			memcpy(silent + n * PACKET_SAMPLES, pcm, PACKET_LEN);
+			silent_len = (n + 1) * PACKET_SAMPLES;
+		}
+	}
+
+	printf("%u s, %zu packets, jitter %.0f us (depth %u us), "
+			"resyncs %llu\n", seconds, packets, jitter,
+			jitter_buffer_depth(&jb),
+			(unsigned long long) jb.resyncs);
+	printf("lost       %6zu sent, %6llu concealed\n", lost,
+				(unsigned long long) jb.gaps);
+	printf("duplicates %6zu sent, %6llu dropped\n", dups,
+				(unsigned long long) jb.surplus);
+	printf("misplaced  %6zu packets, length %zd samples off\n",
+			dup_wrong, (ssize_t) out_len - (ssize_t) silent_len);
+	printf("SNR        %6.1f dB concealed, %6.1f dB silence\n",
+			snr(ref, out, L_MIN(out_len, silent_len)),
+			snr(ref, silent, silent_len));
+
+	l_free(ref);
+	l_free(out);
+	l_free(silent);
+
+	return dup_wrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}
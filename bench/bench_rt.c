@@ -0,0 +1,160 @@
+/*
+ * bench_rt.c
+ *
+ * Runs the real-time audio thread against synthetic SCO links: a sender
+ * thread writes one 60 byte packet per stream every 7.5 ms, as an mSBC
+ * link would, into socketpairs the audio thread reads. Reports wakeup
+ * jitter against the packet cadence and per-read processing time over
+ * the whole run, as histograms. Run it long and under load to see the
+ * worst case; without CAP_SYS_NICE and CAP_IPC_LOCK the thread runs
+ * unprivileged and the numbers show what that costs.
+ *
+ * Build: make CFLAGS=-O2 bench_rt (from src/)
+ * Usage: bench_rt [-c cpu] [-P priority] [-s seconds] [-n streams]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "main.h"
+#include "rt_audio.h"
+
+#define PACKET_LEN		60
+#define PACKET_INTERVAL_NS	7500000
+
+static int senders[RT_AUDIO_STREAMS];
+static int receivers[RT_AUDIO_STREAMS];
+static unsigned int nstreams = 1;
+static unsigned int seconds = 10;
+static uint64_t received;
+
+static bool read_packet(int fd, void *user_data)
+{
+	uint8_t buf[PACKET_LEN * 2];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		__atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static void *sender_thread(void *user_data)
+{
+	uint8_t packet[PACKET_LEN] = { 0 };
+	uint64_t count = (uint64_t) seconds * 1000000000 / PACKET_INTERVAL_NS;
+	struct timespec next;
+	unsigned int i;
+	uint64_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (n = 0; n < count; n++) {
+		next.tv_nsec += PACKET_INTERVAL_NS;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+							NULL) == EINTR)
+			;
+
+		for (i = 0; i < nstreams; i++) {
+			if (write(senders[i], packet, sizeof(packet)) < 0)
+				perror("write");
+		}
+	}
+
+	return NULL;
+}
+
+static void print_histogram(const char *label, const uint64_t *hist,
+							uint64_t max)
+{
+	unsigned int i;
+
+	printf("%s (max %llu us)\n", label, (unsigned long long) max);
+
+	for (i = 0; i < RT_AUDIO_BUCKETS; i++) {
+		if (hist[i])
+			printf("  < %7u us  %10llu\n", 2u << i,
+						(unsigned long long) hist[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct rt_audio_config config = { .cpu = -1, .priority = 50,
+							.measure = true };
+	struct rt_audio_stats stats;
+	pthread_t sender;
+	unsigned int i;
+	int opt, sv[2];
+
+	while ((opt = getopt(argc, argv, "c:P:s:n:")) != -1) {
+		switch (opt) {
+		case 'c':
+			config.cpu = atoi(optarg);
+			break;
+		case 'P':
+			config.priority = atoi(optarg);
+			break;
+		case 's':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nstreams = strtoul(optarg, NULL, 10);
+			if (!nstreams || nstreams > RT_AUDIO_STREAMS)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (!l_main_init() || !rt_audio_init(&config))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < nstreams; i++) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0,
+								sv) < 0) {
+			perror("socketpair");
+			return EXIT_FAILURE;
+		}
+
+		senders[i] = sv[0];
+		receivers[i] = sv[1];
+		rt_audio_add(receivers[i], read_packet, NULL);
+	}
+
+	pthread_create(&sender, NULL, sender_thread, NULL);
+	pthread_join(sender, NULL);
+	/* Let the last packets through. */
+	usleep(20000);
+
+	for (i = 0; i < nstreams; i++) {
+		rt_audio_remove(receivers[i]);
+		close(senders[i]);
+		close(receivers[i]);
+	}
+
+	rt_audio_get_stats(&stats);
+	rt_audio_cleanup();
+	l_main_exit();
+
+	printf("%u streams, %u s, %llu packets read, %llu wakeups\n",
+				nstreams, seconds,
+				(unsigned long long) received,
+				(unsigned long long) stats.wakeups);
+	print_histogram("wakeup jitter", stats.jitter, stats.jitter_max);
+	print_histogram("read time", stats.process, stats.process_max);
+
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-c cpu] [-P priority] [-s seconds] "
+			"[-n streams (1-%u)]\n", argv[0], RT_AUDIO_STREAMS);
+	return EXIT_FAILURE;
+}
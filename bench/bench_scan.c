@@ -0,0 +1,198 @@
+/*
+ * bench_scan.c
+ *
+ * Byte set scanner throughput, and a randomized cross-check of every
+ * implementation the CPU supports against the scalar reference. Each
+ * round searches a random buffer for a random set of one to four bytes,
+ * at a random alignment, ending right before an unmapped page so that
+ * a read past the end faults instead of going unnoticed.
+ *
+ * Build: make CFLAGS=-O2 bench_scan (from src/)
+ * Usage: bench_scan [fuzz rounds]
+ */
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include "main.h"
+
+#define MAX_LEN		512
+#define BULK_LEN	(1 << 20)
+
+static const char *impl_names[] = { "scalar", "sse2", "avx2", "neon" };
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_set(struct scan_set *set, char *chars)
+{
+	unsigned int i, count = 1 + random() % SCAN_SET_MAX;
+
+	/* Bytes above 0x7f catch sign mixups, NUL is a byte like any. */
+	for (i = 0; i < count; i++)
+		chars[i] = random() % 4 ? 0x20 + random() % 0x60 : random();
+
+	/* NUL ends the string, so it can only show up first. */
+	if (!chars[0])
+		chars[0] = 1;
+
+	chars[count] = '\0';
+	scan_set_init(set, chars);
+}
+
+/* Mostly bytes outside the set, so matches land anywhere or nowhere. */
+static void random_data(char *data, size_t len, const char *chars,
+						unsigned int density)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (density && random() % density == 0)
+			data[i] = chars[random() % strlen(chars)];
+		else
+			data[i] = random();
+	}
+}
+
+static unsigned int fuzz(scan_func_t func, char *end, unsigned int rounds)
+{
+	unsigned int round, mismatches = 0;
+	struct scan_set set;
+	const char *want, *got;
+	char chars[SCAN_SET_MAX + 1], *data;
+	size_t len;
+
+	for (round = 0; round < rounds; round++) {
+		random_set(&set, chars);
+
+		len = random() % MAX_LEN;
+		data = end - len;
+		random_data(data, len, chars, random() % 64);
+
+		want = scan_scalar(&set, data, len);
+
+		/* The set bytes really are absent where scalar says so. */
+		if (want && !memchr(chars, *want, strlen(chars)))
+			mismatches++;
+
+		got = func(&set, data, len);
+		if (got == want)
+			continue;
+
+		if (mismatches++ < 10)
+			fprintf(stderr, "%s: set \"%s\" len %zu: expected "
+					"offset %td, got %td\n", scan_name(func),
+					chars, len, want ? want - data : -1,
+					got ? got - data : -1);
+	}
+
+	return mismatches;
+}
+
+/* Searching a long run for a byte that is not there. */
+static double bulk(scan_func_t func, const char *data)
+{
+	unsigned int i, reps = 256;
+	double start;
+
+	start = cpu_seconds();
+
+	for (i = 0; i < reps; i++) {
+		if (func(&scan_set_eol, data, BULK_LEN))
+			abort();
+	}
+
+	return (double) reps * BULK_LEN / (cpu_seconds() - start) / 1e9;
+}
+
+/*
+ * Framing a stream of +CIEV lines, the way handle_recv_data() does,
+ * through scan_find() with @func behind it.
+ */
+static double lines(scan_func_t func, const char *data, size_t len,
+							unsigned int *count)
+{
+	unsigned int i, reps = 2000;
+	const char *pos, *end = data + len, *eol;
+	double start;
+
+	scan_impl = func;
+	start = cpu_seconds();
+	*count = 0;
+
+	for (i = 0; i < reps; i++) {
+		for (pos = data; pos < end; pos = eol + 1) {
+			eol = scan_find(&scan_set_eol, pos, end - pos);
+			if (!eol)
+				break;
+
+			if (eol != pos)
+				scan_find(&scan_set_args, pos, eol - pos);
+
+			++*count;
+		}
+	}
+
+	return (cpu_seconds() - start) * 1e9 / *count;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	unsigned int i, count, mismatches = 0;
+	long page = sysconf(_SC_PAGESIZE);
+	char *map, *guard, *bulk_data, *stream;
+	size_t stream_len = 0;
+	scan_func_t func;
+
+	/* Test buffers end where an inaccessible page starts. */
+	map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	guard = map + page;
+	mprotect(guard, page, PROT_NONE);
+
+	bulk_data = l_malloc(BULK_LEN);
+	memset(bulk_data, 'a', BULK_LEN);
+
+	stream = l_malloc(64 * 1024);
+	while (stream_len < 64 * 1024 - 32)
+		stream_len += sprintf(stream + stream_len, "\r\n+CIEV: %ld,%ld\r\n",
+					1 + random() % 7, random() % 4);
+
+	printf("selected: %s\n", scan_name(scan_select()));
+
+	for (i = 0; i < L_ARRAY_SIZE(impl_names); i++) {
+		func = scan_lookup(impl_names[i]);
+		if (!func)
+			continue;
+
+		srandom(1);
+		mismatches += fuzz(func, guard, rounds);
+
+		printf("%-7s %6.2f GB/s bulk  %6.1f ns/line", impl_names[i],
+				bulk(func, bulk_data),
+				lines(func, stream, stream_len, &count));
+		printf("  fuzz %u rounds ok\n", rounds);
+	}
+
+	l_free(stream);
+	l_free(bulk_data);
+	munmap(map, 2 * page);
+
+	if (mismatches) {
+		printf("cross-check: %u mismatches\n", mismatches);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
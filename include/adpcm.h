@@ -0,0 +1,27 @@
+/*
+ * adpcm.h
+ *
+ * IMA ADPCM, 4 bits per sample. The state is two numbers, so every
+ * record can carry the state it starts from and decode on its own.
+ */
+
+#ifndef ADPCM_H_
+#define ADPCM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct adpcm_state {
+	int16_t predictor;
+	uint8_t index;		/* into the step size table, 0 to 88 */
+};
+
+/* Bytes for @samples, two per byte, low nibble first. */
+#define ADPCM_BYTES(samples)	(((samples) + 1) / 2)
+
+void adpcm_encode(struct adpcm_state *state, const int16_t *pcm,
+					unsigned int samples, uint8_t *out);
+void adpcm_decode(struct adpcm_state *state, const uint8_t *in,
+					unsigned int samples, int16_t *pcm);
+
+#endif /* ADPCM_H_ */
@@ -0,0 +1,28 @@
+/*
+ * arena.h
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/* Enough for the largest reply, MAX_DATA_BUF_SIZE, twice over. */
+#define ARENA_SIZE		512
+
+/*
+ * Bump allocator for scratch memory that only lives while one AT line
+ * is handled. Each session owns one and the parser resets it after
+ * every line, so replies are built without touching the heap.
+ */
+struct arena {
+	size_t used;
+	char buf[ARENA_SIZE] __attribute__((aligned(16)));
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_printf(struct arena *arena, const char *format, ...)
+					__attribute__((format(printf, 2, 3)));
+void arena_reset(struct arena *arena);
+
+#endif /* ARENA_H_ */
@@ -5,9 +5,119 @@
 #ifndef AT_PARSER_H_
 #define AT_PARSER_H_
 
-void handle_recv_data(char *data, int bytes_read);
-bool send_command(const char *cmd);
+#include <stdbool.h>
+#include <stdint.h>
 
-void init_connection(void);
+#include "ringbuf.h"
+
+/* Per-connection inbound AT stream state. */
+struct at_framer {
+	struct ringbuf ring;
+	/* bytes after ring.out already searched for a line terminator. */
+	unsigned int scan;
+	/* linear copy of a line that wraps around the end of the ring. */
+	char line[RINGBUF_SIZE];
+};
+
+struct hfp_session;
+
+/* HFP 1.7 codec ids, as used by AT+BAC and +BCS. */
+enum hfp_codec {
+	HFP_CODEC_CVSD = 1,
+	HFP_CODEC_MSBC = 2,
+};
+
+/*
+ * Every AT command and result code known to the parser. Each entry is
+ * (enum id, token, handler); the enum here and the token and dispatch
+ * tables in at_parser.c are all generated from this list so they can not
+ * drift apart. Tokens are what we put on the wire; received lines are matched
+ * on the token part before the first ':', '?' or '='. Entries without a
+ * handler are only ever sent by us.
+ */
+#define AT_COMMANDS(X) \
+	X(OK,		"OK",		handle_ok_response) \
+	X(ERROR,	"ERROR",	handle_error_response) \
+	X(AT_BRSF,	"AT+BRSF=",	handle_brsf_cmd) \
+	X(BRSF,		"+BRSF:",	handle_brsf_response) \
+	/* retrieve info about supported AG indicators and their ordering. */ \
+	X(AT_CIND_Q,	"AT+CIND=?",	NULL) \
+	X(CIND,		"+CIND:",	handle_cind_response) \
+	/* get the current status of the AG supported indicators. */ \
+	X(AT_CIND_R,	"AT+CIND?",	NULL) \
+	X(AT_CMER,	"AT+CMER=",	NULL) \
+	X(CIEV,		"+CIEV:",	handle_ciev_events) \
+	/* notify AG of the available codecs in HF. in-case both HF and AG
+	 * support codec negotiation feature. */ \
+	X(AT_BAC,	"AT+BAC=",	NULL) \
+	/* AG selects a codec, HF confirms it. */ \
+	X(BCS,		"+BCS:",	handle_bcs_events) \
+	X(AT_BCS,	"AT+BCS=",	NULL) \
+	/* HF asks the AG to start codec connection setup. */ \
+	X(AT_BCC,	"AT+BCC",	NULL) \
+	X(AT_BIND,	"AT+BIND=",	NULL) \
+	/* request from HF to get the supported indicators supported by AG,
+	 * in-case HF and AG support HF indicators. */ \
+	X(AT_BIND_Q,	"AT+BIND=?",	NULL) \
+	/* request from HF to get the current enabled HF indicators on AG. */ \
+	X(AT_BIND_R,	"AT+BIND?",	NULL) \
+	/* AG response for AT+BIND? command. */ \
+	X(BIND,		"+BIND:",	NULL) \
+	/* HF command to AG to indicate change in HF indicators. */ \
+	X(AT_BIEV,	"AT+BIEV=",	NULL) \
+	/* standard call answer AT command. */ \
+	X(ATA,		"ATA",		NULL) \
+	X(RING,		"RING",		handle_ring_events) \
+	X(AT_CHUP,	"AT+CHUP",	NULL) \
+	X(AT_CLIP,	"AT+CLIP=",	NULL) \
+	/* +CLIP: <number>, 128-143 or +CLIP: <number>, 144-159 or
+	 * +CLIP: <number>, 160-175 */ \
+	X(CLIP,		"+CLIP:",	handle_clip_events)
+
+#define AT_CMD_ENUM(id, token, handler)		id,
+
+enum at_cmds {
+	AT_COMMANDS(AT_CMD_ENUM)
+	AT_CMD_COUNT
+};
+
+/* Remote SDP record, from the fd_properties of Profile1.NewConnection. */
+struct slc_sdp {
+	uint16_t version;	/* 0 if BlueZ passed none */
+	uint16_t features;	/* AG SupportedFeatures */
+};
+
+/* Service Level Connection setup, in the order the spec lists it. */
+enum slc_step {
+	SLC_BRSF,
+	SLC_BAC,
+	SLC_CIND_TEST,
+	SLC_CIND_READ,
+	SLC_CMER,
+	SLC_CLIP,
+	SLC_STEP_COUNT
+};
+
+struct slc {
+	struct slc_sdp sdp;
+	struct l_timeout *timeout;	/* for the oldest command in flight */
+	unsigned int next;		/* first step not sent yet */
+	/* Sent and waiting for OK or ERROR, oldest first. */
+	uint8_t inflight[SLC_STEP_COUNT];
+	unsigned int head, count;
+	unsigned int retries;		/* of the oldest command in flight */
+	bool serial;			/* one command at a time */
+	bool brsf;			/* +BRSF seen, ag_features valid */
+	bool ready;
+};
+
+void at_framer_init(struct at_framer *framer);
+void handle_recv_data(struct hfp_session *session);
+bool send_command(struct hfp_session *session, const char *cmd);
+
+void slc_start(struct hfp_session *session, const struct slc_sdp *sdp);
+void slc_resume(struct hfp_session *session);
+void slc_stop(struct hfp_session *session);
+bool at_codec_connection(struct hfp_session *session);
 
 #endif /* AT_PARSER_H_ */
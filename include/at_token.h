@@ -0,0 +1,46 @@
+/*
+ * at_token.h
+ */
+
+#ifndef AT_TOKEN_H_
+#define AT_TOKEN_H_
+
+#include <stdbool.h>
+
+/* A run of bytes inside a received line, not NUL terminated. */
+struct at_view {
+	const char *ptr;
+	unsigned int len;
+};
+
+enum at_token_type {
+	AT_TOKEN_END,
+	AT_TOKEN_VALUE,		/* one field, without quotes or padding */
+	AT_TOKEN_OPEN,		/* ( */
+	AT_TOKEN_CLOSE,		/* ) */
+};
+
+/*
+ * Splits the arguments of a result code into fields in one pass. Commas
+ * separate fields, parentheses nest lists, blanks around a field and
+ * the quotes of a quoted field are dropped. An empty field between two
+ * commas is reported as an empty value so positions stay right. The
+ * line is never written to; all state is in the caller's struct.
+ */
+struct at_tokenizer {
+	const char *pos;
+	const char *end;
+	enum at_token_type prev;
+	bool separated;		/* a comma since the last field */
+};
+
+void at_tokenizer_init(struct at_tokenizer *tk, const char *data,
+							unsigned int len);
+enum at_token_type at_tokenizer_next(struct at_tokenizer *tk,
+						struct at_view *value);
+bool at_tokenizer_next_uint(struct at_tokenizer *tk, unsigned int *value);
+
+bool at_view_equal(const struct at_view *view, const char *str);
+bool at_view_to_uint(const struct at_view *view, unsigned int *value);
+
+#endif /* AT_TOKEN_H_ */
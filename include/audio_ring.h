@@ -0,0 +1,48 @@
+/*
+ * audio_ring.h
+ */
+
+#ifndef AUDIO_RING_H_
+#define AUDIO_RING_H_
+
+#include <stdint.h>
+
+/* Largest SCO packet we accept, eSCO EV5 2-EV5 payloads fit. */
+#define AUDIO_FRAME_MAX		240
+
+struct audio_frame {
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, usec */
+	uint16_t len;
+	uint8_t type;		/* 0 for audio, else a metadata rec_type */
+	uint8_t data[AUDIO_FRAME_MAX];
+};
+
+/*
+ * Single producer / single consumer ring of preallocated frames. The
+ * producer only writes head, the consumer only writes tail, so no lock
+ * is needed; the two live on separate cache lines to avoid false
+ * sharing between the capture and writer threads.
+ */
+struct audio_ring {
+	struct audio_frame *frames;
+	unsigned int size;	/* power of two */
+
+	unsigned int head __attribute__((aligned(64)));
+	uint64_t overruns;
+
+	unsigned int tail __attribute__((aligned(64)));
+};
+
+bool audio_ring_init(struct audio_ring *ring, unsigned int size);
+void audio_ring_free(struct audio_ring *ring);
+
+struct audio_frame *audio_ring_reserve(struct audio_ring *ring);
+void audio_ring_commit(struct audio_ring *ring);
+
+struct audio_frame *audio_ring_peek(struct audio_ring *ring, unsigned int index);
+void audio_ring_release(struct audio_ring *ring, unsigned int count);
+
+unsigned int audio_ring_fill(const struct audio_ring *ring);
+uint64_t audio_ring_overruns(const struct audio_ring *ring);
+
+#endif /* AUDIO_RING_H_ */
@@ -0,0 +1,47 @@
+/*
+ * bluetooth.h
+ *
+ * The few kernel Bluetooth socket definitions we need, so building does
+ * not depend on libbluetooth headers.
+ */
+
+#ifndef BLUETOOTH_H_
+#define BLUETOOTH_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH		31
+#endif
+
+#define BTPROTO_SCO		2
+#define SOL_BLUETOOTH		274
+#define SOL_SCO			17
+
+#define SCO_OPTIONS		0x01
+#define BT_DEFER_SETUP		7
+#define BT_VOICE		11
+
+/* BT_VOICE settings */
+#define BT_VOICE_TRANSPARENT		0x0003
+#define BT_VOICE_CVSD_16BIT		0x0060
+
+typedef struct {
+	uint8_t b[6];
+} __attribute__((packed)) bdaddr_t;
+
+struct sockaddr_sco {
+	sa_family_t	sco_family;
+	bdaddr_t	sco_bdaddr;
+};
+
+struct sco_options {
+	uint16_t mtu;
+};
+
+struct bt_voice {
+	uint16_t setting;
+};
+
+#endif /* BLUETOOTH_H_ */
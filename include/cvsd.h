@@ -0,0 +1,40 @@
+/*
+ * cvsd.h
+ */
+
+#ifndef CVSD_H_
+#define CVSD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64 kbit/s, one bit per 64 kHz sample, decimated to 8 kHz PCM. */
+#define CVSD_RATE		8000
+#define CVSD_DECIMATION		8
+#define CVSD_FIR_TAPS		64
+
+struct cvsd_decoder {
+	int32_t estimate;	/* x^(k), Q10 */
+	int32_t delta;		/* step size, Q10 */
+	unsigned int history;	/* last 3 bits, oldest in bit 0 */
+
+	/* 64 kHz samples twice over, so the decimation filter always
+	 * reads one contiguous run.
+	 */
+	int16_t samples[2 * CVSD_FIR_TAPS] __attribute__((aligned(16)));
+	unsigned int pos;
+};
+
+typedef size_t (*cvsd_decode_func_t)(struct cvsd_decoder *dec,
+			const uint8_t *in, size_t len, int16_t *pcm);
+
+void cvsd_decoder_init(struct cvsd_decoder *dec);
+
+/* Reference implementation, straight from the spec. */
+size_t cvsd_decode_scalar(struct cvsd_decoder *dec, const uint8_t *in,
+				size_t len, int16_t *pcm);
+
+cvsd_decode_func_t cvsd_decode_select(void);
+const char *cvsd_decode_name(cvsd_decode_func_t func);
+
+#endif /* CVSD_H_ */
@@ -7,7 +7,7 @@
 
 #include <stdbool.h>
 
-bool dbus_init(void);
+bool dbus_init(bool replace);
 void dbus_cleanup(void);
 
 #endif /* DBUS_H_ */
@@ -0,0 +1,72 @@
+/*
+ * encode_pool.h
+ *
+ * A few worker threads compressing recordings for the SCO writer. Each
+ * recording is a stream with a fixed queue of jobs: runs of samples to
+ * encode, and records that only have to stay in order with them. A
+ * stream is worked on by one thread at a time, in order, so different
+ * calls encode in parallel while each encoder sees its audio in
+ * sequence. Finished jobs are handed back to the writer, which wakes on
+ * the eventfd given to encode_pool_new(), through encode_stream_reap().
+ *
+ * Queues never grow: a writer finding its stream's queue full waits
+ * for a worker, leaving new audio in the capture ring meanwhile.
+ * Everything except encode_pool_get_stats() belongs to one thread.
+ */
+
+#ifndef ENCODE_POOL_H_
+#define ENCODE_POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "recording.h"
+
+#define ENCODE_THREADS_MAX	8
+/* Jobs queued per stream, and the largest record one can carry. */
+#define ENCODE_STREAM_JOBS	16
+#define ENCODE_JOB_MAX		2048
+
+struct encoder;
+struct encode_pool;
+struct encode_stream;
+
+struct encode_stats {
+	const char *encoder;
+	unsigned int threads;
+	uint64_t jobs;
+	uint64_t audio_time;	/* usec of audio encoded */
+	uint64_t cpu_time;	/* usec, summed over the workers */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t stalls;	/* times a writer waited for a worker */
+	uint64_t errors;
+};
+
+typedef void (*encode_record_func_t)(enum rec_type type, enum rec_codec codec,
+					uint64_t timestamp, const void *data,
+					size_t len, void *user_data);
+
+struct encode_pool *encode_pool_new(const struct encoder *encoder,
+							int notify_fd);
+void encode_pool_free(struct encode_pool *pool);
+void encode_pool_get_stats(struct encode_pool *pool,
+					struct encode_stats *stats);
+
+struct encode_stream *encode_stream_new(struct encode_pool *pool,
+					unsigned int rate,
+					encode_record_func_t func,
+					void *user_data);
+void encode_stream_free(struct encode_stream *stream);
+
+bool encode_stream_audio(struct encode_stream *stream, uint64_t timestamp,
+				const int16_t *pcm, unsigned int samples);
+bool encode_stream_record(struct encode_stream *stream, enum rec_type type,
+				enum rec_codec codec, uint64_t timestamp,
+				const void *data, size_t len);
+void encode_stream_reap(struct encode_stream *stream);
+unsigned int encode_stream_room(struct encode_stream *stream);
+bool encode_stream_idle(struct encode_stream *stream);
+
+#endif /* ENCODE_POOL_H_ */
@@ -0,0 +1,53 @@
+/*
+ * encoder.h
+ *
+ * Compression for stored audio. An encoder turns a run of decoded
+ * samples into one record payload, struct rec_encoded followed by its
+ * data. Encoders keep state between runs of the same stream; one
+ * stream's runs are always encoded in order, one at a time.
+ *
+ * The same entry decodes such payloads again for readers of the
+ * recording. Decoders too are fed one stream's records in order, but
+ * may start at any record: they only owe exact audio once warmed up
+ * over a few records.
+ */
+
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "recording.h"
+
+struct encoder {
+	const char *name;
+	enum rec_codec codec_8k;
+	enum rec_codec codec_16k;
+
+	void *(*create)(unsigned int rate);
+	void (*destroy)(void *state);
+	/* Returns the payload length, or a negative errno. */
+	int (*encode)(void *state, const int16_t *pcm, unsigned int samples,
+					uint8_t *out, size_t len);
+
+	void *(*decoder_new)(unsigned int rate);
+	void (*decoder_free)(void *state);
+	/* Returns the samples written to @pcm, or a negative errno. */
+	int (*decode)(void *state, const void *data, size_t len,
+					int16_t *pcm, unsigned int samples);
+	/* Audio to decode ahead of a cold start, usec. */
+	unsigned int preroll;
+};
+
+extern const struct encoder encoder_adpcm;
+#ifdef HAVE_OPUS
+extern const struct encoder encoder_opus;
+#endif
+
+const struct encoder *encoder_find(const char *name);
+const struct encoder *encoder_for_codec(enum rec_codec codec);
+enum rec_codec encoder_codec(const struct encoder *encoder,
+							unsigned int rate);
+
+#endif /* ENCODER_H_ */
@@ -0,0 +1,32 @@
+/*
+ * handoff.h
+ *
+ * Hot restart. On SIGUSR2 the daemon executes its binary again, which
+ * may have been replaced by an upgrade, and once the new process says
+ * it is ready hands it every RFCOMM and SCO socket, the SCO listener
+ * and the recordings in progress over a socketpair, then exits. Calls
+ * go on being recorded, in the same files, across the restart.
+ *
+ * The new process finds its end of the socketpair in
+ * HFP_RECORDER_HANDOFF_FD. It owns the journal and the bus name only
+ * once the old one is gone.
+ */
+
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <stdbool.h>
+
+#define HANDOFF_FD_ENV		"HFP_RECORDER_HANDOFF_FD"
+
+/* The old process' SCO listener, or -1 if it had none or died early. */
+typedef void (*handoff_listen_func_t)(int fd);
+/* The old process is gone, the rest of the daemon may start. */
+typedef void (*handoff_done_func_t)(void);
+
+bool handoff_init(char *argv[]);
+bool handoff_receive(const char *fd, handoff_listen_func_t listen,
+					handoff_done_func_t done);
+void handoff_cleanup(void);
+
+#endif /* HANDOFF_H_ */
@@ -0,0 +1,44 @@
+/*
+ * jitter.h
+ *
+ * Places received SCO frames on the timeline implied by the link's
+ * fixed bit rate. Every frame owns a slot one frame long on that
+ * timeline; one landing past its slot means frames went missing before
+ * it, one landing before it is surplus, typically a duplicated packet.
+ * Where the slot starts adapts to how early frames arrive: the radio
+ * delivers late far more often than early, so most of the slot is kept
+ * for lateness. The timeline slowly follows the sender's clock so drift
+ * does not turn into losses.
+ */
+
+#ifndef JITTER_H_
+#define JITTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longer gaps restart the timeline instead of being concealed. */
+#define JITTER_GAP_MAX		500000
+
+struct jitter_buffer {
+	unsigned int rate;	/* link bytes per second */
+	uint64_t start;		/* usec, when byte 0 was due */
+	uint64_t bytes;		/* placed on the timeline since start */
+	uint64_t jitter;	/* mean deviation, usec << 4 */
+	uint64_t early;		/* mean earliness, usec << 4 */
+	unsigned int frame_len;	/* of the last frame */
+	bool started;
+
+	uint64_t frames;
+	uint64_t gaps;		/* frames missing */
+	uint64_t surplus;	/* frames dropped */
+	uint64_t resyncs;
+};
+
+void jitter_buffer_init(struct jitter_buffer *jb, unsigned int rate);
+long jitter_buffer_put(struct jitter_buffer *jb, uint64_t timestamp,
+							size_t len);
+unsigned int jitter_buffer_depth(const struct jitter_buffer *jb);
+
+#endif /* JITTER_H_ */
@@ -0,0 +1,106 @@
+/*
+ * journal.h
+ *
+ * Binary call event journal: a preallocated file mapped shared, a page
+ * of header and then a ring of fixed 64 byte records. Logging an event
+ * is one clock read and one cache line copy into the mapping, with no
+ * formatting and no system call, and since the kernel owns the pages a
+ * crash of the daemon loses nothing already logged.
+ *
+ * Records are numbered from 1 on; record n lives in slot (n - 1) %
+ * capacity. Nothing else says where the ring ends: every record carries
+ * its number and a check over its contents, so a reader, or the daemon
+ * opening the file again, finds the newest record by looking, and a
+ * record torn by a crash or caught mid copy simply does not check out.
+ * All integers are little endian.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC		"HFPJRN1"
+#define JOURNAL_VERSION		1
+#define JOURNAL_HEADER_SIZE	4096
+#define JOURNAL_RECORDS		65536	/* 4 MiB */
+#define JOURNAL_PAYLOAD		28
+
+enum journal_type {
+	JOURNAL_START = 1,	/* daemon up, payload: le64 realtime offset */
+	JOURNAL_CONNECT = 2,	/* SLC up */
+	JOURNAL_DISCONNECT = 3,
+	JOURNAL_BRSF = 4,	/* payload: le32 AG features */
+	JOURNAL_RING = 5,	/* payload: le32 rings so far */
+	JOURNAL_CLIP = 6,	/* payload: number, may be cut short */
+	JOURNAL_CIEV = 7,	/* payload: struct journal_ciev */
+	JOURNAL_ANSWER = 8,	/* we answered the call */
+};
+
+/* Indicators by meaning, their indexes differ between AGs. */
+enum journal_indicator {
+	JOURNAL_IND_OTHER = 0,
+	JOURNAL_IND_SERVICE = 1,
+	JOURNAL_IND_CALL = 2,
+	JOURNAL_IND_CALLSETUP = 3,
+};
+
+struct journal_ciev {
+	uint8_t indicator;	/* enum journal_indicator */
+	uint8_t index;		/* as the AG numbers it */
+	uint8_t value;
+} __attribute__((packed));
+
+struct journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;	/* records */
+	uint32_t reserved;
+	/*
+	 * nsec to add to record timestamps for the time of day, as of the
+	 * last start; JOURNAL_START records carry it for older ones.
+	 */
+	uint64_t realtime_offset;
+	uint8_t pad[JOURNAL_HEADER_SIZE - 32];
+} __attribute__((packed));
+
+struct journal_record {
+	uint64_t seq;
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, nsec */
+	uint32_t session;	/* per daemon run, 0 for none */
+	uint16_t type;
+	uint8_t len;		/* payload bytes */
+	uint8_t reserved;
+	uint8_t address[6];	/* AG, as bdaddr_t */
+	uint8_t reserved2[2];
+	uint8_t payload[JOURNAL_PAYLOAD];
+	uint32_t check;		/* over everything before it */
+} __attribute__((packed, aligned(64)));
+
+/* Writing, from the main loop only. */
+bool journal_open(const char *path);
+void journal_close(void);
+void journal_log(uint32_t session, const uint8_t *address,
+			enum journal_type type, const void *payload,
+			size_t len);
+
+/* Reading, any process. */
+struct journal_reader;
+
+struct journal_reader *journal_reader_open(const char *path);
+void journal_reader_close(struct journal_reader *reader);
+const struct journal_header *journal_reader_header(
+					struct journal_reader *reader);
+bool journal_reader_range(struct journal_reader *reader, uint64_t *first,
+							uint64_t *last);
+int journal_reader_next(struct journal_reader *reader, uint64_t *seq,
+					struct journal_record *rec);
+
+const char *journal_type_name(enum journal_type type);
+int journal_type_from_name(const char *name);
+int journal_format(const struct journal_record *rec, char *buf, size_t len);
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,72 @@
+/*
+ * log.h
+ *
+ * Logging for the daemon, in front of ELL's. The level is fixed when
+ * building, make LOG_LEVEL=<priority>, and calls above it compile to
+ * nothing: their arguments are type checked but never evaluated.
+ *
+ * What is left goes to ELL as it always did, unless log_init() started
+ * the deferred backend. Then a call stores its call site, which doubles
+ * as the id of its format, and its raw arguments in a ring owned by the
+ * calling thread, with no lock, no allocation and no formatting, and a
+ * background thread formats and hands lines to ELL a few milliseconds
+ * later, in time order across threads. Strings are copied, so callers
+ * may free theirs right away; %m is the errno of the call. A full ring
+ * drops the message and counts it, it never blocks the caller.
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ell/ell.h>
+
+/* Priorities as in ELL and syslog, most severe first. */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL	L_LOG_INFO
+#endif
+
+#define LOG_SITE_ARGS	12
+
+/* One per call site, the deferred backend fills in the rest. */
+struct log_site {
+	int priority;
+	const char *format;
+	const char *file;
+	const char *line;
+	const char *func;
+	int state;
+	uint8_t nargs;
+	uint8_t args[LOG_SITE_ARGS];
+};
+
+extern bool log_deferred;
+
+void log_record(struct log_site *site, ...);
+
+#define log_at(pri, fmt, ...) do {					\
+	if ((pri) <= LOG_LEVEL) {					\
+		static struct log_site log_site_ = {			\
+			.priority = (pri), .format = fmt,		\
+			.file = __FILE__, .line = L_STRINGIFY(__LINE__),	\
+			.func = __func__ };				\
+		if (log_deferred)					\
+			log_record(&log_site_, ##__VA_ARGS__);		\
+		else							\
+			l_log_with_location((pri), __FILE__,		\
+				L_STRINGIFY(__LINE__), __func__,	\
+				fmt "\n", ##__VA_ARGS__);		\
+	}								\
+} while (0)
+
+#define log_error(fmt, ...)	log_at(L_LOG_ERR, fmt, ##__VA_ARGS__)
+#define log_warn(fmt, ...)	log_at(L_LOG_WARNING, fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...)	log_at(L_LOG_INFO, fmt, ##__VA_ARGS__)
+#define log_debug(fmt, ...)	log_at(L_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+bool log_init(bool deferred);
+void log_exit(void);
+
+#endif /* LOG_H_ */
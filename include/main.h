@@ -16,5 +16,11 @@
 #include "utils.h"
 #include "socket.h"
 #include "dbus.h"
+#include "log.h"
 
 #define VERSION "0.1"
+
+/* Overridden by HFP_RECORDER_DIR. */
+#define DEFAULT_RECORD_DIR "/var/lib/hfp_recorder"
+/* In the record directory, unless HFP_RECORDER_JOURNAL names a file. */
+#define DEFAULT_JOURNAL "events.journal"
@@ -0,0 +1,49 @@
+/*
+ * msbc.h
+ */
+
+#ifndef MSBC_H_
+#define MSBC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sbc_synth.h"
+
+#define MSBC_SYNCWORD		0xad
+#define MSBC_BLOCKS		15
+#define MSBC_BITPOOL		26
+#define MSBC_FRAME_LEN		57
+/* H2 header + frame + one padding byte, as sent over transparent SCO. */
+#define MSBC_PACKET_LEN		60
+#define MSBC_SAMPLES		(MSBC_BLOCKS * SBC_SUBBANDS)
+#define MSBC_RATE		16000
+
+struct msbc_decoder {
+	struct sbc_synth synth;
+	sbc_synth_func_t synth_func;
+
+	/* H2 reassembly of the SCO byte stream. */
+	uint8_t buf[2 * MSBC_PACKET_LEN];
+	unsigned int len;
+	int seq;
+
+	uint64_t frames;
+	uint64_t crc_errors;
+	uint64_t sync_losses;	/* bytes skipped looking for a H2 header */
+	uint64_t lost;		/* frames missing according to H2 sequence */
+	uint64_t duplicates;	/* frames repeating the H2 sequence number */
+};
+
+void msbc_decoder_init(struct msbc_decoder *dec);
+int msbc_decode_frame(struct msbc_decoder *dec, const uint8_t *frame,
+			int16_t pcm[MSBC_SAMPLES]);
+
+/* @pcm is NULL for @samples lost or undecodable, to be concealed. */
+typedef void (*msbc_pcm_func_t)(const int16_t *pcm, unsigned int samples,
+				void *user_data);
+void msbc_decode_stream(struct msbc_decoder *dec, const uint8_t *data,
+			size_t len, msbc_pcm_func_t func, void *user_data);
+void msbc_decoder_gap(struct msbc_decoder *dec);
+
+#endif /* MSBC_H_ */
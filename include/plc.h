@@ -0,0 +1,45 @@
+/*
+ * plc.h
+ *
+ * Packet loss concealment by waveform substitution: a lost stretch is
+ * filled by repeating the last pitch period found in the history, fading
+ * out the longer the loss lasts, and the first good samples after it
+ * are cross-faded from the substitute. Works at 8 and 16 kHz, for PCM
+ * and CVSD links as for mSBC.
+ */
+
+#ifndef PLC_H_
+#define PLC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Pitch periods searched, 2.5 to 15 ms, and the matching window. */
+#define PLC_PITCH_MIN_MS_X10	25
+#define PLC_PITCH_MAX_MS	15
+/* At 16 kHz: the longest period plus the matching window. */
+#define PLC_HISTORY		(16 * PLC_PITCH_MAX_MS + 16 * 25 / 10 + 16)
+
+struct plc {
+	unsigned int rate;
+	unsigned int pitch_min, pitch_max;
+	unsigned int window;	/* samples matched and cross-faded */
+	unsigned int fade;	/* samples until silence, once fading */
+
+	int16_t history[PLC_HISTORY];	/* newest last */
+	unsigned int filled;	/* valid samples in history */
+
+	/* Current loss. */
+	unsigned int pitch;
+	unsigned int pos;	/* in the repeated period */
+	unsigned int lost;	/* samples concealed so far */
+	bool concealing;
+
+	uint64_t concealed;	/* samples, in total */
+};
+
+void plc_init(struct plc *plc, unsigned int rate);
+void plc_good(struct plc *plc, int16_t *pcm, unsigned int samples);
+void plc_conceal(struct plc *plc, int16_t *pcm, unsigned int samples);
+
+#endif /* PLC_H_ */
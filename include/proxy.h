@@ -0,0 +1,70 @@
+/*
+ * proxy.h
+ *
+ * Registry of the BlueZ objects seen through the org.bluez client, by
+ * object path. Every object keeps the proxy of each interface we know
+ * and a typed copy of their properties, kept current from
+ * PropertiesChanged instead of asking BlueZ again.
+ */
+
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct l_dbus_proxy;
+struct l_dbus_message;
+
+enum bluez_iface {
+	BLUEZ_ADAPTER,
+	BLUEZ_DEVICE,
+	BLUEZ_TRANSPORT,
+	BLUEZ_PROFILE_MANAGER,
+	BLUEZ_IFACE_COUNT
+};
+
+/* org.bluez.Adapter1 */
+struct bluez_adapter {
+	char *address;
+	char *alias;
+	bool powered;
+};
+
+/* org.bluez.Device1 */
+struct bluez_device {
+	char *address;
+	char *alias;
+	char *adapter;		/* object path */
+	uint32_t class;
+	int16_t rssi;
+	bool paired;
+	bool connected;
+};
+
+/* org.bluez.MediaTransport1 */
+struct bluez_transport {
+	char *device;		/* object path */
+	char *state;		/* idle, pending or active */
+	uint8_t codec;
+	uint16_t volume;
+};
+
+struct bluez_object {
+	char *path;
+	struct l_dbus_proxy *proxies[BLUEZ_IFACE_COUNT];
+	struct bluez_adapter adapter;
+	struct bluez_device device;
+	struct bluez_transport transport;
+};
+
+enum bluez_iface proxy_registry_add(struct l_dbus_proxy *proxy);
+void proxy_registry_remove(struct l_dbus_proxy *proxy);
+void proxy_registry_update(struct l_dbus_proxy *proxy, const char *name,
+						struct l_dbus_message *msg);
+void proxy_registry_clear(void);
+
+struct l_dbus_proxy *proxy_lookup(const char *path, enum bluez_iface iface);
+const struct bluez_device *proxy_get_device(const char *path);
+
+#endif /* PROXY_H_ */
@@ -0,0 +1,177 @@
+/*
+ * recording.h
+ *
+ * On-disk recording container. All integers are little endian.
+ *
+ *   file header | chunk 0 | chunk 1 | ... | chunk n-1 | index | footer
+ *
+ * Chunks are REC_CHUNK_SIZE bytes and hold whole records, so chunk i
+ * always starts at REC_HEADER_SIZE + i * REC_CHUNK_SIZE. The index has
+ * one entry per chunk, sorted by timestamp, and the footer at the very
+ * end of the file locates it. Call metadata is stored in-band as records
+ * next to the audio it belongs to.
+ */
+
+#ifndef RECORDING_H_
+#define RECORDING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_MAGIC		"HFPREC1"
+#define REC_FOOTER_MAGIC	"HFPIDX1"
+#define REC_VERSION		1
+#define REC_HEADER_SIZE		64
+#define REC_CHUNK_SIZE		(32 * 1024)
+#define REC_CHUNK_MAGIC		0x43504648	/* "HFPC" */
+
+/* Audio payload formats. */
+enum rec_codec {
+	REC_CODEC_NONE = 0,
+	REC_CODEC_PCM_8K = 1,		/* s16le mono 8 kHz */
+	REC_CODEC_PCM_16K = 2,		/* s16le mono 16 kHz */
+	/* Compressed, payload is struct rec_encoded and the data. */
+	REC_CODEC_ADPCM_8K = 3,		/* IMA ADPCM, low nibble first */
+	REC_CODEC_ADPCM_16K = 4,
+	REC_CODEC_OPUS_8K = 5,		/* Opus packets, each after a le16 length */
+	REC_CODEC_OPUS_16K = 6,
+};
+
+enum rec_type {
+	REC_AUDIO = 1,
+	REC_CALLER_ID = 2,	/* payload: number, not NUL terminated */
+	REC_CALL = 3,		/* payload: one byte, +CIEV call value */
+	REC_CALLSETUP = 4,	/* payload: one byte, +CIEV callsetup value */
+	REC_LINK_QUALITY = 5,	/* payload: struct rec_link_quality, last */
+	REC_SILENCE = 6,	/* payload: struct rec_silence, codec as audio */
+};
+
+struct rec_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t start_realtime;	/* usec since the epoch */
+	char address[18];		/* AG bluetooth address */
+	uint8_t reserved[REC_HEADER_SIZE - 42];
+} __attribute__((packed));
+
+struct rec_chunk_header {
+	uint32_t magic;
+	uint32_t used;		/* bytes of records after this header */
+	uint64_t timestamp;	/* of the first record, usec since start */
+	uint32_t seq;
+	uint16_t call;		/* call ordinal at chunk start, 0 = none */
+	uint8_t codec;
+	uint8_t reserved[9];
+} __attribute__((packed));
+
+struct rec_record {
+	uint8_t type;
+	uint8_t codec;
+	uint16_t len;		/* payload bytes, records are 8 byte aligned */
+	uint32_t reserved;
+	uint64_t timestamp;	/* usec since start */
+} __attribute__((packed));
+
+/* How the audio link held up over the whole recording. */
+struct rec_link_quality {
+	uint64_t frames;	/* SCO packets received */
+	uint64_t concealed;	/* frames lost and concealed */
+	uint64_t duplicates;	/* packets dropped as surplus */
+	uint32_t jitter;	/* usec, mean arrival deviation at the end */
+	uint32_t resyncs;	/* gaps too long to conceal */
+} __attribute__((packed));
+
+/* Leads the payload of compressed audio records. */
+struct rec_encoded {
+	uint32_t samples;	/* decoded, padding of the last packet dropped */
+	int16_t predictor;	/* ADPCM: state the record starts from */
+	uint8_t index;
+	uint8_t reserved;
+} __attribute__((packed));
+
+/* Audio the writer judged silent, stored as its length only. */
+struct rec_silence {
+	uint32_t samples;
+	uint16_t level;		/* RMS of the background noise */
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct rec_index_entry {
+	uint64_t timestamp;
+	uint64_t offset;	/* of the chunk header */
+	uint8_t codec;
+	uint8_t reserved;
+	uint16_t call;
+	uint32_t reserved2;
+} __attribute__((packed));
+
+struct rec_footer {
+	uint64_t index_offset;
+	uint64_t duration;	/* usec */
+	uint32_t entries;
+	uint32_t entry_size;
+	char magic[8];
+} __attribute__((packed));
+
+#define REC_RECORD_MAX		(REC_CHUNK_SIZE - \
+					sizeof(struct rec_chunk_header) - \
+					sizeof(struct rec_record))
+
+/* Writing, used by the SCO writer thread only. */
+struct rec_writer;
+
+struct storage;
+struct storage_file;
+
+/* Timestamps passed in are l_time_now() values. */
+struct rec_writer *rec_writer_new(struct storage *storage,
+					struct storage_file *file,
+					const char *address,
+					uint64_t start_monotonic);
+int rec_write(struct rec_writer *writer, enum rec_type type,
+		enum rec_codec codec, uint64_t timestamp,
+		const void *data, size_t len);
+int rec_writer_finish(struct rec_writer *writer);
+
+/* Where a recording left off, for another process to go on with it. */
+struct rec_resume {
+	uint64_t offset;	/* of the next chunk */
+	uint64_t last_timestamp;
+	uint32_t seq;
+	uint16_t call;
+	uint8_t codec;
+	uint8_t reserved;
+};
+
+int rec_writer_suspend(struct rec_writer *writer, struct rec_resume *resume);
+struct rec_writer *rec_writer_resume(struct storage *storage,
+					struct storage_file *file, int fd,
+					uint64_t start_monotonic,
+					const struct rec_resume *resume);
+
+/* Reading, through mmap. */
+struct rec_reader;
+
+struct rec_reader *rec_reader_open(const char *path);
+void rec_reader_close(struct rec_reader *reader);
+const struct rec_file_header *rec_reader_header(struct rec_reader *reader);
+uint64_t rec_reader_duration(struct rec_reader *reader);
+unsigned int rec_reader_chunks(struct rec_reader *reader);
+int rec_reader_seek(struct rec_reader *reader, uint64_t timestamp);
+
+/* Walks the records from the chunk found by rec_reader_seek on. */
+struct rec_cursor {
+	unsigned int chunk;
+	size_t pos;
+};
+
+void rec_cursor_init(struct rec_cursor *cursor, unsigned int chunk);
+const struct rec_record *rec_cursor_next(struct rec_reader *reader,
+					struct rec_cursor *cursor,
+					const void **payload);
+unsigned int rec_record_samples(const struct rec_record *rec,
+					const void *payload);
+unsigned int rec_codec_rate(enum rec_codec codec);
+
+#endif /* RECORDING_H_ */
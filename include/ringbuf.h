@@ -0,0 +1,33 @@
+/*
+ * ringbuf.h
+ */
+
+#ifndef RINGBUF_H_
+#define RINGBUF_H_
+
+#include <sys/types.h>
+
+/* Must be a power of two. */
+#define RINGBUF_SIZE		1024
+
+/* Byte ring used for inbound socket data. in and out are free running
+ * counters, so (in - out) is always the number of queued bytes.
+ */
+struct ringbuf {
+	char buf[RINGBUF_SIZE];
+	unsigned int in;
+	unsigned int out;
+};
+
+#define RINGBUF_MASK(X)		((X) & (RINGBUF_SIZE - 1))
+
+void ringbuf_init(struct ringbuf *ring);
+unsigned int ringbuf_len(const struct ringbuf *ring);
+unsigned int ringbuf_avail(const struct ringbuf *ring);
+char ringbuf_at(const struct ringbuf *ring, unsigned int pos);
+void ringbuf_drain(struct ringbuf *ring, unsigned int count);
+unsigned int ringbuf_write(struct ringbuf *ring, const void *data,
+							unsigned int len);
+ssize_t ringbuf_read_fd(struct ringbuf *ring, int fd);
+
+#endif /* RINGBUF_H_ */
@@ -0,0 +1,52 @@
+/*
+ * rt_audio.h
+ *
+ * Optional real-time audio thread. When enabled, SCO sockets are read
+ * on a dedicated SCHED_FIFO thread, optionally pinned to one CPU, with
+ * all memory locked, so audio does not wait behind D-Bus or AT work on
+ * the main loop. Streams are added and removed from the main loop only.
+ */
+
+#ifndef RT_AUDIO_H_
+#define RT_AUDIO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Streams served at once, one per active audio link. */
+#define RT_AUDIO_STREAMS	8
+
+/* Time histograms, bucket i counts [2^i, 2^(i+1)) usec. */
+#define RT_AUDIO_BUCKETS	20
+
+struct rt_audio_config {
+	int cpu;		/* -1 for no pinning */
+	int priority;		/* SCHED_FIFO, 1 to 99 */
+	bool measure;		/* collect and log timing statistics */
+};
+
+struct rt_audio_stats {
+	uint64_t wakeups;
+	uint64_t jitter[RT_AUDIO_BUCKETS];	/* from the stream cadence */
+	uint64_t jitter_max;			/* usec */
+	uint64_t process[RT_AUDIO_BUCKETS];	/* per read */
+	uint64_t process_max;			/* usec */
+};
+
+/*
+ * Reads what @fd has, returns false to stop polling it. A hangup or
+ * error on @fd stops polling it too, the main loop sees it as well.
+ */
+typedef bool (*rt_audio_read_func_t)(int fd, void *user_data);
+
+bool rt_audio_init(const struct rt_audio_config *config);
+void rt_audio_cleanup(void);
+bool rt_audio_running(void);
+
+bool rt_audio_add(int fd, rt_audio_read_func_t func, void *user_data);
+void rt_audio_remove(int fd);
+
+void rt_audio_get_stats(struct rt_audio_stats *stats);
+void rt_audio_report(void);
+
+#endif /* RT_AUDIO_H_ */
@@ -0,0 +1,39 @@
+/*
+ * sbc_synth.h
+ */
+
+#ifndef SBC_SYNTH_H_
+#define SBC_SYNTH_H_
+
+#include <stdint.h>
+
+#define SBC_SUBBANDS		8
+/* Ten past blocks of 16 matrixed values feed the window. */
+#define SBC_SYNTH_V		160
+
+/*
+ * 8 subband synthesis filterbank state. v holds the last SBC_SYNTH_V
+ * values of the V vector twice, so the window always reads one
+ * contiguous run and shifting costs nothing.
+ */
+struct sbc_synth {
+	float v[2 * SBC_SYNTH_V];
+	unsigned int offset;
+};
+
+typedef void (*sbc_synth_func_t)(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm);
+
+void sbc_synth_init(struct sbc_synth *synth);
+
+/* Reference implementation, used to cross-check the vector ones. */
+void sbc_synth_scalar(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm);
+
+/* Fastest implementation the running CPU supports. */
+sbc_synth_func_t sbc_synth_select(void);
+const char *sbc_synth_name(sbc_synth_func_t func);
+
+#endif /* SBC_SYNTH_H_ */
@@ -0,0 +1,65 @@
+/*
+ * sco.h
+ */
+
+#ifndef SCO_H_
+#define SCO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct hfp_session;
+struct sco_capture;
+struct storage_stats;
+struct encode_stats;
+struct rec_resume;
+
+struct sco_capture_stats {
+	unsigned int ring_fill;		/* frames queued for the writer */
+	unsigned int ring_size;
+	uint64_t frames;		/* frames captured */
+	uint64_t overruns;		/* frames dropped, ring was full */
+	uint64_t write_errors;
+	uint64_t concealed;		/* frames lost on the link */
+	uint64_t duplicates;		/* surplus frames dropped */
+	uint64_t silence_saved;		/* bytes not stored, VAD */
+};
+
+/* A capture as handed over to a new process, see handoff.h. */
+struct sco_handoff {
+	uint64_t start;			/* of its recording, l_time_now() */
+	uint64_t frames;
+	uint64_t frozen;		/* l_time_now() reading stopped */
+	uint16_t mtu;
+	uint8_t codec;
+};
+
+typedef void (*sco_suspend_func_t)(const char *path,
+					const struct rec_resume *resume,
+					void *user_data);
+
+void sco_init(const char *record_dir, bool cvsd_bypass, bool vad);
+bool sco_listen(int fd);
+int sco_listen_fd(void);
+void sco_suspend(sco_suspend_func_t func, void *user_data);
+void sco_cleanup(void);
+
+void sco_capture_close(struct sco_capture *capture);
+void sco_capture_meta(struct sco_capture *capture, unsigned int type,
+					const void *data, size_t len);
+void sco_capture_get_stats(struct sco_capture *capture,
+				struct sco_capture_stats *stats);
+void sco_get_storage_stats(struct storage_stats *stats);
+void sco_get_encode_stats(struct encode_stats *stats);
+
+int sco_capture_freeze(struct sco_capture *capture,
+				struct sco_handoff *state, int *file_fd);
+void sco_capture_thaw(struct sco_capture *capture);
+void sco_capture_hand_off(struct sco_capture *capture);
+bool sco_capture_adopt(struct hfp_session *session, int fd, int file_fd,
+					const struct sco_handoff *state);
+void sco_capture_resume(struct sco_capture *capture,
+					const struct rec_resume *resume);
+
+#endif /* SCO_H_ */
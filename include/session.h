@@ -0,0 +1,68 @@
+/*
+ * session.h
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include "arena.h"
+#include "at_parser.h"
+#include "bluetooth.h"
+#include "journal.h"
+#include "socket.h"
+#include "stats.h"
+
+/* Caller ids longer than this are truncated. */
+#define HFP_CALLID_MAX		64
+
+/*
+ * One Service Level Connection with an AG. Sessions are created from
+ * Profile1.NewConnection and keyed by the BlueZ device object path.
+ */
+struct hfp_session {
+	char *path;
+	uint32_t id;			/* numbers sessions in the journal */
+	bdaddr_t bdaddr;
+	char address[18];
+	int fd;
+	struct l_io *io;
+	struct at_framer framer;
+	struct tx_queue txq;
+	struct arena arena;		/* reset after every AT line */
+	struct sco_capture *sco;
+
+	struct slc slc;
+	enum at_cmds last_cmd;
+	unsigned int ag_features;	/* from +BRSF */
+	enum hfp_codec codec;		/* for the next audio connection */
+	/* Indicator indexes */
+	int service_index;
+	int call_index;
+	int callsetup_index;
+	int signal_index;
+	int ring_count;
+	char incoming_callid[HFP_CALLID_MAX];	/* empty if unknown */
+	/* Last reported indicator values */
+	unsigned int call;
+	unsigned int callsetup;
+
+	uint64_t created;		/* l_time_now(), for SLC setup time */
+	struct hfp_stats stats;
+	bool handed_off;		/* to a new process, see handoff.h */
+};
+
+struct hfp_session *session_new(const char *path, int fd);
+struct hfp_session *session_resume(const char *path, int fd, uint32_t id);
+struct hfp_session *session_lookup(const char *path);
+struct hfp_session *session_lookup_by_bdaddr(const bdaddr_t *bdaddr);
+void session_destroy(struct hfp_session *session);
+unsigned int session_count(void);
+void session_foreach(void (*func)(struct hfp_session *session,
+						void *user_data),
+			void *user_data);
+void session_cleanup(void);
+
+void session_journal(struct hfp_session *session, enum journal_type type,
+					const void *payload, size_t len);
+
+#endif /* SESSION_H_ */
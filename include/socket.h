@@ -5,7 +5,44 @@
 #ifndef SOCKET_H_
 #define SOCKET_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_DATA_BUF_SIZE	256
-void new_rfcomm_connection(int sock);
-bool write_data(const char *data, int len);
+/* Commands queued per connection before new ones are dropped. */
+#define TX_QUEUE_SLOTS		16
+
+struct hfp_session;
+struct slc_sdp;
+
+struct tx_buf {
+	uint16_t len;
+	char data[MAX_DATA_BUF_SIZE];
+};
+
+/*
+ * Outbound queue of encoded commands. Everything queued while handling
+ * one event goes out in a single writev once the socket is writable.
+ */
+struct tx_queue {
+	struct tx_buf bufs[TX_QUEUE_SLOTS];
+	unsigned int head, tail;	/* free running */
+	size_t offset;			/* bytes of head already sent */
+
+	unsigned int high_water;	/* most commands ever queued */
+	uint64_t commands;
+	uint64_t writes;		/* writev calls that sent data */
+	uint64_t partial;		/* short writes */
+	uint64_t eagain;
+	uint64_t dropped;
+};
+
+void new_rfcomm_connection(const char *path, int sock,
+						const struct slc_sdp *sdp);
+struct hfp_session *resume_rfcomm_connection(const char *path, int sock,
+								uint32_t id);
+void freeze_rfcomm_connection(struct hfp_session *session);
+void thaw_rfcomm_connection(struct hfp_session *session);
+bool write_data(struct hfp_session *session, const char *data, int len);
+bool write_line(struct hfp_session *session, const char *line, size_t len);
 #endif
@@ -0,0 +1,60 @@
+/*
+ * stats.h
+ *
+ * Counters exported on the org.hfp.recorder.Stats1 interface. Every
+ * session keeps its own set and every update also goes to a process
+ * wide total, which outlives the sessions.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "at_parser.h"
+
+#define STATS_INTERFACE		"org.hfp.recorder.Stats1"
+
+/* Handler latency, bucket i counts calls taking [2^i, 2^(i+1)) ns. */
+#define STATS_LATENCY_BUCKETS	24
+
+struct hfp_stats {
+	uint64_t commands[AT_CMD_COUNT];
+	uint64_t latency[AT_CMD_COUNT][STATS_LATENCY_BUCKETS];
+	uint64_t unknown;		/* lines matching no command */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t slc_setups;
+	uint64_t slc_setup_time;	/* usec, summed over setups */
+	uint64_t sco_frames;		/* captured */
+	uint64_t sco_dropped;		/* capture ring was full */
+	uint64_t sco_concealed;		/* frames, total only */
+	uint64_t sco_duplicates;	/* total only */
+	uint64_t vad_saved;		/* bytes, total only */
+};
+
+extern struct hfp_stats stats_total;
+
+/* Relaxed atomics, so any thread may count and readers never block. */
+#define STATS_ADD(stats, field, n) do {					\
+	__atomic_fetch_add(&(stats)->field, (n), __ATOMIC_RELAXED);	\
+	__atomic_fetch_add(&stats_total.field, (n), __ATOMIC_RELAXED);	\
+} while (0)
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_command(struct hfp_stats *stats, int index, uint64_t ns);
+void stats_reset(struct hfp_stats *stats);
+void stats_merge(struct hfp_stats *stats, const struct hfp_stats *from);
+
+struct l_dbus_interface;
+void stats_interface_setup(struct l_dbus_interface *interface);
+
+#endif /* STATS_H_ */
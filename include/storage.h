@@ -0,0 +1,96 @@
+/*
+ * storage.h
+ *
+ * Asynchronous storage for recordings. Writers fill buffers taken from a
+ * fixed pool and hand them to a backend, which writes them in place and
+ * returns them to the pool on completion. Writes queued with
+ * storage_write() are batched until storage_submit(); completions are
+ * signalled on the eventfd given to storage_new() and processed by
+ * storage_reap(). All calls must come from a single thread, except
+ * storage_get_stats().
+ */
+
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* ~1 minute of 16 kHz audio in flight before writers see -ENOBUFS. */
+#define STORAGE_BUFFERS		32
+#define STORAGE_BUFFER_SIZE	(32 * 1024)
+
+/* storage_write() flags */
+#define STORAGE_WRITE_SYNC	(1 << 0)	/* fdatasync once written */
+#define STORAGE_WRITE_FREE	(1 << 1)	/* l_malloc'd data, not pooled */
+
+struct storage;
+struct storage_file;
+
+struct storage_stats {
+	const char *backend;
+	unsigned int queue_depth;	/* writes in flight */
+	unsigned int queue_depth_max;
+	unsigned int buffers_free;
+	uint64_t writes;		/* completed */
+	uint64_t errors;
+	uint64_t latency_avg;		/* usec, queued to completed */
+	uint64_t latency_max;
+};
+
+struct storage *storage_new(int notify_fd);
+void storage_free(struct storage *storage);
+const char *storage_name(struct storage *storage);
+
+void *storage_buffer_get(struct storage *storage);
+
+struct storage_file *storage_file_open(struct storage *storage, int fd);
+void storage_file_close(struct storage_file *file);
+uint64_t storage_file_errors(struct storage_file *file);
+
+int storage_write(struct storage_file *file, void *data, size_t len,
+					uint64_t offset, unsigned int flags);
+void storage_submit(struct storage *storage);
+void storage_reap(struct storage *storage);
+
+void storage_get_stats(struct storage *storage, struct storage_stats *stats);
+
+/* Backend interface. */
+
+struct storage_req {
+	struct storage_file *file;
+	int fd;
+	void *data;
+	size_t len;
+	uint64_t offset;
+	int buffer;		/* pool index, -1 for STORAGE_WRITE_FREE */
+	unsigned int flags;
+	uint64_t queued;
+	int result;
+	/* Backend private. */
+	struct iovec iov;
+	unsigned int parts;
+	struct storage_req *next;
+};
+
+struct storage_backend {
+	const char *name;
+	/* @buffers may be registered with the kernel for the lifetime. */
+	void *(*create)(struct storage *storage, const struct iovec *buffers,
+				unsigned int count, int notify_fd);
+	void (*destroy)(void *data);
+	/* Returns false if the request can not be queued right now. */
+	bool (*queue)(void *data, struct storage_req *req);
+	void (*submit)(void *data);
+	/* Calls storage_complete() for finished requests. */
+	void (*reap)(void *data, bool wait);
+};
+
+extern const struct storage_backend storage_uring;
+extern const struct storage_backend storage_pwrite;
+
+void storage_complete(struct storage *storage, struct storage_req *req,
+								int result);
+
+#endif /* STORAGE_H_ */
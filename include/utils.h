@@ -5,8 +5,90 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
-char *strchr_multi_byte(const char *str, const char *delim);
-char *strip_spaces(char *str);
-void util_strstrip(char *str);
-void util_charstrip(char *str, int c);
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Vector scanners compare against at most this many bytes. */
+#define SCAN_SET_MAX		4
+
+/*
+ * A set of bytes to search for. member[] is what the scalar scanner
+ * looks up, chars[] is what the vector ones broadcast. A set of fewer
+ * than SCAN_SET_MAX bytes repeats its last one in chars[].
+ */
+struct scan_set {
+	bool member[256];
+	char chars[SCAN_SET_MAX];
+	unsigned int count;
+};
+
+/* The sets the AT parser searches for, on every received byte. */
+extern const struct scan_set scan_set_eol;	/* \r \n */
+extern const struct scan_set scan_set_args;	/* : ? = */
+
+typedef const char *(*scan_func_t)(const struct scan_set *set,
+					const char *data, size_t len);
+
+bool scan_set_init(struct scan_set *set, const char *chars);
+
+/* Selected on first use. */
+extern scan_func_t scan_impl;
+
+/*
+ * Most AT lines end within this many bytes, so scan_find() looks at them
+ * with the table in place and only calls out for longer data.
+ */
+#define SCAN_HEAD		32
+
+static inline const char *scan_table(const struct scan_set *set,
+					const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + len;
+
+	for (; end - p >= 4; p += 4) {
+		if (set->member[p[0]])
+			return (const char *) p;
+		if (set->member[p[1]])
+			return (const char *) p + 1;
+		if (set->member[p[2]])
+			return (const char *) p + 2;
+		if (set->member[p[3]])
+			return (const char *) p + 3;
+	}
+
+	for (; p < end; p++) {
+		if (set->member[*p])
+			return (const char *) p;
+	}
+
+	return NULL;
+}
+
+/* First byte of @data[0..len) in @set, NULL if there is none. */
+static inline const char *scan_find(const struct scan_set *set,
+					const char *data, size_t len)
+{
+	const char *hit;
+
+	if (len <= SCAN_HEAD)
+		return scan_table(set, data, len);
+
+	hit = scan_table(set, data, SCAN_HEAD);
+	if (hit)
+		return hit;
+
+	return scan_impl(set, data + SCAN_HEAD, len - SCAN_HEAD);
+}
+
+/* Reference implementation, used to cross-check the vector ones. */
+const char *scan_scalar(const struct scan_set *set, const char *data,
+								size_t len);
+
+/* Fastest implementation the running CPU supports. */
+scan_func_t scan_select(void);
+/* "scalar", "sse2", "avx2" or "neon", NULL if not usable here. */
+scan_func_t scan_lookup(const char *name);
+const char *scan_name(scan_func_t func);
+
 #endif /* UTILS_H_ */
@@ -0,0 +1,65 @@
+/*
+ * vad.h
+ *
+ * Voice activity detection on decoded call audio, so the writer can
+ * store silence as a length instead of samples. Every 10 ms block is
+ * judged by its energy against a tracked noise floor, with the zero
+ * crossing rate rescuing quiet unvoiced speech, and speech is held for
+ * a hangover after the last active block so word endings and short
+ * pauses are kept. The block before speech starts is kept as well, as
+ * a pre-roll for onsets that fall late in a block. Analysis runs under a per stream CPU budget; a
+ * stream over it stores everything until its next budget window.
+ */
+
+#ifndef VAD_H_
+#define VAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VAD_BLOCK_MS		10
+#define VAD_HANGOVER_MS		300
+/* CPU time analysis may take, per second of audio and stream. */
+#define VAD_BUDGET_USEC		2000
+
+struct vad_features {
+	uint64_t energy;	/* sum of squares */
+	unsigned int crossings;	/* sign changes between neighbours */
+};
+
+typedef void (*vad_analyze_func_t)(const int16_t *pcm, unsigned int samples,
+					struct vad_features *features);
+
+struct vad {
+	unsigned int rate;
+	unsigned int block;	/* samples */
+	vad_analyze_func_t analyze;
+
+	uint64_t floor;		/* noise energy per sample, << 8 */
+	unsigned int hangover;	/* blocks of speech still held */
+	int16_t last;		/* previous block's last sample */
+	bool silent_last;	/* previous block judged silent */
+	bool onset;		/* speech after silence, keep the block before */
+
+	/* Budget window, one second of audio. */
+	unsigned int window;	/* samples into it */
+	uint64_t spent;		/* nsec in it */
+	bool bypass;		/* over budget, everything is speech */
+
+	uint64_t blocks;
+	uint64_t silent;	/* blocks judged silent */
+	uint64_t over_budget;	/* windows bypassed */
+};
+
+void vad_init(struct vad *vad, unsigned int rate);
+bool vad_process(struct vad *vad, const int16_t *pcm, unsigned int samples);
+unsigned int vad_level(const struct vad *vad);
+
+/* Reference implementation, used to cross-check the vector ones. */
+void vad_analyze_scalar(const int16_t *pcm, unsigned int samples,
+					struct vad_features *features);
+
+vad_analyze_func_t vad_analyze_select(void);
+const char *vad_analyze_name(vad_analyze_func_t func);
+
+#endif /* VAD_H_ */
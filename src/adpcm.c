@@ -0,0 +1,92 @@
+/*
+ * adpcm.c
+ */
+
+#include "main.h"
+#include "adpcm.h"
+
+static const int16_t step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34,
+	37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143,
+	157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494,
+	544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552,
+	1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428,
+	4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086,
+	29794, 32767
+};
+
+static const int8_t index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/* Shared by both directions, so encoder and decoder never diverge. */
+static void adpcm_update(struct adpcm_state *state, unsigned int code)
+{
+	int step = step_table[state->index];
+	int diff = step >> 3, predictor, index;
+
+	if (code & 4)
+		diff += step;
+	if (code & 2)
+		diff += step >> 1;
+	if (code & 1)
+		diff += step >> 2;
+
+	predictor = state->predictor + (code & 8 ? -diff : diff);
+	state->predictor = L_MAX(-32768, L_MIN(32767, predictor));
+
+	index = state->index + index_table[code & 7];
+	state->index = L_MAX(0, L_MIN(88, index));
+}
+
+static unsigned int adpcm_code(const struct adpcm_state *state,
+							int16_t sample)
+{
+	int step = step_table[state->index];
+	int diff = sample - state->predictor;
+	unsigned int code = 0;
+
+	if (diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+
+	if (diff >= step) {
+		code |= 4;
+		diff -= step;
+	}
+	if (diff >= step >> 1) {
+		code |= 2;
+		diff -= step >> 1;
+	}
+	if (diff >= step >> 2)
+		code |= 1;
+
+	return code;
+}
+
+void adpcm_encode(struct adpcm_state *state, const int16_t *pcm,
+					unsigned int samples, uint8_t *out)
+{
+	unsigned int i, code;
+
+	for (i = 0; i < samples; i++) {
+		code = adpcm_code(state, pcm[i]);
+		adpcm_update(state, code);
+
+		if (i & 1)
+			out[i / 2] |= code << 4;
+		else
+			out[i / 2] = code;
+	}
+}
+
+void adpcm_decode(struct adpcm_state *state, const uint8_t *in,
+					unsigned int samples, int16_t *pcm)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++) {
+		adpcm_update(state, in[i / 2] >> (i & 1 ? 4 : 0) & 15);
+		pcm[i] = state->predictor;
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * arena.c
+ */
+
+#include <stdarg.h>
+
+#include "main.h"
+#include "arena.h"
+
+/**
+ * arena_alloc:
+ * @arena: arena to allocate from
+ * @size: number of bytes
+ *
+ * Carves @size bytes out of @arena, aligned for any basic type. The
+ * memory stays valid until the next arena_reset().
+ *
+ * Returns: the memory, or NULL if the arena is used up.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size_t offset = (arena->used + 15) & ~(size_t) 15;
+
+	if (size > ARENA_SIZE - L_MIN(offset, (size_t) ARENA_SIZE)) {
+		log_error("arena exhausted allocating %zu bytes", size);
+		return NULL;
+	}
+
+	arena->used = offset + size;
+	return arena->buf + offset;
+}
+
+/**
+ * arena_printf:
+ * @arena: arena to allocate from
+ * @format: printf style format
+ *
+ * Formats into the free space of @arena and keeps only what was used.
+ *
+ * Returns: the string, or NULL if it does not fit.
+ */
+char *arena_printf(struct arena *arena, const char *format, ...)
+{
+	size_t offset = (arena->used + 15) & ~(size_t) 15;
+	size_t avail = ARENA_SIZE - L_MIN(offset, (size_t) ARENA_SIZE);
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(arena->buf + offset, avail, format, args);
+	va_end(args);
+
+	if (len < 0 || (size_t) len >= avail) {
+		log_error("arena exhausted formatting %s", format);
+		return NULL;
+	}
+
+	arena->used = offset + len + 1;
+	return arena->buf + offset;
+}
+
+void arena_reset(struct arena *arena)
+{
+	arena->used = 0;
+}
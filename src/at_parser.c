@@ -2,10 +2,18 @@
  * at_parser.c
  */
 
+#include <endian.h>
+#include <sys/socket.h>
 
 #include "main.h"
+#include "at_parser.h"
+#include "at_token.h"
+#include "session.h"
+#include "sco.h"
+#include "recording.h"
 
-typedef void (*cmd_handler)(const char *cmd, int index);
+typedef void (*cmd_handler)(struct hfp_session *session, const char *cmd,
+		int index);
 
 #define INRANGE(X, Y, Z)	(X >= Y && X <= Z)
 
@@ -27,7 +35,11 @@ typedef void (*cmd_handler)(const char *cmd, int index);
 
 #endif
 
-#define SUPPORTED_FEATURES		(1<<2)
+/* HFP 1.7 additions to the HF bit map above. */
+#define HF_CODEC_NEGOTIATION		(1<<7)
+
+/* CLI presentation and codec negotiation. */
+#define SUPPORTED_FEATURES		((1<<2) | HF_CODEC_NEGOTIATION)
 
 #define IS_FEATURES_SUPPORTED(X, Y)		(X & Y)
 
@@ -37,234 +49,279 @@ typedef void (*cmd_handler)(const char *cmd, int index);
  * Query command ex: AT+CIND=?
  */
 
-enum at_cmds {
-	OK = 0,
-	ERROR,
-	AT_BRSF,
-	BRSF,
-	AT_CIND_Q,
-	CIND,
-	AT_CIND_R,
-	AT_CMER,
-	CIEV,
-	AT_BIND,
-	AT_BIND_Q,
-	AT_BIND_R,
-	BIND,
-	AT_BIEV,
-	ATA,
-	RING,
-	AT_CHUP,
-	AT_CLIP,
-	CLIP,
-};
+#define AT_CMD_TOKEN(id, token, handler)	token,
+#define AT_CMD_HANDLER(id, token, handler)	{ handler },
 
 const char *str_cmds[] = {
-		"OK",
-		"ERROR",
-		"AT+BRSF=",
-		"+BRSF:",
-		"AT+CIND=?"	// retrieve info about supported AG indicators and their ordering.
-		"+CIND"
-		"AT+CIND?"	// get the current status of the AG supported indicators.
-		"AT+CMER="
-		"+CIEV"
-		"AT+BAC"	// notify AG of the available codecs in HF. in-case both HF and AG support codec negotiation feature.
-		"AT+BIND="
-		"AT+BIND=?"	// request from HF to get the supported indicators supported by AG, in-case HF and AG support HF indicators.
-		"AT+BIND?"	// request from HF to get the current enabled HF indicators on AG.
-		"+BIND"		// AG response for AT+BIND? command.
-		"AT+BIEV="	// HF command to AG to indicate change in HF indicators.
-
-		"ATA"	// standard call answer AT command.
-		"RING"
-		"AT+CHUP="
-		"AT+CLIP="
-		"+CLIP:"	// +CLIP: <number>, 128-143 or +CLIP: <number>, 144-159 or +CLIP: <number>, 160-175
+	AT_COMMANDS(AT_CMD_TOKEN)
 };
 
 struct cmd_struct {
 	cmd_handler handler_callback;
 };
 
-struct _connection {
-	enum at_cmds last_cmd;
-	/* Indicator indexes */
-	int service_index;
-	int call_index;
-	int callsetup_index;
-	int signal_index;
-	int ring_count;
-	char *incoming_callid;
-};
+extern struct cmd_struct cmd_handle[];
 
-struct _connection connection;
+/*
+ * Received lines are dispatched through a perfect hash over the match
+ * keys: one hash and one memcmp per line, whatever the table size. The
+ * seed is searched once, the first time a line is dispatched.
+ */
+#define CMD_HASH_SIZE		256	/* power of two, keep > 4 * AT_CMD_COUNT */
+#define CMD_HASH_EMPTY		0xff	/* so at most 255 commands */
+
+static uint8_t cmd_hash[CMD_HASH_SIZE];
+static uint8_t cmd_key_len[AT_CMD_COUNT];
+static uint32_t cmd_hash_seed;
+static bool cmd_hash_ready;
 
 /* HFP 1.7 - 4 Hands-Free Control Interoperability Requirements
  * documents the complete HF connection establishment procedure.
  */
 
 /* arg passed to this function should be string. */
-bool send_command(const char *cmd)
+bool send_command(struct hfp_session *session, const char *cmd)
 {
-	char data[MAX_DATA_BUF_SIZE];
-	int i;
+	/* An arena_printf() that did not fit. */
+	if (!cmd)
+		return false;
 
-	for (i = 0; *cmd != '\0'; i++, cmd++)
-		data[i] = *cmd;
-
-	data[i] = '\r';
-	data[++i] = '\n';
+	return write_line(session, cmd, strlen(cmd));
+}
 
-	write_data(data, i);
+static int cmd_key_length(const char *cmd, unsigned int len)
+{
+	const char *end = scan_find(&scan_set_args, cmd, len);
 
-	return true;
+	return end ? end - cmd : (int) len;
 }
 
-static int get_cmd_index(const char *cmd)
+static uint32_t cmd_key_hash(uint32_t seed, const char *key, unsigned int len)
 {
-	int i, j;
-	int len = strlen(cmd);
+	/* FNV-1a */
+	uint32_t hash = 2166136261u ^ seed;
+	unsigned int i;
 
 	for (i = 0; i < len; i++) {
-		if (cmd[i] == '?' || cmd[i] == '=' || cmd[i] == ':' )
-			break;
+		hash ^= (uint8_t) key[i];
+		hash *= 16777619u;
 	}
 
-	int cmd_count = sizeof(str_cmds)/sizeof(str_cmds[0]);
+	return hash & (CMD_HASH_SIZE - 1);
+}
+
+static bool cmd_hash_try_seed(uint32_t seed)
+{
+	uint32_t slot;
+	int i;
 
-	for (j = 0; j < cmd_count; j++) {
-		if (strncmp(str_cmds[j], cmd, i) == 0)
-			break;
+	memset(cmd_hash, CMD_HASH_EMPTY, sizeof(cmd_hash));
+
+	for (i = 0; i < AT_CMD_COUNT; i++) {
+		if (!cmd_handle[i].handler_callback)
+			continue;
+
+		slot = cmd_key_hash(seed, str_cmds[i], cmd_key_len[i]);
+		if (cmd_hash[slot] != CMD_HASH_EMPTY)
+			return false;
+
+		cmd_hash[slot] = i;
 	}
 
-	/* we expect that the cmd will be always a known command. */
-	return j;
+	return true;
 }
 
-static char *get_cmd_value(const char *cmd)
+static void cmd_hash_build(void)
 {
-	char *tmp;
+	uint32_t seed;
+	int i;
+
+	for (i = 0; i < AT_CMD_COUNT; i++)
+		cmd_key_len[i] = cmd_key_length(str_cmds[i], strlen(str_cmds[i]));
+
+	for (seed = 0; !cmd_hash_try_seed(seed); seed++)
+		/* Only fails if CMD_HASH_SIZE is far too small. */
+		assert(seed < 1u << 20);
+
+	cmd_hash_seed = seed;
+	cmd_hash_ready = true;
+}
+
+static int get_cmd_index(const char *cmd, unsigned int len)
+{
+	unsigned int key_len = cmd_key_length(cmd, len);
+	uint8_t index;
+
+	if (!cmd_hash_ready)
+		cmd_hash_build();
+
+	index = cmd_hash[cmd_key_hash(cmd_hash_seed, cmd, key_len)];
+	if (index == CMD_HASH_EMPTY || cmd_key_len[index] != key_len ||
+			memcmp(str_cmds[index], cmd, key_len))
+		return -1;
+
+	return index;
+}
+
+/* Sets @tk up on the arguments of @cmd, false if there are none. */
+static bool get_cmd_args(const char *cmd, struct at_tokenizer *tk)
+{
+	size_t len;
+	const char *tmp;
 	/* Assert on a coding errors. */
-	assert(!cmd || *cmd == '\0');
+	assert(cmd && *cmd != '\0');
 
-	tmp = strchr_multi_byte(cmd, ":?=");
-	if (!tmp || strlen(tmp) <= 1)
-		return NULL;
+	len = strlen(cmd);
+	tmp = scan_find(&scan_set_args, cmd, len);
+	if (!tmp || tmp[1] == '\0')
+		return false;
 
-	return (tmp + 1);
+	++tmp;
+	at_tokenizer_init(tk, tmp, cmd + len - tmp);
+	return true;
 }
 
-void handle_clip_events(const char *cmd, int index)
+/* AT+BAC=1,2 - we decode both CVSD and mSBC. */
+static void send_available_codecs(struct hfp_session *session)
 {
-	char *value = get_cmd_value(cmd);
-	util_charstrip(value, '"');
-	util_strstrip(value);
-	connection.incoming_callid = strdup(value);
-	l_info("Incoming caller id is: %s", connection.incoming_callid);
+	char *str;
+
+	str = arena_printf(&session->arena, "%s%d,%d", str_cmds[AT_BAC],
+					HFP_CODEC_CVSD, HFP_CODEC_MSBC);
+	send_command(session, str);
 }
 
-void handle_ring_events(const char *cmd, int index)
+/*
+ * +CLIP: "<number>",<type>[,...] - only the number is kept, it is empty
+ * when the caller withheld it.
+ */
+void handle_clip_events(struct hfp_session *session, const char *cmd, int index)
 {
-	++connection.ring_count;
-	if (connection.ring_count >= 3) {
-		l_info("Received more than 3 rings. Accepting call from caller id: %s", connection.incoming_callid);
-		connection.ring_count = 0;
-		send_command(str_cmds[ATA]);
-		connection.last_cmd = ATA;
+	struct at_tokenizer tk;
+	struct at_view number;
+
+	if (!get_cmd_args(cmd, &tk) ||
+			at_tokenizer_next(&tk, &number) != AT_TOKEN_VALUE) {
+		log_error("Invalid CLIP event %s", cmd);
+		return;
 	}
+
+	number.len = L_MIN(number.len, sizeof(session->incoming_callid) - 1);
+	memcpy(session->incoming_callid, number.ptr, number.len);
+	session->incoming_callid[number.len] = '\0';
+
+	session_journal(session, JOURNAL_CLIP, session->incoming_callid,
+							number.len);
+	sco_capture_meta(session->sco, REC_CALLER_ID, session->incoming_callid,
+					strlen(session->incoming_callid));
 }
 
-void handle_ciev_events(const char *cmd, int index)
+void handle_ring_events(struct hfp_session *session, const char *cmd, int index)
 {
-	char *indicator, *end = NULL;
-	unsigned long ind_index = 1, ind_value;
-	char *value = get_cmd_value(cmd);
-	indicator = strtok(value, ",");
-	ind_value = strtoul(indicator, &end, 10);
-	if (end && *end) {
-		l_error("%s Failed processing +CIEV event. Unknown command: %s", __func__, cmd);
-		goto failed;
+	uint32_t rings = htole32(++session->ring_count);
+
+	session_journal(session, JOURNAL_RING, &rings, sizeof(rings));
+
+	if (session->ring_count >= 3) {
+		session_journal(session, JOURNAL_ANSWER, NULL, 0);
+		session->ring_count = 0;
+		send_command(session, str_cmds[ATA]);
+		session->last_cmd = ATA;
 	}
+}
 
-	while(1) {
-		indicator = strtok(NULL, ",");
-		if (!indicator) { break; }
-		ind_value = strtoul(indicator, &end, 10);
-		if (ind_index == connection.service_index) {
-			ind_value ? l_info("Service connection is available now") : l_info("Lost service connection");
-			break;
-		} else if (ind_index == connection.callsetup_index) {
-			if (ind_value == 0) {
-				l_info("Call set up is done");
-			} else if (ind_value == 1) {
-				l_info("An incoming call progress is ongoing");
-			} else if (ind_value == 2) {
-				l_info("An outgoing call set up is ongoing");
-			} else if (ind_value == 3) {
-				l_info("Remote party is being alerted in an outgoing call");
-			}
-		} else if(ind_index == connection.call_index) {
-			ind_value ? l_info("Call is active now") : l_info("No active call is in progress");
-		}
-		++ind_index;
+/*
+ * +CIEV: <ind>,<value> reports a single indicator change.
+ */
+void handle_ciev_events(struct hfp_session *session, const char *cmd, int index)
+{
+	struct at_tokenizer tk;
+	unsigned int ind_index, ind_value;
+	struct journal_ciev event;
+	uint8_t meta;
+
+	if (!get_cmd_args(cmd, &tk) ||
+			!at_tokenizer_next_uint(&tk, &ind_index) ||
+			!at_tokenizer_next_uint(&tk, &ind_value))
+		goto failed;
+
+	meta = ind_value;
+	event.indicator = JOURNAL_IND_OTHER;
+
+	if (ind_index == session->service_index) {
+		event.indicator = JOURNAL_IND_SERVICE;
+	} else if (ind_index == session->callsetup_index) {
+		event.indicator = JOURNAL_IND_CALLSETUP;
+		session->callsetup = ind_value;
+		sco_capture_meta(session->sco, REC_CALLSETUP, &meta, 1);
+	} else if(ind_index == session->call_index) {
+		event.indicator = JOURNAL_IND_CALL;
+		session->call = ind_value;
+		sco_capture_meta(session->sco, REC_CALL, &meta, 1);
 	}
 
-	send_command(str_cmds[OK]);
+	event.index = ind_index;
+	event.value = ind_value;
+	session_journal(session, JOURNAL_CIEV, &event, sizeof(event));
 	return;
 failed:
-	send_command(str_cmds[ERROR]);
+	log_error("%s Failed processing +CIEV event. Unknown command: %s", __func__, cmd);
 }
 
 /*
  * CIND query response format: +CIND: ("service",(0-1)),("callsetup",(0-3))
  */
-static void cind_query_response(char *value)
+static void cind_query_response(struct hfp_session *session,
+						struct at_tokenizer *tk)
 {
-	char *tmp;
-	const char *service = "\"service\"", *callsetup = "\"callsetup\"";
-	const char *call = "\"call\"", *signal = "\"signal\"";
+	enum at_token_type type;
+	struct at_view name, range;
+	unsigned int depth;
 	int index = 1;
 
-	util_strstrip(value);
-	tmp = value;
-
-	while (*tmp != '\0') {
-		tmp = strchr(tmp, '(');
-		if (!tmp) {
-			l_error("Invalid CIND query response %s\n", value);
+	while ((type = at_tokenizer_next(tk, &name)) != AT_TOKEN_END) {
+		if (type != AT_TOKEN_OPEN ||
+				at_tokenizer_next(tk, &name) != AT_TOKEN_VALUE) {
+			log_error("Invalid CIND query response");
 			goto failed;
 		}
-		++tmp;
-		if (!strncmp(tmp, service, 9)) {
-			connection.service_index = index;
-		} else if (!strncmp(tmp, callsetup, 11)) {
-			connection.callsetup_index = index;
-		} else if (!strncmp(tmp, call, 6)) {
-			connection.call_index = index;
-		} else if (!strncmp(tmp, signal, 8)) {
-			connection.signal_index = index;
+
+		if (at_view_equal(&name, "service")) {
+			session->service_index = index;
+		} else if (at_view_equal(&name, "callsetup")) {
+			session->callsetup_index = index;
+		} else if (at_view_equal(&name, "call")) {
+			session->call_index = index;
+		} else if (at_view_equal(&name, "signal")) {
+			session->signal_index = index;
 		}
 
-		if ((tmp = strchr(tmp, ')')) && (tmp = strchr(tmp, ')'))) {
-			++tmp;
-			++index;
-		} else {
-			l_error("Misformed CIND query response %s\n", value);
-			goto failed;
+		/* Skip the value ranges up to the end of this indicator. */
+		for (depth = 1; depth; ) {
+			type = at_tokenizer_next(tk, &range);
+			if (type == AT_TOKEN_OPEN) {
+				++depth;
+			} else if (type == AT_TOKEN_CLOSE) {
+				--depth;
+			} else if (type == AT_TOKEN_END) {
+				log_error("Misformed CIND query response");
+				goto failed;
+			}
 		}
-	}
 
-	l_info("service index: %d, callsetup index: %d, call index: %d\n",
-			connection.service_index, connection.callsetup_index, connection.call_index);
+		++index;
+	}
 
-	send_command(str_cmds[OK]);
-	send_command(str_cmds[AT_CIND_R]);
-	connection.last_cmd = AT_CIND_R;
+	log_info("service index: %d, callsetup index: %d, call index: %d\n",
+			session->service_index, session->callsetup_index, session->call_index);
 	return;
 
 failed:
-	send_command(str_cmds[ERROR]);
+	/* The AG's OK still moves Service Level setup on. */
+	session->service_index = 0;
+	session->callsetup_index = 0;
+	session->call_index = 0;
+	session->signal_index = 0;
 }
 
 /* service:
@@ -278,84 +335,79 @@ callsetup: When supported, this indicator shall be used in conjunction with, and
 <value>=1 means an incoming call process ongoing.
 <value>=2 means an outgoing call set up is ongoing.
 <value>=3 means remote party being alerted in an outgoing call. */
-static void cind_read_response(char *value)
+static void cind_read_response(struct hfp_session *session,
+						struct at_tokenizer *tk)
 {
-	char *indicator, *end = NULL;
-	unsigned long i, ind_value;
-	char *cmd;
-	if (!value || *value == '\0') {
-
-		goto failed;
-	}
+	enum at_token_type type;
+	struct at_view field;
+	unsigned int i, ind_value;
 
-	util_strstrip(value);
-	indicator = strtok(value, ",");
 	for (i = 1; ; i++) {
-		ind_value = strtoul(indicator, &end, 10);
-		if (end && *end)
+		type = at_tokenizer_next(tk, &field);
+		if (type == AT_TOKEN_END)
+			break;
+
+		if (type != AT_TOKEN_VALUE ||
+				!at_view_to_uint(&field, &ind_value))
 			goto failed;
 
-		if (i == connection.service_index) {
+		if (i == session->service_index) {
 			if (ind_value)
-				l_info("Home/Roam network service is available");
+				log_info("Home/Roam network service is available");
 			else
-				l_info("No Home/Roam network service is available");
-		} else if (i == connection.call_index) {
+				log_info("No Home/Roam network service is available");
+		} else if (i == session->call_index) {
+			session->call = ind_value;
 			if (ind_value)
-				l_info("Active call is already in-progress");
+				log_info("Active call is already in-progress");
 			else
-				l_info("No active call is in progress");
-		} else if (i == connection.callsetup_index) {
+				log_info("No active call is in progress");
+		} else if (i == session->callsetup_index) {
+			session->callsetup = ind_value;
 			if (ind_value == 0)
-				l_info("No current call set up is in progress");
+				log_info("No current call set up is in progress");
 			else if (ind_value == 1)
-				l_info("An incoming call progress is ongoing");
+				log_info("An incoming call progress is ongoing");
 			else if (ind_value == 2)
-				l_info("An outgoing call set up is ongoing");
+				log_info("An outgoing call set up is ongoing");
 			else if (ind_value == 3)
-				l_info("Remote party is being alerted in an outgoing call");
+				log_info("Remote party is being alerted in an outgoing call");
 		}
-
-		indicator = strtok(NULL, ",");
-		if (!indicator)
-			break;
 	}
 
-	send_command(str_cmds[OK]);
-	/* AT+CMER=3,0,0,1 - Command to enable "indicator events reporting".
-	 * AT+CMER=3,0,0,0 - To disable "indicator event reporting".
-	 */
-	cmd = l_strdup_printf("%s%s", str_cmds[AT_CMER], "3,0,0,1");
-	send_command(cmd);
-	l_free(cmd);
-	connection.last_cmd = AT_CMER;
+	if (i > 1)
+		return;
+
 failed:
-	send_command(str_cmds[ERROR]);
+	log_error("Invalid CIND read response");
 }
 
-void handle_cind_response(const char *cmd, int index)
+void handle_cind_response(struct hfp_session *session, const char *cmd, int index)
 {
-	char *value;
+	struct at_tokenizer tk, peek;
+	struct at_view first;
 
-	value = get_cmd_value(cmd);
-	if (!value){
-		l_error("Invalid CIND response %s", cmd);
+	if (!get_cmd_args(cmd, &tk)) {
+		log_error("Invalid CIND response %s", cmd);
 		return;
 	}
 
-	if (strchr(value, '('))
-		cind_query_response(value);
+	/* The test response is a list of (name,(range)) pairs. */
+	peek = tk;
+	if (at_tokenizer_next(&peek, &first) == AT_TOKEN_OPEN)
+		cind_query_response(session, &tk);
 	else
-		cind_read_response(value);
+		cind_read_response(session, &tk);
 }
 
-void handle_brsf_response(const char *cmd, int index)
+void handle_brsf_response(struct hfp_session *session, const char *cmd, int index)
 {
-	char *value, *end;
-	int features;
+	struct at_tokenizer tk;
+	unsigned int features;
+	uint32_t features_le;
 
 // HFP 1.7 AG supported features.
-#define THREE_WAY_CALLING		(0<<1)
+#define THREE_WAY_CALLING		(1<<0)
 #define EC_NR_FUNCTION			(1<<1)
 #define VOICE_RECOGNITION		(1<<2)
 #define INBAND_RINGING			(1<<3)
@@ -367,203 +419,490 @@ void handle_brsf_response(const char *cmd, int index)
 #define CODEC_NEGOTIATION		(1<<9)
 #define HF_INDICATORS			(1<<10)
 
-	value = get_cmd_value(cmd);
-	if (!value) {
-		l_error("Invalid BRSF response %s", cmd);
+	if (!get_cmd_args(cmd, &tk) ||
+			!at_tokenizer_next_uint(&tk, &features)) {
+		log_error("Invalid BRSF response %s", cmd);
 		return;
 	}
 
-	features = strtoul(value, &end, 10);
-	if (end && *end) {
-		l_error("Invalid BRSF response %s", cmd);
+	features_le = htole32(features);
+	session_journal(session, JOURNAL_BRSF, &features_le,
+						sizeof(features_le));
+
+	session->ag_features = features;
+	session->slc.brsf = true;
+}
+
+/*
+ * +BCS: <codec id>, the AG picked the codec for the next audio
+ * connection. Confirm it if we support it, otherwise tell the AG again
+ * which codecs we have so it can choose another.
+ */
+void handle_bcs_events(struct hfp_session *session, const char *cmd, int index)
+{
+	struct at_tokenizer tk;
+	struct at_view value;
+	unsigned int codec = 0;
+	char *str;
+
+	if (!get_cmd_args(cmd, &tk) ||
+			at_tokenizer_next(&tk, &value) != AT_TOKEN_VALUE) {
+		log_error("Invalid BCS event %s", cmd);
 		return;
 	}
 
-	l_info("features supported by AG:");
-
-	if (IS_FEATURES_SUPPORTED(features, THREE_WAY_CALLING))
-		l_info("three way calling supported");
-	if (IS_FEATURES_SUPPORTED(features, EC_NR_FUNCTION))
-		l_info("echo cancellation and noise reduction supported");
-	if (IS_FEATURES_SUPPORTED(features, VOICE_RECOGNITION))
-		l_info("voice recognition supported");
-	if (IS_FEATURES_SUPPORTED(features, INBAND_RINGING))
-		l_info("in-band ringing supported");
-	if (IS_FEATURES_SUPPORTED(features, ATTACH_NUM_TO_VOICETAG))
-		l_info("Attach a number to a voice tag supported");
-	if (IS_FEATURES_SUPPORTED(features, ABILITY_TO_REJECT_CALL))
-		l_info("ability to reject call supported");
-	if (IS_FEATURES_SUPPORTED(features, ENHANCED_CALL_STATUS))
-		l_info("Enhanced call status supported");
-	if (IS_FEATURES_SUPPORTED(features, ENHANCED_CALL_CONTROL))
-		l_info("Enhanced call control supported");
-	if (IS_FEATURES_SUPPORTED(features, EXTENDED_ERROR_RESULTS))
-		l_info("Extended error results supported");
-	if (IS_FEATURES_SUPPORTED(features, CODEC_NEGOTIATION))
-		l_info("Codec negotiation supported");
-	if (IS_FEATURES_SUPPORTED(features, HF_INDICATORS))
-		l_info("HF indicators supported");
-
-	send_command(str_cmds[OK]);
-	send_command(str_cmds[AT_CIND_Q]);
-	connection.last_cmd = AT_CIND_Q;
-}
-
-void handle_brsf_cmd(const char *cmd, int index)
+	at_view_to_uint(&value, &codec);
+	if (codec != HFP_CODEC_CVSD && codec != HFP_CODEC_MSBC) {
+		log_info("AG selected unsupported codec %.*s", value.len,
+								value.ptr);
+		send_available_codecs(session);
+		session->last_cmd = AT_BCS;
+		return;
+	}
+
+	log_info("AG selected codec %s", codec == HFP_CODEC_MSBC ? "mSBC" : "CVSD");
+	session->codec = codec;
+
+	str = arena_printf(&session->arena, "%s%u", str_cmds[AT_BCS], codec);
+	send_command(session, str);
+	session->last_cmd = AT_BCS;
+}
+
+/**
+ * at_codec_connection:
+ * @session: session with a completed Service Level Connection
+ *
+ * Asks the AG to start codec selection and then set up audio (AT+BCC).
+ *
+ * Returns: false if the AG does not negotiate codecs.
+ */
+bool at_codec_connection(struct hfp_session *session)
 {
+	if (!IS_FEATURES_SUPPORTED(session->ag_features, CODEC_NEGOTIATION))
+		return false;
+
+	send_command(session, str_cmds[AT_BCC]);
+	session->last_cmd = AT_BCC;
+	return true;
+}
+
+void handle_brsf_cmd(struct hfp_session *session, const char *cmd, int index)
+{
+	struct at_tokenizer tk;
+	struct at_view features;
 	char *value;
 
 	if (!cmd) {
-		value = l_strdup_printf("%s%d", str_cmds[AT_BRSF], SUPPORTED_FEATURES);
-		send_command(value);
-		free(value);
+		value = arena_printf(&session->arena, "%s%d", str_cmds[AT_BRSF],
+							SUPPORTED_FEATURES);
+		send_command(session, value);
 		return;
 	}
 
 	/* HF device never receive AT+BRSF command. */
-	value = get_cmd_value(cmd);
-	if (!value) {
-		l_error("Error in BRSF response %s", cmd);
+	if (!get_cmd_args(cmd, &tk) ||
+			at_tokenizer_next(&tk, &features) != AT_TOKEN_VALUE) {
+		log_error("Error in BRSF response %s", cmd);
 		return;
 	}
 
-	util_strstrip(value);
-	l_info("BRSF command supported features %s", value);
+	log_info("BRSF command supported features %.*s", features.len,
+							features.ptr);
 }
 
-void handle_ok_response(const char *cmd, int index)
+/*
+ * Service Level Connection setup, HFP 1.7 section 4.2.1. The steps go
+ * out in table order, each one done on its OK or ERROR, which the AG
+ * sends in the order it got the commands. When the AG's SDP record
+ * tells us its version we don't wait for each reply before sending the
+ * next command; a step that depends on something not known yet (AT+BAC
+ * on the AG features) holds back everything after it.
+ */
+#define SLC_TIMEOUT_MS		1500	/* per reply */
+#define SLC_RETRIES		2
+
+/* AG SDP SupportedFeatures, HFP 1.6 and later. */
+#define SDP_WIDEBAND_SPEECH	(1<<5)
+
+enum slc_need {
+	SLC_NEED,
+	SLC_SKIP,
+	SLC_UNKNOWN,
+};
+
+struct slc_step_info {
+	enum at_cmds cmd;
+	const char *args;
+	enum slc_need (*need)(struct hfp_session *session);
+	bool optional;		/* ERROR does not fail the setup */
+};
+
+static enum slc_need slc_need_bac(struct hfp_session *session)
 {
-	char *str;
-	if (connection.last_cmd == AT_CMER) {
-		/* Enable Caller Line Identification. */
-		str = l_strdup_printf("%s%d", str_cmds[AT_CLIP], 1);
-		send_command(str);
-		l_free(str);
-		connection.last_cmd = AT_CLIP;
-	}
+	struct slc *slc = &session->slc;
+
+	if (!IS_FEATURES_SUPPORTED(SUPPORTED_FEATURES, HF_CODEC_NEGOTIATION))
+		return SLC_SKIP;
+
+	if (slc->brsf)
+		return IS_FEATURES_SUPPORTED(session->ag_features,
+				CODEC_NEGOTIATION) ? SLC_NEED : SLC_SKIP;
+
+	/* Wide band speech requires codec negotiation from HFP 1.6 on. */
+	if (slc->sdp.version >= 0x0106 &&
+			IS_FEATURES_SUPPORTED(slc->sdp.features,
+						SDP_WIDEBAND_SPEECH))
+		return SLC_NEED;
+
+	return SLC_UNKNOWN;
 }
 
-void handle_error_response(const char *cmd, int index)
+static const struct slc_step_info slc_steps[SLC_STEP_COUNT] = {
+	[SLC_BRSF]	= { AT_BRSF,	NULL,		NULL,		false },
+	[SLC_BAC]	= { AT_BAC,	NULL,		slc_need_bac,	true },
+	[SLC_CIND_TEST]	= { AT_CIND_Q,	"",		NULL,		false },
+	[SLC_CIND_READ]	= { AT_CIND_R,	"",		NULL,		false },
+	/* Indicator events reporting on. */
+	[SLC_CMER]	= { AT_CMER,	"3,0,0,1",	NULL,		false },
+	/* Caller Line Identification, the SLC is up without it. */
+	[SLC_CLIP]	= { AT_CLIP,	"1",		NULL,		true },
+};
+
+/* Runs from the timeout and at connection time, outside any arena use. */
+static bool slc_send(struct hfp_session *session, enum slc_step step)
 {
-	if (connection.last_cmd == ATA) {
-		l_error("Attending incoming call failed");
-	} else {
-		l_error("Command failed: %s", str_cmds[connection.last_cmd]);
+	const struct slc_step_info *info = &slc_steps[step];
+	char cmd[32];
+
+	switch (step) {
+	case SLC_BRSF:
+		snprintf(cmd, sizeof(cmd), "%s%d", str_cmds[info->cmd],
+							SUPPORTED_FEATURES);
+		break;
+	case SLC_BAC:
+		snprintf(cmd, sizeof(cmd), "%s%d,%d", str_cmds[info->cmd],
+					HFP_CODEC_CVSD, HFP_CODEC_MSBC);
+		break;
+	default:
+		snprintf(cmd, sizeof(cmd), "%s%s", str_cmds[info->cmd],
+								info->args);
+		break;
 	}
+
+	session->last_cmd = info->cmd;
+	return send_command(session, cmd);
 }
 
-/* callback methods don't expect escape character in leading and trailing
- * characters.
- */
-struct cmd_struct cmd_handle[] = {
-		{ handle_ok_response },
-		{ handle_error_response },
-		{ handle_brsf_cmd },
-		{ handle_brsf_response },
-		{ NULL },
-		{ handle_cind_response },
-		{ NULL },
-		{ NULL },
-		{ handle_ciev_events },
-		{ NULL },
-		{ NULL },
-		{ NULL },
-		{ NULL },
-		{ NULL },
-		{ NULL },
-		{ NULL },
-		{ handle_ring_events },
-		{ NULL },
-		{ NULL },
-		{ handle_clip_events },
-};
+/* The disconnect handler frees the session once the socket is down. */
+static void slc_fail(struct hfp_session *session)
+{
+	log_error("Service Level Connection with %s failed", session->address);
+	slc_stop(session);
+	shutdown(session->fd, SHUT_RDWR);
+}
 
-void init_connection(void)
+static void slc_ready(struct hfp_session *session)
 {
-	char *value;
-	value = l_strdup_printf("%s%d", str_cmds[AT_BRSF], SUPPORTED_FEATURES);
-	send_command(value);
-	l_free(value);
+	uint64_t elapsed = l_time_now() - session->created;
+
+	session->slc.ready = true;
+	STATS_ADD(&session->stats, slc_setups, 1);
+	STATS_ADD(&session->stats, slc_setup_time, elapsed);
+
+	log_info("Service Level Connection with %s up in %llu ms",
+			session->address, (unsigned long long) elapsed / 1000);
 }
 
-static void process_command(const char *data)
+/* Sends every step that can be decided now. */
+static void slc_pump(struct hfp_session *session)
 {
-	char *cmd;
-	int len, index;
+	struct slc *slc = &session->slc;
+	unsigned int before = slc->count;
+	enum slc_need need;
 
-	if (!data || strlen(data) < 2) {
-		l_debug("Invalid AT command");
-		return;
+	while (slc->next < SLC_STEP_COUNT) {
+		if (slc->count && slc->serial)
+			break;
+
+		need = slc_steps[slc->next].need ?
+				slc_steps[slc->next].need(session) : SLC_NEED;
+		if (need == SLC_UNKNOWN)
+			break;
+
+		if (need == SLC_NEED) {
+			if (!slc_send(session, slc->next)) {
+				slc_fail(session);
+				return;
+			}
+
+			slc->inflight[(slc->head + slc->count++) %
+						SLC_STEP_COUNT] = slc->next;
+		}
+
+		slc->next++;
 	}
 
-	cmd = l_strdup(data);
-	index = get_cmd_index(cmd);
-	free(cmd);
+	if (!before && slc->count)
+		l_timeout_modify_ms(slc->timeout, SLC_TIMEOUT_MS);
+}
 
-	len = sizeof(cmd_handle)/sizeof(cmd_handle[0]);
+/*
+ * Gives up on the oldest command after SLC_RETRIES resends. Resending
+ * while later commands are in flight reorders the replies, so resend
+ * all of them and drop to one command at a time.
+ */
+static void slc_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct hfp_session *session = user_data;
+	struct slc *slc = &session->slc;
+	unsigned int i;
 
-	if (!INRANGE(index, 0, len - 1)) {
-		l_debug("Unknown command %s", cmd);
+	if (!slc->count)
+		return;
+
+	if (slc->retries++ == SLC_RETRIES) {
+		log_error("No reply from %s to %s", session->address,
+				str_cmds[slc_steps[slc->inflight[slc->head]].cmd]);
+		slc_fail(session);
 		return;
 	}
 
-	cmd_handle[index].handler_callback(data, index);
+	log_warn("No reply from %s, resending %u command(s)", session->address,
+								slc->count);
+	slc->serial = true;
+
+	for (i = 0; i < slc->count; i++) {
+		if (!slc_send(session, slc->inflight[(slc->head + i) %
+							SLC_STEP_COUNT])) {
+			slc_fail(session);
+			return;
+		}
+	}
+
+	l_timeout_modify_ms(timeout, SLC_TIMEOUT_MS);
 }
 
-void handle_recv_data(char *data, int bytes_read)
+/* Takes OK or ERROR for the oldest setup command, false if none is sent. */
+static bool slc_complete(struct hfp_session *session, bool ok)
 {
-	char cmd[MAX_DATA_BUF_SIZE];
-	int total_bytes = bytes_read;
+	struct slc *slc = &session->slc;
+	enum slc_step step;
+
+	if (!slc->count)
+		return false;
+
+	step = slc->inflight[slc->head];
+	slc->head = (slc->head + 1) % SLC_STEP_COUNT;
+	slc->count--;
+	slc->retries = 0;
+
+	if (!ok) {
+		if (!slc_steps[step].optional) {
+			log_error("AG rejected %s", str_cmds[slc_steps[step].cmd]);
+			slc_fail(session);
+			return true;
+		}
 
+		log_warn("AG rejected %s, going on without it",
+						str_cmds[slc_steps[step].cmd]);
+	}
 
-	/* data field may contain multiple commands.
-	 * Each command need to be processed separately.
-	 */
+	if (step == SLC_CMER)
+		slc_ready(session);
 
-	while (total_bytes > 0) {
-		int i, j, k;
+	if (slc->count)
+		l_timeout_modify_ms(slc->timeout, SLC_TIMEOUT_MS);
 
-		memset(cmd, 0, sizeof(cmd));
-		for (i = 0; i < bytes_read; i++) {
-			if (data[i] == '\r' || data[i] == '\n')
-				continue;
+	slc_pump(session);
 
-			break;
-		}
+	if (slc->next == SLC_STEP_COUNT && !slc->count)
+		slc_stop(session);
 
-		for (j = i, k = 0 ; j < bytes_read ; k++, j++) {
-			if (data[j] != '\r' && data[j] != '\n')
-				cmd[k] = data[j];
+	return true;
+}
 
-			break;
-		}
+/**
+ * slc_start:
+ * @session: freshly connected session
+ * @sdp: AG SDP record from BlueZ, or NULL if there is none
+ *
+ * Starts Service Level Connection setup. If the SDP record gives the AG
+ * version, commands are pipelined instead of sent one per reply.
+ */
+void slc_start(struct hfp_session *session, const struct slc_sdp *sdp)
+{
+	struct slc *slc = &session->slc;
 
-		cmd[k] = '\0';
+	memset(slc, 0, sizeof(*slc));
+	if (sdp)
+		slc->sdp = *sdp;
 
-		process_command(cmd);
+	slc->serial = !slc->sdp.version;
+	slc->timeout = l_timeout_create_ms(SLC_TIMEOUT_MS, slc_timeout,
+								session, NULL);
 
-		/* Can we reduce this loop ? */
-		for (i = j ; i < bytes_read; i++) {
-			if (data[i] == '\r' || data[i] == '\n')
-				continue;
+	slc_pump(session);
+}
 
-			break;
-		}
-		total_bytes -= i;
+/**
+ * slc_resume:
+ * @session: session taken over from another process, with its slc state
+ *
+ * Goes on with Service Level Connection setup from where the other
+ * process left it. Commands it had in flight are not sent again, their
+ * replies are still to come.
+ */
+void slc_resume(struct hfp_session *session)
+{
+	struct slc *slc = &session->slc;
+
+	slc->timeout = NULL;
+	if (slc->next == SLC_STEP_COUNT && !slc->count)
+		return;
+
+	slc->timeout = l_timeout_create_ms(SLC_TIMEOUT_MS, slc_timeout,
+								session, NULL);
+	slc_pump(session);
+}
+
+/**
+ * slc_stop:
+ * @session: session
+ *
+ * Stops Service Level Connection setup, replies still outstanding are
+ * then handled like those for any other command.
+ */
+void slc_stop(struct hfp_session *session)
+{
+	struct slc *slc = &session->slc;
+
+	l_timeout_remove(slc->timeout);
+	slc->timeout = NULL;
+	slc->count = 0;
+	slc->next = SLC_STEP_COUNT;
+}
+
+void handle_ok_response(struct hfp_session *session, const char *cmd, int index)
+{
+	slc_complete(session, true);
+}
+
+void handle_error_response(struct hfp_session *session, const char *cmd, int index)
+{
+	if (slc_complete(session, false))
+		return;
+
+	if (session->last_cmd == ATA) {
+		log_error("Attending incoming call failed");
+	} else {
+		log_error("Command failed: %s", str_cmds[session->last_cmd]);
 	}
 }
 
-#ifdef UNIT_TEST
+/* callback methods don't expect escape character in leading and trailing
+ * characters.
+ */
+struct cmd_struct cmd_handle[] = {
+	AT_COMMANDS(AT_CMD_HANDLER)
+};
 
-int main(void)
+static void process_command(struct hfp_session *session, const char *data,
+		unsigned int len)
 {
-	char data1[] = {'\r', 'A', 'T', '\r', '\n', 'O', 'K', '\r', '\n'};
-	handle_recv_data(data1, sizeof(data1)/sizeof(data1[0]));
+	uint64_t start;
+	int index;
 
-	char *data2 = "\r\nAT+BRSF\rATA\nOK\r\n\r\n"
+	if (!data || len < 2) {
+		log_debug("Invalid AT command");
+		return;
+	}
 
-	handle_recv_data(, sizeof(data1)/sizeof(data1[0]));
+	index = get_cmd_index(data, len);
+	if (index < 0) {
+		log_debug("Unknown command %s", data);
+		STATS_ADD(&session->stats, unknown, 1);
+		return;
+	}
 
+	start = stats_now();
+	cmd_handle[index].handler_callback(session, data, index);
+	arena_reset(&session->arena);
+	stats_command(&session->stats, index, stats_now() - start);
 }
 
-#endif
+void at_framer_init(struct at_framer *framer)
+{
+	ringbuf_init(&framer->ring);
+	framer->scan = 0;
+}
+
+/*
+ * Returns a NUL terminated view of the line [start, end) in the ring.
+ * The terminator found at end is overwritten in place, so the common
+ * case costs no copy. Only a line that wraps around the end of the ring
+ * is linearized into framer->line.
+ */
+static const char *frame_line(struct at_framer *framer, unsigned int start,
+		unsigned int end)
+{
+	struct ringbuf *ring = &framer->ring;
+	unsigned int offset = RINGBUF_MASK(start);
+	unsigned int len = end - start;
+	unsigned int i;
+
+	if (offset + len < RINGBUF_SIZE) {
+		ring->buf[offset + len] = '\0';
+		return ring->buf + offset;
+	}
+
+	for (i = 0; i < len; i++)
+		framer->line[i] = ringbuf_at(ring, start + i);
+
+	framer->line[len] = '\0';
+	return framer->line;
+}
+
+/*
+ * Called every time new bytes land in the ring. Complete lines are
+ * handed to process_command, a partial line stays queued and scanning
+ * resumes where it stopped once the rest of it arrives.
+ */
+void handle_recv_data(struct hfp_session *session)
+{
+	struct at_framer *framer = &session->framer;
+	struct ringbuf *ring = &framer->ring;
+	unsigned int pos = ring->out + framer->scan;
+	unsigned int offset, len;
+	const char *line, *eol;
+
+	while (pos != ring->in) {
+		/* Up to the write position or the end of the ring. */
+		offset = RINGBUF_MASK(pos);
+		len = L_MIN(ring->in - pos, RINGBUF_SIZE - offset);
+
+		eol = scan_find(&scan_set_eol, ring->buf + offset, len);
+		if (!eol) {
+			pos += len;
+			continue;
+		}
+
+		pos += eol - (ring->buf + offset);
+
+		/* Back to back \r\n pairs give empty lines, skip them. */
+		if (pos != ring->out) {
+			line = frame_line(framer, ring->out, pos);
+			process_command(session, line, pos - ring->out);
+		}
+
+		ring->out = ++pos;
+	}
+
+	framer->scan = pos - ring->out;
+
+	/* A line longer than the whole ring can never complete. */
+	if (!ringbuf_avail(ring)) {
+		log_error("AT line exceeds %d bytes, dropping it", RINGBUF_SIZE);
+		ringbuf_drain(ring, ringbuf_len(ring));
+		framer->scan = 0;
+	}
+}
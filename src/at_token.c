@@ -0,0 +1,166 @@
+/*
+ * at_token.c
+ */
+
+#include <limits.h>
+
+#include "main.h"
+#include "at_token.h"
+
+static bool is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* Bytes that end an unquoted field. */
+static const bool separator[256] = {
+	[','] = true, ['('] = true, [')'] = true,
+};
+
+/**
+ * at_tokenizer_init:
+ * @tk: tokenizer to set up
+ * @data: first byte of the arguments, e.g. just after "+CIND:"
+ * @len: number of bytes at @data
+ *
+ * @data must stay valid and unchanged while @tk is in use.
+ */
+void at_tokenizer_init(struct at_tokenizer *tk, const char *data,
+							unsigned int len)
+{
+	tk->pos = data;
+	tk->end = data + len;
+	tk->prev = AT_TOKEN_END;
+	tk->separated = false;
+}
+
+static enum at_token_type emit(struct at_tokenizer *tk, enum at_token_type type)
+{
+	tk->prev = type;
+	return type;
+}
+
+static enum at_token_type emit_empty(struct at_tokenizer *tk,
+						struct at_view *value)
+{
+	value->ptr = tk->pos;
+	value->len = 0;
+	return emit(tk, AT_TOKEN_VALUE);
+}
+
+/**
+ * at_tokenizer_next:
+ * @tk: tokenizer
+ * @value: set to the field for AT_TOKEN_VALUE
+ *
+ * Returns: the next token, AT_TOKEN_END once the arguments are used up.
+ */
+enum at_token_type at_tokenizer_next(struct at_tokenizer *tk,
+						struct at_view *value)
+{
+	const char *start;
+
+	while (tk->pos < tk->end) {
+		switch (*tk->pos) {
+		case ' ':
+		case '\t':
+			tk->pos++;
+			continue;
+		case ',':
+			tk->pos++;
+			/* Nothing since the last comma or the list start. */
+			if (tk->separated || tk->prev == AT_TOKEN_END ||
+						tk->prev == AT_TOKEN_OPEN) {
+				tk->separated = true;
+				return emit_empty(tk, value);
+			}
+
+			tk->separated = true;
+			continue;
+		case '(':
+			tk->pos++;
+			tk->separated = false;
+			return emit(tk, AT_TOKEN_OPEN);
+		case ')':
+			/* A trailing comma leaves an empty last field. */
+			if (tk->separated) {
+				tk->separated = false;
+				return emit_empty(tk, value);
+			}
+
+			tk->pos++;
+			return emit(tk, AT_TOKEN_CLOSE);
+		case '"':
+			start = ++tk->pos;
+			tk->pos = memchr(start, '"', tk->end - start);
+			if (!tk->pos)
+				tk->pos = tk->end;
+
+			value->ptr = start;
+			value->len = tk->pos - start;
+
+			if (tk->pos < tk->end)
+				tk->pos++;
+
+			tk->separated = false;
+			return emit(tk, AT_TOKEN_VALUE);
+		default:
+			start = tk->pos;
+			while (tk->pos < tk->end &&
+					!separator[(unsigned char) *tk->pos])
+				tk->pos++;
+
+			value->ptr = start;
+			value->len = tk->pos - start;
+			while (value->len && is_blank(start[value->len - 1]))
+				value->len--;
+
+			tk->separated = false;
+			return emit(tk, AT_TOKEN_VALUE);
+		}
+	}
+
+	if (tk->separated) {
+		tk->separated = false;
+		return emit_empty(tk, value);
+	}
+
+	return emit(tk, AT_TOKEN_END);
+}
+
+/* Takes the next token, which has to be a number. */
+bool at_tokenizer_next_uint(struct at_tokenizer *tk, unsigned int *value)
+{
+	struct at_view field;
+
+	if (at_tokenizer_next(tk, &field) != AT_TOKEN_VALUE)
+		return false;
+
+	return at_view_to_uint(&field, value);
+}
+
+bool at_view_equal(const struct at_view *view, const char *str)
+{
+	/* Lines may hold NULs, so the lengths are compared first. */
+	return strlen(str) == view->len && !memcmp(view->ptr, str, view->len);
+}
+
+/* Decimal digits only, no sign and nothing that overflows. */
+bool at_view_to_uint(const struct at_view *view, unsigned int *value)
+{
+	unsigned int i, digit, result = 0;
+
+	if (!view->len)
+		return false;
+
+	for (i = 0; i < view->len; i++) {
+		digit = (unsigned char) view->ptr[i] - '0';
+		if (digit > 9 || result > (UINT_MAX - digit) / 10)
+			return false;
+
+		result = result * 10 + digit;
+	}
+
+	*value = result;
+	return true;
+}
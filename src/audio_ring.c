@@ -0,0 +1,94 @@
+/*
+ * audio_ring.c
+ */
+
+#include "main.h"
+#include "audio_ring.h"
+
+bool audio_ring_init(struct audio_ring *ring, unsigned int size)
+{
+	size_t i;
+
+	/* Must be a power of two. */
+	if (!size || (size & (size - 1)))
+		return false;
+
+	ring->frames = l_new(struct audio_frame, size);
+	ring->size = size;
+
+	/*
+	 * Touch every page now, the capture path must never fault. Large
+	 * zeroed allocations come straight from mmap and are not touched.
+	 */
+	for (i = 0; i < size * sizeof(*ring->frames); i += 4096)
+		((volatile char *) ring->frames)[i] = 0;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->overruns = 0;
+
+	return true;
+}
+
+void audio_ring_free(struct audio_ring *ring)
+{
+	l_free(ring->frames);
+	ring->frames = NULL;
+}
+
+/**
+ * audio_ring_reserve:
+ * @ring: ring to produce into
+ *
+ * Producer side. Returns the next free frame so the caller can read()
+ * straight into it, or NULL when the consumer has fallen behind. In that
+ * case the overrun counter is bumped and the caller drops the frame.
+ */
+struct audio_frame *audio_ring_reserve(struct audio_ring *ring)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= ring->size) {
+		__atomic_store_n(&ring->overruns, ring->overruns + 1,
+							__ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return &ring->frames[head & (ring->size - 1)];
+}
+
+/* Publishes the frame returned by the last audio_ring_reserve. */
+void audio_ring_commit(struct audio_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side. Returns the @index'th queued frame or NULL. */
+struct audio_frame *audio_ring_peek(struct audio_ring *ring, unsigned int index)
+{
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = ring->tail;
+
+	if (head - tail <= index)
+		return NULL;
+
+	return &ring->frames[(tail + index) & (ring->size - 1)];
+}
+
+/* Hands @count consumed frames back to the producer. */
+void audio_ring_release(struct audio_ring *ring, unsigned int count)
+{
+	__atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+}
+
+unsigned int audio_ring_fill(const struct audio_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+uint64_t audio_ring_overruns(const struct audio_ring *ring)
+{
+	return __atomic_load_n(&ring->overruns, __ATOMIC_RELAXED);
+}
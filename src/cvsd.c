@@ -0,0 +1,276 @@
+/*
+ * cvsd.c
+ *
+ * CVSD decoder (Bluetooth Core, Vol 2 Part B 9.2) for SCO links in
+ * transparent air mode, where the controller hands us the raw 64 kbit/s
+ * bit stream instead of transcoding it. Bits are taken LSB first, as
+ * they are sent over the air; a set bit steps the estimate up.
+ *
+ * Every input byte is eight 64 kHz samples and thus exactly one 8 kHz
+ * output sample once decimated, which keeps the API trivial: n bytes
+ * in, n samples out.
+ */
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "main.h"
+#include "cvsd.h"
+
+/* All in Q10: h = 1 - 1/32, beta = 1 - 1/1024, J = K = 4. */
+#define CVSD_SHIFT		10
+#define CVSD_DELTA_MIN		(10 << CVSD_SHIFT)
+#define CVSD_DELTA_MAX		(1280 << CVSD_SHIFT)
+#define CVSD_Y_MAX		(INT16_MAX << CVSD_SHIFT)
+#define CVSD_Y_MIN		(-(32768 << CVSD_SHIFT))
+
+/* Decimation low pass, Q15, 3.6 kHz cut-off at 64 kHz. */
+static int16_t fir_taps[CVSD_FIR_TAPS] __attribute__((aligned(16)));
+static bool fir_ready;
+
+static void fir_init(void)
+{
+	double taps[CVSD_FIR_TAPS], sum = 0, fc = 3600.0 / 64000.0, t, w;
+	int i;
+
+	/* Blackman windowed sinc. */
+	for (i = 0; i < CVSD_FIR_TAPS; i++) {
+		t = i - (CVSD_FIR_TAPS - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2 * M_PI * i / (CVSD_FIR_TAPS - 1)) +
+			0.08 * cos(4 * M_PI * i / (CVSD_FIR_TAPS - 1));
+		taps[i] = w * (t ? sin(2 * M_PI * fc * t) / (M_PI * t) : 2 * fc);
+		sum += taps[i];
+	}
+
+	/* Unity gain at DC. */
+	for (i = 0; i < CVSD_FIR_TAPS; i++)
+		fir_taps[i] = lrint(taps[i] / sum * 32768);
+
+	fir_ready = true;
+}
+
+void cvsd_decoder_init(struct cvsd_decoder *dec)
+{
+	if (!fir_ready)
+		fir_init();
+
+	memset(dec, 0, sizeof(*dec));
+	dec->delta = CVSD_DELTA_MIN;
+}
+
+/* One step of the syllabic companding decoder, returns y(k). */
+static int32_t cvsd_step(struct cvsd_decoder *dec, bool bit, bool alpha)
+{
+	int32_t y;
+
+	if (alpha)
+		dec->delta = L_MIN(dec->delta + CVSD_DELTA_MIN, CVSD_DELTA_MAX);
+	else
+		dec->delta = L_MAX(dec->delta - (dec->delta >> 10),
+							CVSD_DELTA_MIN);
+
+	y = dec->estimate + (bit ? dec->delta : -dec->delta);
+	y = L_MIN(L_MAX(y, CVSD_Y_MIN), CVSD_Y_MAX);
+
+	dec->estimate = y - (y >> 5);
+
+	return y;
+}
+
+static int16_t fir_round(int32_t acc)
+{
+	acc = (acc + (1 << 14)) >> 15;
+
+	return L_MIN(L_MAX(acc, INT16_MIN), INT16_MAX);
+}
+
+size_t cvsd_decode_scalar(struct cvsd_decoder *dec, const uint8_t *in,
+				size_t len, int16_t *pcm)
+{
+	int16_t *window = dec->samples;
+	unsigned int run;
+	bool bit, prev;
+	int32_t acc;
+	size_t n;
+	int i;
+
+	/* Rebuild the current run length from the 3 bit history. */
+	prev = dec->history >> 2 & 1;
+	for (run = 1; run < 3 && (dec->history >> (2 - run) & 1) == prev; run++)
+		;
+
+	for (n = 0; n < len; n++) {
+		for (i = 0; i < 8; i++) {
+			bit = in[n] >> i & 1;
+			run = bit == prev ? L_MIN(run + 1, 4u) : 1;
+			prev = bit;
+
+			/* Shift the 64 tap window, oldest first. */
+			memmove(window, window + 1,
+				(CVSD_FIR_TAPS - 1) * sizeof(*window));
+			window[CVSD_FIR_TAPS - 1] =
+				cvsd_step(dec, bit, run >= 4) >> CVSD_SHIFT;
+		}
+
+		acc = 0;
+		for (i = 0; i < CVSD_FIR_TAPS; i++)
+			acc += window[i] * fir_taps[i];
+		pcm[n] = fir_round(acc);
+
+		dec->history = in[n] >> 5;
+	}
+
+	return len;
+}
+
+/*
+ * alpha for all 8 bits of a byte at once: a bit completes a run of four
+ * when it and its three predecessors are equal. With the 3 history bits
+ * below the byte, bit i of e says whether bits i and i + 1 of w agree.
+ */
+static unsigned int cvsd_alpha_mask(unsigned int history, uint8_t byte)
+{
+	unsigned int w = history | byte << 3;
+	unsigned int e = ~(w ^ w >> 1);
+
+	return e & e >> 1 & e >> 2 & 0xff;
+}
+
+/* Decodes one byte into 8 new 64 kHz samples, returns the window. */
+static const int16_t *cvsd_byte(struct cvsd_decoder *dec, uint8_t byte)
+{
+	unsigned int alpha = cvsd_alpha_mask(dec->history, byte);
+	int16_t *out = dec->samples + dec->pos;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		out[i] = cvsd_step(dec, byte >> i & 1, alpha >> i & 1) >>
+								CVSD_SHIFT;
+
+	memcpy(out + CVSD_FIR_TAPS, out, 8 * sizeof(*out));
+	dec->history = byte >> 5;
+	dec->pos = (dec->pos + 8) & (CVSD_FIR_TAPS - 1);
+
+	/* The 64 most recent samples, oldest first. */
+	return dec->samples + dec->pos;
+}
+
+static size_t cvsd_decode_bitsliced(struct cvsd_decoder *dec,
+				const uint8_t *in, size_t len, int16_t *pcm)
+{
+	const int16_t *window;
+	int32_t acc;
+	size_t n;
+	int i;
+
+	for (n = 0; n < len; n++) {
+		window = cvsd_byte(dec, in[n]);
+
+		acc = 0;
+		for (i = 0; i < CVSD_FIR_TAPS; i++)
+			acc += window[i] * fir_taps[i];
+		pcm[n] = fir_round(acc);
+	}
+
+	return len;
+}
+
+#ifdef HAVE_SSE2
+static size_t cvsd_decode_sse2(struct cvsd_decoder *dec, const uint8_t *in,
+				size_t len, int16_t *pcm)
+{
+	const int16_t *window;
+	__m128i acc;
+	int32_t sum[4];
+	size_t n;
+	int i;
+
+	for (n = 0; n < len; n++) {
+		window = cvsd_byte(dec, in[n]);
+
+		/* pos is a multiple of 8, so window is 16 byte aligned. */
+		acc = _mm_setzero_si128();
+		for (i = 0; i < CVSD_FIR_TAPS; i += 8)
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(
+				_mm_load_si128((const __m128i *) (window + i)),
+				_mm_load_si128((const __m128i *) (fir_taps + i))));
+
+		_mm_storeu_si128((__m128i *) sum, acc);
+		pcm[n] = fir_round(sum[0] + sum[1] + sum[2] + sum[3]);
+	}
+
+	return len;
+}
+#endif
+
+#if defined(__ARM_NEON)
+static size_t cvsd_decode_neon(struct cvsd_decoder *dec, const uint8_t *in,
+				size_t len, int16_t *pcm)
+{
+	const int16_t *window;
+	int32x4_t acc;
+	int32x2_t sum;
+	size_t n;
+	int i;
+
+	for (n = 0; n < len; n++) {
+		window = cvsd_byte(dec, in[n]);
+
+		acc = vdupq_n_s32(0);
+		for (i = 0; i < CVSD_FIR_TAPS; i += 4)
+			acc = vmlal_s16(acc, vld1_s16(window + i),
+						vld1_s16(fir_taps + i));
+
+		sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+		pcm[n] = fir_round(vget_lane_s32(vpadd_s32(sum, sum), 0));
+	}
+
+	return len;
+}
+#endif
+
+/**
+ * cvsd_decode_select:
+ *
+ * All implementations produce bit identical output; this only picks the
+ * fastest one for the CPU we run on.
+ *
+ * Returns: decode function, never NULL.
+ */
+cvsd_decode_func_t cvsd_decode_select(void)
+{
+	if (getenv("HFP_RECORDER_NO_SIMD"))
+		return cvsd_decode_bitsliced;
+
+#if defined(HAVE_SSE2)
+	return cvsd_decode_sse2;
+#elif defined(__ARM_NEON)
+	return cvsd_decode_neon;
+#else
+	return cvsd_decode_bitsliced;
+#endif
+}
+
+const char *cvsd_decode_name(cvsd_decode_func_t func)
+{
+#if defined(HAVE_SSE2)
+	if (func == cvsd_decode_sse2)
+		return "sse2";
+#endif
+#if defined(__ARM_NEON)
+	if (func == cvsd_decode_neon)
+		return "neon";
+#endif
+	if (func == cvsd_decode_bitsliced)
+		return "bitsliced";
+
+	return "scalar";
+}
@@ -3,9 +3,14 @@
  */
 
 #include "main.h"
+#include "proxy.h"
+#include "session.h"
+#include "stats.h"
 
 static struct l_dbus *dbus;
-static struct l_queue *proxy_queue;
+static struct l_dbus_client *client;
+/* Take the name over from the process that handed over, see handoff.h. */
+static bool replace_name;
 
 #define PROFILE_VERSION						0x0107
 #define PROFILE_NAME						"hfp_recorder"
@@ -15,20 +20,14 @@ static struct l_queue *proxy_queue;
 #define DBUS_OBJ_PATH						"/org/hfp/recorder"
 
 #define DBUS_BLUEZ_PROFILE_INTERFACE		"org.bluez.Profile1"
-#define DBUS_BLUEZ_PROFILE_MANAGER			"org.bluez.ProfileManager1"
 
 static void bluez_client_disconnected(struct l_dbus *dbus, void *user_data)
 {
 
-	l_info("bluez disappeared on message bus");
-	if (proxy_queue) {
-		/* TODO: may need to pass destroy function to free the inserted proxy structures.
-		 * Looks like struct l_dbus_proxy that are inserted into queue are dynamically
-		 * allocated and need to be freed by application.
-		 */
-		l_queue_destroy(proxy_queue, NULL);
-		proxy_queue = NULL;
-	}
+	log_info("bluez disappeared on message bus");
+
+	/* The client frees its proxies without telling proxy_removed. */
+	proxy_registry_clear();
 }
 
 /* fill the message received in the first argument with the message to be sent. */
@@ -36,37 +35,35 @@ static void hfp_registration_msg_setup(struct l_dbus_message *message, void *use
 {
 	struct l_dbus_message_builder *builder;
 
-	int channel = 6;
-	int version = 0x0107;
+	uint16_t channel = PROFILE_CHANNEL;
+	uint16_t version = PROFILE_VERSION;
 
 	/* do we need to call this ? */
 	l_dbus_message_set_no_autostart(message, true);
 
 	builder = l_dbus_message_builder_new(message);
 
-	l_dbus_message_builder_enter_struct(builder, "osa{sv}");
+	/* RegisterProfile(object profile, string uuid, dict options) */
 	l_dbus_message_builder_append_basic(builder, 'o', DBUS_OBJ_PATH);
 	l_dbus_message_builder_append_basic(builder, 's', "hfp-hf");
 
 	l_dbus_message_builder_enter_array(builder, "{sv}");
+
 	l_dbus_message_builder_enter_dict(builder, "sv");
 	l_dbus_message_builder_append_basic(builder, 's', "Channel");
-
 	l_dbus_message_builder_enter_variant(builder, "q");
 	l_dbus_message_builder_append_basic(builder, 'q', &channel);
 	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
 
-	/* TODO: Do we need a dict here ? */
-	l_dbus_message_builder_enter_dict(builder, "{sv}");
+	l_dbus_message_builder_enter_dict(builder, "sv");
 	l_dbus_message_builder_append_basic(builder, 's', "Version");
-
 	l_dbus_message_builder_enter_variant(builder, "q");
 	l_dbus_message_builder_append_basic(builder, 'q', &version);
 	l_dbus_message_builder_leave_variant(builder);
-
 	l_dbus_message_builder_leave_dict(builder);
+
 	l_dbus_message_builder_leave_array(builder);
-	l_dbus_message_builder_leave_struct(builder);
 
 	message = l_dbus_message_builder_finalize(builder);
 
@@ -82,9 +79,9 @@ static void hfp_registration_msg_reply(struct l_dbus_proxy *proxy,
 	if (l_dbus_message_is_error(message)) {
 		const char *name, *text;
 		l_dbus_message_get_error(message, &name, &text);
-		l_error("Failed registering hfp profile error name: %s error text: %s", name, text);
+		log_error("Failed registering hfp profile error name: %s error text: %s", name, text);
 	} else {
-		l_info("hfp profile registered with bluez successfully");
+		log_info("hfp profile registered with bluez successfully");
 	}
 }
 
@@ -103,19 +100,17 @@ static bool register_hfp_service(struct l_dbus_proxy *proxy)
  */
 static void proxy_added(struct l_dbus_proxy *proxy, void *user_data)
 {
-//	const char *path = l_dbus_proxy_get_path(proxy);
+	const char *path = l_dbus_proxy_get_path(proxy);
 	const char *interface = l_dbus_proxy_get_interface(proxy);
 
-	if (!strcmp(interface, DBUS_BLUEZ_PROFILE_MANAGER)) {
-		register_hfp_service(proxy);
-		l_queue_push_tail(proxy_queue, proxy);
-	} /* TODO: register default agent. */
-
 	/* once a remote bluetooth device is connected,
 	 * A new proxy is created and this call back is invoked.
 	 */
-	l_info("%s", interface);
+	if (proxy_registry_add(proxy) == BLUEZ_PROFILE_MANAGER)
+		register_hfp_service(proxy);
+	/* TODO: register default agent. */
 
+	log_debug("Proxy added. object path: %s, interface: %s", path, interface);
 }
 
 static void proxy_removed(struct l_dbus_proxy *proxy, void *user_data)
@@ -123,7 +118,8 @@ static void proxy_removed(struct l_dbus_proxy *proxy, void *user_data)
 	const char *path = l_dbus_proxy_get_path(proxy);
 	const char *interface = l_dbus_proxy_get_interface(proxy);
 
-	l_info("Proxy removed. object path: %s, interface: %s", path, interface);
+	log_debug("Proxy removed. object path: %s, interface: %s", path, interface);
+	proxy_registry_remove(proxy);
 }
 
 static void property_changed(struct l_dbus_proxy *proxy,
@@ -131,27 +127,20 @@ static void property_changed(struct l_dbus_proxy *proxy,
 		struct l_dbus_message *msg,
 		void *user_data)
 {
-//	const char *path = l_dbus_proxy_get_path(proxy);
-//	const char *interface = l_dbus_proxy_get_interface(proxy);
-	;
-	// Define property change actions here.
+	proxy_registry_update(proxy, name, msg);
 }
 
 static void bluez_client_connected(struct l_dbus *dbus, void *user_data)
 {
-	l_info("bluez client connected");
-	if (!proxy_queue)
-		proxy_queue = l_queue_new();
+	log_info("bluez client connected");
 }
 
 /* This callback called once requested DBus name is allocated to the application. */
 static void name_acquired_callback(struct l_dbus *dbus, bool success,
 		bool queued, void *user_data)
 {
-	struct l_dbus_client *client;
-
 	if (!success) {
-		l_error("Failed acquiring message bus");
+		log_error("Failed acquiring message bus");
 		return;
 	}
 
@@ -177,18 +166,51 @@ static void name_acquired_callback(struct l_dbus *dbus, bool success,
 
 }
 
+/* BlueZ passes the AG's HFP SDP record as fd_properties. */
+static void parse_fd_properties(struct l_dbus_message_iter *properties,
+							struct slc_sdp *sdp)
+{
+	struct l_dbus_message_iter variant;
+	const char *key;
+
+	memset(sdp, 0, sizeof(*sdp));
+
+	while (l_dbus_message_iter_next_entry(properties, &key, &variant)) {
+		if (!strcmp(key, "Version"))
+			l_dbus_message_iter_get_variant(&variant, "q",
+							&sdp->version);
+		else if (!strcmp(key, "Features"))
+			l_dbus_message_iter_get_variant(&variant, "q",
+							&sdp->features);
+	}
+
+	log_info("AG SDP version 0x%04x features 0x%04x", sdp->version,
+								sdp->features);
+}
+
 struct l_dbus_message* new_connection(struct l_dbus *dbus, struct l_dbus_message *message,
 		void *user_data)
 {
+	const char *path;
 	int sock;
+	struct l_dbus_message_iter properties;
 	struct l_dbus_message *reply;
+	const struct bluez_device *device;
+	struct slc_sdp sdp;
 
-	l_info("%s", __func__);
+	log_info("%s", __func__);
 
-	if (!l_dbus_message_get_arguments(message, "h", &sock)) {
-		l_info("no fd received");
+	if (!l_dbus_message_get_arguments(message, "oha{sv}", &path, &sock,
+							&properties)) {
+		log_info("no fd received");
 	} else {
-		new_rfcomm_connection(sock);
+		device = proxy_get_device(path);
+		if (device)
+			log_info("connection from %s (%s)", device->alias ?
+					device->alias : "unnamed", device->address);
+
+		parse_fd_properties(&properties, &sdp);
+		new_rfcomm_connection(path, sock, &sdp);
 	}
 
 	reply = l_dbus_message_new_method_return(message);
@@ -200,9 +222,13 @@ struct l_dbus_message* new_connection(struct l_dbus *dbus, struct l_dbus_message
 struct l_dbus_message* request_disconnection(struct l_dbus *dbus, struct l_dbus_message *message,
 		void *user_data)
 {
+	const char *path;
 	struct l_dbus_message *reply;
 
-	l_info("%s Method Call", __func__);
+	log_info("%s Method Call", __func__);
+
+	if (l_dbus_message_get_arguments(message, "o", &path))
+		session_destroy(session_lookup(path));
 
 	reply = l_dbus_message_new_method_return(message);
 	l_dbus_message_set_arguments(reply, "");
@@ -215,7 +241,7 @@ struct l_dbus_message* release(struct l_dbus *dbus, struct l_dbus_message *messa
 {
 	struct l_dbus_message *reply;
 
-	l_info("Method Call");
+	log_info("Method Call");
 
 	reply = l_dbus_message_new_method_return(message);
 	l_dbus_message_set_arguments(reply, "");
@@ -227,7 +253,7 @@ void dbus_interface_setup(struct l_dbus_interface *interface)
 {
 
 	if (!l_dbus_object_manager_enable(dbus)) {
-		l_error("Unable to enable DBus ObjectManager");
+		log_error("Unable to enable DBus ObjectManager");
 		return;
 	}
 
@@ -253,7 +279,7 @@ static void ready_callback(void *user_data)
 	success = l_dbus_register_interface(dbus, DBUS_BLUEZ_PROFILE_INTERFACE,
 			dbus_interface_setup, NULL, false);
 	if (!success) {
-		l_error("failed to register interface");
+		log_error("failed to register interface");
 		goto error;
 	}
 
@@ -262,14 +288,28 @@ static void ready_callback(void *user_data)
 	 */
 	success = l_dbus_object_add_interface(dbus, DBUS_OBJ_PATH, DBUS_BLUEZ_PROFILE_INTERFACE, NULL);
 	if (!success) {
-		l_error("failed to add interface on %s", DBUS_OBJ_PATH);
+		log_error("failed to add interface on %s", DBUS_OBJ_PATH);
+		goto error;
+	}
+
+	success = l_dbus_register_interface(dbus, STATS_INTERFACE,
+			stats_interface_setup, NULL, false);
+	if (!success) {
+		log_error("failed to register interface %s", STATS_INTERFACE);
+		goto error;
+	}
+
+	success = l_dbus_object_add_interface(dbus, DBUS_OBJ_PATH, STATS_INTERFACE, NULL);
+	if (!success) {
+		log_error("failed to add interface %s on %s", STATS_INTERFACE,
+				DBUS_OBJ_PATH);
 		goto error;
 	}
 
 	/* The callback passed may get called while l_dbus_name_acquire is running
-	 * or during main_loop.
+	 * or during main_loop. A process started by a handoff may replace us.
 	 */
-	l_dbus_name_acquire(dbus, DBUS_NAME, false, false, false,
+	l_dbus_name_acquire(dbus, DBUS_NAME, true, replace_name, false,
 			name_acquired_callback, NULL);
 
 error:
@@ -281,8 +321,9 @@ static void disconnect_callback(void *user_data)
 	l_main_quit();
 }
 
-bool dbus_init(void)
+bool dbus_init(bool replace)
 {
+	replace_name = replace;
 
 	dbus = l_dbus_new_default(L_DBUS_SYSTEM_BUS);
 
@@ -301,8 +342,17 @@ bool dbus_init(void)
 	return false;
 }
 
+/* Nothing to do if the daemon quit while taking over, before dbus_init. */
 void dbus_cleanup(void)
 {
+	if (!dbus)
+		return;
+
+	proxy_registry_clear();
+	l_dbus_client_destroy(client);
+	client = NULL;
+
 	l_dbus_unregister_object(dbus, DBUS_OBJ_PATH);
 	l_dbus_destroy(dbus);
+	dbus = NULL;
 }
@@ -0,0 +1,426 @@
+/*
+ * encode_pool.c
+ *
+ * Streams with work are queued for the workers under one lock, the same
+ * way the pwrite storage backend queues requests. Job slots are a ring
+ * per stream: the writer fills at tail and reaps at head, a worker
+ * encodes at done, and head <= done <= tail always holds.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "main.h"
+#include "encoder.h"
+#include "encode_pool.h"
+
+/* Without HFP_RECORDER_ENCODE_THREADS. */
+#define ENCODE_THREADS		2
+
+struct encode_job {
+	enum rec_type type;
+	enum rec_codec codec;
+	uint64_t timestamp;
+	unsigned int samples;	/* to encode, 0 for records passed through */
+	int len;		/* of data, a negative errno if encoding failed */
+	uint8_t data[ENCODE_JOB_MAX] __attribute__((aligned(8)));
+};
+
+struct encode_stream {
+	struct encode_pool *pool;
+	void *state;
+	unsigned int rate;
+	enum rec_codec codec;
+	encode_record_func_t func;
+	void *user_data;
+
+	struct encode_job jobs[ENCODE_STREAM_JOBS];
+	unsigned int head;	/* writer only */
+	unsigned int tail;	/* written by the writer under the lock */
+	unsigned int done;	/* written by a worker under the lock */
+	bool scheduled;		/* queued or being worked on */
+	struct encode_stream *next;
+};
+
+struct encode_pool {
+	const struct encoder *encoder;
+	int notify_fd;
+	pthread_t threads[ENCODE_THREADS_MAX];
+	unsigned int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t completed;
+	struct encode_stream *queue;
+	struct encode_stream **queue_tail;
+	bool stop;
+
+	/* Relaxed atomics, read by encode_pool_get_stats(). */
+	uint64_t jobs;
+	uint64_t audio_time;
+	uint64_t cpu_time;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t stalls;
+	uint64_t errors;
+};
+
+#define STAT_ADD(field, n) \
+	__atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) \
+	__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static uint64_t thread_cpu_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void encode_job(struct encode_pool *pool, struct encode_stream *stream,
+						struct encode_job *job)
+{
+	uint8_t out[ENCODE_JOB_MAX];
+	uint64_t start;
+	int len;
+
+	if (!job->samples)
+		return;
+
+	start = thread_cpu_usec();
+	len = pool->encoder->encode(stream->state, (const int16_t *) job->data,
+					job->samples, out, sizeof(out));
+	STAT_ADD(pool->cpu_time, thread_cpu_usec() - start);
+
+	if (len < 0) {
+		STAT_ADD(pool->errors, 1);
+		job->len = len;
+		return;
+	}
+
+	STAT_ADD(pool->jobs, 1);
+	STAT_ADD(pool->audio_time,
+			(uint64_t) job->samples * 1000000 / stream->rate);
+	STAT_ADD(pool->bytes_in, job->samples * sizeof(int16_t));
+	STAT_ADD(pool->bytes_out, len);
+
+	memcpy(job->data, out, len);
+	job->len = len;
+}
+
+static void *encode_thread(void *user_data)
+{
+	struct encode_pool *pool = user_data;
+	struct encode_stream *stream;
+	struct encode_job *job;
+	uint64_t val = 1;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+		while (!pool->queue && !pool->stop)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+
+		stream = pool->queue;
+		if (!stream)
+			break;
+
+		pool->queue = stream->next;
+		if (!pool->queue)
+			pool->queue_tail = &pool->queue;
+
+		/* Ours until scheduled is cleared, nobody else encodes it. */
+		while (stream->done != stream->tail) {
+			job = &stream->jobs[stream->done % ENCODE_STREAM_JOBS];
+
+			pthread_mutex_unlock(&pool->lock);
+			encode_job(pool, stream, job);
+			pthread_mutex_lock(&pool->lock);
+
+			__atomic_store_n(&stream->done, stream->done + 1,
+							__ATOMIC_RELEASE);
+			pthread_cond_broadcast(&pool->completed);
+		}
+
+		stream->scheduled = false;
+		pthread_cond_broadcast(&pool->completed);
+
+		if (write(pool->notify_fd, &val, sizeof(val)) < 0 &&
+							errno != EAGAIN)
+			log_error("encoder notify failed: %s", strerror(errno));
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * encode_pool_new:
+ * @encoder: what the streams are compressed with
+ * @notify_fd: eventfd written whenever jobs complete
+ *
+ * HFP_RECORDER_ENCODE_THREADS sets the number of workers.
+ *
+ * Returns: pool, or NULL if no worker could be started.
+ */
+struct encode_pool *encode_pool_new(const struct encoder *encoder,
+							int notify_fd)
+{
+	const char *value = getenv("HFP_RECORDER_ENCODE_THREADS");
+	unsigned int threads = ENCODE_THREADS;
+	struct encode_pool *pool;
+
+	if (value)
+		threads = L_MAX(1, L_MIN(atoi(value), ENCODE_THREADS_MAX));
+
+	pool = l_new(struct encode_pool, 1);
+	pool->encoder = encoder;
+	pool->notify_fd = notify_fd;
+	pool->queue_tail = &pool->queue;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->completed, NULL);
+
+	for (; pool->nthreads < threads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+						encode_thread, pool))
+			break;
+	}
+
+	if (!pool->nthreads) {
+		log_error("failed to start encoder threads");
+		encode_pool_free(pool);
+		return NULL;
+	}
+
+	log_info("recording compression: %s on %u threads", encoder->name,
+							pool->nthreads);
+	return pool;
+}
+
+/* Workers finish what is queued first. Streams must have been freed. */
+void encode_pool_free(struct encode_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->completed);
+	pthread_cond_destroy(&pool->queued);
+	pthread_mutex_destroy(&pool->lock);
+	l_free(pool);
+}
+
+void encode_pool_get_stats(struct encode_pool *pool,
+					struct encode_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!pool)
+		return;
+
+	stats->encoder = pool->encoder->name;
+	stats->threads = pool->nthreads;
+	stats->jobs = STAT_GET(pool->jobs);
+	stats->audio_time = STAT_GET(pool->audio_time);
+	stats->cpu_time = STAT_GET(pool->cpu_time);
+	stats->bytes_in = STAT_GET(pool->bytes_in);
+	stats->bytes_out = STAT_GET(pool->bytes_out);
+	stats->stalls = STAT_GET(pool->stalls);
+	stats->errors = STAT_GET(pool->errors);
+}
+
+/**
+ * encode_stream_new:
+ * @pool: worker pool
+ * @rate: sample rate of the audio
+ * @func: called from encode_stream_reap() with each finished record
+ * @user_data: passed to @func
+ *
+ * Returns: stream, or NULL if the encoder could not be set up.
+ */
+struct encode_stream *encode_stream_new(struct encode_pool *pool,
+					unsigned int rate,
+					encode_record_func_t func,
+					void *user_data)
+{
+	struct encode_stream *stream;
+	void *state;
+
+	state = pool->encoder->create(rate);
+	if (!state)
+		return NULL;
+
+	stream = l_new(struct encode_stream, 1);
+	stream->pool = pool;
+	stream->state = state;
+	stream->rate = rate;
+	stream->codec = encoder_codec(pool->encoder, rate);
+	stream->func = func;
+	stream->user_data = user_data;
+
+	return stream;
+}
+
+/* The stream must be idle, see encode_stream_idle(). */
+void encode_stream_free(struct encode_stream *stream)
+{
+	struct encode_pool *pool;
+
+	if (!stream)
+		return;
+
+	/* Its worker may still be on the way out. */
+	pool = stream->pool;
+	pthread_mutex_lock(&pool->lock);
+	while (stream->scheduled)
+		pthread_cond_wait(&pool->completed, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	stream->pool->encoder->destroy(stream->state);
+	l_free(stream);
+}
+
+/**
+ * encode_stream_reap:
+ * @stream: stream
+ *
+ * Passes finished jobs to the stream's callback, in submission order.
+ */
+void encode_stream_reap(struct encode_stream *stream)
+{
+	unsigned int done = __atomic_load_n(&stream->done, __ATOMIC_ACQUIRE);
+	struct encode_job *job;
+
+	for (; stream->head != done; stream->head++) {
+		job = &stream->jobs[stream->head % ENCODE_STREAM_JOBS];
+		if (job->len < 0)
+			continue;
+
+		stream->func(job->type, job->samples ? stream->codec :
+					job->codec, job->timestamp,
+					job->data, job->len,
+					stream->user_data);
+	}
+}
+
+unsigned int encode_stream_room(struct encode_stream *stream)
+{
+	return ENCODE_STREAM_JOBS - (stream->tail - stream->head);
+}
+
+bool encode_stream_idle(struct encode_stream *stream)
+{
+	return stream->head == stream->tail;
+}
+
+/* A free slot, waiting for the workers if the queue is full. */
+static struct encode_job *stream_reserve(struct encode_stream *stream)
+{
+	struct encode_pool *pool = stream->pool;
+
+	encode_stream_reap(stream);
+	if (encode_stream_room(stream))
+		return &stream->jobs[stream->tail % ENCODE_STREAM_JOBS];
+
+	STAT_ADD(pool->stalls, 1);
+
+	pthread_mutex_lock(&pool->lock);
+	while (stream->done == stream->head)
+		pthread_cond_wait(&pool->completed, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	encode_stream_reap(stream);
+	return &stream->jobs[stream->tail % ENCODE_STREAM_JOBS];
+}
+
+static void stream_commit(struct encode_stream *stream)
+{
+	struct encode_pool *pool = stream->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	stream->tail++;
+
+	if (!stream->scheduled) {
+		stream->scheduled = true;
+		stream->next = NULL;
+		*pool->queue_tail = stream;
+		pool->queue_tail = &stream->next;
+		pthread_cond_signal(&pool->queued);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * encode_stream_audio:
+ * @stream: stream
+ * @timestamp: of the first sample
+ * @pcm: samples to encode into one record
+ * @samples: at most ENCODE_JOB_MAX / 2
+ *
+ * Returns: false if the run is too long to take.
+ */
+bool encode_stream_audio(struct encode_stream *stream, uint64_t timestamp,
+				const int16_t *pcm, unsigned int samples)
+{
+	struct encode_job *job;
+
+	if (samples * sizeof(int16_t) > ENCODE_JOB_MAX)
+		return false;
+
+	job = stream_reserve(stream);
+	job->type = REC_AUDIO;
+	job->timestamp = timestamp;
+	job->samples = samples;
+	job->len = 0;
+	memcpy(job->data, pcm, samples * sizeof(int16_t));
+	stream_commit(stream);
+
+	return true;
+}
+
+/**
+ * encode_stream_record:
+ * @stream: stream
+ * @type: record type
+ * @codec: record codec
+ * @timestamp: record timestamp
+ * @data: payload, stored as is
+ * @len: at most ENCODE_JOB_MAX
+ *
+ * Queues a record behind the audio submitted before it.
+ *
+ * Returns: false if the record is too long to take.
+ */
+bool encode_stream_record(struct encode_stream *stream, enum rec_type type,
+				enum rec_codec codec, uint64_t timestamp,
+				const void *data, size_t len)
+{
+	struct encode_job *job;
+
+	if (len > ENCODE_JOB_MAX)
+		return false;
+
+	job = stream_reserve(stream);
+	job->type = type;
+	job->codec = codec;
+	job->timestamp = timestamp;
+	job->samples = 0;
+	job->len = len;
+	memcpy(job->data, data, len);
+	stream_commit(stream);
+
+	return true;
+}
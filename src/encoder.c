@@ -0,0 +1,129 @@
+/*
+ * encoder.c
+ *
+ * Encoder registry and the built-in IMA ADPCM encoder, which needs no
+ * library and quarters the size of PCM for next to no CPU.
+ */
+
+#include <endian.h>
+
+#include "main.h"
+#include "adpcm.h"
+#include "encoder.h"
+
+static const struct encoder *encoders[] = {
+	&encoder_adpcm,
+#ifdef HAVE_OPUS
+	&encoder_opus,
+#endif
+};
+
+/**
+ * encoder_find:
+ * @name: "adpcm", or "opus" if built with it
+ *
+ * Returns: the encoder, or NULL if there is none by that name.
+ */
+const struct encoder *encoder_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(encoders); i++) {
+		if (!strcmp(encoders[i]->name, name))
+			return encoders[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * encoder_for_codec:
+ * @codec: of a stored audio record
+ *
+ * Returns: the encoder that wrote it, or NULL for PCM and for codecs
+ * this build cannot decode.
+ */
+const struct encoder *encoder_for_codec(enum rec_codec codec)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(encoders); i++) {
+		if (encoders[i]->codec_8k == codec ||
+					encoders[i]->codec_16k == codec)
+			return encoders[i];
+	}
+
+	return NULL;
+}
+
+enum rec_codec encoder_codec(const struct encoder *encoder,
+							unsigned int rate)
+{
+	return rate > 8000 ? encoder->codec_16k : encoder->codec_8k;
+}
+
+static void *adpcm_create(unsigned int rate)
+{
+	return l_new(struct adpcm_state, 1);
+}
+
+static void adpcm_destroy(void *state)
+{
+	l_free(state);
+}
+
+static int adpcm_encode_run(void *state, const int16_t *pcm,
+				unsigned int samples, uint8_t *out, size_t len)
+{
+	struct adpcm_state *adpcm = state;
+	struct rec_encoded *hdr = (void *) out;
+
+	if (sizeof(*hdr) + ADPCM_BYTES(samples) > len)
+		return -ENOSPC;
+
+	hdr->samples = htole32(samples);
+	hdr->predictor = htole16(adpcm->predictor);
+	hdr->index = adpcm->index;
+	hdr->reserved = 0;
+
+	adpcm_encode(adpcm, pcm, samples, out + sizeof(*hdr));
+
+	return sizeof(*hdr) + ADPCM_BYTES(samples);
+}
+
+/* Every record carries its starting state, nothing is kept between. */
+static int adpcm_decode_run(void *state, const void *data, size_t len,
+					int16_t *pcm, unsigned int samples)
+{
+	const struct rec_encoded *hdr = data;
+	struct adpcm_state adpcm;
+	unsigned int count;
+
+	if (len < sizeof(*hdr))
+		return -EBADMSG;
+
+	count = le32toh(hdr->samples);
+	if (sizeof(*hdr) + ADPCM_BYTES(count) > len || hdr->index > 88)
+		return -EBADMSG;
+
+	if (count > samples)
+		return -ENOSPC;
+
+	adpcm.predictor = (int16_t) le16toh(hdr->predictor);
+	adpcm.index = hdr->index;
+	adpcm_decode(&adpcm, (const uint8_t *) (hdr + 1), count, pcm);
+
+	return count;
+}
+
+const struct encoder encoder_adpcm = {
+	.name = "adpcm",
+	.codec_8k = REC_CODEC_ADPCM_8K,
+	.codec_16k = REC_CODEC_ADPCM_16K,
+	.create = adpcm_create,
+	.destroy = adpcm_destroy,
+	.encode = adpcm_encode_run,
+	.decoder_new = adpcm_create,
+	.decoder_free = adpcm_destroy,
+	.decode = adpcm_decode_run,
+};
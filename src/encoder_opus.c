@@ -0,0 +1,190 @@
+/*
+ * encoder_opus.c
+ *
+ * Opus encoder, built with make WITH_OPUS=1. Runs are cut into 20 ms
+ * packets; a shorter tail is padded with silence to the next frame
+ * size Opus accepts, and rec_encoded.samples tells the reader how much
+ * of the decoded audio to keep.
+ *
+ * Decoding drops that padding again. Each packet depends on the ones
+ * before it, so a reader starting mid recording decodes OPUS_PREROLL_MS
+ * ahead of where it needs exact audio.
+ */
+
+#ifdef HAVE_OPUS
+
+#include <endian.h>
+#include <opus.h>
+
+#include "main.h"
+#include "encoder.h"
+
+/* Voice at about 16 and 24 kbit/s. */
+#define OPUS_BITRATE_8K		16000
+#define OPUS_BITRATE_16K	24000
+#define OPUS_FRAME_MS		20
+#define OPUS_PREROLL_MS		80
+
+struct opus_state {
+	OpusEncoder *enc;
+	unsigned int rate;
+};
+
+static void *opus_create(unsigned int rate)
+{
+	struct opus_state *state;
+	int err;
+
+	state = l_new(struct opus_state, 1);
+	state->rate = rate;
+	state->enc = opus_encoder_create(rate, 1, OPUS_APPLICATION_VOIP, &err);
+	if (!state->enc) {
+		log_error("opus encoder: %s", opus_strerror(err));
+		l_free(state);
+		return NULL;
+	}
+
+	opus_encoder_ctl(state->enc, OPUS_SET_BITRATE(rate > 8000 ?
+				OPUS_BITRATE_16K : OPUS_BITRATE_8K));
+	opus_encoder_ctl(state->enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+
+	return state;
+}
+
+static void opus_destroy(void *data)
+{
+	struct opus_state *state = data;
+
+	opus_encoder_destroy(state->enc);
+	l_free(state);
+}
+
+/* Smallest frame Opus takes that holds @samples, up to 20 ms. */
+static unsigned int opus_frame(const struct opus_state *state,
+							unsigned int samples)
+{
+	unsigned int frame = state->rate / 400;		/* 2.5 ms */
+
+	while (frame < samples && frame < state->rate / 1000 * OPUS_FRAME_MS)
+		frame *= 2;
+
+	return frame;
+}
+
+static int opus_encode_run(void *data, const int16_t *pcm,
+				unsigned int samples, uint8_t *out, size_t len)
+{
+	struct opus_state *state = data;
+	struct rec_encoded *hdr = (void *) out;
+	int16_t tail[48000 / 1000 * OPUS_FRAME_MS];
+	size_t pos = sizeof(*hdr);
+	unsigned int done, frame, n;
+	const int16_t *in;
+	uint16_t plen;
+	int ret;
+
+	if (pos > len)
+		return -ENOSPC;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->samples = htole32(samples);
+
+	for (done = 0; done < samples; done += n) {
+		n = L_MIN(samples - done,
+				state->rate / 1000 * OPUS_FRAME_MS);
+		frame = opus_frame(state, n);
+		in = pcm + done;
+
+		if (frame != n) {
+			memcpy(tail, in, n * sizeof(int16_t));
+			memset(tail + n, 0, (frame - n) * sizeof(int16_t));
+			in = tail;
+		}
+
+		if (pos + sizeof(plen) >= len)
+			return -ENOSPC;
+
+		ret = opus_encode(state->enc, in, frame, out + pos +
+				sizeof(plen), len - pos - sizeof(plen));
+		if (ret < 0)
+			return -EIO;
+
+		plen = htole16(ret);
+		memcpy(out + pos, &plen, sizeof(plen));
+		pos += sizeof(plen) + ret;
+	}
+
+	return pos;
+}
+
+static void *opus_decoder_new(unsigned int rate)
+{
+	OpusDecoder *dec;
+	int err;
+
+	dec = opus_decoder_create(rate, 1, &err);
+	if (!dec)
+		log_error("opus decoder: %s", opus_strerror(err));
+
+	return dec;
+}
+
+static void opus_decoder_free(void *data)
+{
+	opus_decoder_destroy(data);
+}
+
+static int opus_decode_run(void *data, const void *payload, size_t len,
+					int16_t *pcm, unsigned int samples)
+{
+	const struct rec_encoded *hdr = payload;
+	const uint8_t *in = payload;
+	int16_t frame[48000 / 1000 * OPUS_FRAME_MS];
+	unsigned int count, done = 0;
+	size_t pos = sizeof(*hdr);
+	uint16_t plen;
+	int ret;
+
+	if (len < sizeof(*hdr))
+		return -EBADMSG;
+
+	count = le32toh(hdr->samples);
+	if (count > samples)
+		return -ENOSPC;
+
+	while (pos + sizeof(plen) <= len && done < count) {
+		memcpy(&plen, in + pos, sizeof(plen));
+		plen = le16toh(plen);
+		pos += sizeof(plen);
+		if (pos + plen > len)
+			return -EBADMSG;
+
+		/* Padded tails decode whole; only what was recorded is kept. */
+		ret = opus_decode(data, in + pos, plen, frame,
+						L_ARRAY_SIZE(frame), 0);
+		if (ret < 0)
+			return -EBADMSG;
+
+		ret = L_MIN((unsigned int) ret, count - done);
+		memcpy(pcm + done, frame, ret * sizeof(int16_t));
+		done += ret;
+		pos += plen;
+	}
+
+	return done;
+}
+
+const struct encoder encoder_opus = {
+	.name = "opus",
+	.codec_8k = REC_CODEC_OPUS_8K,
+	.codec_16k = REC_CODEC_OPUS_16K,
+	.create = opus_create,
+	.destroy = opus_destroy,
+	.encode = opus_encode_run,
+	.decoder_new = opus_decoder_new,
+	.decoder_free = opus_decoder_free,
+	.decode = opus_decode_run,
+	.preroll = OPUS_PREROLL_MS * 1000,
+};
+
+#endif /* HAVE_OPUS */
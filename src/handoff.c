@@ -0,0 +1,901 @@
+/*
+ * handoff.c
+ *
+ * The old process, on SIGUSR2:
+ *	socketpair, fork and exec with HANDOFF_FD_ENV
+ *	<- READY
+ *	freeze every session, -> SESSION for each, -> END with the listener
+ *	   (a failure up to here thaws them all and this process goes on)
+ *	close the journal, hand the captures off, stop the writer
+ *	-> RECORDING for each suspended recording, -> DONE, and exit
+ *
+ * The new process only queues each session as it arrives: until END the
+ * old one may still take them back, so nothing is read from or written
+ * to them before. At END they are restored and their SCO sockets read,
+ * the audio held back from the writer until the RECORDING for the same
+ * session says where the file left off. Once the old process hung up,
+ * recordings without one start new files and the rest of the daemon
+ * starts; sessions still queued then were taken back and are dropped.
+ *
+ * Messages are SOCK_SEQPACKET, one struct each, with the fds they carry
+ * as SCM_RIGHTS. Both processes are the same build or they refuse each
+ * other, so structs go over as they are.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "main.h"
+#include "handoff.h"
+#include "recording.h"
+#include "sco.h"
+#include "session.h"
+
+#define HANDOFF_VERSION		1
+/* Seconds the new process may take to start up. */
+#define HANDOFF_TIMEOUT		10
+#define HANDOFF_PATH_MAX	128
+/* At most per message: RFCOMM, SCO, recording. */
+#define HANDOFF_FDS		3
+/* The new process finds its end here. */
+#define HANDOFF_CHILD_FD	3
+
+enum handoff_type {
+	HANDOFF_READY = 1,
+	HANDOFF_SESSION,
+	HANDOFF_END,
+	HANDOFF_RECORDING,
+	HANDOFF_DONE,
+};
+
+struct handoff_ready {
+	uint32_t type;
+	uint32_t version;
+	uint32_t size;			/* of the largest message */
+	int32_t pid;
+};
+
+/* fds: RFCOMM, then SCO and its recording as flagged. */
+struct handoff_session {
+	uint32_t type;
+	char path[HANDOFF_PATH_MAX];
+	uint32_t id;
+	struct slc slc;
+	enum at_cmds last_cmd;
+	unsigned int ag_features;
+	enum hfp_codec codec;
+	int service_index;
+	int call_index;
+	int callsetup_index;
+	int signal_index;
+	int ring_count;
+	char incoming_callid[HFP_CALLID_MAX];
+	unsigned int call;
+	unsigned int callsetup;
+	uint64_t created;
+	struct hfp_stats stats;
+	/* Received, not parsed yet. */
+	uint32_t rx_len;
+	char rx[RINGBUF_SIZE];
+	/* Queued, not sent yet, without what went out of the first. */
+	uint32_t tx_count;
+	struct tx_buf tx[TX_QUEUE_SLOTS];
+	bool has_sco;
+	bool has_file;
+	struct sco_handoff sco;
+};
+
+/* fds: the SCO listener, if flagged. */
+struct handoff_end {
+	uint32_t type;
+	bool has_listener;
+	struct hfp_stats total;
+};
+
+struct handoff_recording {
+	uint32_t type;
+	char path[HANDOFF_PATH_MAX];
+	struct rec_resume resume;
+};
+
+union handoff_msg {
+	uint32_t type;
+	struct handoff_ready ready;
+	struct handoff_session session;
+	struct handoff_end end;
+	struct handoff_recording recording;
+};
+
+static union handoff_msg msg;
+static struct l_io *peer;		/* the other process, either side */
+
+/* Old process */
+static char *exe;
+static char **args;
+static struct l_signal *restart_signal;
+static struct l_timeout *timeout;
+static pid_t child;
+
+/* New process */
+static handoff_listen_func_t listen_func;
+static handoff_done_func_t done_func;
+static bool listening;
+static bool done_received;
+
+/* A session as received, restored once the old process let go at END. */
+struct handoff_pending {
+	struct handoff_pending *next;
+	struct handoff_session state;
+	int fds[HANDOFF_FDS];
+	unsigned int nfds;
+};
+
+static struct handoff_pending *pending;
+static struct handoff_pending **pending_tail = &pending;
+
+static bool handoff_send(const void *data, size_t len, const int *fds,
+							unsigned int nfds)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct iovec iov = { (void *) data, len };
+	struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	ssize_t sent;
+
+	if (nfds) {
+		memset(&control, 0, sizeof(control));
+		hdr.msg_control = control.buf;
+		hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	do {
+		sent = sendmsg(l_io_get_fd(peer), &hdr, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0) {
+		log_error("handoff: send failed: %s", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static void close_fds(const int *fds, unsigned int nfds)
+{
+	unsigned int i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+/* Returns: the message length, 0 at the end or -errno. */
+static ssize_t handoff_recv(int *fds, unsigned int *nfds)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct iovec iov = { &msg, sizeof(msg) };
+	struct msghdr hdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	*nfds = 0;
+
+	do {
+		len = recvmsg(l_io_get_fd(peer), &hdr, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		return -errno;
+
+	for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+	}
+
+	if (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		close_fds(fds, *nfds);
+		*nfds = 0;
+		return -EMSGSIZE;
+	}
+
+	return len;
+}
+
+/* Under systemd the new process becomes the service's main process. */
+static void notify_main_pid(pid_t pid)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t path_len;
+	char text[32];
+	int fd, len;
+
+	if (!path || (path[0] != '/' && path[0] != '@'))
+		return;
+
+	path_len = strlen(path);
+	if (path_len >= sizeof(addr.sun_path))
+		return;
+
+	/* '@' stands for the abstract namespace. */
+	memcpy(addr.sun_path, path, path_len);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	len = snprintf(text, sizeof(text), "MAINPID=%d", (int) pid);
+	if (sendto(fd, text, len, MSG_NOSIGNAL, (struct sockaddr *) &addr,
+			offsetof(struct sockaddr_un, sun_path) + path_len) < 0)
+		log_warn("failed to tell systemd about pid %d: %s", (int) pid,
+							strerror(errno));
+
+	close(fd);
+}
+
+static void handoff_abort(void)
+{
+	l_timeout_remove(timeout);
+	timeout = NULL;
+
+	l_io_destroy(peer);
+	peer = NULL;
+
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+		child = 0;
+	}
+
+	log_warn("handoff aborted, carrying on");
+}
+
+/* Stops the session's traffic and sends it as it stands. */
+static bool send_session(struct hfp_session *session)
+{
+	struct handoff_session *state = &msg.session;
+	struct tx_queue *txq = &session->txq;
+	struct ringbuf *ring = &session->framer.ring;
+	struct tx_buf *buf;
+	int fds[HANDOFF_FDS], file_fd;
+	unsigned int nfds = 0, i;
+
+	freeze_rfcomm_connection(session);
+
+	memset(state, 0, sizeof(*state));
+	state->type = HANDOFF_SESSION;
+	strcpy(state->path, session->path);
+	state->id = session->id;
+	state->slc = session->slc;
+	state->last_cmd = session->last_cmd;
+	state->ag_features = session->ag_features;
+	state->codec = session->codec;
+	state->service_index = session->service_index;
+	state->call_index = session->call_index;
+	state->callsetup_index = session->callsetup_index;
+	state->signal_index = session->signal_index;
+	state->ring_count = session->ring_count;
+	memcpy(state->incoming_callid, session->incoming_callid,
+					sizeof(state->incoming_callid));
+	state->call = session->call;
+	state->callsetup = session->callsetup;
+	state->created = session->created;
+	memcpy(&state->stats, &session->stats, sizeof(state->stats));
+
+	state->rx_len = ringbuf_len(ring);
+	for (i = 0; i < state->rx_len; i++)
+		state->rx[i] = ringbuf_at(ring, ring->out + i);
+
+	for (i = txq->head; i != txq->tail; i++)
+		state->tx[state->tx_count++] = txq->bufs[i % TX_QUEUE_SLOTS];
+
+	if (state->tx_count) {
+		buf = &state->tx[0];
+		buf->len -= txq->offset;
+		memmove(buf->data, buf->data + txq->offset, buf->len);
+	}
+
+	fds[nfds++] = l_io_get_fd(session->io);
+
+	if (session->sco) {
+		state->has_sco = true;
+		fds[nfds++] = sco_capture_freeze(session->sco, &state->sco,
+								&file_fd);
+		if (file_fd >= 0) {
+			state->has_file = true;
+			fds[nfds++] = file_fd;
+		}
+	}
+
+	return handoff_send(state, sizeof(*state), fds, nfds);
+}
+
+static void thaw_session(struct hfp_session *session)
+{
+	thaw_rfcomm_connection(session);
+
+	if (session->sco)
+		sco_capture_thaw(session->sco);
+}
+
+static bool send_end(void)
+{
+	struct handoff_end *end = &msg.end;
+	int fd = sco_listen_fd();
+
+	memset(end, 0, sizeof(*end));
+	end->type = HANDOFF_END;
+	end->has_listener = fd >= 0;
+	memcpy(&end->total, &stats_total, sizeof(end->total));
+
+	return handoff_send(end, sizeof(*end), &fd, fd >= 0);
+}
+
+static void send_recording(const char *path, const struct rec_resume *resume,
+							void *user_data)
+{
+	struct handoff_recording *recording = &msg.recording;
+	bool *ok = user_data;
+
+	memset(recording, 0, sizeof(*recording));
+	recording->type = HANDOFF_RECORDING;
+	snprintf(recording->path, sizeof(recording->path), "%s", path);
+	recording->resume = *resume;
+
+	if (*ok)
+		*ok = handoff_send(recording, sizeof(*recording), NULL, 0);
+}
+
+struct session_list {
+	struct hfp_session **sessions;
+	unsigned int count;
+};
+
+static void collect_session(struct hfp_session *session, void *user_data)
+{
+	struct session_list *list = user_data;
+
+	list->sessions[list->count++] = session;
+}
+
+static void handoff_send_all(void)
+{
+	struct session_list list;
+	uint32_t type = HANDOFF_DONE;
+	unsigned int i, frozen;
+	bool ok = true;
+
+	list.sessions = l_new(struct hfp_session *, session_count() + 1);
+	list.count = 0;
+	session_foreach(collect_session, &list);
+
+	for (frozen = 0; ok && frozen < list.count; frozen++) {
+		if (strlen(list.sessions[frozen]->path) >= HANDOFF_PATH_MAX) {
+			log_error("handoff: path too long: %s",
+					list.sessions[frozen]->path);
+			ok = false;
+			break;
+		}
+
+		ok = send_session(list.sessions[frozen]);
+	}
+
+	if (ok)
+		ok = send_end();
+
+	/* Nothing was let go yet, the new process dies with its copies. */
+	if (!ok) {
+		for (i = 0; i < frozen; i++)
+			thaw_session(list.sessions[i]);
+
+		l_free(list.sessions);
+		handoff_abort();
+		return;
+	}
+
+	/* No going back from here on. */
+	journal_close();
+
+	for (i = 0; i < list.count; i++) {
+		struct hfp_session *session = list.sessions[i];
+
+		if (session->sco)
+			sco_capture_hand_off(session->sco);
+
+		session->handed_off = true;
+		session_destroy(session);
+	}
+
+	l_free(list.sessions);
+
+	/* Once the writer stored all it had, the files are the new one's. */
+	sco_suspend(send_recording, &ok);
+
+	if (!ok || !handoff_send(&type, sizeof(type), NULL, 0))
+		log_error("handoff: recordings not resumed go to new files");
+
+	notify_main_pid(child);
+	log_info("handed %u sessions over to pid %d", list.count, (int) child);
+
+	child = 0;
+	l_io_set_disconnect_handler(peer, NULL, NULL, NULL);
+	l_main_quit();
+}
+
+static void handoff_child_gone(struct l_io *io, void *user_data)
+{
+	log_error("handoff: pid %d went away", (int) child);
+	handoff_abort();
+}
+
+static bool handoff_ready_callback(struct l_io *io, void *user_data)
+{
+	int fds[HANDOFF_FDS];
+	unsigned int nfds;
+	ssize_t len;
+
+	len = handoff_recv(fds, &nfds);
+	if (len == -EAGAIN)
+		return true;
+
+	close_fds(fds, nfds);
+
+	if (len <= 0) {
+		handoff_child_gone(io, NULL);
+		return false;
+	}
+
+	if (len != sizeof(msg.ready) || msg.type != HANDOFF_READY ||
+			msg.ready.version != HANDOFF_VERSION ||
+			msg.ready.size != sizeof(msg)) {
+		log_error("handoff: %s is not a compatible build", exe);
+		handoff_abort();
+		return false;
+	}
+
+	l_timeout_remove(timeout);
+	timeout = NULL;
+
+	handoff_send_all();
+	return false;
+}
+
+static void handoff_timeout(struct l_timeout *timeout, void *user_data)
+{
+	log_error("handoff: pid %d not ready in %u seconds", (int) child,
+							HANDOFF_TIMEOUT);
+	handoff_abort();
+}
+
+/* Our environment, pointing the new process at its end of the pair. */
+static char **handoff_environ(void)
+{
+	unsigned int count = 0, i;
+	char **envp;
+
+	while (environ[count])
+		count++;
+
+	envp = l_new(char *, count + 2);
+
+	for (count = 0, i = 0; environ[i]; i++) {
+		if (!strncmp(environ[i], HANDOFF_FD_ENV "=",
+						strlen(HANDOFF_FD_ENV "=")))
+			continue;
+
+		envp[count++] = l_strdup(environ[i]);
+	}
+
+	envp[count] = l_strdup_printf("%s=%d", HANDOFF_FD_ENV,
+							HANDOFF_CHILD_FD);
+
+	return envp;
+}
+
+/* In the child, only async-signal-safe calls from here on. */
+static void handoff_exec(int fd, char **envp)
+{
+	sigset_t none;
+
+	if (fd == HANDOFF_CHILD_FD)
+		fcntl(fd, F_SETFD, 0);
+	else if (dup2(fd, HANDOFF_CHILD_FD) < 0)
+		_exit(127);
+
+	/* Sockets BlueZ passed us may lack O_CLOEXEC. */
+	close_range(HANDOFF_CHILD_FD + 1, ~0U, 0);
+
+	/* ELL blocks the signals it handles, a new process starts clean. */
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	execve(exe, args, envp);
+	_exit(127);
+}
+
+static void handoff_start(void *user_data)
+{
+	char **envp;
+	int sv[2];
+	struct timeval send_timeout = { 1, 0 };
+	pid_t pid;
+
+	if (peer) {
+		log_warn("handoff already in progress");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_error("handoff: socketpair failed: %s", strerror(errno));
+		return;
+	}
+
+	envp = handoff_environ();
+
+	pid = fork();
+	if (!pid)
+		handoff_exec(sv[1], envp);
+
+	l_strfreev(envp);
+	close(sv[1]);
+
+	if (pid < 0) {
+		log_error("handoff: fork failed: %s", strerror(errno));
+		close(sv[0]);
+		return;
+	}
+
+	/* A stuck new process must not stall us for long. */
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+							sizeof(send_timeout));
+
+	child = pid;
+	peer = l_io_new(sv[0]);
+	l_io_set_close_on_destroy(peer, true);
+	l_io_set_read_handler(peer, handoff_ready_callback, NULL, NULL);
+	l_io_set_disconnect_handler(peer, handoff_child_gone, NULL, NULL);
+	timeout = l_timeout_create(HANDOFF_TIMEOUT, handoff_timeout, NULL,
+									NULL);
+
+	log_info("handing over to %s, pid %d", exe, (int) pid);
+}
+
+/**
+ * handoff_init:
+ * @argv: the daemon's arguments, passed on as they are
+ *
+ * Hands over to a new process on SIGUSR2. The binary is looked up now,
+ * so one replaced by an upgrade is the one started.
+ *
+ * Returns: false if there is nothing to execute.
+ */
+bool handoff_init(char *argv[])
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	char *deleted;
+
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len < 0) {
+		log_error("handoff unavailable: %s", strerror(errno));
+		return false;
+	}
+
+	path[len] = '\0';
+
+	/* Replaced underneath us, the new file has the old name. */
+	deleted = strstr(path, " (deleted)");
+	if (deleted && !deleted[strlen(" (deleted)")])
+		*deleted = '\0';
+
+	exe = l_strdup(path);
+	args = argv;
+	restart_signal = l_signal_create(SIGUSR2, handoff_start, NULL, NULL);
+
+	return true;
+}
+
+/* Taken back by the old process, or we are quitting before END. */
+static void pending_drop(void)
+{
+	struct handoff_pending *entry;
+	unsigned int count = 0;
+
+	while ((entry = pending)) {
+		pending = entry->next;
+		close_fds(entry->fds, entry->nfds);
+		l_free(entry);
+		count++;
+	}
+
+	pending_tail = &pending;
+
+	if (count)
+		log_warn("handoff: %u sessions left with the old process",
+									count);
+}
+
+/* Recordings the old process did not suspend start new files. */
+static void resume_capture(struct hfp_session *session, void *user_data)
+{
+	sco_capture_resume(session->sco, NULL);
+}
+
+/* The old process is gone, whatever state it left us in. */
+static void handoff_finish(void)
+{
+	if (!done_received)
+		log_warn("handoff: old process gone before it was done");
+
+	l_io_destroy(peer);
+	peer = NULL;
+
+	pending_drop();
+
+	if (!listening)
+		listen_func(-1);
+
+	session_foreach(resume_capture, NULL);
+
+	done_func();
+}
+
+static void receive_session(struct handoff_session *state, int *fds,
+							unsigned int nfds)
+{
+	struct handoff_pending *entry;
+
+	if (nfds != 1u + state->has_sco + state->has_file ||
+			state->has_file > state->has_sco ||
+			state->rx_len > RINGBUF_SIZE ||
+			state->tx_count > TX_QUEUE_SLOTS) {
+		log_error("handoff: malformed session");
+		close_fds(fds, nfds);
+		return;
+	}
+
+	state->path[HANDOFF_PATH_MAX - 1] = '\0';
+
+	entry = l_new(struct handoff_pending, 1);
+	memcpy(&entry->state, state, sizeof(*state));
+	memcpy(entry->fds, fds, nfds * sizeof(int));
+	entry->nfds = nfds;
+
+	*pending_tail = entry;
+	pending_tail = &entry->next;
+}
+
+static void restore_session(struct handoff_session *state, int *fds,
+							unsigned int nfds)
+{
+	struct hfp_session *session;
+	unsigned int i;
+
+	session = resume_rfcomm_connection(state->path, fds[0], state->id);
+	if (!session) {
+		close_fds(fds + 1, nfds - 1);
+		return;
+	}
+
+	session->slc = state->slc;
+	session->last_cmd = state->last_cmd;
+	session->ag_features = state->ag_features;
+	session->codec = state->codec;
+	session->service_index = state->service_index;
+	session->call_index = state->call_index;
+	session->callsetup_index = state->callsetup_index;
+	session->signal_index = state->signal_index;
+	session->ring_count = state->ring_count;
+	memcpy(session->incoming_callid, state->incoming_callid,
+					sizeof(session->incoming_callid));
+	session->incoming_callid[HFP_CALLID_MAX - 1] = '\0';
+	session->call = state->call;
+	session->callsetup = state->callsetup;
+	session->created = state->created;
+	memcpy(&session->stats, &state->stats, sizeof(session->stats));
+
+	/* What the old process had queued goes out first. */
+	for (i = 0; i < state->tx_count; i++)
+		write_data(session, state->tx[i].data,
+				L_MIN(state->tx[i].len, MAX_DATA_BUF_SIZE));
+
+	slc_resume(session);
+
+	/*
+	 * Frames the AG sent meanwhile wait in the socket, the gap is only
+	 * lost audio if it outgrew the socket's buffer.
+	 */
+	if (state->has_sco && sco_capture_adopt(session, fds[1],
+				state->has_file ? fds[2] : -1, &state->sco))
+		log_info("session %s handed over, SCO unread for %llu us",
+				session->path, (unsigned long long)
+				(l_time_now() - state->sco.frozen));
+	else
+		log_info("session %s handed over", session->path);
+
+	/* Last, replies may need all of the above. */
+	ringbuf_write(&session->framer.ring, state->rx, state->rx_len);
+	handle_recv_data(session);
+}
+
+static void receive_end(struct handoff_end *end, int *fds, unsigned int nfds)
+{
+	struct handoff_pending *entry;
+
+	/* The old process let go of the sessions, they are ours now. */
+	while ((entry = pending)) {
+		pending = entry->next;
+		restore_session(&entry->state, entry->fds, entry->nfds);
+		l_free(entry);
+	}
+
+	pending_tail = &pending;
+
+	if (nfds != end->has_listener) {
+		log_error("handoff: malformed end");
+		close_fds(fds, nfds);
+		return;
+	}
+
+	stats_merge(&stats_total, &end->total);
+
+	listening = true;
+	listen_func(end->has_listener ? fds[0] : -1);
+}
+
+static void receive_recording(struct handoff_recording *recording)
+{
+	struct hfp_session *session;
+
+	recording->path[HANDOFF_PATH_MAX - 1] = '\0';
+
+	session = session_lookup(recording->path);
+	if (!session || !session->sco) {
+		log_warn("handoff: recording of %s has no capture",
+							recording->path);
+		return;
+	}
+
+	sco_capture_resume(session->sco, &recording->resume);
+}
+
+static bool handoff_message_callback(struct l_io *io, void *user_data)
+{
+	int fds[HANDOFF_FDS];
+	unsigned int nfds;
+	ssize_t len;
+
+	len = handoff_recv(fds, &nfds);
+	if (len == -EAGAIN)
+		return true;
+
+	if (len <= 0) {
+		if (len < 0)
+			log_error("handoff: receive failed: %s",
+							strerror(-len));
+		handoff_finish();
+		return false;
+	}
+
+	if (msg.type == HANDOFF_SESSION && !listening &&
+				len == sizeof(msg.session))
+		receive_session(&msg.session, fds, nfds);
+	else if (msg.type == HANDOFF_END && len == sizeof(msg.end))
+		receive_end(&msg.end, fds, nfds);
+	else if (msg.type == HANDOFF_RECORDING && !nfds &&
+				len == sizeof(msg.recording))
+		receive_recording(&msg.recording);
+	else if (msg.type == HANDOFF_DONE && !nfds)
+		done_received = true;
+	else {
+		log_error("handoff: unexpected message %u", msg.type);
+		close_fds(fds, nfds);
+	}
+
+	return true;
+}
+
+static void handoff_old_gone(struct l_io *io, void *user_data)
+{
+	handoff_finish();
+}
+
+/**
+ * handoff_receive:
+ * @fd: HANDOFF_FD_ENV, as the old process set it
+ * @listen: called with the old process' SCO listener
+ * @done: called once the old process is gone
+ *
+ * Takes over from the process that started us. @listen and @done are
+ * called exactly once each, in this order, even if it dies halfway.
+ *
+ * Returns: false if there is nothing to take over.
+ */
+bool handoff_receive(const char *fd, handoff_listen_func_t listen,
+					handoff_done_func_t done)
+{
+	struct handoff_ready *ready = &msg.ready;
+	char *end;
+	long value;
+
+	unsetenv(HANDOFF_FD_ENV);
+
+	errno = 0;
+	value = strtol(fd, &end, 10);
+	if (errno || *end || end == fd || value < 0 || value > INT_MAX ||
+			fcntl(value, F_SETFD, FD_CLOEXEC) < 0) {
+		log_error("handoff: bad fd %s", fd);
+		return false;
+	}
+
+	listen_func = listen;
+	done_func = done;
+
+	peer = l_io_new(value);
+	l_io_set_close_on_destroy(peer, true);
+
+	memset(ready, 0, sizeof(*ready));
+	ready->type = HANDOFF_READY;
+	ready->version = HANDOFF_VERSION;
+	ready->size = sizeof(msg);
+	ready->pid = getpid();
+
+	if (!handoff_send(ready, sizeof(*ready), NULL, 0)) {
+		l_io_destroy(peer);
+		peer = NULL;
+		return false;
+	}
+
+	l_io_set_read_handler(peer, handoff_message_callback, NULL, NULL);
+	l_io_set_disconnect_handler(peer, handoff_old_gone, NULL, NULL);
+
+	log_info("taking over from the previous process");
+	return true;
+}
+
+void handoff_cleanup(void)
+{
+	l_signal_remove(restart_signal);
+	restart_signal = NULL;
+
+	/* Handed over, the new process sees us gone once we exit. */
+	if (peer && !child)
+		l_io_set_close_on_destroy(peer, false);
+	else if (peer)
+		handoff_abort();
+
+	l_io_destroy(peer);
+	peer = NULL;
+
+	pending_drop();
+
+	l_free(exe);
+	exe = NULL;
+}
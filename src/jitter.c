@@ -0,0 +1,125 @@
+/*
+ * jitter.c
+ */
+
+#include "main.h"
+#include "jitter.h"
+
+/*
+ * The timeline follows the earliest arrivals: it moves a quarter of the
+ * way towards an early frame but only 1/1024 towards a late one, which
+ * is still plenty for the sender's clock drift.
+ */
+#define JITTER_EARLY_SHIFT	2
+#define JITTER_LATE_SHIFT	10
+
+void jitter_buffer_init(struct jitter_buffer *jb, unsigned int rate)
+{
+	memset(jb, 0, sizeof(*jb));
+	jb->rate = rate;
+}
+
+static int64_t bytes_to_usec(const struct jitter_buffer *jb, uint64_t bytes)
+{
+	return bytes * 1000000 / jb->rate;
+}
+
+/*
+ * How early a frame may land and still own its slot: four times the
+ * mean earliness, between an eighth and half of a frame.
+ */
+static int64_t jitter_buffer_early(const struct jitter_buffer *jb,
+							int64_t frame)
+{
+	int64_t early = 4 * (jb->early >> 4);
+
+	return L_MAX(frame / 8, L_MIN(early, frame / 2));
+}
+
+/**
+ * jitter_buffer_depth:
+ * @jb: jitter buffer
+ *
+ * Returns: how late, in usec, the last frame length may land and still
+ * be in place.
+ */
+unsigned int jitter_buffer_depth(const struct jitter_buffer *jb)
+{
+	int64_t frame = bytes_to_usec(jb, jb->frame_len);
+
+	return frame - jitter_buffer_early(jb, frame);
+}
+
+static void jitter_buffer_restart(struct jitter_buffer *jb,
+					uint64_t timestamp, size_t len)
+{
+	jb->start = timestamp - bytes_to_usec(jb, len);
+	jb->bytes = len;
+	jb->started = true;
+	/* Half a frame either way until arrivals have been seen. */
+	jb->early = bytes_to_usec(jb, len) / 8 << 4;
+}
+
+/**
+ * jitter_buffer_put:
+ * @jb: jitter buffer
+ * @timestamp: arrival of the frame, usec
+ * @len: frame length
+ *
+ * Returns: the number of bytes missing before this frame, to be
+ * concealed, or -1 if the frame is surplus and must be dropped. Gaps
+ * are whole multiples of @len.
+ */
+long jitter_buffer_put(struct jitter_buffer *jb, uint64_t timestamp,
+							size_t len)
+{
+	int64_t deviation, frame, early;
+	uint64_t missing = 0;
+
+	jb->frames++;
+	jb->frame_len = len;
+
+	if (!jb->started || !len) {
+		jitter_buffer_restart(jb, timestamp, len);
+		return 0;
+	}
+
+	deviation = (int64_t) (timestamp - jb->start) -
+					bytes_to_usec(jb, jb->bytes + len);
+
+	if (deviation > JITTER_GAP_MAX || deviation < -JITTER_GAP_MAX) {
+		/* The link was suspended, or our clock jumped. */
+		jb->resyncs++;
+		jitter_buffer_restart(jb, timestamp, len);
+		return 0;
+	}
+
+	frame = bytes_to_usec(jb, len);
+	early = jitter_buffer_early(jb, frame);
+
+	if (deviation < -early) {
+		jb->surplus++;
+		return -1;
+	}
+
+	if (deviation >= frame - early) {
+		missing = (deviation + early) / frame;
+		jb->gaps += missing;
+		deviation -= missing * frame;
+		missing *= len;
+	}
+
+	jb->bytes += missing + len;
+	if (deviation < 0)
+		jb->start -= -deviation >> JITTER_EARLY_SHIFT;
+	else
+		jb->start += deviation >> JITTER_LATE_SHIFT;
+
+	/* Means in 1/16 usec, over the last 16 frames or so. */
+	jb->jitter += (deviation < 0 ? -deviation : deviation) -
+						(int64_t) (jb->jitter >> 4);
+	jb->early += (deviation < 0 ? -deviation : 0) -
+						(int64_t) (jb->early >> 4);
+
+	return missing;
+}
@@ -0,0 +1,443 @@
+/*
+ * journal.c
+ *
+ * The file is sized once, with its blocks allocated up front, so the
+ * mapping can never fault on a full disk later. A record is built on
+ * the stack and lands in its slot with a single 64 byte copy; readers
+ * copy it out again and only trust what checks out.
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "main.h"
+#include "journal.h"
+
+#define JOURNAL_SIZE(capacity)	(JOURNAL_HEADER_SIZE + \
+				(size_t) (capacity) * sizeof(struct journal_record))
+
+static struct {
+	struct journal_header *header;
+	struct journal_record *ring;
+	size_t size;
+	uint64_t seq;		/* last written */
+} journal;
+
+static const char *type_names[] = {
+	[JOURNAL_START] = "START",
+	[JOURNAL_CONNECT] = "CONNECT",
+	[JOURNAL_DISCONNECT] = "DISCONNECT",
+	[JOURNAL_BRSF] = "BRSF",
+	[JOURNAL_RING] = "RING",
+	[JOURNAL_CLIP] = "CLIP",
+	[JOURNAL_CIEV] = "CIEV",
+	[JOURNAL_ANSWER] = "ANSWER",
+};
+
+/* +BRSF AG feature bits, HFP 1.7. */
+static const char *brsf_names[] = {
+	"3way", "ecnr", "vr", "inband", "voicetag", "reject", "ecs", "ecc",
+	"errors", "codecs", "hfind",
+};
+
+static const char *callsetup_names[] = {
+	"none", "incoming", "outgoing", "alerting",
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Word at a time, a few ns for a whole record. */
+static uint32_t journal_check(const struct journal_record *rec)
+{
+	const uint8_t *p = (const void *) rec;
+	uint64_t h = 0x6a09e667f3bcc909ull, w;
+	uint32_t tail;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= offsetof(struct journal_record, check); i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+
+	memcpy(&tail, p + i, sizeof(tail));
+	h = (h ^ tail) * 0x9e3779b97f4a7c15ull;
+
+	return h >> 32;
+}
+
+static bool record_valid(const struct journal_record *rec)
+{
+	return rec->seq && le32toh(rec->check) == journal_check(rec);
+}
+
+static bool header_valid(const struct journal_header *header, size_t size)
+{
+	uint32_t capacity = le32toh(header->capacity);
+
+	return !memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) &&
+		le32toh(header->version) == JOURNAL_VERSION &&
+		le32toh(header->record_size) ==
+					sizeof(struct journal_record) &&
+		capacity && JOURNAL_SIZE(capacity) <= size;
+}
+
+/* Lowest and highest numbered records that check out, 0 for none. */
+static uint64_t ring_scan(const struct journal_record *ring,
+					uint32_t capacity, uint64_t *first)
+{
+	struct journal_record rec;
+	uint64_t last = 0, low = UINT64_MAX, seq;
+	uint32_t i;
+
+	for (i = 0; i < capacity; i++) {
+		rec = ring[i];
+		if (!record_valid(&rec))
+			continue;
+
+		seq = le64toh(rec.seq);
+		last = L_MAX(last, seq);
+		low = L_MIN(low, seq);
+	}
+
+	if (first)
+		*first = last ? low : 0;
+
+	return last;
+}
+
+/**
+ * journal_open:
+ * @path: journal file, created or resized as needed
+ *
+ * Maps the journal and carries on numbering after the newest record
+ * found in it, so records from before a crash or restart are kept.
+ *
+ * Returns: false if the journal cannot be used; events then go to the
+ * log as text.
+ */
+bool journal_open(const char *path)
+{
+	uint64_t offset;
+	struct stat st;
+	size_t size = JOURNAL_SIZE(JOURNAL_RECORDS);
+	void *map;
+	int fd, err;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		log_error("journal %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size != size) {
+		err = ftruncate(fd, 0) < 0 ? errno :
+					posix_fallocate(fd, 0, size);
+		if (err == EOPNOTSUPP)
+			err = ftruncate(fd, size) < 0 ? errno : 0;
+
+		if (err) {
+			log_error("journal %s: %s", path, strerror(err));
+			close(fd);
+			return false;
+		}
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("journal %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	journal.header = map;
+	journal.ring = (void *) ((uint8_t *) map + JOURNAL_HEADER_SIZE);
+	journal.size = size;
+
+	if (!header_valid(journal.header, size) ||
+			le32toh(journal.header->capacity) != JOURNAL_RECORDS) {
+		memset(map, 0, size);
+		memcpy(journal.header->magic, JOURNAL_MAGIC,
+						sizeof(JOURNAL_MAGIC));
+		journal.header->version = htole32(JOURNAL_VERSION);
+		journal.header->record_size =
+				htole32(sizeof(struct journal_record));
+		journal.header->capacity = htole32(JOURNAL_RECORDS);
+	}
+
+	journal.seq = ring_scan(journal.ring, JOURNAL_RECORDS, NULL);
+
+	offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+	journal.header->realtime_offset = htole64(offset);
+
+	log_info("event journal %s, resuming at record %llu", path,
+				(unsigned long long) journal.seq + 1);
+
+	offset = htole64(offset);
+	journal_log(0, NULL, JOURNAL_START, &offset, sizeof(offset));
+
+	return true;
+}
+
+void journal_close(void)
+{
+	if (!journal.header)
+		return;
+
+	munmap(journal.header, journal.size);
+	memset(&journal, 0, sizeof(journal));
+}
+
+/**
+ * journal_log:
+ * @session: session number, 0 for none
+ * @address: AG address as bdaddr_t bytes, or NULL
+ * @type: event
+ * @payload: event data, cut to JOURNAL_PAYLOAD bytes
+ * @len: its length
+ */
+void journal_log(uint32_t session, const uint8_t *address,
+			enum journal_type type, const void *payload,
+			size_t len)
+{
+	struct journal_record rec;
+	char text[128];
+
+	memset(&rec, 0, sizeof(rec));
+	rec.timestamp = htole64(clock_ns(CLOCK_MONOTONIC));
+	rec.session = htole32(session);
+	rec.type = htole16(type);
+	rec.len = L_MIN(len, (size_t) JOURNAL_PAYLOAD);
+	if (address)
+		memcpy(rec.address, address, sizeof(rec.address));
+	if (rec.len)
+		memcpy(rec.payload, payload, rec.len);
+
+	if (!journal.ring) {
+		journal_format(&rec, text, sizeof(text));
+		log_info("%s", text);
+		return;
+	}
+
+	rec.seq = htole64(++journal.seq);
+	rec.check = htole32(journal_check(&rec));
+
+	journal.ring[(journal.seq - 1) % JOURNAL_RECORDS] = rec;
+}
+
+struct journal_reader {
+	const struct journal_header *header;
+	const struct journal_record *ring;
+	uint32_t capacity;
+	size_t size;
+};
+
+struct journal_reader *journal_reader_open(const char *path)
+{
+	struct journal_reader *reader;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < JOURNAL_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (!header_valid(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	reader = l_new(struct journal_reader, 1);
+	reader->header = map;
+	reader->ring = (void *) ((uint8_t *) map + JOURNAL_HEADER_SIZE);
+	reader->capacity = le32toh(reader->header->capacity);
+	reader->size = st.st_size;
+
+	return reader;
+}
+
+void journal_reader_close(struct journal_reader *reader)
+{
+	if (!reader)
+		return;
+
+	munmap((void *) reader->header, reader->size);
+	l_free(reader);
+}
+
+const struct journal_header *journal_reader_header(
+					struct journal_reader *reader)
+{
+	return reader->header;
+}
+
+/**
+ * journal_reader_range:
+ * @reader: journal
+ * @first: set to the oldest record held
+ * @last: set to the newest
+ *
+ * Looks at every slot, the file says nothing about where the ring ends.
+ *
+ * Returns: false if the journal holds no records.
+ */
+bool journal_reader_range(struct journal_reader *reader, uint64_t *first,
+							uint64_t *last)
+{
+	/* A record torn by a crash may have taken the oldest's slot. */
+	*last = ring_scan(reader->ring, reader->capacity, first);
+
+	return *last != 0;
+}
+
+/**
+ * journal_reader_next:
+ * @reader: journal
+ * @seq: record wanted, advanced past it when read
+ * @rec: filled with the record, integers left little endian
+ *
+ * Returns: 0 on success, -EAGAIN if record @seq was not written yet,
+ * or -ESTALE if it was overwritten already, in which case @seq moves
+ * ahead to a record that may still be held.
+ */
+int journal_reader_next(struct journal_reader *reader, uint64_t *seq,
+					struct journal_record *rec)
+{
+	uint64_t got;
+
+	*rec = reader->ring[(*seq - 1) % reader->capacity];
+	if (!record_valid(rec))
+		return -EAGAIN;
+
+	got = le64toh(rec->seq);
+	if (got < *seq)
+		return -EAGAIN;
+
+	if (got > *seq) {
+		*seq = got - reader->capacity + 1;
+		return -ESTALE;
+	}
+
+	(*seq)++;
+	return 0;
+}
+
+const char *journal_type_name(enum journal_type type)
+{
+	if ((unsigned int) type >= L_ARRAY_SIZE(type_names) ||
+						!type_names[type])
+		return "UNKNOWN";
+
+	return type_names[type];
+}
+
+/* Returns: the type named @name, any case, or -EINVAL. */
+int journal_type_from_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(type_names); i++) {
+		if (type_names[i] && !strcasecmp(type_names[i], name))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static int append(char *buf, size_t len, int n, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(buf + n, len > (size_t) n ? len - n : 0, format, ap);
+	va_end(ap);
+
+	return n + ret;
+}
+
+/**
+ * journal_format:
+ * @rec: record, as read
+ * @buf: buffer for the text
+ * @len: its size
+ *
+ * One line for the record: the AG address, then the event and what it
+ * carries. Timestamps and session numbers are left to the caller.
+ *
+ * Returns: as snprintf.
+ */
+int journal_format(const struct journal_record *rec, char *buf, size_t len)
+{
+	const struct journal_ciev *ciev = (const void *) rec->payload;
+	enum journal_type type = le16toh(rec->type);
+	const uint8_t *a = rec->address;
+	uint32_t value = 0;
+	unsigned int i;
+	int n;
+
+	n = snprintf(buf, len, "%02X:%02X:%02X:%02X:%02X:%02X %s",
+				a[5], a[4], a[3], a[2], a[1], a[0],
+				journal_type_name(type));
+
+	memcpy(&value, rec->payload, L_MIN(rec->len, sizeof(value)));
+	value = le32toh(value);
+
+	switch (type) {
+	case JOURNAL_RING:
+		return append(buf, len, n, " %u", value);
+	case JOURNAL_CLIP:
+		return append(buf, len, n, " \"%.*s\"", rec->len, rec->payload);
+	case JOURNAL_BRSF:
+		n = append(buf, len, n, " 0x%x", value);
+		for (i = 0; i < L_ARRAY_SIZE(brsf_names); i++) {
+			if (value & (1 << i))
+				n = append(buf, len, n, " %s", brsf_names[i]);
+		}
+
+		return n;
+	case JOURNAL_CIEV:
+		if (rec->len < sizeof(*ciev))
+			break;
+
+		switch (ciev->indicator) {
+		case JOURNAL_IND_SERVICE:
+			return append(buf, len, n, " service=%u", ciev->value);
+		case JOURNAL_IND_CALL:
+			return append(buf, len, n, " call=%u", ciev->value);
+		case JOURNAL_IND_CALLSETUP:
+			return append(buf, len, n, " callsetup=%u (%s)",
+					ciev->value, ciev->value <
+					L_ARRAY_SIZE(callsetup_names) ?
+					callsetup_names[ciev->value] : "?");
+		default:
+			return append(buf, len, n, " %u=%u", ciev->index,
+								ciev->value);
+		}
+	default:
+		break;
+	}
+
+	return n;
+}
@@ -0,0 +1,680 @@
+/*
+ * log.c
+ *
+ * Each thread logging through the deferred backend gets a ring of its
+ * own on first use, producer at head and the log thread at tail, so a
+ * message costs a clock read and a copy into it. A call site's format
+ * is parsed once, into the kinds of arguments it takes; formats that
+ * cannot be taken apart that way are formatted on the spot instead and
+ * queued as text, as are messages from threads left without a ring.
+ *
+ * Entries are 8 byte aligned and never wrap: one that does not fit
+ * before the end of the ring is preceded by a pad entry, or by nothing
+ * if not even an entry header fits, and goes at the start.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "main.h"
+#include "log.h"
+
+#define LOG_RINGS		32
+#define LOG_RING_SIZE		(64 * 1024)
+#define LOG_ENTRY_MAX		512
+#define LOG_LINE_MAX		1024
+#define LOG_FLUSH_MS		10
+#define LOG_SPEC_MAX		32
+
+enum site_state {
+	SITE_NEW,
+	SITE_PARSING,
+	SITE_READY,
+	SITE_TEXT,		/* format on the spot */
+};
+
+enum log_arg {
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,
+	ARG_PRECISION,		/* an int, bounding the string after it */
+};
+
+struct log_entry {
+	const struct log_site *site;	/* NULL for padding */
+	uint64_t time;
+	uint16_t size;
+	bool text;		/* one string, formatted by the caller */
+	int err;		/* for %m */
+} __attribute__((aligned(8)));
+
+struct log_ring {
+	uint8_t data[LOG_RING_SIZE];
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint64_t dropped;
+	uint64_t reported;	/* log thread only */
+	bool owned;		/* by a live thread */
+};
+
+struct log_spec {
+	const char *start;
+	size_t len;
+	char conv;		/* 0 if not supported */
+	enum log_arg arg;
+	bool width_star;
+	bool precision_star;
+	bool precision;
+};
+
+bool log_deferred;
+
+static struct log_ring *rings[LOG_RINGS];
+static unsigned int nrings;
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct log_ring *self;
+
+static pthread_t thread;
+static bool stop;
+
+static inline uint32_t align8(uint32_t n)
+{
+	return (n + 7) & ~7u;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Next conversion in a format, NULL past the last one. */
+static const char *next_spec(const char *p, struct log_spec *spec)
+{
+	unsigned int longs = 0, shorts = 0;
+
+	p = strchr(p, '%');
+	if (!p)
+		return NULL;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+
+	if (*p == '*') {
+		spec->width_star = true;
+		p++;
+	}
+
+	while (*p >= '0' && *p <= '9')
+		p++;
+
+	/* Positional arguments are not followed. */
+	if (*p == '$')
+		goto unsupported;
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->precision_star = true;
+			p++;
+		} else {
+			spec->precision = true;
+		}
+
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	for (;; p++) {
+		if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't')
+			longs++;
+		else if (*p == 'q')
+			longs += 2;
+		else if (*p == 'h')
+			shorts++;
+		else if (*p == 'L')
+			goto unsupported;
+		else
+			break;
+	}
+
+	spec->conv = *p;
+	if (*p)
+		p++;
+	spec->len = p - spec->start;
+
+	switch (spec->conv) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		spec->arg = longs > 1 ? ARG_LLONG : longs ? ARG_LONG : ARG_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		spec->arg = ARG_DOUBLE;
+		break;
+	case 'p':
+		spec->arg = ARG_PTR;
+		break;
+	case 's':
+		/* Only a precision passed along can be honoured when copying. */
+		if (longs || shorts || spec->precision)
+			goto unsupported;
+		spec->arg = ARG_STR;
+		break;
+	case 'm':
+	case '%':
+		break;
+	default:
+		goto unsupported;
+	}
+
+	if (spec->len < LOG_SPEC_MAX)
+		return p;
+
+unsupported:
+	spec->conv = 0;
+	return *p ? p + 1 : p;
+}
+
+static enum site_state parse_site(struct log_site *site)
+{
+	struct log_spec spec;
+	const char *p = site->format;
+	unsigned int n = 0;
+
+	while ((p = next_spec(p, &spec))) {
+		if (!spec.conv || n + 3 > LOG_SITE_ARGS)
+			return SITE_TEXT;
+
+		if (spec.conv == '%' || spec.conv == 'm')
+			continue;
+
+		if (spec.width_star)
+			site->args[n++] = ARG_INT;
+
+		if (spec.precision_star)
+			site->args[n++] = spec.arg == ARG_STR ?
+						ARG_PRECISION : ARG_INT;
+
+		site->args[n++] = spec.arg;
+	}
+
+	site->nargs = n;
+	return SITE_READY;
+}
+
+/* Parsed once, whoever comes first; the others make do with text. */
+static enum site_state site_state(struct log_site *site)
+{
+	int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+	int expected = SITE_NEW;
+
+	if (state != SITE_NEW)
+		return state;
+
+	if (!__atomic_compare_exchange_n(&site->state, &expected, SITE_PARSING,
+						false, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+		return SITE_TEXT;
+
+	state = parse_site(site);
+	__atomic_store_n(&site->state, state, __ATOMIC_RELEASE);
+
+	return state;
+}
+
+static void ring_release(void *data)
+{
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+}
+
+/* The ring of an exited thread is taken over before making a new one. */
+static struct log_ring *ring_attach(void)
+{
+	struct log_ring *ring = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&attach_lock);
+
+	for (i = 0; i < nrings && !ring; i++)
+		if (!__atomic_load_n(&rings[i]->owned, __ATOMIC_ACQUIRE))
+			ring = rings[i];
+
+	if (!ring && nrings < LOG_RINGS) {
+		ring = l_new(struct log_ring, 1);
+		rings[nrings] = ring;
+		__atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+	}
+
+	if (ring) {
+		__atomic_store_n(&ring->owned, true, __ATOMIC_RELAXED);
+		pthread_setspecific(ring_key, ring);
+	}
+
+	pthread_mutex_unlock(&attach_lock);
+
+	self = ring;
+	return ring;
+}
+
+static void ring_put(struct log_ring *ring, const struct log_entry *entry)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t pos = head % LOG_RING_SIZE;
+	uint32_t pad = LOG_RING_SIZE - pos;
+	struct log_entry *slot;
+
+	if (pad >= entry->size)
+		pad = 0;
+
+	if (LOG_RING_SIZE - (head - tail) < pad + entry->size) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (pad >= sizeof(*slot)) {
+		slot = (struct log_entry *) (ring->data + pos);
+		slot->site = NULL;
+		slot->size = pad;
+	}
+
+	head += pad;
+	memcpy(ring->data + head % LOG_RING_SIZE, entry, entry->size);
+	__atomic_store_n(&ring->head, head + entry->size, __ATOMIC_RELEASE);
+}
+
+/* Oldest entry, skipping padding, or NULL if the ring is empty. */
+static const struct log_entry *ring_peek(struct log_ring *ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	const struct log_entry *entry;
+	uint32_t pos, left;
+
+	while (ring->tail != head) {
+		pos = ring->tail % LOG_RING_SIZE;
+		left = LOG_RING_SIZE - pos;
+		entry = (const struct log_entry *) (ring->data + pos);
+
+		if (left >= sizeof(*entry) && entry->site)
+			return entry;
+
+		__atomic_store_n(&ring->tail, ring->tail +
+				(left < sizeof(*entry) ? left : entry->size),
+				__ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void ring_pop(struct log_ring *ring, const struct log_entry *entry)
+{
+	__atomic_store_n(&ring->tail, ring->tail + entry->size,
+							__ATOMIC_RELEASE);
+}
+
+/*
+ * Cut short to end by @limit, which leaves at least 8 bytes for every
+ * argument after it; 8 is all an empty string takes.
+ */
+static uint32_t put_string(uint8_t *buf, uint32_t off, uint32_t limit,
+					const char *str, size_t max)
+{
+	uint16_t len;
+
+	if (!str)
+		str = "(null)";
+
+	max = L_MIN(max, (size_t) limit - off - sizeof(len) - 1);
+	len = strnlen(str, max);
+
+	memcpy(buf + off, &len, sizeof(len));
+	memcpy(buf + off + sizeof(len), str, len);
+	buf[off + sizeof(len) + len] = '\0';
+
+	return align8(off + sizeof(len) + len + 1);
+}
+
+static void ell_log(const struct log_site *site, const char *text)
+{
+	l_log_with_location(site->priority, site->file, site->line, site->func,
+							"%s\n", text);
+}
+
+/**
+ * log_record:
+ * @site: call site of the message
+ *
+ * Queues a message for the log thread; only log_at() calls this.
+ */
+void log_record(struct log_site *site, ...)
+{
+	uint8_t buf[LOG_ENTRY_MAX] __attribute__((aligned(8)));
+	struct log_entry *entry = (struct log_entry *) buf;
+	struct log_ring *ring = self;
+	uint32_t off = sizeof(*entry);
+	int err = errno;
+	size_t precision = SIZE_MAX;
+	int64_t value = 0;
+	double real;
+	void *ptr;
+	unsigned int i;
+	va_list ap;
+
+	if (!ring)
+		ring = ring_attach();
+
+	entry->site = site;
+	entry->time = now_nsec();
+	entry->err = err;
+	entry->text = !ring || site_state(site) != SITE_READY;
+
+	va_start(ap, site);
+
+	if (entry->text) {
+		errno = err;
+		vsnprintf((char *) buf + off, LOG_ENTRY_MAX - off,
+							site->format, ap);
+		va_end(ap);
+
+		if (!ring) {
+			ell_log(site, (char *) buf + off);
+			return;
+		}
+
+		entry->size = align8(off + strlen((char *) buf + off) + 1);
+		ring_put(ring, entry);
+		return;
+	}
+
+	for (i = 0; i < site->nargs; i++) {
+		switch (site->args[i]) {
+		case ARG_INT:
+		case ARG_PRECISION:
+			value = va_arg(ap, int);
+			if (site->args[i] == ARG_PRECISION)
+				precision = value < 0 ? SIZE_MAX : value;
+			break;
+		case ARG_LONG:
+			value = va_arg(ap, long);
+			break;
+		case ARG_LLONG:
+			value = va_arg(ap, long long);
+			break;
+		case ARG_DOUBLE:
+			real = va_arg(ap, double);
+			memcpy(buf + off, &real, sizeof(real));
+			off += sizeof(real);
+			continue;
+		case ARG_PTR:
+			ptr = va_arg(ap, void *);
+			memcpy(buf + off, &ptr, sizeof(ptr));
+			off += 8;
+			continue;
+		case ARG_STR:
+			off = put_string(buf, off, LOG_ENTRY_MAX -
+					8 * (site->nargs - i - 1),
+					va_arg(ap, const char *), precision);
+			precision = SIZE_MAX;
+			continue;
+		}
+
+		memcpy(buf + off, &value, sizeof(value));
+		off += sizeof(value);
+	}
+
+	va_end(ap);
+
+	entry->size = off;
+	ring_put(ring, entry);
+}
+
+#define FORMAT(...) do {						\
+	if (nstars == 2)						\
+		n = snprintf(out + pos, size - pos, spec, stars[0],	\
+						stars[1], __VA_ARGS__);	\
+	else if (nstars == 1)						\
+		n = snprintf(out + pos, size - pos, spec, stars[0],	\
+							__VA_ARGS__);	\
+	else								\
+		n = snprintf(out + pos, size - pos, spec, __VA_ARGS__);	\
+} while (0)
+
+static void format_entry(const struct log_entry *entry, char *out, size_t size)
+{
+	const char *p = entry->site->format, *next;
+	const uint8_t *arg = (const uint8_t *) (entry + 1);
+	char spec[LOG_SPEC_MAX];
+	struct log_spec s;
+	unsigned int nstars;
+	int stars[2];
+	int64_t value;
+	double real;
+	void *ptr;
+	uint16_t len;
+	size_t pos = 0;
+	int n;
+
+	if (entry->text) {
+		snprintf(out, size, "%s", (const char *) arg);
+		return;
+	}
+
+	while (pos < size - 1 && (next = next_spec(p, &s))) {
+		n = L_MIN((size_t) (s.start - p), size - 1 - pos);
+		memcpy(out + pos, p, n);
+		pos += n;
+		p = next;
+
+		if (pos >= size - 1)
+			break;
+
+		if (s.conv == '%') {
+			out[pos++] = '%';
+			continue;
+		}
+
+		if (s.conv == 'm') {
+			n = snprintf(out + pos, size - pos, "%s",
+							strerror(entry->err));
+			pos = L_MIN(pos + n, size - 1);
+			continue;
+		}
+
+		memcpy(spec, s.start, s.len);
+		spec[s.len] = '\0';
+
+		nstars = 0;
+		if (s.width_star) {
+			memcpy(&value, arg, sizeof(value));
+			stars[nstars++] = value;
+			arg += 8;
+		}
+
+		if (s.precision_star) {
+			memcpy(&value, arg, sizeof(value));
+			stars[nstars++] = value;
+			arg += 8;
+		}
+
+		switch (s.arg) {
+		case ARG_INT:
+		case ARG_PRECISION:
+			memcpy(&value, arg, sizeof(value));
+			FORMAT((int) value);
+			arg += 8;
+			break;
+		case ARG_LONG:
+			memcpy(&value, arg, sizeof(value));
+			FORMAT((long) value);
+			arg += 8;
+			break;
+		case ARG_LLONG:
+			memcpy(&value, arg, sizeof(value));
+			FORMAT((long long) value);
+			arg += 8;
+			break;
+		case ARG_DOUBLE:
+			memcpy(&real, arg, sizeof(real));
+			FORMAT(real);
+			arg += 8;
+			break;
+		case ARG_PTR:
+			memcpy(&ptr, arg, sizeof(ptr));
+			FORMAT(ptr);
+			arg += 8;
+			break;
+		case ARG_STR:
+			memcpy(&len, arg, sizeof(len));
+			FORMAT((const char *) arg + sizeof(len));
+			arg += align8(sizeof(len) + len + 1);
+			break;
+		}
+
+		pos = L_MIN(pos + n, size - 1);
+	}
+
+	if (pos < size - 1)
+		pos += snprintf(out + pos, size - pos, "%s", p);
+
+	out[L_MIN(pos, size - 1)] = '\0';
+}
+
+/* Everything queued so far, oldest first across threads. */
+static void drain(void)
+{
+	char line[LOG_LINE_MAX];
+	const struct log_entry *entry, *oldest;
+	struct log_ring *ring, *from;
+	unsigned int i, n;
+	uint64_t dropped;
+
+	for (;;) {
+		n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+		oldest = NULL;
+		from = NULL;
+
+		for (i = 0; i < n; i++) {
+			entry = ring_peek(rings[i]);
+			if (entry && (!oldest || entry->time < oldest->time)) {
+				oldest = entry;
+				from = rings[i];
+			}
+		}
+
+		if (!oldest)
+			break;
+
+		format_entry(oldest, line, sizeof(line));
+		ell_log(oldest->site, line);
+		ring_pop(from, oldest);
+	}
+
+	for (i = 0; i < n; i++) {
+		ring = rings[i];
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped == ring->reported)
+			continue;
+
+		l_log_with_location(L_LOG_WARNING, __FILE__,
+					L_STRINGIFY(__LINE__), __func__,
+					"%llu log messages dropped\n",
+					(unsigned long long)
+					(dropped - ring->reported));
+		ring->reported = dropped;
+	}
+}
+
+static void *log_thread(void *user_data)
+{
+	struct timespec interval = { 0, LOG_FLUSH_MS * 1000000 };
+	bool stopping;
+
+	for (;;) {
+		/* Whatever was logged before stop was set gets drained. */
+		stopping = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+		drain();
+		if (stopping)
+			break;
+
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * log_init:
+ * @deferred: use the deferred backend rather than ELL directly
+ *
+ * Call before starting any other thread. Without @deferred, nothing
+ * changes.
+ *
+ * Returns: false if the deferred backend could not be started, in which
+ * case logging stays with ELL.
+ */
+bool log_init(bool deferred)
+{
+	int err;
+
+	if (!deferred || log_deferred)
+		return true;
+
+	err = pthread_key_create(&ring_key, ring_release);
+	if (err) {
+		log_error("failed to set up deferred logging: %s",
+							strerror(err));
+		return false;
+	}
+
+	stop = false;
+	err = pthread_create(&thread, NULL, log_thread, NULL);
+	if (err) {
+		log_error("failed to start log thread: %s", strerror(err));
+		pthread_key_delete(ring_key);
+		return false;
+	}
+
+	log_deferred = true;
+	log_info("deferred logging, level %d", LOG_LEVEL);
+
+	return true;
+}
+
+/**
+ * log_exit:
+ *
+ * Writes out everything still queued and goes back to logging through
+ * ELL directly. Call once every other thread has stopped.
+ */
+void log_exit(void)
+{
+	unsigned int i;
+
+	if (!log_deferred)
+		return;
+
+	log_deferred = false;
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	for (i = 0; i < nrings; i++) {
+		l_free(rings[i]);
+		rings[i] = NULL;
+	}
+
+	nrings = 0;
+	self = NULL;
+	pthread_key_delete(ring_key);
+}
@@ -3,25 +3,139 @@
  */
 
 #include "main.h"
+#include "session.h"
+#include "sco.h"
+#include "rt_audio.h"
+#include "journal.h"
+#include "handoff.h"
+
+static const char *record_dir;
+static char **args;
+
+/*
+ * HFP_RECORDER_RT_CPU=<cpu> reads audio on a real-time thread pinned to
+ * <cpu>, -1 for any. HFP_RECORDER_RT_PRIO sets its SCHED_FIFO priority
+ * and HFP_RECORDER_RT_MEASURE logs its timing every 10 seconds.
+ */
+static void rt_audio_setup(void)
+{
+	struct rt_audio_config config = { .cpu = -1, .priority = 50 };
+	const char *value;
+
+	value = getenv("HFP_RECORDER_RT_CPU");
+	if (!value)
+		return;
+
+	config.cpu = atoi(value);
+
+	value = getenv("HFP_RECORDER_RT_PRIO");
+	if (value)
+		config.priority = atoi(value);
+
+	config.measure = getenv("HFP_RECORDER_RT_MEASURE") != NULL;
+
+	if (!rt_audio_init(&config))
+		log_error("audio stays on the main loop");
+}
+
+/* Without a journal, call events still reach the log as text. */
+static void journal_setup(const char *record_dir)
+{
+	const char *path = getenv("HFP_RECORDER_JOURNAL");
+	char *file = NULL;
+
+	if (!path)
+		path = file = l_strdup_printf("%s/%s", record_dir,
+							DEFAULT_JOURNAL);
+
+	if (!journal_open(path))
+		log_warn("call events are logged as text");
+
+	l_free(file);
+}
+
+/*
+ * HFP_RECORDER_LOG=deferred formats log messages on a thread of their
+ * own, leaving only a copy of the arguments to the caller.
+ */
+static void log_setup(void)
+{
+	const char *value = getenv("HFP_RECORDER_LOG");
+
+	if (!value || !strcmp(value, "ell"))
+		return;
+
+	if (strcmp(value, "deferred")) {
+		log_warn("unknown log backend %s, logging through ELL", value);
+		return;
+	}
+
+	log_init(true);
+}
+
+/* Owned by the previous process until it handed over, see handoff.h. */
+static void daemon_start(bool replace)
+{
+	journal_setup(record_dir);
+	dbus_init(replace);
+	handoff_init(args);
+}
+
+static void handoff_listen(int fd)
+{
+	sco_listen(fd);
+}
+
+static void handoff_done(void)
+{
+	daemon_start(true);
+}
 
 /* TODO: implement commandline arg parser */
 int main(int argc, char *argv[])
 {
+	const char *handoff_fd = getenv(HANDOFF_FD_ENV);
+
+	args = argv;
 
 	l_log_set_syslog();
 
 	l_log_set_stderr();
 
+	log_setup();
+
 	if (!l_main_init()) {
-		l_error("Unable to create main_loop");
+		log_error("Unable to create main_loop");
+		log_exit();
 		exit(EXIT_FAILURE);
 	}
 
-	dbus_init();
+	record_dir = getenv("HFP_RECORDER_DIR");
+	if (!record_dir)
+		record_dir = DEFAULT_RECORD_DIR;
+
+	rt_audio_setup();
+
+	sco_init(record_dir,
+				getenv("HFP_RECORDER_CVSD_BYPASS") != NULL,
+				getenv("HFP_RECORDER_NO_VAD") == NULL);
+
+	if (!handoff_fd || !handoff_receive(handoff_fd, handoff_listen,
+							handoff_done)) {
+		sco_listen(-1);
+		daemon_start(false);
+	}
 
 	l_main_run();
 
 	/* cleanup after mainloop complete. */
+	handoff_cleanup();
+	session_cleanup();
+	dbus_cleanup();
+	sco_cleanup();
+	rt_audio_cleanup();
+	journal_close();
+	log_exit();
 	l_main_exit();
 
 	return 0;
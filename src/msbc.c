@@ -0,0 +1,277 @@
+/*
+ * msbc.c
+ *
+ * mSBC (HFP 1.7 Appendix A) decoder for transparent SCO. mSBC is SBC
+ * with every parameter fixed: 16 kHz, mono, 15 blocks, 8 subbands,
+ * loudness allocation, bitpool 26, so the parser needs no header fields
+ * beyond the syncword and the CRC.
+ */
+
+#include "main.h"
+#include "msbc.h"
+
+/* Loudness offsets for 8 subbands at 16 kHz. */
+static const int offset8_16k[SBC_SUBBANDS] = { -2, 0, 0, 0, 0, 0, 0, 1 };
+
+/* H2 synchronization header, second byte carries the sequence number. */
+#define H2_SYNC			0x01
+static const uint8_t h2_seq[4] = { 0x08, 0x38, 0xc8, 0xf8 };
+
+void msbc_decoder_init(struct msbc_decoder *dec)
+{
+	memset(dec, 0, sizeof(*dec));
+	sbc_synth_init(&dec->synth);
+	dec->synth_func = sbc_synth_select();
+	dec->seq = -1;
+}
+
+/* CRC-8, x^8 + x^4 + x^3 + x^2 + 1, initial value 0x0f. */
+static uint8_t sbc_crc8(const uint8_t *data, unsigned int len)
+{
+	uint8_t crc = 0x0f;
+	unsigned int i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x1d : crc << 1;
+	}
+
+	return crc;
+}
+
+/* A2DP spec 12.6.3, loudness method, one channel. */
+static void bit_allocation(const uint8_t *scale_factor, int *bits)
+{
+	int bitneed[SBC_SUBBANDS];
+	int max_bitneed = 0, bitcount = 0, slicecount = 0, bitslice;
+	int loudness, sb;
+
+	for (sb = 0; sb < SBC_SUBBANDS; sb++) {
+		if (!scale_factor[sb]) {
+			bitneed[sb] = -5;
+		} else {
+			loudness = scale_factor[sb] - offset8_16k[sb];
+			bitneed[sb] = loudness > 0 ? loudness / 2 : loudness;
+		}
+
+		if (bitneed[sb] > max_bitneed)
+			max_bitneed = bitneed[sb];
+	}
+
+	bitslice = max_bitneed + 1;
+	do {
+		bitslice--;
+		bitcount += slicecount;
+		slicecount = 0;
+
+		for (sb = 0; sb < SBC_SUBBANDS; sb++) {
+			if (bitneed[sb] > bitslice + 1 &&
+					bitneed[sb] < bitslice + 16)
+				slicecount++;
+			else if (bitneed[sb] == bitslice + 1)
+				slicecount += 2;
+		}
+	} while (bitcount + slicecount < MSBC_BITPOOL);
+
+	if (bitcount + slicecount == MSBC_BITPOOL) {
+		bitcount += slicecount;
+		bitslice--;
+	}
+
+	for (sb = 0; sb < SBC_SUBBANDS; sb++) {
+		if (bitneed[sb] < bitslice + 2)
+			bits[sb] = 0;
+		else
+			bits[sb] = L_MIN(bitneed[sb] - bitslice, 16);
+	}
+
+	for (sb = 0; bitcount < MSBC_BITPOOL && sb < SBC_SUBBANDS; sb++) {
+		if (bits[sb] >= 2 && bits[sb] < 16) {
+			bits[sb]++;
+			bitcount++;
+		} else if (bitneed[sb] == bitslice + 1 &&
+				MSBC_BITPOOL > bitcount + 1) {
+			bits[sb] = 2;
+			bitcount += 2;
+		}
+	}
+
+	for (sb = 0; bitcount < MSBC_BITPOOL && sb < SBC_SUBBANDS; sb++) {
+		if (bits[sb] < 16) {
+			bits[sb]++;
+			bitcount++;
+		}
+	}
+}
+
+/**
+ * msbc_decode_frame:
+ * @dec: decoder
+ * @frame: MSBC_FRAME_LEN bytes starting with the syncword
+ * @pcm: receives MSBC_SAMPLES 16 bit samples
+ *
+ * Returns: 0 on success, -EBADMSG if the frame is not a valid mSBC frame.
+ * @pcm is left untouched then so the caller can conceal the loss.
+ */
+int msbc_decode_frame(struct msbc_decoder *dec, const uint8_t *frame,
+			int16_t pcm[MSBC_SAMPLES])
+{
+	float sb_sample[MSBC_BLOCKS][SBC_SUBBANDS];
+	uint8_t scale_factor[SBC_SUBBANDS];
+	uint8_t crc_data[6];
+	float scale[SBC_SUBBANDS];
+	int bits[SBC_SUBBANDS];
+	float levels_inv[SBC_SUBBANDS];
+	const uint8_t *p;
+	uint32_t acc = 0;
+	int acc_bits = 0, blk, sb, q;
+
+	if (frame[0] != MSBC_SYNCWORD || frame[1] || frame[2])
+		return -EBADMSG;
+
+	for (sb = 0; sb < SBC_SUBBANDS; sb += 2) {
+		scale_factor[sb] = frame[4 + sb / 2] >> 4;
+		scale_factor[sb + 1] = frame[4 + sb / 2] & 0x0f;
+	}
+
+	/* The CRC covers the two header bytes after the syncword and the
+	 * scale factors.
+	 */
+	crc_data[0] = frame[1];
+	crc_data[1] = frame[2];
+	memcpy(crc_data + 2, frame + 4, 4);
+	if (sbc_crc8(crc_data, sizeof(crc_data)) != frame[3]) {
+		dec->crc_errors++;
+		return -EBADMSG;
+	}
+
+	bit_allocation(scale_factor, bits);
+
+	for (sb = 0; sb < SBC_SUBBANDS; sb++) {
+		scale[sb] = (float) (1 << (scale_factor[sb] + 1));
+		levels_inv[sb] = bits[sb] ? 2.0f / ((1 << bits[sb]) - 1) : 0;
+	}
+
+	p = frame + 8;
+	for (blk = 0; blk < MSBC_BLOCKS; blk++) {
+		for (sb = 0; sb < SBC_SUBBANDS; sb++) {
+			if (!bits[sb]) {
+				sb_sample[blk][sb] = 0;
+				continue;
+			}
+
+			while (acc_bits < bits[sb]) {
+				acc = acc << 8 | *p++;
+				acc_bits += 8;
+			}
+
+			acc_bits -= bits[sb];
+			q = (acc >> acc_bits) & ((1 << bits[sb]) - 1);
+
+			/* scale * ((2q + 1) / levels - 1) */
+			sb_sample[blk][sb] = scale[sb] *
+					((q + 0.5f) * levels_inv[sb] - 1.0f);
+		}
+	}
+
+	dec->synth_func(&dec->synth, sb_sample, MSBC_BLOCKS, pcm);
+	dec->frames++;
+
+	return 0;
+}
+
+static int h2_sequence(const uint8_t *p)
+{
+	int i;
+
+	if (p[0] != H2_SYNC)
+		return -1;
+
+	for (i = 0; i < 4; i++)
+		if (p[1] == h2_seq[i])
+			return i;
+
+	return -1;
+}
+
+/**
+ * msbc_decode_stream:
+ * @dec: decoder
+ * @data: bytes as read from a transparent SCO socket
+ * @len: number of bytes
+ * @func: called with every decoded frame
+ * @user_data: passed to @func
+ *
+ * Controllers deliver the 60 byte mSBC packets split or merged in
+ * arbitrary SCO packet sizes, so frames are located by their H2 header
+ * followed by the syncword. After corruption the decoder resynchronizes
+ * on the next such pair. Gaps in the H2 sequence numbers are counted
+ * as lost frames; being two bits wide they only reveal up to 3 in a row.
+ * Lost frames and frames failing the CRC are passed to @func as NULL,
+ * a repeated sequence number is taken for a duplicate and skipped.
+ */
+void msbc_decode_stream(struct msbc_decoder *dec, const uint8_t *data,
+			size_t len, msbc_pcm_func_t func, void *user_data)
+{
+	int16_t pcm[MSBC_SAMPLES];
+	unsigned int n, start, lost;
+	int seq;
+
+	while (len) {
+		n = L_MIN(len, sizeof(dec->buf) - dec->len);
+		memcpy(dec->buf + dec->len, data, n);
+		dec->len += n;
+		data += n;
+		len -= n;
+
+		start = 0;
+		while (dec->len - start >= MSBC_PACKET_LEN) {
+			seq = h2_sequence(dec->buf + start);
+			if (seq < 0 || dec->buf[start + 2] != MSBC_SYNCWORD) {
+				start++;
+				dec->sync_losses++;
+				continue;
+			}
+
+			if (seq == dec->seq) {
+				dec->duplicates++;
+				start += MSBC_PACKET_LEN;
+				continue;
+			}
+
+			lost = dec->seq >= 0 ? (seq - dec->seq - 1) & 3 : 0;
+			dec->seq = seq;
+
+			if (lost) {
+				dec->lost += lost;
+				func(NULL, lost * MSBC_SAMPLES, user_data);
+			}
+
+			if (!msbc_decode_frame(dec, dec->buf + start + 2, pcm))
+				func(pcm, MSBC_SAMPLES, user_data);
+			else
+				func(NULL, MSBC_SAMPLES, user_data);
+
+			start += MSBC_PACKET_LEN;
+		}
+
+		memmove(dec->buf, dec->buf + start, dec->len - start);
+		dec->len -= start;
+	}
+}
+
+/**
+ * msbc_decoder_gap:
+ * @dec: decoder
+ *
+ * Tells the decoder that stream bytes went missing, which the caller
+ * conceals itself. The partial frame buffered is dropped and the next
+ * sequence number is not compared with the last one.
+ */
+void msbc_decoder_gap(struct msbc_decoder *dec)
+{
+	dec->len = 0;
+	dec->seq = -1;
+}
@@ -0,0 +1,148 @@
+/*
+ * plc.c
+ */
+
+#include "main.h"
+#include "plc.h"
+
+void plc_init(struct plc *plc, unsigned int rate)
+{
+	memset(plc, 0, sizeof(*plc));
+	plc->rate = rate;
+	plc->pitch_min = rate * PLC_PITCH_MIN_MS_X10 / 10000;
+	plc->pitch_max = rate * PLC_PITCH_MAX_MS / 1000;
+	plc->window = rate / 400;
+	/* Full level for 10 ms, then down to silence over 50 ms. */
+	plc->fade = rate / 20;
+}
+
+static void history_push(struct plc *plc, const int16_t *pcm,
+						unsigned int samples)
+{
+	if (samples >= PLC_HISTORY) {
+		memcpy(plc->history, pcm + samples - PLC_HISTORY,
+						sizeof(plc->history));
+		plc->filled = PLC_HISTORY;
+		return;
+	}
+
+	memmove(plc->history, plc->history + samples,
+				(PLC_HISTORY - samples) * sizeof(int16_t));
+	memcpy(plc->history + PLC_HISTORY - samples, pcm,
+						samples * sizeof(int16_t));
+	plc->filled = L_MIN(plc->filled + samples, (unsigned int) PLC_HISTORY);
+}
+
+/*
+ * The period whose preceding samples best match the most recent window,
+ * by normalized cross-correlation.
+ */
+static unsigned int find_pitch(const struct plc *plc)
+{
+	const int16_t *end = plc->history + PLC_HISTORY;
+	const int16_t *tmpl = end - plc->window;
+	float best_score = -1.0f, score, corr, energy;
+	unsigned int p, i, best = plc->pitch_max;
+
+	for (p = plc->pitch_min; p <= plc->pitch_max; p++) {
+		const int16_t *cand = tmpl - p;
+
+		corr = 0.0f;
+		energy = 1.0f;
+		for (i = 0; i < plc->window; i++) {
+			corr += (float) tmpl[i] * cand[i];
+			energy += (float) cand[i] * cand[i];
+		}
+
+		score = corr > 0 ? corr * corr / energy : -corr * corr / energy;
+		if (score > best_score) {
+			best_score = score;
+			best = p;
+		}
+	}
+
+	return best;
+}
+
+/* One substitute sample, advancing through the repeated period. */
+static int16_t substitute(struct plc *plc)
+{
+	const int16_t *period = plc->history + PLC_HISTORY - plc->pitch;
+	unsigned int hold = plc->rate / 100;
+	int32_t sample = period[plc->pos];
+
+	if (++plc->pos == plc->pitch)
+		plc->pos = 0;
+
+	if (plc->lost > hold) {
+		if (plc->lost - hold >= plc->fade)
+			return 0;
+
+		sample = sample * (int32_t) (plc->fade - (plc->lost - hold)) /
+							(int32_t) plc->fade;
+	}
+
+	return sample;
+}
+
+/**
+ * plc_conceal:
+ * @plc: concealment state
+ * @pcm: receives @samples substitute samples
+ * @samples: length of the loss, or of this part of it
+ *
+ * Fills in for lost audio. Before enough history is there, that is
+ * silence.
+ */
+void plc_conceal(struct plc *plc, int16_t *pcm, unsigned int samples)
+{
+	unsigned int i;
+
+	if (!samples)
+		return;
+
+	plc->concealed += samples;
+
+	if (plc->filled < plc->window + plc->pitch_max) {
+		memset(pcm, 0, samples * sizeof(int16_t));
+		return;
+	}
+
+	if (!plc->concealing) {
+		plc->pitch = find_pitch(plc);
+		plc->pos = 0;
+		plc->lost = 0;
+		plc->concealing = true;
+	}
+
+	for (i = 0; i < samples; i++, plc->lost++)
+		pcm[i] = substitute(plc);
+}
+
+/**
+ * plc_good:
+ * @plc: concealment state
+ * @pcm: received samples, cross-faded in place right after a loss
+ * @samples: number of samples
+ *
+ * Feeds audio that arrived intact into the history.
+ */
+void plc_good(struct plc *plc, int16_t *pcm, unsigned int samples)
+{
+	unsigned int i, n;
+	int32_t sub;
+
+	if (plc->concealing) {
+		n = L_MIN(samples, plc->window);
+
+		for (i = 0; i < n; i++, plc->lost++) {
+			sub = substitute(plc);
+			pcm[i] = (sub * (int32_t) (n - i) +
+					pcm[i] * (int32_t) i) / (int32_t) n;
+		}
+
+		plc->concealing = false;
+	}
+
+	history_push(plc, pcm, samples);
+}
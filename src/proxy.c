@@ -0,0 +1,296 @@
+/*
+ * proxy.c
+ */
+
+#include <stddef.h>
+
+#include "main.h"
+#include "proxy.h"
+
+/* object path -> struct bluez_object */
+static struct l_hashmap *objects;
+
+struct property {
+	const char *name;
+	char type;		/* D-Bus signature, 's' and 'o' are l_strdup'ed */
+	size_t offset;		/* in struct bluez_object */
+};
+
+#define ADAPTER(field)		offsetof(struct bluez_object, adapter.field)
+#define DEVICE(field)		offsetof(struct bluez_object, device.field)
+#define TRANSPORT(field)	offsetof(struct bluez_object, transport.field)
+
+static const struct property adapter_properties[] = {
+	{ "Address",	's', ADAPTER(address) },
+	{ "Alias",	's', ADAPTER(alias) },
+	{ "Powered",	'b', ADAPTER(powered) },
+	{ }
+};
+
+static const struct property device_properties[] = {
+	{ "Address",	's', DEVICE(address) },
+	{ "Alias",	's', DEVICE(alias) },
+	{ "Adapter",	'o', DEVICE(adapter) },
+	{ "Class",	'u', DEVICE(class) },
+	{ "RSSI",	'n', DEVICE(rssi) },
+	{ "Paired",	'b', DEVICE(paired) },
+	{ "Connected",	'b', DEVICE(connected) },
+	{ }
+};
+
+static const struct property transport_properties[] = {
+	{ "Device",	'o', TRANSPORT(device) },
+	{ "State",	's', TRANSPORT(state) },
+	{ "Codec",	'y', TRANSPORT(codec) },
+	{ "Volume",	'q', TRANSPORT(volume) },
+	{ }
+};
+
+static const struct {
+	const char *name;
+	const struct property *properties;
+} interfaces[BLUEZ_IFACE_COUNT] = {
+	[BLUEZ_ADAPTER]		= { "org.bluez.Adapter1", adapter_properties },
+	[BLUEZ_DEVICE]		= { "org.bluez.Device1", device_properties },
+	[BLUEZ_TRANSPORT]	= { "org.bluez.MediaTransport1",
+						transport_properties },
+	[BLUEZ_PROFILE_MANAGER]	= { "org.bluez.ProfileManager1", NULL },
+};
+
+static enum bluez_iface iface_from_name(const char *name)
+{
+	enum bluez_iface iface;
+
+	for (iface = 0; iface < BLUEZ_IFACE_COUNT; iface++) {
+		if (!strcmp(interfaces[iface].name, name))
+			break;
+	}
+
+	return iface;
+}
+
+static bool is_string(char type)
+{
+	return type == 's' || type == 'o';
+}
+
+/* Frees the strings of @iface, the other fields are just zeroed. */
+static void properties_clear(struct bluez_object *object,
+						enum bluez_iface iface)
+{
+	const struct property *prop = interfaces[iface].properties;
+	char *base = (char *) object;
+
+	for (; prop && prop->name; prop++) {
+		if (is_string(prop->type))
+			l_free(*(char **) (base + prop->offset));
+	}
+
+	switch (iface) {
+	case BLUEZ_ADAPTER:
+		memset(&object->adapter, 0, sizeof(object->adapter));
+		break;
+	case BLUEZ_DEVICE:
+		memset(&object->device, 0, sizeof(object->device));
+		break;
+	case BLUEZ_TRANSPORT:
+		memset(&object->transport, 0, sizeof(object->transport));
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Stores one property value, from the proxy's cache when @msg is NULL,
+ * else from a PropertiesChanged update. Values of the wrong type are
+ * left alone.
+ */
+static void property_store(struct bluez_object *object,
+				const struct property *prop,
+				struct l_dbus_proxy *proxy,
+				struct l_dbus_message *msg)
+{
+	char sig[2] = { prop->type, '\0' };
+	void *field = (char *) object + prop->offset;
+	const char *str;
+	bool ok;
+
+	if (!is_string(prop->type)) {
+		if (msg)
+			l_dbus_message_get_arguments(msg, sig, field);
+		else
+			l_dbus_proxy_get_property(proxy, prop->name, sig,
+									field);
+		return;
+	}
+
+	if (msg)
+		ok = l_dbus_message_get_arguments(msg, sig, &str);
+	else
+		ok = l_dbus_proxy_get_property(proxy, prop->name, sig, &str);
+
+	if (!ok)
+		return;
+
+	l_free(*(char **) field);
+	*(char **) field = l_strdup(str);
+}
+
+static void object_free(void *data)
+{
+	struct bluez_object *object = data;
+	enum bluez_iface iface;
+
+	for (iface = 0; iface < BLUEZ_IFACE_COUNT; iface++)
+		properties_clear(object, iface);
+
+	l_free(object->path);
+	l_free(object);
+}
+
+static bool object_is_empty(struct bluez_object *object)
+{
+	enum bluez_iface iface;
+
+	for (iface = 0; iface < BLUEZ_IFACE_COUNT; iface++) {
+		if (object->proxies[iface])
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * proxy_registry_add:
+ * @proxy: proxy the org.bluez client just created
+ *
+ * Files @proxy under its object path and loads the properties of its
+ * interface. Interfaces we have no use for are not kept.
+ *
+ * Returns: the interface of @proxy, BLUEZ_IFACE_COUNT if not kept.
+ */
+enum bluez_iface proxy_registry_add(struct l_dbus_proxy *proxy)
+{
+	const char *path = l_dbus_proxy_get_path(proxy);
+	enum bluez_iface iface;
+	struct bluez_object *object;
+	const struct property *prop;
+
+	iface = iface_from_name(l_dbus_proxy_get_interface(proxy));
+	if (iface == BLUEZ_IFACE_COUNT)
+		return iface;
+
+	if (!objects)
+		objects = l_hashmap_string_new();
+
+	object = l_hashmap_lookup(objects, path);
+	if (!object) {
+		object = l_new(struct bluez_object, 1);
+		object->path = l_strdup(path);
+		l_hashmap_insert(objects, object->path, object);
+	}
+
+	properties_clear(object, iface);
+	object->proxies[iface] = proxy;
+
+	for (prop = interfaces[iface].properties; prop && prop->name; prop++)
+		property_store(object, prop, proxy, NULL);
+
+	return iface;
+}
+
+/**
+ * proxy_registry_remove:
+ * @proxy: proxy the org.bluez client is about to free
+ *
+ * Forgets @proxy, and its object once no interface of it is left.
+ */
+void proxy_registry_remove(struct l_dbus_proxy *proxy)
+{
+	const char *path = l_dbus_proxy_get_path(proxy);
+	struct bluez_object *object;
+	enum bluez_iface iface;
+
+	object = objects ? l_hashmap_lookup(objects, path) : NULL;
+	if (!object)
+		return;
+
+	iface = iface_from_name(l_dbus_proxy_get_interface(proxy));
+	if (iface == BLUEZ_IFACE_COUNT || object->proxies[iface] != proxy)
+		return;
+
+	object->proxies[iface] = NULL;
+	properties_clear(object, iface);
+
+	if (object_is_empty(object)) {
+		l_hashmap_remove(objects, path);
+		object_free(object);
+	}
+}
+
+/**
+ * proxy_registry_update:
+ * @proxy: proxy whose property changed
+ * @name: property name
+ * @msg: new value, as handed to the client's property handler
+ *
+ * Applies one PropertiesChanged update to the cached copy.
+ */
+void proxy_registry_update(struct l_dbus_proxy *proxy, const char *name,
+						struct l_dbus_message *msg)
+{
+	struct bluez_object *object;
+	const struct property *prop;
+	enum bluez_iface iface;
+
+	object = objects ? l_hashmap_lookup(objects,
+					l_dbus_proxy_get_path(proxy)) : NULL;
+	if (!object)
+		return;
+
+	iface = iface_from_name(l_dbus_proxy_get_interface(proxy));
+	if (iface == BLUEZ_IFACE_COUNT)
+		return;
+
+	for (prop = interfaces[iface].properties; prop && prop->name; prop++) {
+		if (!strcmp(prop->name, name)) {
+			property_store(object, prop, proxy, msg);
+			break;
+		}
+	}
+}
+
+/* BlueZ went away, its proxies go with it. */
+void proxy_registry_clear(void)
+{
+	l_hashmap_destroy(objects, object_free);
+	objects = NULL;
+}
+
+struct l_dbus_proxy *proxy_lookup(const char *path, enum bluez_iface iface)
+{
+	struct bluez_object *object;
+
+	if (!objects || !path || iface >= BLUEZ_IFACE_COUNT)
+		return NULL;
+
+	object = l_hashmap_lookup(objects, path);
+
+	return object ? object->proxies[iface] : NULL;
+}
+
+/* Device1 properties of @path, NULL if BlueZ did not report the device. */
+const struct bluez_device *proxy_get_device(const char *path)
+{
+	struct bluez_object *object;
+
+	if (!objects || !path)
+		return NULL;
+
+	object = l_hashmap_lookup(objects, path);
+	if (!object || !object->proxies[BLUEZ_DEVICE])
+		return NULL;
+
+	return &object->device;
+}
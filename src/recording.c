@@ -0,0 +1,619 @@
+/*
+ * recording.c
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "main.h"
+#include "recording.h"
+#include "storage.h"
+
+_Static_assert(REC_CHUNK_SIZE <= STORAGE_BUFFER_SIZE,
+			"a chunk must fit a storage buffer");
+
+#define REC_ALIGN(X)		(((X) + 7) & ~(size_t) 7)
+#define CHUNK_PAYLOAD		(REC_CHUNK_SIZE - sizeof(struct rec_chunk_header))
+
+struct rec_writer {
+	struct storage *storage;
+	struct storage_file *file;
+	uint64_t start;
+
+	/* Storage buffer being filled, handed over once full. */
+	uint8_t *chunk;
+	size_t used;
+	uint32_t seq;
+	uint64_t offset;
+
+	uint16_t call;
+	uint8_t codec;
+	uint64_t last_timestamp;
+
+	struct rec_index_entry *index;
+	unsigned int entries;
+	unsigned int index_size;
+};
+
+/**
+ * rec_writer_new:
+ * @storage: storage the chunk buffers come from
+ * @file: file to write, owned by the caller
+ * @address: bluetooth address of the AG
+ * @start_monotonic: l_time_now() that record timestamps are relative to
+ *
+ * Returns: writer, or NULL if the file header could not be queued.
+ */
+struct rec_writer *rec_writer_new(struct storage *storage,
+					struct storage_file *file,
+					const char *address,
+					uint64_t start_monotonic)
+{
+	struct rec_file_header *header;
+	struct rec_writer *writer;
+	struct timeval tv;
+
+	header = l_new(struct rec_file_header, 1);
+	memcpy(header->magic, REC_MAGIC, sizeof(REC_MAGIC));
+	header->version = htole32(REC_VERSION);
+	header->chunk_size = htole32(REC_CHUNK_SIZE);
+	gettimeofday(&tv, NULL);
+	header->start_realtime = htole64((uint64_t) tv.tv_sec * 1000000 +
+								tv.tv_usec);
+	strncpy(header->address, address, sizeof(header->address) - 1);
+
+	if (storage_write(file, header, sizeof(*header), 0,
+						STORAGE_WRITE_FREE) < 0)
+		return NULL;
+
+	writer = l_new(struct rec_writer, 1);
+	writer->storage = storage;
+	writer->file = file;
+	writer->start = start_monotonic;
+	writer->offset = REC_HEADER_SIZE;
+
+	return writer;
+}
+
+static int chunk_open(struct rec_writer *writer, uint64_t timestamp)
+{
+	struct rec_chunk_header *hdr;
+
+	writer->chunk = storage_buffer_get(writer->storage);
+	if (!writer->chunk)
+		return -ENOBUFS;
+
+	hdr = (void *) writer->chunk;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = htole32(REC_CHUNK_MAGIC);
+	hdr->timestamp = htole64(timestamp);
+	hdr->seq = htole32(writer->seq);
+	hdr->call = htole16(writer->call);
+	hdr->codec = writer->codec;
+
+	writer->used = 0;
+	return 0;
+}
+
+/* Chunks are written straight from the buffer they were built in. */
+static int chunk_flush(struct rec_writer *writer)
+{
+	struct rec_chunk_header *hdr = (void *) writer->chunk;
+	struct rec_index_entry *entry;
+	int err;
+
+	if (!writer->chunk)
+		return 0;
+
+	hdr->used = htole32(writer->used);
+	memset(writer->chunk + sizeof(*hdr) + writer->used, 0,
+					CHUNK_PAYLOAD - writer->used);
+
+	if (writer->entries == writer->index_size) {
+		writer->index_size = writer->index_size ?
+					writer->index_size * 2 : 256;
+		writer->index = l_realloc(writer->index, writer->index_size *
+						sizeof(*writer->index));
+	}
+
+	entry = &writer->index[writer->entries];
+	memset(entry, 0, sizeof(*entry));
+	entry->timestamp = hdr->timestamp;
+	entry->offset = htole64(writer->offset);
+	entry->codec = hdr->codec;
+	entry->call = hdr->call;
+
+	/* Chunk boundaries are where the recording is made durable. */
+	err = storage_write(writer->file, writer->chunk, REC_CHUNK_SIZE,
+					writer->offset, STORAGE_WRITE_SYNC);
+	writer->chunk = NULL;
+	if (err < 0)
+		return err;
+
+	writer->entries++;
+	writer->offset += REC_CHUNK_SIZE;
+	writer->seq++;
+
+	return 0;
+}
+
+/**
+ * rec_write:
+ * @writer: recording
+ * @type: record type
+ * @codec: payload format for REC_AUDIO, REC_CODEC_NONE otherwise
+ * @timestamp: l_time_now() when the data was captured
+ * @data: payload
+ * @len: payload length, at most REC_RECORD_MAX
+ *
+ * Returns: 0, or a negative errno if the record was dropped, e.g.
+ * -ENOBUFS while storage is behind.
+ */
+int rec_write(struct rec_writer *writer, enum rec_type type,
+		enum rec_codec codec, uint64_t timestamp,
+		const void *data, size_t len)
+{
+	struct rec_record *rec;
+	size_t size = sizeof(*rec) + REC_ALIGN(len);
+	int err;
+
+	if (len > REC_RECORD_MAX)
+		return -EMSGSIZE;
+
+	timestamp = timestamp > writer->start ? timestamp - writer->start : 0;
+
+	if (type == REC_AUDIO || type == REC_SILENCE)
+		writer->codec = codec;
+
+	if (writer->chunk && writer->used + size > CHUNK_PAYLOAD) {
+		err = chunk_flush(writer);
+		if (err < 0)
+			return err;
+	}
+
+	if (!writer->chunk) {
+		err = chunk_open(writer, timestamp);
+		if (err < 0)
+			return err;
+	}
+
+	rec = (void *) (writer->chunk + sizeof(struct rec_chunk_header) +
+							writer->used);
+	memset(rec, 0, size);
+	rec->type = type;
+	rec->codec = codec;
+	rec->len = htole16(len);
+	rec->timestamp = htole64(timestamp);
+	memcpy(rec + 1, data, len);
+
+	writer->used += size;
+	writer->last_timestamp = timestamp;
+
+	/* Each caller id starts a new call for the index. */
+	if (type == REC_CALLER_ID)
+		writer->call++;
+
+	return 0;
+}
+
+/**
+ * rec_writer_finish:
+ * @writer: recording, freed by this call
+ *
+ * Queues the last chunk, the index and the footer. The storage file
+ * stays open.
+ *
+ * Returns: 0 or a negative errno.
+ */
+int rec_writer_finish(struct rec_writer *writer)
+{
+	struct rec_footer *footer;
+	size_t index_len;
+	uint8_t *tail;
+	int err;
+
+	err = chunk_flush(writer);
+	if (err < 0)
+		goto done;
+
+	/* Index and footer go out together, as one allocation. */
+	index_len = writer->entries * sizeof(*writer->index);
+	tail = l_malloc(index_len + sizeof(*footer));
+	if (index_len)
+		memcpy(tail, writer->index, index_len);
+
+	footer = (void *) (tail + index_len);
+	memset(footer, 0, sizeof(*footer));
+	footer->index_offset = htole64(writer->offset);
+	footer->duration = htole64(writer->last_timestamp);
+	footer->entries = htole32(writer->entries);
+	footer->entry_size = htole32(sizeof(struct rec_index_entry));
+	memcpy(footer->magic, REC_FOOTER_MAGIC, sizeof(REC_FOOTER_MAGIC));
+
+	err = storage_write(writer->file, tail, index_len + sizeof(*footer),
+				writer->offset,
+				STORAGE_WRITE_FREE | STORAGE_WRITE_SYNC);
+
+done:
+	l_free(writer->index);
+	l_free(writer);
+
+	return err;
+}
+
+/**
+ * rec_writer_suspend:
+ * @writer: recording, freed by this call
+ * @resume: filled with where the recording goes on
+ *
+ * Queues the last chunk like rec_writer_finish(), but leaves the index
+ * and footer to whoever resumes the recording with @resume.
+ *
+ * Returns: 0 or a negative errno.
+ */
+int rec_writer_suspend(struct rec_writer *writer, struct rec_resume *resume)
+{
+	int err = chunk_flush(writer);
+
+	memset(resume, 0, sizeof(*resume));
+	resume->offset = writer->offset;
+	resume->last_timestamp = writer->last_timestamp;
+	resume->seq = writer->seq;
+	resume->call = writer->call;
+	resume->codec = writer->codec;
+
+	l_free(writer->index);
+	l_free(writer);
+
+	return err;
+}
+
+/**
+ * rec_writer_resume:
+ * @storage: storage the chunk buffers come from
+ * @file: file to write, owned by the caller
+ * @fd: the same file, to read back the chunks written so far
+ * @start_monotonic: what the recording was started with
+ * @resume: from rec_writer_suspend(), once its writes completed
+ *
+ * Goes on with a recording another writer suspended, in this process
+ * or another one. The index is rebuilt from the chunk headers on disk.
+ *
+ * Returns: writer, or NULL if the chunks written so far do not check out.
+ */
+struct rec_writer *rec_writer_resume(struct storage *storage,
+					struct storage_file *file, int fd,
+					uint64_t start_monotonic,
+					const struct rec_resume *resume)
+{
+	struct rec_chunk_header hdr;
+	struct rec_index_entry *entry;
+	struct rec_writer *writer;
+	uint64_t offset;
+
+	if (resume->offset < REC_HEADER_SIZE ||
+			(resume->offset - REC_HEADER_SIZE) % REC_CHUNK_SIZE)
+		return NULL;
+
+	writer = l_new(struct rec_writer, 1);
+	writer->storage = storage;
+	writer->file = file;
+	writer->start = start_monotonic;
+	writer->offset = resume->offset;
+	writer->last_timestamp = resume->last_timestamp;
+	writer->seq = resume->seq;
+	writer->call = resume->call;
+	writer->codec = resume->codec;
+
+	writer->entries = (resume->offset - REC_HEADER_SIZE) / REC_CHUNK_SIZE;
+	writer->index_size = L_MAX(writer->entries * 2, 256u);
+	writer->index = l_new(struct rec_index_entry, writer->index_size);
+
+	for (offset = REC_HEADER_SIZE, entry = writer->index;
+			offset < resume->offset;
+			offset += REC_CHUNK_SIZE, entry++) {
+		if (pread(fd, &hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+				le32toh(hdr.magic) != REC_CHUNK_MAGIC) {
+			l_free(writer->index);
+			l_free(writer);
+			return NULL;
+		}
+
+		entry->timestamp = hdr.timestamp;
+		entry->offset = htole64(offset);
+		entry->codec = hdr.codec;
+		entry->call = hdr.call;
+	}
+
+	return writer;
+}
+
+struct rec_reader {
+	const uint8_t *map;
+	size_t size;
+	const struct rec_index_entry *index;
+	unsigned int entries;
+	/* Set when the footer is missing and the index had to be rebuilt. */
+	struct rec_index_entry *rebuilt;
+	uint64_t duration;
+};
+
+static const struct rec_chunk_header *chunk_at(struct rec_reader *reader,
+							unsigned int chunk)
+{
+	const struct rec_chunk_header *hdr;
+	uint64_t offset;
+
+	if (chunk >= reader->entries)
+		return NULL;
+
+	offset = le64toh(reader->index[chunk].offset);
+	if (offset + REC_CHUNK_SIZE > reader->size)
+		return NULL;
+
+	hdr = (const void *) (reader->map + offset);
+	if (le32toh(hdr->magic) != REC_CHUNK_MAGIC ||
+			le32toh(hdr->used) > CHUNK_PAYLOAD)
+		return NULL;
+
+	return hdr;
+}
+
+static bool reader_load_index(struct rec_reader *reader)
+{
+	const struct rec_footer *footer;
+	uint64_t offset, entries;
+
+	if (reader->size < REC_HEADER_SIZE + sizeof(*footer))
+		return false;
+
+	footer = (const void *) (reader->map + reader->size - sizeof(*footer));
+	if (memcmp(footer->magic, REC_FOOTER_MAGIC, sizeof(REC_FOOTER_MAGIC)) ||
+			le32toh(footer->entry_size) !=
+					sizeof(struct rec_index_entry))
+		return false;
+
+	offset = le64toh(footer->index_offset);
+	entries = le32toh(footer->entries);
+	if (offset + entries * sizeof(struct rec_index_entry) >
+				reader->size - sizeof(*footer))
+		return false;
+
+	reader->index = (const void *) (reader->map + offset);
+	reader->entries = entries;
+	reader->duration = le64toh(footer->duration);
+
+	return true;
+}
+
+/*
+ * A recording cut short by a crash has no footer. Chunks sit at fixed
+ * offsets though, so the index is rebuilt from the chunk headers alone.
+ */
+static void reader_rebuild_index(struct rec_reader *reader)
+{
+	const struct rec_chunk_header *hdr;
+	const struct rec_record *rec;
+	struct rec_cursor cursor;
+	unsigned int count, i;
+	uint64_t offset;
+
+	count = (reader->size - REC_HEADER_SIZE) / REC_CHUNK_SIZE;
+	reader->rebuilt = l_new(struct rec_index_entry, count ? count : 1);
+
+	for (i = 0; i < count; i++) {
+		offset = REC_HEADER_SIZE + (uint64_t) i * REC_CHUNK_SIZE;
+		hdr = (const void *) (reader->map + offset);
+		if (le32toh(hdr->magic) != REC_CHUNK_MAGIC)
+			break;
+
+		reader->rebuilt[i].timestamp = hdr->timestamp;
+		reader->rebuilt[i].offset = htole64(offset);
+		reader->rebuilt[i].codec = hdr->codec;
+		reader->rebuilt[i].call = hdr->call;
+	}
+
+	reader->index = reader->rebuilt;
+	reader->entries = i;
+
+	if (!i)
+		return;
+
+	/* Duration is the last record of the last complete chunk. */
+	rec_cursor_init(&cursor, i - 1);
+	while ((rec = rec_cursor_next(reader, &cursor, NULL)))
+		reader->duration = le64toh(rec->timestamp);
+}
+
+struct rec_reader *rec_reader_open(const char *path)
+{
+	struct rec_reader *reader;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < REC_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (memcmp(map, REC_MAGIC, sizeof(REC_MAGIC))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	reader = l_new(struct rec_reader, 1);
+	reader->map = map;
+	reader->size = st.st_size;
+
+	if (!reader_load_index(reader))
+		reader_rebuild_index(reader);
+
+	return reader;
+}
+
+void rec_reader_close(struct rec_reader *reader)
+{
+	if (!reader)
+		return;
+
+	munmap((void *) reader->map, reader->size);
+	l_free(reader->rebuilt);
+	l_free(reader);
+}
+
+const struct rec_file_header *rec_reader_header(struct rec_reader *reader)
+{
+	return (const void *) reader->map;
+}
+
+uint64_t rec_reader_duration(struct rec_reader *reader)
+{
+	return reader->duration;
+}
+
+unsigned int rec_reader_chunks(struct rec_reader *reader)
+{
+	return reader->entries;
+}
+
+/**
+ * rec_reader_seek:
+ * @reader: recording
+ * @timestamp: usec since the start of the recording
+ *
+ * Binary search over the index, no chunk is touched.
+ *
+ * Returns: the chunk holding @timestamp, for rec_cursor_init, or -ENOENT
+ * for an empty recording.
+ */
+int rec_reader_seek(struct rec_reader *reader, uint64_t timestamp)
+{
+	unsigned int lo = 0, hi = reader->entries, mid;
+
+	if (!reader->entries)
+		return -ENOENT;
+
+	/* Last chunk starting at or before timestamp. */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (le64toh(reader->index[mid].timestamp) <= timestamp)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void rec_cursor_init(struct rec_cursor *cursor, unsigned int chunk)
+{
+	cursor->chunk = chunk;
+	cursor->pos = 0;
+}
+
+/**
+ * rec_cursor_next:
+ * @reader: recording
+ * @cursor: position, advanced past the returned record
+ * @payload: if not NULL, set to the record payload
+ *
+ * Returns: the next record, or NULL at the end of the recording. Record
+ * fields are little endian.
+ */
+const struct rec_record *rec_cursor_next(struct rec_reader *reader,
+					struct rec_cursor *cursor,
+					const void **payload)
+{
+	const struct rec_chunk_header *hdr;
+	const struct rec_record *rec;
+	size_t used, size;
+
+	while ((hdr = chunk_at(reader, cursor->chunk))) {
+		used = le32toh(hdr->used);
+
+		if (cursor->pos + sizeof(*rec) <= used) {
+			rec = (const void *) ((const uint8_t *) (hdr + 1) +
+							cursor->pos);
+			size = sizeof(*rec) + REC_ALIGN(le16toh(rec->len));
+			if (cursor->pos + size > used)
+				return NULL;
+
+			cursor->pos += size;
+			if (payload)
+				*payload = rec + 1;
+
+			return rec;
+		}
+
+		cursor->chunk++;
+		cursor->pos = 0;
+	}
+
+	return NULL;
+}
+
+/**
+ * rec_record_samples:
+ * @rec: record, as returned by rec_cursor_next
+ * @payload: its payload
+ *
+ * Returns: the number of samples of audio @rec covers, silence included,
+ * 0 for records that are not audio.
+ */
+unsigned int rec_record_samples(const struct rec_record *rec,
+					const void *payload)
+{
+	const struct rec_silence *silence = payload;
+	const struct rec_encoded *encoded = payload;
+
+	switch (rec->type) {
+	case REC_AUDIO:
+		if (rec->codec == REC_CODEC_PCM_8K ||
+					rec->codec == REC_CODEC_PCM_16K)
+			return le16toh(rec->len) / sizeof(int16_t);
+
+		if (le16toh(rec->len) < sizeof(*encoded))
+			return 0;
+
+		return le32toh(encoded->samples);
+	case REC_SILENCE:
+		if (le16toh(rec->len) < sizeof(*silence))
+			return 0;
+
+		return le32toh(silence->samples);
+	}
+
+	return 0;
+}
+
+/* Returns: the sample rate of audio stored as @codec, 0 if unknown. */
+unsigned int rec_codec_rate(enum rec_codec codec)
+{
+	switch (codec) {
+	case REC_CODEC_PCM_8K:
+	case REC_CODEC_ADPCM_8K:
+	case REC_CODEC_OPUS_8K:
+		return 8000;
+	case REC_CODEC_PCM_16K:
+	case REC_CODEC_ADPCM_16K:
+	case REC_CODEC_OPUS_16K:
+		return 16000;
+	case REC_CODEC_NONE:
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * ringbuf.c
+ */
+
+#include <sys/uio.h>
+
+#include "main.h"
+#include "ringbuf.h"
+
+void ringbuf_init(struct ringbuf *ring)
+{
+	ring->in = 0;
+	ring->out = 0;
+}
+
+unsigned int ringbuf_len(const struct ringbuf *ring)
+{
+	return ring->in - ring->out;
+}
+
+unsigned int ringbuf_avail(const struct ringbuf *ring)
+{
+	return RINGBUF_SIZE - ringbuf_len(ring);
+}
+
+/* @pos is a free running position, not an offset into buf. */
+char ringbuf_at(const struct ringbuf *ring, unsigned int pos)
+{
+	return ring->buf[RINGBUF_MASK(pos)];
+}
+
+void ringbuf_drain(struct ringbuf *ring, unsigned int count)
+{
+	if (count > ringbuf_len(ring))
+		count = ringbuf_len(ring);
+
+	ring->out += count;
+}
+
+/* Copies in as much of @data as fits, returns how much that was. */
+unsigned int ringbuf_write(struct ringbuf *ring, const void *data,
+							unsigned int len)
+{
+	unsigned int i;
+
+	len = L_MIN(len, ringbuf_avail(ring));
+
+	for (i = 0; i < len; i++)
+		ring->buf[RINGBUF_MASK(ring->in + i)] = ((const char *) data)[i];
+
+	ring->in += len;
+	return len;
+}
+
+/**
+ * ringbuf_read_fd:
+ * @ring: ring to fill
+ * @fd: file descriptor to read from
+ *
+ * Reads as much as fits into the free space of the ring with a single
+ * readv, so a wrap around the end of buf costs no extra syscall.
+ *
+ * Returns: bytes read, 0 on EOF or when the ring is full, -1 on error
+ * with errno set.
+ */
+ssize_t ringbuf_read_fd(struct ringbuf *ring, int fd)
+{
+	struct iovec iov[2];
+	unsigned int avail = ringbuf_avail(ring);
+	unsigned int start = RINGBUF_MASK(ring->in);
+	unsigned int first;
+	int iovcnt = 1;
+	ssize_t bytes_read;
+
+	if (!avail)
+		return 0;
+
+	first = RINGBUF_SIZE - start;
+	if (first > avail)
+		first = avail;
+
+	iov[0].iov_base = ring->buf + start;
+	iov[0].iov_len = first;
+
+	if (avail > first) {
+		iov[1].iov_base = ring->buf;
+		iov[1].iov_len = avail - first;
+		iovcnt = 2;
+	}
+
+	bytes_read = readv(fd, iov, iovcnt);
+	if (bytes_read > 0)
+		ring->in += bytes_read;
+
+	return bytes_read;
+}
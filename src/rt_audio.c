@@ -0,0 +1,438 @@
+/*
+ * rt_audio.c
+ *
+ * The thread sleeps in epoll_wait on every stream plus a control
+ * eventfd. Stream slots are owned by the main loop: it fills a slot
+ * before adding its fd to the epoll set, and only reuses it after a
+ * barrier, once the thread finished the batch of events that might
+ * still point at it. The thread itself never allocates, logs or takes
+ * a lock.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "main.h"
+#include "rt_audio.h"
+
+/* Touched at thread start so the stack never faults on the audio path. */
+#define RT_STACK_SIZE		(256 * 1024)
+#define RT_STACK_PREFAULT	(64 * 1024)
+
+#define RT_REPORT_MS		10000
+/* Wakeups a stream needs before its cadence is trusted. */
+#define RT_CADENCE_WARMUP	8
+
+struct rt_stream {
+	int fd;			/* -1 if the slot is free */
+	rt_audio_read_func_t func;
+	void *user_data;
+	bool stopped;		/* func asked to stop, thread only */
+
+	/* Measurement, thread only. */
+	uint64_t last_wake;
+	uint64_t period;	/* usec << 3, moving average */
+	unsigned int wakeups;
+};
+
+static struct rt_audio_config rt_config;
+static struct rt_stream streams[RT_AUDIO_STREAMS];
+static struct rt_audio_stats rt_stats;
+
+static pthread_t rt_thread;
+static bool rt_running;
+static bool rt_stop;
+static int rt_epoll = -1;
+static int rt_control = -1;
+static sem_t rt_barrier;
+static struct l_timeout *report_timeout;
+
+static uint64_t rt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void rt_count(uint64_t *hist, uint64_t *max, uint64_t usec)
+{
+	unsigned int bucket = 63 - __builtin_clzll(usec | 1);
+
+	if (bucket >= RT_AUDIO_BUCKETS)
+		bucket = RT_AUDIO_BUCKETS - 1;
+
+	__atomic_fetch_add(&hist[bucket], 1, __ATOMIC_RELAXED);
+	if (usec > __atomic_load_n(max, __ATOMIC_RELAXED))
+		__atomic_store_n(max, usec, __ATOMIC_RELAXED);
+}
+
+/* Deviation of this wakeup from the cadence the stream settled on. */
+static void rt_measure_wakeup(struct rt_stream *stream, uint64_t now)
+{
+	uint64_t interval = now - stream->last_wake;
+	uint64_t period = stream->period >> 3;
+
+	__atomic_fetch_add(&rt_stats.wakeups, 1, __ATOMIC_RELAXED);
+
+	if (stream->wakeups++ == 0) {
+		stream->last_wake = now;
+		return;
+	}
+
+	stream->last_wake = now;
+	stream->period = stream->period ?
+			stream->period - period + interval : interval << 3;
+
+	if (stream->wakeups > RT_CADENCE_WARMUP)
+		rt_count(rt_stats.jitter, &rt_stats.jitter_max,
+				interval > period ? interval - period :
+							period - interval);
+}
+
+static void rt_stream_stop(struct rt_stream *stream)
+{
+	epoll_ctl(rt_epoll, EPOLL_CTL_DEL, stream->fd, NULL);
+	stream->stopped = true;
+}
+
+static void rt_stream_event(struct rt_stream *stream, uint32_t events,
+								uint64_t wake)
+{
+	uint64_t start;
+
+	if (stream->stopped)
+		return;
+
+	if (rt_config.measure)
+		rt_measure_wakeup(stream, wake);
+
+	start = rt_config.measure ? rt_now() : 0;
+
+	if ((events & EPOLLIN) && !stream->func(stream->fd, stream->user_data))
+		rt_stream_stop(stream);
+
+	/*
+	 * Level triggered, a hangup would wake the thread over and over
+	 * until the main loop got to remove the stream.
+	 */
+	if (!stream->stopped && (events & (EPOLLHUP | EPOLLERR)))
+		rt_stream_stop(stream);
+
+	if (rt_config.measure)
+		rt_count(rt_stats.process, &rt_stats.process_max,
+							rt_now() - start);
+}
+
+static void rt_prefault_stack(void)
+{
+	volatile char stack[RT_STACK_PREFAULT];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static void *rt_thread_main(void *user_data)
+{
+	struct epoll_event events[RT_AUDIO_STREAMS + 1];
+	bool barrier;
+	uint64_t val, wake;
+	int n, i;
+
+	rt_prefault_stack();
+
+	while (!__atomic_load_n(&rt_stop, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(rt_epoll, events, L_ARRAY_SIZE(events), -1);
+		if (n < 0)
+			continue;
+
+		wake = rt_config.measure ? rt_now() : 0;
+		barrier = false;
+
+		for (i = 0; i < n; i++) {
+			if (!events[i].data.ptr) {
+				barrier = read(rt_control, &val,
+							sizeof(val)) > 0;
+				continue;
+			}
+
+			rt_stream_event(events[i].data.ptr, events[i].events,
+									wake);
+		}
+
+		/* Nothing from this batch is touched after this point. */
+		if (barrier)
+			sem_post(&rt_barrier);
+	}
+
+	return NULL;
+}
+
+/* Returns once the thread is done with every event it had fetched. */
+static void rt_sync(void)
+{
+	uint64_t val = 1;
+
+	if (write(rt_control, &val, sizeof(val)) < 0) {
+		log_error("failed to signal audio thread: %s", strerror(errno));
+		return;
+	}
+
+	while (sem_wait(&rt_barrier) < 0 && errno == EINTR)
+		;
+}
+
+static void rt_thread_setup(const struct rt_audio_config *config)
+{
+	struct sched_param param = { .sched_priority = config->priority };
+	cpu_set_t cpus;
+	int err;
+
+	if (config->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+
+		err = pthread_setaffinity_np(rt_thread, sizeof(cpus), &cpus);
+		if (err)
+			log_warn("failed to pin audio thread to CPU %d: %s",
+						config->cpu, strerror(err));
+	}
+
+	err = pthread_setschedparam(rt_thread, SCHED_FIFO, &param);
+	if (err)
+		log_warn("no SCHED_FIFO for audio thread: %s", strerror(err));
+}
+
+static void report_callback(struct l_timeout *timeout, void *user_data)
+{
+	rt_audio_report();
+	l_timeout_modify_ms(timeout, RT_REPORT_MS);
+}
+
+/**
+ * rt_audio_init:
+ * @config: thread placement and priority
+ *
+ * Locks all current and future memory and starts the audio thread.
+ * Missing privileges for memory locking, SCHED_FIFO or CPU pinning only
+ * cost the guarantees, the thread still runs.
+ *
+ * Returns: false if the thread could not be started.
+ */
+bool rt_audio_init(const struct rt_audio_config *config)
+{
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	pthread_attr_t attr;
+	unsigned int i;
+	int err;
+
+	if (rt_running)
+		return true;
+
+	rt_config = *config;
+
+	for (i = 0; i < RT_AUDIO_STREAMS; i++)
+		streams[i].fd = -1;
+
+	/* Also prefaults every page mapped from now on. */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		log_warn("failed to lock memory: %s", strerror(errno));
+
+	rt_epoll = epoll_create1(EPOLL_CLOEXEC);
+	rt_control = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rt_epoll < 0 || rt_control < 0 ||
+			epoll_ctl(rt_epoll, EPOLL_CTL_ADD, rt_control,
+							&event) < 0) {
+		log_error("failed to set up audio thread: %s", strerror(errno));
+		goto failed;
+	}
+
+	sem_init(&rt_barrier, 0, 0);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+	err = pthread_create(&rt_thread, &attr, rt_thread_main, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		log_error("failed to start audio thread: %s", strerror(err));
+		sem_destroy(&rt_barrier);
+		goto failed;
+	}
+
+	rt_thread_setup(config);
+	rt_running = true;
+
+	if (config->measure)
+		report_timeout = l_timeout_create_ms(RT_REPORT_MS,
+						report_callback, NULL, NULL);
+
+	log_info("real-time audio thread, CPU %d, priority %d%s", config->cpu,
+			config->priority,
+			config->measure ? ", measuring" : "");
+
+	return true;
+
+failed:
+	if (rt_control >= 0)
+		close(rt_control);
+	if (rt_epoll >= 0)
+		close(rt_epoll);
+
+	rt_control = -1;
+	rt_epoll = -1;
+	return false;
+}
+
+/* Streams must all be removed by now. */
+void rt_audio_cleanup(void)
+{
+	if (!rt_running)
+		return;
+
+	l_timeout_remove(report_timeout);
+	report_timeout = NULL;
+
+	__atomic_store_n(&rt_stop, true, __ATOMIC_RELEASE);
+	rt_sync();
+	pthread_join(rt_thread, NULL);
+
+	if (rt_config.measure)
+		rt_audio_report();
+
+	sem_destroy(&rt_barrier);
+	close(rt_control);
+	close(rt_epoll);
+	rt_control = -1;
+	rt_epoll = -1;
+	rt_running = false;
+	rt_stop = false;
+}
+
+bool rt_audio_running(void)
+{
+	return rt_running;
+}
+
+/**
+ * rt_audio_add:
+ * @fd: socket to read from
+ * @func: called on the audio thread whenever @fd is readable
+ * @user_data: passed to @func
+ *
+ * Returns: false if the thread is not running or has no free slot.
+ */
+bool rt_audio_add(int fd, rt_audio_read_func_t func, void *user_data)
+{
+	struct epoll_event event = { .events = EPOLLIN };
+	struct rt_stream *stream = NULL;
+	unsigned int i;
+
+	if (!rt_running)
+		return false;
+
+	for (i = 0; i < RT_AUDIO_STREAMS && !stream; i++) {
+		if (streams[i].fd < 0)
+			stream = &streams[i];
+	}
+
+	if (!stream) {
+		log_warn("no audio thread slot left for fd %d", fd);
+		return false;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	stream->fd = fd;
+	stream->func = func;
+	stream->user_data = user_data;
+
+	/* The syscall orders the slot setup before the thread sees it. */
+	event.data.ptr = stream;
+	if (epoll_ctl(rt_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+		log_error("failed to add fd %d to audio thread: %s", fd,
+							strerror(errno));
+		stream->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * rt_audio_remove:
+ * @fd: socket passed to rt_audio_add()
+ *
+ * Stops reading @fd. Once this returns the read function is not running
+ * and will not be called again, so its data may be freed.
+ */
+void rt_audio_remove(int fd)
+{
+	unsigned int i;
+
+	if (!rt_running || fd < 0)
+		return;
+
+	for (i = 0; i < RT_AUDIO_STREAMS; i++) {
+		if (streams[i].fd != fd)
+			continue;
+
+		/* ENOENT if the read function already stopped it. */
+		epoll_ctl(rt_epoll, EPOLL_CTL_DEL, fd, NULL);
+		rt_sync();
+		streams[i].fd = -1;
+		return;
+	}
+}
+
+void rt_audio_get_stats(struct rt_audio_stats *stats)
+{
+	uint64_t *dst = (uint64_t *) stats;
+	const uint64_t *src = (const uint64_t *) &rt_stats;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Upper bound of the bucket holding the 99th percentile. */
+static uint64_t rt_p99(const uint64_t *hist, uint64_t max)
+{
+	uint64_t total = 0, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < RT_AUDIO_BUCKETS; i++)
+		total += hist[i];
+
+	for (i = 0; i < RT_AUDIO_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * 99)
+			break;
+	}
+
+	return total ? L_MIN(2ull << i, max) : 0;
+}
+
+void rt_audio_report(void)
+{
+	struct rt_audio_stats stats;
+	uint64_t jitter, process;
+
+	rt_audio_get_stats(&stats);
+	jitter = rt_p99(stats.jitter, stats.jitter_max);
+	process = rt_p99(stats.process, stats.process_max);
+
+	log_info("audio thread: %llu wakeups, jitter p99 %llu us max %llu us, "
+			"read p99 %llu us max %llu us",
+			(unsigned long long) stats.wakeups,
+			(unsigned long long) jitter,
+			(unsigned long long) stats.jitter_max,
+			(unsigned long long) process,
+			(unsigned long long) stats.process_max);
+}
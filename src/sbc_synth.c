@@ -0,0 +1,333 @@
+/*
+ * sbc_synth.c
+ *
+ * SBC synthesis filterbank for 8 subbands (A2DP spec 12.6.4), which is
+ * where an mSBC decoder spends most of its time. Per block it computes
+ *
+ *   V[k]  = sum(i = 0..7) N[k][i] * S[i],  k = 0..15
+ *   X[j]  = sum(m = 0..4) V[32m + j]      * D[16m + j]
+ *                       + V[32m + 24 + j] * D[16m + 8 + j],  j = 0..7
+ *
+ * Both are runs of 8 contiguous multiply-adds, so every implementation
+ * shares the same table layout and only differs in vector width.
+ */
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "main.h"
+#include "sbc_synth.h"
+
+/*
+ * First half of the 80 tap prototype filter, C[0..40] in the spec's
+ * sign convention. The other half mirrors it.
+ */
+static const float proto_8_half[41] = {
+	 0.00000000E+00f,  1.56575398E-04f,  3.43256425E-04f,  5.54620202E-04f,
+	 8.23919506E-04f,  1.13992507E-03f,  1.47640169E-03f,  1.78371725E-03f,
+	 2.01182542E-03f,  2.10371989E-03f,  1.99454554E-03f,  1.61656283E-03f,
+	 9.02154502E-04f, -1.78805361E-04f, -1.64973098E-03f, -3.49717454E-03f,
+	 5.65949473E-03f,  8.02941163E-03f,  1.04584443E-02f,  1.27472335E-02f,
+	 1.46525263E-02f,  1.59045603E-02f,  1.62208471E-02f,  1.53184106E-02f,
+	 1.29371806E-02f,  8.85757540E-03f,  2.92408442E-03f, -4.91578024E-03f,
+	-1.46404076E-02f, -2.61098752E-02f, -3.90751381E-02f, -5.31873032E-02f,
+	 6.79989431E-02f,  8.29847578E-02f,  9.75753918E-02f,  1.11196689E-01f,
+	 1.23264548E-01f,  1.33264415E-01f,  1.40753505E-01f,  1.45389847E-01f,
+	 1.46955068E-01f,
+};
+
+/* D[i] = -8 * C[i], the synthesis window. */
+static float window_d[80] __attribute__((aligned(32)));
+/* N transposed, matrix_n[i][k] = cos((i + 0.5)(k + 4)pi/8). */
+static float matrix_n[SBC_SUBBANDS][16] __attribute__((aligned(32)));
+static bool tables_ready;
+
+static void tables_init(void)
+{
+	int i, k, mirror;
+	float c;
+
+	for (i = 0; i < 80; i++) {
+		mirror = i <= 40 ? i : 80 - i;
+		c = proto_8_half[mirror];
+
+		/* The spec negates taps 16..31 and 48..63; undo that before
+		 * mirroring and reapply it for the mirrored position.
+		 */
+		if (mirror >= 16 && mirror < 32)
+			c = -c;
+		if ((i >= 16 && i < 32) || (i >= 48 && i < 64))
+			c = -c;
+
+		window_d[i] = -8.0f * c;
+	}
+
+	for (i = 0; i < SBC_SUBBANDS; i++)
+		for (k = 0; k < 16; k++)
+			matrix_n[i][k] = cos((i + 0.5) * (k + 4) * M_PI / 8);
+
+	tables_ready = true;
+}
+
+void sbc_synth_init(struct sbc_synth *synth)
+{
+	if (!tables_ready)
+		tables_init();
+
+	memset(synth->v, 0, sizeof(synth->v));
+	synth->offset = 0;
+}
+
+/* Makes room for one block and returns where its 16 values go. */
+static float *synth_shift(struct sbc_synth *synth)
+{
+	synth->offset = synth->offset ? synth->offset - 16 : SBC_SYNTH_V - 16;
+
+	return synth->v + synth->offset;
+}
+
+/* Keeps the mirror copy in sync after the 16 new values are written. */
+static void synth_mirror(struct sbc_synth *synth)
+{
+	memcpy(synth->v + synth->offset + SBC_SYNTH_V,
+			synth->v + synth->offset, 16 * sizeof(float));
+}
+
+static int16_t clip16(float x)
+{
+	long val = lrintf(x);
+
+	if (val > INT16_MAX)
+		return INT16_MAX;
+	if (val < INT16_MIN)
+		return INT16_MIN;
+
+	return val;
+}
+
+void sbc_synth_scalar(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm)
+{
+	unsigned int blk;
+	const float *v;
+	float *out, x;
+	int i, j, k, m;
+
+	for (blk = 0; blk < blocks; blk++) {
+		out = synth_shift(synth);
+
+		for (k = 0; k < 16; k++) {
+			x = 0;
+			for (i = 0; i < SBC_SUBBANDS; i++)
+				x += matrix_n[i][k] * sb[blk][i];
+			out[k] = x;
+		}
+
+		synth_mirror(synth);
+		v = synth->v + synth->offset;
+
+		for (j = 0; j < 8; j++) {
+			x = 0;
+			for (m = 0; m < 5; m++) {
+				x += v[32 * m + j] * window_d[16 * m + j];
+				x += v[32 * m + 24 + j] * window_d[16 * m + 8 + j];
+			}
+			*pcm++ = clip16(x);
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+static void sbc_synth_sse2(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm)
+{
+	unsigned int blk;
+	const float *v;
+	__m128 s, a0, a1, a2, a3, x0, x1;
+	float *out;
+	int i, m;
+
+	for (blk = 0; blk < blocks; blk++) {
+		out = synth_shift(synth);
+
+		a0 = a1 = a2 = a3 = _mm_setzero_ps();
+		for (i = 0; i < SBC_SUBBANDS; i++) {
+			s = _mm_set1_ps(sb[blk][i]);
+			a0 = _mm_add_ps(a0, _mm_mul_ps(s, _mm_load_ps(matrix_n[i])));
+			a1 = _mm_add_ps(a1, _mm_mul_ps(s, _mm_load_ps(matrix_n[i] + 4)));
+			a2 = _mm_add_ps(a2, _mm_mul_ps(s, _mm_load_ps(matrix_n[i] + 8)));
+			a3 = _mm_add_ps(a3, _mm_mul_ps(s, _mm_load_ps(matrix_n[i] + 12)));
+		}
+		/* The state may live in malloc'ed memory, so v is accessed
+		 * unaligned; the constant tables are aligned.
+		 */
+		_mm_storeu_ps(out, a0);
+		_mm_storeu_ps(out + 4, a1);
+		_mm_storeu_ps(out + 8, a2);
+		_mm_storeu_ps(out + 12, a3);
+
+		synth_mirror(synth);
+		v = synth->v + synth->offset;
+
+		x0 = x1 = _mm_setzero_ps();
+		for (m = 0; m < 5; m++) {
+			const float *va = v + 32 * m, *vb = va + 24;
+			const float *da = window_d + 16 * m, *db = da + 8;
+
+			x0 = _mm_add_ps(x0, _mm_mul_ps(_mm_loadu_ps(va), _mm_load_ps(da)));
+			x1 = _mm_add_ps(x1, _mm_mul_ps(_mm_loadu_ps(va + 4), _mm_load_ps(da + 4)));
+			x0 = _mm_add_ps(x0, _mm_mul_ps(_mm_loadu_ps(vb), _mm_load_ps(db)));
+			x1 = _mm_add_ps(x1, _mm_mul_ps(_mm_loadu_ps(vb + 4), _mm_load_ps(db + 4)));
+		}
+
+		/* cvtps rounds to nearest, packs saturates to int16. */
+		_mm_storeu_si128((__m128i *) pcm,
+				_mm_packs_epi32(_mm_cvtps_epi32(x0),
+						_mm_cvtps_epi32(x1)));
+		pcm += 8;
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void sbc_synth_avx2(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm)
+{
+	unsigned int blk;
+	const float *v;
+	__m256 s, a0, a1, x;
+	__m256i q;
+	float *out;
+	int i, m;
+
+	for (blk = 0; blk < blocks; blk++) {
+		out = synth_shift(synth);
+
+		a0 = a1 = _mm256_setzero_ps();
+		for (i = 0; i < SBC_SUBBANDS; i++) {
+			s = _mm256_set1_ps(sb[blk][i]);
+			a0 = _mm256_fmadd_ps(s, _mm256_load_ps(matrix_n[i]), a0);
+			a1 = _mm256_fmadd_ps(s, _mm256_load_ps(matrix_n[i] + 8), a1);
+		}
+		_mm256_storeu_ps(out, a0);
+		_mm256_storeu_ps(out + 8, a1);
+
+		synth_mirror(synth);
+		v = synth->v + synth->offset;
+
+		x = _mm256_setzero_ps();
+		for (m = 0; m < 5; m++) {
+			x = _mm256_fmadd_ps(_mm256_loadu_ps(v + 32 * m),
+					_mm256_load_ps(window_d + 16 * m), x);
+			x = _mm256_fmadd_ps(_mm256_loadu_ps(v + 32 * m + 24),
+					_mm256_load_ps(window_d + 16 * m + 8), x);
+		}
+
+		q = _mm256_cvtps_epi32(x);
+		_mm_storeu_si128((__m128i *) pcm,
+				_mm_packs_epi32(_mm256_castsi256_si128(q),
+						_mm256_extracti128_si256(q, 1)));
+		pcm += 8;
+	}
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static void sbc_synth_neon(struct sbc_synth *synth,
+			const float (*sb)[SBC_SUBBANDS], unsigned int blocks,
+			int16_t *pcm)
+{
+	unsigned int blk;
+	const float *v;
+	float32x4_t a0, a1, a2, a3, x0, x1;
+	float *out, s;
+	int i, m;
+
+	for (blk = 0; blk < blocks; blk++) {
+		out = synth_shift(synth);
+
+		a0 = a1 = a2 = a3 = vdupq_n_f32(0);
+		for (i = 0; i < SBC_SUBBANDS; i++) {
+			s = sb[blk][i];
+			a0 = vfmaq_n_f32(a0, vld1q_f32(matrix_n[i]), s);
+			a1 = vfmaq_n_f32(a1, vld1q_f32(matrix_n[i] + 4), s);
+			a2 = vfmaq_n_f32(a2, vld1q_f32(matrix_n[i] + 8), s);
+			a3 = vfmaq_n_f32(a3, vld1q_f32(matrix_n[i] + 12), s);
+		}
+		vst1q_f32(out, a0);
+		vst1q_f32(out + 4, a1);
+		vst1q_f32(out + 8, a2);
+		vst1q_f32(out + 12, a3);
+
+		synth_mirror(synth);
+		v = synth->v + synth->offset;
+
+		x0 = x1 = vdupq_n_f32(0);
+		for (m = 0; m < 5; m++) {
+			const float *va = v + 32 * m, *vb = va + 24;
+			const float *da = window_d + 16 * m, *db = da + 8;
+
+			x0 = vfmaq_f32(x0, vld1q_f32(va), vld1q_f32(da));
+			x1 = vfmaq_f32(x1, vld1q_f32(va + 4), vld1q_f32(da + 4));
+			x0 = vfmaq_f32(x0, vld1q_f32(vb), vld1q_f32(db));
+			x1 = vfmaq_f32(x1, vld1q_f32(vb + 4), vld1q_f32(db + 4));
+		}
+
+		vst1q_s16(pcm, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(x0)),
+					vqmovn_s32(vcvtnq_s32_f32(x1))));
+		pcm += 8;
+	}
+}
+#endif
+
+/**
+ * sbc_synth_select:
+ *
+ * Picks the widest implementation the CPU we run on supports. x86 builds
+ * always have SSE2 and check for AVX2 at runtime; aarch64 always has
+ * NEON.
+ *
+ * Returns: synthesis function, never NULL.
+ */
+sbc_synth_func_t sbc_synth_select(void)
+{
+	if (getenv("HFP_RECORDER_NO_SIMD"))
+		return sbc_synth_scalar;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return sbc_synth_avx2;
+
+	return sbc_synth_sse2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	return sbc_synth_neon;
+#else
+	return sbc_synth_scalar;
+#endif
+}
+
+const char *sbc_synth_name(sbc_synth_func_t func)
+{
+#ifdef HAVE_X86_SIMD
+	if (func == sbc_synth_avx2)
+		return "avx2";
+	if (func == sbc_synth_sse2)
+		return "sse2";
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+	if (func == sbc_synth_neon)
+		return "neon";
+#endif
+	return "scalar";
+}
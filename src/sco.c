@@ -0,0 +1,1490 @@
+/*
+ * sco.c
+ *
+ * We play HF role, so audio connections are always set up by the AG and
+ * we only accept them. Each accepted SCO link is bound to the RFCOMM
+ * session of the same device. Frames are read on the main loop into a
+ * preallocated lock-free ring, and a single writer thread drains every
+ * ring to storage, so a stalling disk can only ever fill rings, never
+ * block AT or D-Bus handling.
+ *
+ * Call state changes reported over AT travel through the same ring as
+ * metadata frames, so the writer stores them in order with the audio.
+ *
+ * With the real-time audio thread running, SCO sockets are read there
+ * instead of on the main loop. The capture ring then has that thread as
+ * its producer, so metadata is queued on a small ring of its own and
+ * moved over by the audio thread before each read.
+ *
+ * The writer itself never blocks on disk either: recordings are built
+ * in storage buffers that go to an asynchronous backend, and their
+ * completions wake the writer through the same eventfd as new frames.
+ *
+ * Frames carry the kernel's receive timestamp. The writer puts them on
+ * the link's timeline through a jitter buffer, drops duplicates and
+ * conceals what went missing, so a recording stays as long as the call
+ * and lossy links do not leave holes in it.
+ *
+ * Before decoded audio is stored, voice activity detection picks out
+ * the silence, which goes to the recording as its length only.
+ *
+ * With HFP_RECORDER_ENCODER set, speech is compressed on a worker pool.
+ * Every record of such a capture then takes the way through the pool,
+ * so it stays in order with the audio, and the recording is finished
+ * once its last job came back, after the socket is long gone.
+ *
+ * A capture handed over to a new process, see handoff.h, stops being
+ * read at once and the new process reads on from there. Its recording
+ * is suspended rather than finished once the writer has stored all it
+ * had, and the new process goes on with the same file from the chunk
+ * after, so a call stays one recording across the handoff.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "main.h"
+#include "bluetooth.h"
+#include "audio_ring.h"
+#include "rt_audio.h"
+#include "jitter.h"
+#include "plc.h"
+#include "vad.h"
+#include "encoder.h"
+#include "encode_pool.h"
+#include "msbc.h"
+#include "cvsd.h"
+#include "recording.h"
+#include "storage.h"
+#include "session.h"
+#include "sco.h"
+#include "stats.h"
+
+/* 256 frames is ~1.9 s of mSBC or CVSD at 7.5 ms per packet. */
+#define CAPTURE_RING_FRAMES	256
+/* Wake the writer once this many frames are queued ... */
+#define WRITER_BATCH_FRAMES	16
+/* ... or at least this often. */
+#define WRITER_FLUSH_MS		100
+/* Metadata queued while the audio thread owns the capture ring. */
+#define META_RING_FRAMES	16
+/* Decoded samples buffered by the writer before they go to disk. */
+#define WRITER_PCM_SAMPLES	(8 * MSBC_SAMPLES)
+/* Longest silence record, so the index keeps up during hold time. */
+#define WRITER_SILENCE_MS	10000
+/* One VAD block at the highest rate, the pre-roll before speech. */
+#define WRITER_HELD_SAMPLES	(16000 * VAD_BLOCK_MS / 1000)
+
+/* What the socket delivers, decided by codec and air mode. */
+enum sco_format {
+	SCO_FORMAT_PCM,		/* controller transcoded CVSD, s16le 8 kHz */
+	SCO_FORMAT_MSBC,	/* transparent, H2 framed mSBC */
+	SCO_FORMAT_CVSD,	/* transparent, raw CVSD bits */
+};
+
+struct sco_capture {
+	/* Main loop only. */
+	struct hfp_session *session;
+	struct l_io *io;
+	uint16_t mtu;
+	uint64_t frames;
+	enum hfp_codec codec;
+	enum sco_format format;
+	bool rt;			/* read on the audio thread */
+	bool waiting;			/* adopted, recording not resumed yet */
+	/* Set by the reader, reported by the main loop once it stopped. */
+	int read_error;
+
+	/* Producer is the main loop, or the audio thread if rt. */
+	struct audio_ring ring;
+	/* Main loop to audio thread, only used if rt. */
+	struct audio_ring meta;
+
+	/* Shared with the writer thread. */
+	int file_fd;
+	char address[18];
+	uint64_t start;
+	struct storage_file *file;
+	bool closed;
+	uint64_t write_errors;
+	uint64_t concealed;		/* frames */
+	uint64_t duplicates;
+	int64_t silence_saved;		/* bytes */
+	/* Handed over: suspend the recording for the new process. */
+	bool handoff;
+	char *handoff_path;		/* the session's */
+	/* Adopted: go on with the recording from here. */
+	bool resuming;
+	struct rec_resume resume;
+
+	/* Writer thread only. */
+	struct sco_capture *next;
+	struct rec_writer *rec;
+	struct encode_stream *enc;
+	bool finishing;			/* closed, waiting for the encoder */
+	/* Transparent links are decoded to PCM before storing. */
+	struct msbc_decoder *msbc;
+	struct cvsd_decoder *cvsd;
+	cvsd_decode_func_t cvsd_decode;
+	struct jitter_buffer jb;
+	struct plc plc;
+	struct vad vad;
+	int16_t pcm[WRITER_PCM_SAMPLES];
+	unsigned int pcm_len;
+	uint64_t pcm_timestamp;
+	uint64_t frame_timestamp;
+	uint32_t silence;		/* samples not stored yet */
+	uint64_t silence_timestamp;
+	/* The last silent block, kept as speech if speech follows it. */
+	int16_t held[WRITER_HELD_SAMPLES];
+	unsigned int held_len;
+	uint64_t held_timestamp;
+};
+
+static struct l_io *listen_io;
+static char *record_dir;
+static bool cvsd_bypass;
+static bool vad_enabled;
+
+static pthread_t writer;
+static bool writer_running;
+static bool writer_stop;
+static int writer_event = -1;
+/* Owned by the writer thread, only stats are read elsewhere. */
+static struct storage *storage;
+static struct encode_pool *encoders;
+/* Captures handed over to the writer, pushed lock-free by the main loop. */
+static struct sco_capture *writer_pending;
+
+/* Recordings suspended for a new process, writer thread until joined. */
+struct sco_suspended {
+	char *path;
+	struct rec_resume resume;
+	struct sco_suspended *next;
+};
+
+static struct sco_suspended *suspended;
+
+static void writer_wakeup(void)
+{
+	uint64_t val = 1;
+
+	if (write(writer_event, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		log_error("failed to wake SCO writer: %s", strerror(errno));
+}
+
+static void writer_store(enum rec_type type, enum rec_codec codec,
+				uint64_t timestamp, const void *data,
+				size_t len, void *user_data)
+{
+	struct sco_capture *capture = user_data;
+
+	if (capture->rec && rec_write(capture->rec, type, codec, timestamp,
+							data, len) < 0)
+		__atomic_add_fetch(&capture->write_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void writer_record(struct sco_capture *capture, enum rec_type type,
+				enum rec_codec codec, uint64_t timestamp,
+				const void *data, size_t len)
+{
+	if (!capture->enc) {
+		writer_store(type, codec, timestamp, data, len, capture);
+		return;
+	}
+
+	if (!encode_stream_record(capture->enc, type, codec, timestamp,
+								data, len))
+		__atomic_add_fetch(&capture->write_errors, 1, __ATOMIC_RELAXED);
+}
+
+/* What the writer stores, decoded audio. */
+static enum rec_codec writer_codec(struct sco_capture *capture)
+{
+	return capture->format == SCO_FORMAT_MSBC ?
+				REC_CODEC_PCM_16K : REC_CODEC_PCM_8K;
+}
+
+static uint64_t writer_pcm_time(struct sco_capture *capture,
+							unsigned int pos)
+{
+	return capture->pcm_timestamp +
+			(uint64_t) pos * 1000000 / capture->vad.rate;
+}
+
+static void writer_silence_flush(struct sco_capture *capture)
+{
+	struct rec_silence silence = {
+		.samples = capture->silence,
+		.level = vad_level(&capture->vad),
+	};
+
+	if (!capture->silence)
+		return;
+
+	writer_record(capture, REC_SILENCE, writer_codec(capture),
+				capture->silence_timestamp, &silence,
+				sizeof(silence));
+	__atomic_fetch_add(&capture->silence_saved,
+			(int64_t) capture->silence * 2 -
+			(int64_t) (sizeof(struct rec_record) + sizeof(silence)),
+			__ATOMIC_RELAXED);
+	capture->silence = 0;
+}
+
+static void writer_samples(struct sco_capture *capture, uint64_t timestamp,
+				const int16_t *pcm, unsigned int samples)
+{
+	if (!samples)
+		return;
+
+	if (capture->enc) {
+		encode_stream_audio(capture->enc, timestamp, pcm, samples);
+		return;
+	}
+
+	writer_record(capture, REC_AUDIO, writer_codec(capture), timestamp,
+							pcm, samples * 2);
+}
+
+static void writer_pcm_store(struct sco_capture *capture, unsigned int pos,
+							unsigned int samples)
+{
+	writer_samples(capture, writer_pcm_time(capture, pos),
+					capture->pcm + pos, samples);
+}
+
+/* Speech starts after the held block, which may hold its onset. */
+static void writer_held_store(struct sco_capture *capture)
+{
+	writer_samples(capture, capture->held_timestamp, capture->held,
+							capture->held_len);
+	capture->held_len = 0;
+}
+
+/* No speech followed the held block, it joins the silence. */
+static void writer_held_silence(struct sco_capture *capture)
+{
+	if (!capture->held_len)
+		return;
+
+	if (!capture->silence)
+		capture->silence_timestamp = capture->held_timestamp;
+
+	capture->silence += capture->held_len;
+	capture->held_len = 0;
+
+	if (capture->silence >= capture->vad.rate / 1000 * WRITER_SILENCE_MS)
+		writer_silence_flush(capture);
+}
+
+static void writer_held_set(struct sco_capture *capture, unsigned int pos,
+							unsigned int samples)
+{
+	memcpy(capture->held, capture->pcm + pos, samples * 2);
+	capture->held_len = samples;
+	capture->held_timestamp = writer_pcm_time(capture, pos);
+}
+
+/* Stores the buffered samples, what the VAD finds silent as its length. */
+static void writer_pcm_flush(struct sco_capture *capture)
+{
+	unsigned int pos, n, speech = 0;
+
+	if (!capture->pcm_len)
+		return;
+
+	if (!vad_enabled) {
+		writer_pcm_store(capture, 0, capture->pcm_len);
+		capture->pcm_len = 0;
+		return;
+	}
+
+	for (pos = 0; pos < capture->pcm_len; pos += n) {
+		n = L_MIN(capture->vad.block, capture->pcm_len - pos);
+
+		if (vad_process(&capture->vad, capture->pcm + pos, n)) {
+			writer_silence_flush(capture);
+			writer_held_store(capture);
+			continue;
+		}
+
+		/* Speech up to here goes out before the silence. */
+		writer_pcm_store(capture, speech, pos - speech);
+		speech = pos + n;
+
+		writer_held_silence(capture);
+		writer_held_set(capture, pos, n);
+	}
+
+	writer_pcm_store(capture, speech, capture->pcm_len - speech);
+	capture->pcm_len = 0;
+}
+
+/* Buffers decoded samples, or concealment for them if @pcm is NULL. */
+static void writer_pcm(struct sco_capture *capture, const int16_t *pcm,
+							unsigned int samples)
+{
+	unsigned int n;
+	int16_t *dst;
+
+	/* Keep a frame's samples in one record when they fit. */
+	if (capture->pcm_len + samples > WRITER_PCM_SAMPLES)
+		writer_pcm_flush(capture);
+
+	while (samples) {
+		if (capture->pcm_len == WRITER_PCM_SAMPLES)
+			writer_pcm_flush(capture);
+
+		if (!capture->pcm_len)
+			capture->pcm_timestamp = capture->frame_timestamp;
+
+		n = L_MIN(samples, WRITER_PCM_SAMPLES - capture->pcm_len);
+		dst = capture->pcm + capture->pcm_len;
+
+		if (pcm) {
+			memcpy(dst, pcm, n * 2);
+			plc_good(&capture->plc, dst, n);
+			pcm += n;
+		} else {
+			plc_conceal(&capture->plc, dst, n);
+		}
+
+		capture->pcm_len += n;
+		samples -= n;
+	}
+}
+
+static void writer_count_concealed(struct sco_capture *capture,
+							uint64_t frames)
+{
+	__atomic_fetch_add(&capture->concealed, frames, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats_total.sco_concealed, frames,
+							__ATOMIC_RELAXED);
+}
+
+static void writer_count_duplicates(struct sco_capture *capture,
+							uint64_t frames)
+{
+	__atomic_fetch_add(&capture->duplicates, frames, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats_total.sco_duplicates, frames,
+							__ATOMIC_RELAXED);
+}
+
+/* Losses inside the stream, found by H2 sequence numbers and CRC. */
+static void writer_msbc_pcm(const int16_t *pcm, unsigned int samples,
+							void *user_data)
+{
+	struct sco_capture *capture = user_data;
+
+	if (!pcm)
+		writer_count_concealed(capture, samples / MSBC_SAMPLES);
+
+	writer_pcm(capture, pcm, samples);
+}
+
+/* Samples covered by @bytes of the link. */
+static unsigned int writer_link_samples(struct sco_capture *capture,
+							size_t bytes)
+{
+	switch (capture->format) {
+	case SCO_FORMAT_PCM:
+		return bytes / 2;
+	case SCO_FORMAT_MSBC:
+		/* Packets need not be whole mSBC frames. */
+		return (bytes + MSBC_PACKET_LEN / 2) / MSBC_PACKET_LEN *
+							MSBC_SAMPLES;
+	case SCO_FORMAT_CVSD:
+		/* One bit per 64 kHz sample, decimated by 8. */
+		return bytes * 8 / CVSD_DECIMATION;
+	}
+
+	return 0;
+}
+
+static void writer_audio(struct sco_capture *capture,
+					struct audio_frame *frame)
+{
+	int16_t pcm[AUDIO_FRAME_MAX];
+	uint64_t duplicates;
+	long gap;
+	size_t samples;
+
+	gap = jitter_buffer_put(&capture->jb, frame->timestamp, frame->len);
+	if (gap < 0) {
+		writer_count_duplicates(capture, 1);
+		return;
+	}
+
+	if (gap) {
+		capture->frame_timestamp = frame->timestamp -
+				(uint64_t) gap * 1000000 / capture->jb.rate;
+		writer_count_concealed(capture, gap / frame->len);
+		writer_pcm(capture, NULL, writer_link_samples(capture, gap));
+
+		/* Whatever frame the hole cut into is gone too. */
+		if (capture->msbc)
+			msbc_decoder_gap(capture->msbc);
+	}
+
+	capture->frame_timestamp = frame->timestamp;
+
+	switch (capture->format) {
+	case SCO_FORMAT_PCM:
+		/* frame->data is not aligned for s16. */
+		memcpy(pcm, frame->data, frame->len & ~1);
+		writer_pcm(capture, pcm, frame->len / 2);
+		break;
+	case SCO_FORMAT_MSBC:
+		duplicates = capture->msbc->duplicates;
+		msbc_decode_stream(capture->msbc, frame->data, frame->len,
+						writer_msbc_pcm, capture);
+		writer_count_duplicates(capture,
+				capture->msbc->duplicates - duplicates);
+		break;
+	case SCO_FORMAT_CVSD:
+		samples = capture->cvsd_decode(capture->cvsd, frame->data,
+							frame->len, pcm);
+		writer_pcm(capture, pcm, samples);
+		break;
+	}
+}
+
+static void writer_drain(struct sco_capture *capture)
+{
+	struct audio_frame *frame;
+
+	if (capture->enc)
+		encode_stream_reap(capture->enc);
+
+	while ((frame = audio_ring_peek(&capture->ring, 0))) {
+		/* Encoder behind, the ring holds the rest meanwhile. */
+		if (capture->enc && encode_stream_room(capture->enc) <
+						ENCODE_STREAM_JOBS / 2)
+			break;
+
+		if (frame->type) {
+			/* Keep audio before the event ahead of it. */
+			writer_pcm_flush(capture);
+			writer_held_silence(capture);
+			writer_silence_flush(capture);
+			writer_record(capture, frame->type, REC_CODEC_NONE,
+					frame->timestamp, frame->data,
+					frame->len);
+		} else {
+			writer_audio(capture, frame);
+		}
+
+		audio_ring_release(&capture->ring, 1);
+	}
+
+	writer_pcm_flush(capture);
+}
+
+/* Closes the recording with how the link did over the call. */
+static void writer_link_report(struct sco_capture *capture)
+{
+	struct rec_link_quality quality = {
+		.frames = capture->jb.frames,
+		.concealed = __atomic_load_n(&capture->concealed,
+							__ATOMIC_RELAXED),
+		.duplicates = __atomic_load_n(&capture->duplicates,
+							__ATOMIC_RELAXED),
+		.jitter = capture->jb.jitter >> 4,
+		.resyncs = capture->jb.resyncs,
+	};
+
+	log_info("call recording %s: %llu frames, %llu concealed (%.1f%%), "
+			"%llu duplicates, jitter %u us", capture->address,
+			(unsigned long long) quality.frames,
+			(unsigned long long) quality.concealed,
+			quality.frames ? 100.0 * quality.concealed /
+				(quality.frames + quality.concealed) : 0.0,
+			(unsigned long long) quality.duplicates,
+			quality.jitter);
+
+	writer_record(capture, REC_LINK_QUALITY, REC_CODEC_NONE,
+				l_time_now(), &quality, sizeof(quality));
+}
+
+static void writer_vad_report(struct sco_capture *capture)
+{
+	struct vad *vad = &capture->vad;
+	int64_t saved = __atomic_load_n(&capture->silence_saved,
+							__ATOMIC_RELAXED);
+
+	if (!vad_enabled || !vad->blocks)
+		return;
+
+	log_info("call recording %s: %.1f%% silence, %lld bytes saved%s",
+			capture->address, 100.0 * vad->silent / vad->blocks,
+			(long long) saved,
+			vad->over_budget ? ", VAD over CPU budget" : "");
+	__atomic_fetch_add(&stats_total.vad_saved, saved, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called on every pass once the capture is closed. Returns true when
+ * everything it had is with the recording.
+ */
+static bool writer_finish(struct sco_capture *capture)
+{
+	if (audio_ring_peek(&capture->ring, 0))
+		return false;
+
+	if (!capture->finishing) {
+		writer_held_silence(capture);
+		writer_silence_flush(capture);
+
+		/* Handed over, the call goes on being recorded. */
+		if (!capture->handoff) {
+			writer_vad_report(capture);
+			writer_link_report(capture);
+		}
+
+		capture->finishing = true;
+	}
+
+	if (!capture->enc)
+		return true;
+
+	encode_stream_reap(capture->enc);
+	return encode_stream_idle(capture->enc);
+}
+
+/* Leaves the recording for the process it was handed over to. */
+static void capture_suspend(struct sco_capture *capture)
+{
+	struct sco_suspended *entry = l_new(struct sco_suspended, 1);
+
+	if (rec_writer_suspend(capture->rec, &entry->resume) < 0) {
+		log_error("failed to suspend recording of %s",
+							capture->address);
+		l_free(entry);
+		return;
+	}
+
+	entry->path = capture->handoff_path;
+	capture->handoff_path = NULL;
+	entry->next = suspended;
+	suspended = entry;
+}
+
+static void capture_free(struct sco_capture *capture)
+{
+	encode_stream_free(capture->enc);
+
+	if (capture->rec && capture->handoff)
+		capture_suspend(capture);
+	else if (capture->rec && rec_writer_finish(capture->rec) < 0)
+		log_error("failed to finish recording index");
+
+	if (capture->file)
+		storage_file_close(capture->file);
+	else if (capture->file_fd >= 0)
+		close(capture->file_fd);
+
+	audio_ring_free(&capture->ring);
+	audio_ring_free(&capture->meta);
+	l_free(capture->handoff_path);
+	l_free(capture->msbc);
+	l_free(capture->cvsd);
+	l_free(capture);
+}
+
+/* Storage belongs to the writer thread, so recordings start here. */
+static void writer_adopt(struct sco_capture *capture)
+{
+	struct storage_file *file;
+
+	if (capture->file_fd < 0)
+		return;
+
+	file = storage_file_open(storage, capture->file_fd);
+
+	if (capture->resuming) {
+		capture->rec = rec_writer_resume(storage, file,
+						capture->file_fd,
+						capture->start,
+						&capture->resume);
+		if (!capture->rec)
+			log_error("failed to resume recording of %s",
+							capture->address);
+	} else {
+		capture->rec = rec_writer_new(storage, file, capture->address,
+							capture->start);
+		if (!capture->rec)
+			log_error("failed to write recording header");
+	}
+
+	if (capture->rec && encoders)
+		capture->enc = encode_stream_new(encoders, capture->vad.rate,
+							writer_store, capture);
+
+	__atomic_store_n(&capture->file, file, __ATOMIC_RELEASE);
+}
+
+static void *writer_thread(void *user_data)
+{
+	struct sco_capture *captures = NULL, *capture, **prev;
+	struct pollfd pfd = { .fd = writer_event, .events = POLLIN };
+	uint64_t val;
+	bool stop;
+
+	do {
+		stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+
+		/*
+		 * The counter value is irrelevant, every pass drains all.
+		 * Stopping, the encoders may still have to be waited for.
+		 */
+		if ((!stop || captures) &&
+				poll(&pfd, 1, WRITER_FLUSH_MS) > 0 &&
+				read(writer_event, &val, sizeof(val)) < 0)
+			continue;
+
+		/* Completions first, they return the buffers drains need. */
+		storage_reap(storage);
+
+		/* Adopt captures started since the last pass. */
+		capture = __atomic_exchange_n(&writer_pending, NULL,
+							__ATOMIC_ACQUIRE);
+		while (capture) {
+			struct sco_capture *next = capture->next;
+
+			writer_adopt(capture);
+			capture->next = captures;
+			captures = capture;
+			capture = next;
+		}
+
+		prev = &captures;
+		while ((capture = *prev)) {
+			bool closed = __atomic_load_n(&capture->closed,
+							__ATOMIC_ACQUIRE);
+
+			writer_drain(capture);
+
+			if ((closed || stop) && writer_finish(capture)) {
+				*prev = capture->next;
+				capture_free(capture);
+				continue;
+			}
+
+			prev = &capture->next;
+		}
+
+		storage_submit(storage);
+	} while (!stop || captures);
+
+	return NULL;
+}
+
+/* HFP_RECORDER_ENCODER names the encoder, e.g. "adpcm". */
+static struct encode_pool *writer_encoders(void)
+{
+	const char *name = getenv("HFP_RECORDER_ENCODER");
+	const struct encoder *encoder;
+
+	if (!name)
+		return NULL;
+
+	encoder = encoder_find(name);
+	if (!encoder) {
+		log_warn("unknown encoder %s, recordings stay PCM", name);
+		return NULL;
+	}
+
+	return encode_pool_new(encoder, writer_event);
+}
+
+static bool writer_start(void)
+{
+	if (writer_running)
+		return true;
+
+	writer_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (writer_event < 0) {
+		log_error("eventfd failed: %s", strerror(errno));
+		return false;
+	}
+
+	storage = storage_new(writer_event);
+	if (!storage) {
+		log_error("no recording storage backend available");
+		close(writer_event);
+		writer_event = -1;
+		return false;
+	}
+
+	/* Without compression, or an encoder that failed, stores PCM. */
+	encoders = writer_encoders();
+
+	if (pthread_create(&writer, NULL, writer_thread, NULL)) {
+		log_error("failed to start SCO writer thread");
+		encode_pool_free(encoders);
+		encoders = NULL;
+		storage_free(storage);
+		storage = NULL;
+		close(writer_event);
+		writer_event = -1;
+		return false;
+	}
+
+	writer_running = true;
+	return true;
+}
+
+static void writer_stop_and_join(void)
+{
+	if (!writer_running)
+		return;
+
+	__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+	writer_wakeup();
+	pthread_join(writer, NULL);
+
+	encode_pool_free(encoders);
+	encoders = NULL;
+	storage_free(storage);
+	storage = NULL;
+
+	close(writer_event);
+	writer_event = -1;
+	writer_running = false;
+}
+
+static int open_recording(struct hfp_session *session)
+{
+	char *path;
+	int fd;
+
+	path = l_strdup_printf("%s/%s-%llu.hfr", record_dir, session->address,
+				(unsigned long long) time(NULL));
+
+	/* Readable, a process taking over reads back the chunk headers. */
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0)
+		log_error("failed to create %s: %s", path, strerror(errno));
+	else
+		log_info("recording %s to %s", session->path, path);
+
+	l_free(path);
+	return fd;
+}
+
+/* Runs on the producer of the capture ring. */
+static void capture_move_meta(struct sco_capture *capture)
+{
+	struct audio_frame *meta, *frame;
+
+	while ((meta = audio_ring_peek(&capture->meta, 0))) {
+		frame = audio_ring_reserve(&capture->ring);
+		if (!frame)
+			return;
+
+		memcpy(frame, meta, offsetof(struct audio_frame, data) +
+								meta->len);
+		audio_ring_commit(&capture->ring);
+		audio_ring_release(&capture->meta, 1);
+	}
+}
+
+/*
+ * When the kernel received @msg, on the l_time_now() clock. Its stamp is
+ * CLOCK_REALTIME, so only the age is taken from it; that is what keeps
+ * main loop and audio thread latency out of the jitter buffer.
+ */
+static uint64_t capture_timestamp(struct msghdr *msg)
+{
+	uint64_t now = l_time_now();
+	struct cmsghdr *cmsg;
+	struct timespec received, realtime;
+	int64_t age;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+
+		memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+		clock_gettime(CLOCK_REALTIME, &realtime);
+
+		age = (int64_t) (realtime.tv_sec - received.tv_sec) * 1000000 +
+			(realtime.tv_nsec - received.tv_nsec) / 1000;
+
+		/* Ignore stamps from before a clock step. */
+		if (age >= 0 && (uint64_t) age < now &&
+						age < JITTER_GAP_MAX)
+			return now - age;
+
+		break;
+	}
+
+	return now;
+}
+
+/* On the main loop or the audio thread, see rt_audio_add(). */
+static bool capture_read(int fd, void *user_data)
+{
+	struct sco_capture *capture = user_data;
+	uint8_t scratch[AUDIO_FRAME_MAX];
+	uint8_t control[CMSG_SPACE(sizeof(struct timespec))];
+	struct audio_frame *frame;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	ssize_t bytes_read;
+
+	if (capture->rt)
+		capture_move_meta(capture);
+
+	/* A full ring still has to be drained from the socket. */
+	frame = audio_ring_reserve(&capture->ring);
+
+	iov.iov_base = frame ? frame->data : scratch;
+	iov.iov_len = AUDIO_FRAME_MAX;
+
+	bytes_read = recvmsg(fd, &msg, 0);
+	if (bytes_read < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+
+		/* No logging here, this may be the audio thread. */
+		capture->read_error = errno;
+		return false;
+	}
+
+	/* The link is gone, the disconnect handler closes the capture. */
+	if (!bytes_read)
+		return false;
+
+	if (!frame) {
+		STATS_ADD(&capture->session->stats, sco_dropped, 1);
+		return true;
+	}
+
+	STATS_ADD(&capture->session->stats, sco_frames, 1);
+
+	frame->len = bytes_read;
+	frame->type = 0;
+	frame->timestamp = capture_timestamp(&msg);
+	audio_ring_commit(&capture->ring);
+	__atomic_store_n(&capture->frames, capture->frames + 1,
+							__ATOMIC_RELAXED);
+
+	if (audio_ring_fill(&capture->ring) >= WRITER_BATCH_FRAMES)
+		writer_wakeup();
+
+	return true;
+}
+
+/* Hands @capture to the writer thread, which starts its recording. */
+static void capture_publish(struct sco_capture *capture)
+{
+	capture->next = __atomic_load_n(&writer_pending, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&writer_pending, &capture->next,
+				capture, false, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED))
+		;
+}
+
+static bool sco_read_callback(struct l_io *io, void *user_data)
+{
+	return capture_read(l_io_get_fd(io), user_data);
+}
+
+static void sco_disconnect_callback(struct l_io *io, void *user_data)
+{
+	struct sco_capture *capture = user_data;
+
+	log_info("SCO disconnected: %s", capture->session->path);
+	sco_capture_close(capture);
+}
+
+/**
+ * sco_capture_close:
+ * @capture: capture to stop
+ *
+ * Stops reading and hands @capture to the writer thread, which flushes
+ * what is still queued and frees it. @capture must not be used after.
+ */
+void sco_capture_close(struct sco_capture *capture)
+{
+	if (!capture)
+		return;
+
+	if (capture->session->sco == capture)
+		capture->session->sco = NULL;
+
+	/* The main loop is the ring's producer again from here on. */
+	if (capture->rt) {
+		rt_audio_remove(l_io_get_fd(capture->io));
+		capture->rt = false;
+		capture_move_meta(capture);
+	}
+
+	if (capture->read_error)
+		log_error("SCO read error on %s: %s", capture->session->path,
+					strerror(capture->read_error));
+
+	l_io_destroy(capture->io);
+	capture->io = NULL;
+
+	/*
+	 * Gone before its recording was resumed: the old process' file is
+	 * left as it was and what was read since is dropped.
+	 */
+	if (capture->waiting) {
+		if (capture->file_fd >= 0)
+			close(capture->file_fd);
+
+		capture->file_fd = -1;
+		capture->waiting = false;
+		capture_publish(capture);
+	}
+
+	__atomic_store_n(&capture->closed, true, __ATOMIC_RELEASE);
+	writer_wakeup();
+}
+
+/**
+ * sco_capture_meta:
+ * @capture: capture to annotate, may be NULL
+ * @type: metadata rec_type
+ * @data: payload, truncated to AUDIO_FRAME_MAX
+ * @len: payload length
+ *
+ * Queues a metadata record behind the audio captured so far. Must be
+ * called from the main loop, which is the only producer of the ring.
+ */
+void sco_capture_meta(struct sco_capture *capture, unsigned int type,
+					const void *data, size_t len)
+{
+	struct audio_frame *frame;
+
+	if (!capture)
+		return;
+
+	frame = audio_ring_reserve(capture->rt ? &capture->meta :
+							&capture->ring);
+	if (!frame)
+		return;
+
+	if (len > AUDIO_FRAME_MAX)
+		len = AUDIO_FRAME_MAX;
+
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	frame->type = type;
+	frame->timestamp = l_time_now();
+	audio_ring_commit(capture->rt ? &capture->meta : &capture->ring);
+}
+
+static void capture_snapshot(struct sco_capture *capture)
+{
+	struct hfp_session *session = capture->session;
+	uint8_t value;
+
+	if (session->incoming_callid[0])
+		sco_capture_meta(capture, REC_CALLER_ID,
+					session->incoming_callid,
+					strlen(session->incoming_callid));
+
+	value = session->call;
+	sco_capture_meta(capture, REC_CALL, &value, 1);
+	value = session->callsetup;
+	sco_capture_meta(capture, REC_CALLSETUP, &value, 1);
+}
+
+void sco_capture_get_stats(struct sco_capture *capture,
+				struct sco_capture_stats *stats)
+{
+	struct storage_file *file;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (!capture)
+		return;
+
+	stats->ring_fill = audio_ring_fill(&capture->ring);
+	stats->ring_size = capture->ring.size;
+	stats->frames = __atomic_load_n(&capture->frames, __ATOMIC_RELAXED);
+	stats->overruns = audio_ring_overruns(&capture->ring);
+	stats->write_errors = __atomic_load_n(&capture->write_errors,
+							__ATOMIC_RELAXED);
+	stats->concealed = __atomic_load_n(&capture->concealed,
+							__ATOMIC_RELAXED);
+	stats->duplicates = __atomic_load_n(&capture->duplicates,
+							__ATOMIC_RELAXED);
+	stats->silence_saved = L_MAX(__atomic_load_n(&capture->silence_saved,
+						__ATOMIC_RELAXED), (int64_t) 0);
+	file = __atomic_load_n(&capture->file, __ATOMIC_ACQUIRE);
+	if (file)
+		stats->write_errors += storage_file_errors(file);
+}
+
+/* Shared by every capture. */
+void sco_get_storage_stats(struct storage_stats *stats)
+{
+	storage_get_stats(storage, stats);
+}
+
+void sco_get_encode_stats(struct encode_stats *stats)
+{
+	encode_pool_get_stats(encoders, stats);
+}
+
+/* The air mode actually in effect, the controller may have refused ours. */
+static enum sco_format sco_format(uint8_t codec, int fd)
+{
+	struct bt_voice voice;
+	socklen_t len = sizeof(voice);
+
+	if (getsockopt(fd, SOL_BLUETOOTH, BT_VOICE, &voice, &len) < 0 ||
+			voice.setting != BT_VOICE_TRANSPARENT)
+		return SCO_FORMAT_PCM;
+
+	return codec == HFP_CODEC_MSBC ? SCO_FORMAT_MSBC : SCO_FORMAT_CVSD;
+}
+
+/* Takes ownership of @fd and @file_fd, NULL if it could not watch @fd. */
+static struct sco_capture *capture_new(struct hfp_session *session, int fd,
+					int file_fd, uint64_t start,
+					uint8_t codec)
+{
+	struct sco_capture *capture;
+	struct sco_options options;
+	socklen_t len = sizeof(options);
+	int on = 1;
+
+	capture = l_new(struct sco_capture, 1);
+	capture->session = session;
+	capture->codec = codec;
+	capture->file_fd = file_fd;
+	capture->start = start;
+	memcpy(capture->address, session->address, sizeof(capture->address));
+
+	audio_ring_init(&capture->ring, CAPTURE_RING_FRAMES);
+
+	capture->format = sco_format(codec, fd);
+
+	if (capture->format == SCO_FORMAT_MSBC) {
+		capture->msbc = l_new(struct msbc_decoder, 1);
+		msbc_decoder_init(capture->msbc);
+	} else if (capture->format == SCO_FORMAT_CVSD) {
+		capture->cvsd = l_new(struct cvsd_decoder, 1);
+		cvsd_decoder_init(capture->cvsd);
+		capture->cvsd_decode = cvsd_decode_select();
+	}
+
+	/* Link bytes per second: 64 kbit/s air, or 8 kHz s16 from the HCI. */
+	jitter_buffer_init(&capture->jb,
+			capture->format == SCO_FORMAT_PCM ? 16000 : 8000);
+	plc_init(&capture->plc,
+			capture->format == SCO_FORMAT_MSBC ? 16000 : 8000);
+	vad_init(&capture->vad, capture->plc.rate);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+		log_warn("SCO receive timestamps unavailable: %s",
+							strerror(errno));
+
+	if (!getsockopt(fd, SOL_SCO, SCO_OPTIONS, &options, &len))
+		capture->mtu = options.mtu;
+
+	capture->io = l_io_new(fd);
+	if (!capture->io) {
+		/* returns NULL in case failed to add watch. */
+		log_error("failed to add io watch on SCO connection");
+		close(fd);
+		capture_free(capture);
+		return NULL;
+	}
+
+	l_io_set_close_on_destroy(capture->io, true);
+
+	return capture;
+}
+
+/* Starts reading, on the audio thread if there is one. */
+static void capture_watch(struct sco_capture *capture)
+{
+	int fd = l_io_get_fd(capture->io);
+
+	/* The main loop keeps watching for disconnection either way. */
+	l_io_set_disconnect_handler(capture->io, sco_disconnect_callback,
+							capture, NULL);
+
+	if (rt_audio_running()) {
+		if (!capture->meta.size)
+			audio_ring_init(&capture->meta, META_RING_FRAMES);
+
+		capture->rt = true;
+
+		if (!rt_audio_add(fd, capture_read, capture))
+			capture->rt = false;
+	}
+
+	if (!capture->rt)
+		l_io_set_read_handler(capture->io, sco_read_callback, capture,
+									NULL);
+}
+
+static void sco_capture_start(struct hfp_session *session, int fd)
+{
+	struct sco_capture *capture;
+
+	if (!writer_start()) {
+		close(fd);
+		return;
+	}
+
+	/* Releasing the old audio link first, an AG only keeps one. */
+	sco_capture_close(session->sco);
+
+	capture = capture_new(session, fd, open_recording(session),
+						l_time_now(), session->codec);
+	if (!capture)
+		return;
+
+	/* One file fully describes the call, so start with its state. */
+	capture_snapshot(capture);
+	capture_watch(capture);
+
+	session->sco = capture;
+	capture_publish(capture);
+
+	log_info("SCO connected: %s mtu %u codec %s%s%s", session->path,
+			capture->mtu,
+			capture->codec == HFP_CODEC_MSBC ? "mSBC" : "CVSD",
+			capture->format == SCO_FORMAT_PCM ? "" : " (transparent)",
+			capture->rt ? " on audio thread" : "");
+}
+
+/**
+ * sco_capture_freeze:
+ * @capture: capture to hand over
+ * @state: filled with what the new process needs to go on
+ * @file_fd: set to its recording, or -1, still owned by @capture
+ *
+ * Stops reading @capture, what the socket receives from here on is left
+ * for whoever reads it next. Audio already read stays queued for this
+ * process' writer. Either sco_capture_hand_off() or sco_capture_thaw()
+ * must follow.
+ *
+ * Returns: the SCO socket, still owned by @capture.
+ */
+int sco_capture_freeze(struct sco_capture *capture,
+				struct sco_handoff *state, int *file_fd)
+{
+	int fd = l_io_get_fd(capture->io);
+
+	if (capture->rt) {
+		rt_audio_remove(fd);
+		capture->rt = false;
+		capture_move_meta(capture);
+	} else {
+		l_io_set_read_handler(capture->io, NULL, NULL, NULL);
+	}
+
+	l_io_set_disconnect_handler(capture->io, NULL, NULL, NULL);
+
+	state->start = capture->start;
+	state->frames = capture->frames;
+	state->frozen = l_time_now();
+	state->mtu = capture->mtu;
+	state->codec = capture->codec;
+	*file_fd = capture->file_fd;
+
+	return fd;
+}
+
+/* The handoff failed, @capture is read here again. */
+void sco_capture_thaw(struct sco_capture *capture)
+{
+	capture_watch(capture);
+}
+
+/**
+ * sco_capture_hand_off:
+ * @capture: frozen capture, see sco_capture_freeze()
+ *
+ * Closes @capture like sco_capture_close(), except its recording is
+ * left for sco_suspend() to report instead of being finished.
+ */
+void sco_capture_hand_off(struct sco_capture *capture)
+{
+	capture->handoff_path = l_strdup(capture->session->path);
+	capture->handoff = true;
+	sco_capture_close(capture);
+}
+
+/**
+ * sco_suspend:
+ * @func: called with each recording suspended by a handoff
+ * @user_data: passed to @func
+ *
+ * Stops the writer thread once it stored all it had, calling @func for
+ * every capture given to sco_capture_hand_off() whose recording can be
+ * resumed. Captures still open are closed as on sco_cleanup().
+ */
+void sco_suspend(sco_suspend_func_t func, void *user_data)
+{
+	struct sco_suspended *entry;
+
+	writer_stop_and_join();
+
+	while ((entry = suspended)) {
+		suspended = entry->next;
+		func(entry->path, &entry->resume, user_data);
+		l_free(entry->path);
+		l_free(entry);
+	}
+}
+
+/**
+ * sco_capture_adopt:
+ * @session: session the audio link belongs to
+ * @fd: SCO socket handed over
+ * @file_fd: its recording, handed over too, or -1
+ * @state: as filled in by sco_capture_freeze()
+ *
+ * Starts reading right away, the recording follows once the old process
+ * suspended it, see sco_capture_resume(). Takes ownership of both fds.
+ *
+ * Returns: false if the capture could not be started.
+ */
+bool sco_capture_adopt(struct hfp_session *session, int fd, int file_fd,
+					const struct sco_handoff *state)
+{
+	struct sco_capture *capture;
+
+	if (!writer_start()) {
+		close(fd);
+		if (file_fd >= 0)
+			close(file_fd);
+		return false;
+	}
+
+	sco_capture_close(session->sco);
+
+	capture = capture_new(session, fd, file_fd, state->start,
+								state->codec);
+	if (!capture)
+		return false;
+
+	capture->frames = state->frames;
+	if (!capture->mtu)
+		capture->mtu = state->mtu;
+
+	capture->waiting = true;
+	capture_watch(capture);
+	session->sco = capture;
+
+	log_info("SCO handed over: %s mtu %u codec %s%s", session->path,
+			capture->mtu,
+			capture->codec == HFP_CODEC_MSBC ? "mSBC" : "CVSD",
+			capture->rt ? " on audio thread" : "");
+
+	return true;
+}
+
+/**
+ * sco_capture_resume:
+ * @capture: adopted capture
+ * @resume: where its recording was suspended, or NULL if it was not
+ *
+ * Hands @capture to the writer thread, which goes on with the recording
+ * at @resume or, without one, starts a new file. Audio read since the
+ * adoption is stored right after what the old process stored.
+ */
+void sco_capture_resume(struct sco_capture *capture,
+					const struct rec_resume *resume)
+{
+	if (!capture || !capture->waiting)
+		return;
+
+	if (resume) {
+		capture->resume = *resume;
+		capture->resuming = true;
+	} else {
+		if (capture->file_fd >= 0)
+			close(capture->file_fd);
+
+		capture->file_fd = open_recording(capture->session);
+		capture->start = l_time_now();
+		capture_snapshot(capture);
+	}
+
+	capture->waiting = false;
+	capture_publish(capture);
+}
+
+/*
+ * The listening socket defers setup, so the air mode can still be chosen
+ * per connection from the codec negotiated on the session: transparent
+ * for mSBC, CVSD with controller transcoding to 16 bit PCM otherwise,
+ * unless CVSD bypass asks for the raw bits. The first read then accepts
+ * the connection.
+ */
+static bool sco_authorize(struct hfp_session *session, int fd)
+{
+	struct bt_voice voice;
+	char c;
+
+	memset(&voice, 0, sizeof(voice));
+	voice.setting = session->codec == HFP_CODEC_MSBC || cvsd_bypass ?
+			BT_VOICE_TRANSPARENT : BT_VOICE_CVSD_16BIT;
+
+	if (setsockopt(fd, SOL_BLUETOOTH, BT_VOICE, &voice, sizeof(voice)) < 0) {
+		log_error("failed to set SCO air mode: %s", strerror(errno));
+		return false;
+	}
+
+	if (read(fd, &c, 1) < 0 && errno != EAGAIN) {
+		log_error("failed to accept SCO: %s", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static bool sco_accept_callback(struct l_io *io, void *user_data)
+{
+	struct sockaddr_sco addr;
+	socklen_t len = sizeof(addr);
+	struct hfp_session *session;
+	int fd;
+
+	fd = accept4(l_io_get_fd(io), (struct sockaddr *) &addr, &len,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			log_error("SCO accept failed: %s", strerror(errno));
+		return true;
+	}
+
+	/* Audio without a Service Level Connection is not for us. */
+	session = session_lookup_by_bdaddr(&addr.sco_bdaddr);
+	if (!session) {
+		log_info("rejecting SCO connection without RFCOMM session");
+		close(fd);
+		return true;
+	}
+
+	if (!sco_authorize(session, fd)) {
+		close(fd);
+		return true;
+	}
+
+	sco_capture_start(session, fd);
+	return true;
+}
+
+/**
+ * sco_init:
+ * @dir: directory recordings are written to
+ * @bypass: take CVSD calls in transparent air mode and decode them here,
+ *	instead of letting the controller transcode them
+ * @vad: store silence as its length only
+ *
+ * Connections are only accepted after sco_listen().
+ */
+void sco_init(const char *dir, bool bypass, bool vad)
+{
+	if (mkdir(dir, 0750) < 0 && errno != EEXIST)
+		log_error("failed to create %s: %s", dir, strerror(errno));
+
+	record_dir = l_strdup(dir);
+	cvsd_bypass = bypass;
+	vad_enabled = vad;
+}
+
+static int sco_socket(void)
+{
+	struct sockaddr_sco addr;
+	int fd, defer = 1;
+
+	fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							BTPROTO_SCO);
+	if (fd < 0) {
+		log_error("failed to create SCO socket: %s", strerror(errno));
+		return -1;
+	}
+
+	/* BDADDR_ANY, accept on every adapter. */
+	memset(&addr, 0, sizeof(addr));
+	addr.sco_family = AF_BLUETOOTH;
+
+	if (setsockopt(fd, SOL_BLUETOOTH, BT_DEFER_SETUP, &defer,
+							sizeof(defer)) < 0)
+		log_error("SCO defer setup unavailable, only CVSD will work");
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(fd, 5) < 0) {
+		log_error("failed to listen for SCO: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * sco_listen:
+ * @fd: listening SCO socket handed over by another process, or -1 to
+ *	create one
+ *
+ * Returns: false if SCO connections can not be accepted.
+ */
+bool sco_listen(int fd)
+{
+	if (fd < 0)
+		fd = sco_socket();
+
+	if (fd < 0)
+		return false;
+
+	listen_io = l_io_new(fd);
+	if (!listen_io) {
+		log_error("failed to add io watch on SCO listener");
+		close(fd);
+		return false;
+	}
+
+	l_io_set_close_on_destroy(listen_io, true);
+	l_io_set_read_handler(listen_io, sco_accept_callback, NULL, NULL);
+
+	return true;
+}
+
+/* For handing it over, still owned here. */
+int sco_listen_fd(void)
+{
+	return listen_io ? l_io_get_fd(listen_io) : -1;
+}
+
+/* Sessions, and with them their captures, must be gone by now. */
+void sco_cleanup(void)
+{
+	if (listen_io) {
+		l_io_destroy(listen_io);
+		listen_io = NULL;
+	}
+
+	writer_stop_and_join();
+
+	l_free(record_dir);
+	record_dir = NULL;
+}
@@ -0,0 +1,209 @@
+/*
+ * session.c
+ */
+
+#include "main.h"
+#include "at_parser.h"
+#include "session.h"
+#include "sco.h"
+
+/* device object path -> struct hfp_session */
+static struct l_hashmap *sessions;
+static uint32_t last_id;
+
+static void session_free(void *data)
+{
+	struct hfp_session *session = data;
+
+	/* Handed over, the connection lives on in the new process. */
+	if (session->handed_off) {
+		log_info("handed over session %s", session->path);
+	} else {
+		log_info("releasing session %s", session->path);
+		session_journal(session, JOURNAL_DISCONNECT, NULL, 0);
+	}
+
+	slc_stop(session);
+
+	/* Releasing a Service Level Connection also releases its audio. */
+	sco_capture_close(session->sco);
+
+	/* l_io owns the socket and closes it. */
+	if (session->io)
+		l_io_destroy(session->io);
+
+	l_free(session->path);
+	l_free(session);
+}
+
+/* BlueZ device paths end in dev_XX_XX_XX_XX_XX_XX. */
+static void session_parse_address(struct hfp_session *session)
+{
+	const char *dev = strrchr(session->path, '/');
+	unsigned int b[6];
+	int i;
+
+	if (!dev || sscanf(dev, "/dev_%2x_%2x_%2x_%2x_%2x_%2x",
+				&b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+		log_warn("no device address in %s", session->path);
+		strcpy(session->address, "00:00:00:00:00:00");
+		return;
+	}
+
+	/* bdaddr_t is little endian. */
+	for (i = 0; i < 6; i++)
+		session->bdaddr.b[5 - i] = b[i];
+
+	snprintf(session->address, sizeof(session->address),
+			"%02X:%02X:%02X:%02X:%02X:%02X",
+			b[0], b[1], b[2], b[3], b[4], b[5]);
+}
+
+static struct hfp_session *session_create(const char *path, int fd,
+								uint32_t id)
+{
+	struct hfp_session *session;
+
+	if (!sessions)
+		sessions = l_hashmap_string_new();
+
+	session = l_hashmap_remove(sessions, path);
+	if (session) {
+		log_warn("replacing stale session for %s", path);
+		session_free(session);
+	}
+
+	session = l_new(struct hfp_session, 1);
+	session->path = l_strdup(path);
+	session->id = id;
+	session->fd = fd;
+	session->codec = HFP_CODEC_CVSD;
+	session->created = l_time_now();
+	session_parse_address(session);
+	at_framer_init(&session->framer);
+
+	l_hashmap_insert(sessions, path, session);
+
+	return session;
+}
+
+/**
+ * session_new:
+ * @path: BlueZ device object path
+ * @fd: connected RFCOMM socket
+ *
+ * Creates a session for @path. A session still registered for the same
+ * device is torn down first, BlueZ only does that after it dropped the
+ * old link.
+ *
+ * Returns: the new session, owned by the session table.
+ */
+struct hfp_session *session_new(const char *path, int fd)
+{
+	struct hfp_session *session = session_create(path, fd, ++last_id);
+
+	session_journal(session, JOURNAL_CONNECT, NULL, 0);
+
+	return session;
+}
+
+/**
+ * session_resume:
+ * @path: BlueZ device object path
+ * @fd: connected RFCOMM socket
+ * @id: the session's number in the process that handed it over
+ *
+ * Like session_new() for a connection taken over from another process,
+ * which already journaled it. The caller restores the rest.
+ *
+ * Returns: the session, owned by the session table.
+ */
+struct hfp_session *session_resume(const char *path, int fd, uint32_t id)
+{
+	last_id = L_MAX(last_id, id);
+
+	return session_create(path, fd, id);
+}
+
+struct hfp_session *session_lookup(const char *path)
+{
+	if (!sessions || !path)
+		return NULL;
+
+	return l_hashmap_lookup(sessions, path);
+}
+
+struct bdaddr_match {
+	const bdaddr_t *bdaddr;
+	struct hfp_session *session;
+};
+
+static void match_bdaddr(const void *key, void *value, void *user_data)
+{
+	struct hfp_session *session = value;
+	struct bdaddr_match *match = user_data;
+
+	if (!memcmp(&session->bdaddr, match->bdaddr, sizeof(bdaddr_t)))
+		match->session = session;
+}
+
+/* Only used when an audio link comes up, a walk is fine here. */
+struct hfp_session *session_lookup_by_bdaddr(const bdaddr_t *bdaddr)
+{
+	struct bdaddr_match match = { .bdaddr = bdaddr };
+
+	if (sessions)
+		l_hashmap_foreach(sessions, match_bdaddr, &match);
+
+	return match.session;
+}
+
+void session_destroy(struct hfp_session *session)
+{
+	if (!session)
+		return;
+
+	l_hashmap_remove(sessions, session->path);
+	session_free(session);
+}
+
+unsigned int session_count(void)
+{
+	return sessions ? l_hashmap_size(sessions) : 0;
+}
+
+struct session_walk {
+	void (*func)(struct hfp_session *session, void *user_data);
+	void *user_data;
+};
+
+static void session_walk(const void *key, void *value, void *user_data)
+{
+	struct session_walk *walk = user_data;
+
+	walk->func(value, walk->user_data);
+}
+
+/* @func must not add or remove sessions. */
+void session_foreach(void (*func)(struct hfp_session *session,
+						void *user_data),
+			void *user_data)
+{
+	struct session_walk walk = { func, user_data };
+
+	if (sessions)
+		l_hashmap_foreach(sessions, session_walk, &walk);
+}
+
+void session_cleanup(void)
+{
+	l_hashmap_destroy(sessions, session_free);
+	sessions = NULL;
+}
+
+/* Call events are journaled rather than logged, see journal.h. */
+void session_journal(struct hfp_session *session, enum journal_type type,
+					const void *payload, size_t len)
+{
+	journal_log(session->id, session->bdaddr.b, type, payload, len);
+}
@@ -2,20 +2,19 @@
  * socket.c
  */
 
+#include <fcntl.h>
+#include <sys/uio.h>
+
 #include "main.h"
 #include "at_parser.h"
-
-struct remote_connection {
-	char *last_cmd;
-	struct l_io *io;
-};
-
-struct remote_connection conn;
+#include "session.h"
 
 static void io_disconnect_callback(struct l_io *io, void *user_data)
 {
-	l_info("socket disconnected");
-	conn.io = NULL;
+	struct hfp_session *session = user_data;
+
+	log_info("socket disconnected: %s", session->path);
+	session_destroy(session);
 }
 
 /* if returned false handler will be destroyed and
@@ -23,59 +22,269 @@ static void io_disconnect_callback(struct l_io *io, void *user_data)
  */
 static bool io_read_callback(struct l_io *io, void *user_data)
 {
-	char buffer[MAX_DATA_BUF_SIZE];
+	struct hfp_session *session = user_data;
 	int fd = l_io_get_fd(io);
 	ssize_t bytes_read;
 
-	bytes_read = read(fd, buffer, MAX_DATA_BUF_SIZE);
-	if (bytes_read < 0) {
-		l_error("socket read error: %s", strerror(errno));
+	/* Drain the socket: one wakeup may carry a burst of result codes
+	 * that does not fit into the ring in one go.
+	 */
+	while (1) {
+		bytes_read = ringbuf_read_fd(&session->framer.ring, fd);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			log_error("socket read error: %s", strerror(errno));
+			return false;
+		}
+
+		STATS_ADD(&session->stats, bytes_in, bytes_read);
+
+		/* EOF is reported through the disconnect handler. */
+		if (bytes_read == 0)
+			break;
+
+		handle_recv_data(session);
+	}
+
+	return true;
+}
+
+static bool io_write_callback(struct l_io *io, void *user_data)
+{
+	struct hfp_session *session = user_data;
+	struct tx_queue *txq = &session->txq;
+	struct iovec iov[TX_QUEUE_SLOTS];
+	struct tx_buf *buf;
+	unsigned int i, count = 0;
+	ssize_t written;
+
+	for (i = txq->head; i != txq->tail; i++) {
+		buf = &txq->bufs[i % TX_QUEUE_SLOTS];
+		iov[count].iov_base = buf->data;
+		iov[count].iov_len = buf->len;
+		count++;
+	}
+
+	if (!count)
+		return false;
+
+	iov[0].iov_base = (char *) iov[0].iov_base + txq->offset;
+	iov[0].iov_len -= txq->offset;
+
+	do {
+		written = writev(l_io_get_fd(io), iov, count);
+	} while (written < 0 && errno == EINTR);
+
+	if (written < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			txq->eagain++;
+			return true;
+		}
+
+		/* The disconnect handler tears the session down. */
+		log_error("failed writing data %s", strerror(errno));
+		txq->head = txq->tail;
+		txq->offset = 0;
 		return false;
 	}
 
-	handle_recv_data(buffer, bytes_read);
+	txq->writes++;
+	STATS_ADD(&session->stats, bytes_out, written);
 
-	return true;
+	/* Retire what went out, a partial command stays at the head. */
+	for (i = 0; i < count; i++) {
+		if ((size_t) written < iov[i].iov_len) {
+			txq->offset += written;
+			txq->partial++;
+			return true;
+		}
+
+		written -= iov[i].iov_len;
+		txq->head++;
+		txq->offset = 0;
+	}
+
+	return false;
 }
 
-void new_rfcomm_connection(int sock)
+static struct tx_buf *tx_queue_push(struct hfp_session *session)
 {
+	struct tx_queue *txq = &session->txq;
+	unsigned int queued = txq->tail - txq->head;
+
+	if (!session->io)
+		return NULL;
+
+	if (queued == TX_QUEUE_SLOTS) {
+		txq->dropped++;
+		log_error("outbound queue full on %s", session->path);
+		return NULL;
+	}
+
+	/* Flushed from the main loop once the socket is writable. */
+	if (!queued)
+		l_io_set_write_handler(session->io, io_write_callback,
+							session, NULL);
+
+	if (++queued > txq->high_water)
+		txq->high_water = queued;
 
-	struct l_io *io = l_io_new(sock);
+	txq->commands++;
+	return &txq->bufs[txq->tail++ % TX_QUEUE_SLOTS];
+}
+
+static struct l_io *rfcomm_io_new(int sock)
+{
+	struct l_io *io;
+	int flags;
+
+	/* io_read_callback reads until EAGAIN. */
+	flags = fcntl(sock, F_GETFL);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+		log_error("failed to make RFCOMM socket non-blocking: %s", strerror(errno));
+
+	io = l_io_new(sock);
 	if (!io) {
 		/* returns NULL in case failed to add watch.
 		 * Any memory allocation failure causes the application
 		 * to abort.
 		 */
-		l_error("failed to add io watch on RFCOMM connection");
-		return;
+		log_error("failed to add io watch on RFCOMM connection");
+		close(sock);
 	}
 
+	return io;
+}
+
+static void rfcomm_io_attach(struct hfp_session *session, struct l_io *io)
+{
+	session->io = io;
+
 	l_io_set_close_on_destroy(io, true);
-	l_io_set_read_handler(io, io_read_callback, NULL, NULL);
-	l_io_set_disconnect_handler(io, io_disconnect_callback, NULL, NULL);
-	init_connection();
-	conn.io = io;
+	l_io_set_read_handler(io, io_read_callback, session, NULL);
+	l_io_set_disconnect_handler(io, io_disconnect_callback, session, NULL);
 }
 
-bool write_data(const char *data, int len)
+void new_rfcomm_connection(const char *path, int sock,
+						const struct slc_sdp *sdp)
 {
-	int fd;
+	struct hfp_session *session;
+	struct l_io *io;
 
-	if (!conn.io)
-		return false;
+	io = rfcomm_io_new(sock);
+	if (!io)
+		return;
+
+	session = session_new(path, sock);
+	rfcomm_io_attach(session, io);
+	slc_start(session, sdp);
+
+	log_info("new RFCOMM connection from %s, %u active", path, session_count());
+}
+
+/**
+ * resume_rfcomm_connection:
+ * @path: BlueZ device object path
+ * @sock: connected RFCOMM socket, handed over by another process
+ * @id: the session's number there
+ *
+ * Watches @sock for a session taken over from another process. Nothing
+ * is sent, the caller restores the session's state.
+ *
+ * Returns: the session, or NULL if @sock could not be watched.
+ */
+struct hfp_session *resume_rfcomm_connection(const char *path, int sock,
+								uint32_t id)
+{
+	struct hfp_session *session;
+	struct l_io *io;
+
+	io = rfcomm_io_new(sock);
+	if (!io)
+		return NULL;
+
+	session = session_resume(path, sock, id);
+	rfcomm_io_attach(session, io);
+
+	return session;
+}
+
+/* Stops all traffic, for handing the connection over as it stands. */
+void freeze_rfcomm_connection(struct hfp_session *session)
+{
+	if (!session->io)
+		return;
+
+	l_io_set_read_handler(session->io, NULL, NULL, NULL);
+	l_io_set_write_handler(session->io, NULL, NULL, NULL);
+	l_io_set_disconnect_handler(session->io, NULL, NULL, NULL);
+}
+
+/* The handoff failed, traffic goes on here. */
+void thaw_rfcomm_connection(struct hfp_session *session)
+{
+	if (!session->io)
+		return;
+
+	rfcomm_io_attach(session, session->io);
 
-	fd = l_io_get_fd(conn.io);
-	if (write(fd, data, len) != len) {
-		l_error("failed writing data %s", strerror(errno));
+	if (session->txq.head != session->txq.tail)
+		l_io_set_write_handler(session->io, io_write_callback,
+							session, NULL);
+}
+
+/**
+ * write_data:
+ * @session: connection
+ * @data: bytes to send
+ * @len: length, at most MAX_DATA_BUF_SIZE
+ *
+ * Queues @data, it is written once control returns to the main loop.
+ *
+ * Returns: false if @data was dropped.
+ */
+bool write_data(struct hfp_session *session, const char *data, int len)
+{
+	struct tx_buf *buf;
+
+	if (len < 0 || len > MAX_DATA_BUF_SIZE) {
+		log_error("%d bytes do not fit the outbound queue", len);
 		return false;
 	}
 
+	buf = tx_queue_push(session);
+	if (!buf)
+		return false;
+
+	memcpy(buf->data, data, len);
+	buf->len = len;
+
 	return true;
 }
 
-/* We play HF role. We only accept SCO connections */
+/* Queues @line with its CRLF terminator, encoded in place. */
+bool write_line(struct hfp_session *session, const char *line, size_t len)
+{
+	struct tx_buf *buf;
 
-/* Releasing a Service Level Connection shall also release
- * any existing Audio Connection related to it.
- */
+	if (len + 2 > MAX_DATA_BUF_SIZE) {
+		log_error("command too long: %zu bytes", len);
+		return false;
+	}
+
+	buf = tx_queue_push(session);
+	if (!buf)
+		return false;
+
+	memcpy(buf->data, line, len);
+	buf->data[len++] = '\r';
+	buf->data[len++] = '\n';
+	buf->len = len;
+
+	return true;
+}
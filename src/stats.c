@@ -0,0 +1,309 @@
+/*
+ * stats.c
+ */
+
+#include "main.h"
+#include "session.h"
+#include "sco.h"
+#include "storage.h"
+#include "encode_pool.h"
+#include "stats.h"
+
+struct hfp_stats stats_total;
+
+#define AT_CMD_NAME(id, token, handler)		#id,
+
+static const char *cmd_names[] = {
+	AT_COMMANDS(AT_CMD_NAME)
+};
+
+/* Counts one handled line and files its handler time by power of two. */
+void stats_command(struct hfp_stats *stats, int index, uint64_t ns)
+{
+	unsigned int bucket = 63 - __builtin_clzll(ns | 1);
+
+	if (bucket >= STATS_LATENCY_BUCKETS)
+		bucket = STATS_LATENCY_BUCKETS - 1;
+
+	STATS_ADD(stats, commands[index], 1);
+	STATS_ADD(stats, latency[index][bucket], 1);
+}
+
+void stats_reset(struct hfp_stats *stats)
+{
+	uint64_t *counter = (uint64_t *) stats;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		__atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+}
+
+/* Adds @from, counted by another process, see handoff.h. */
+void stats_merge(struct hfp_stats *stats, const struct hfp_stats *from)
+{
+	uint64_t *counter = (uint64_t *) stats;
+	const uint64_t *add = (const uint64_t *) from;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		__atomic_fetch_add(&counter[i], add[i], __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void dict_append(struct l_dbus_message_builder *builder,
+				const char *key, char type, const void *value)
+{
+	char sig[2] = { type, '\0' };
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', key);
+	l_dbus_message_builder_enter_variant(builder, sig);
+	l_dbus_message_builder_append_basic(builder, type, value);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static void dict_append_u64(struct l_dbus_message_builder *builder,
+				const char *key, uint64_t value)
+{
+	dict_append(builder, key, 't', &value);
+}
+
+static void dict_append_u32(struct l_dbus_message_builder *builder,
+				const char *key, uint32_t value)
+{
+	dict_append(builder, key, 'u', &value);
+}
+
+/* Commands: a{st}, Latency: a{sat}, only for commands seen so far. */
+static void append_commands(struct l_dbus_message_builder *builder,
+					const struct hfp_stats *stats)
+{
+	uint64_t count;
+	unsigned int i, b;
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', "Commands");
+	l_dbus_message_builder_enter_variant(builder, "a{st}");
+	l_dbus_message_builder_enter_array(builder, "{st}");
+
+	for (i = 0; i < AT_CMD_COUNT; i++) {
+		count = stats_get(&stats->commands[i]);
+		if (!count)
+			continue;
+
+		l_dbus_message_builder_enter_dict(builder, "st");
+		l_dbus_message_builder_append_basic(builder, 's', cmd_names[i]);
+		l_dbus_message_builder_append_basic(builder, 't', &count);
+		l_dbus_message_builder_leave_dict(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', "Latency");
+	l_dbus_message_builder_enter_variant(builder, "a{sat}");
+	l_dbus_message_builder_enter_array(builder, "{sat}");
+
+	for (i = 0; i < AT_CMD_COUNT; i++) {
+		if (!stats_get(&stats->commands[i]))
+			continue;
+
+		l_dbus_message_builder_enter_dict(builder, "sat");
+		l_dbus_message_builder_append_basic(builder, 's', cmd_names[i]);
+		l_dbus_message_builder_enter_array(builder, "t");
+
+		for (b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+			count = stats_get(&stats->latency[i][b]);
+			l_dbus_message_builder_append_basic(builder, 't',
+								&count);
+		}
+
+		l_dbus_message_builder_leave_array(builder);
+		l_dbus_message_builder_leave_dict(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static void append_counters(struct l_dbus_message_builder *builder,
+					const struct hfp_stats *stats)
+{
+	append_commands(builder, stats);
+	dict_append_u64(builder, "UnknownCommands", stats_get(&stats->unknown));
+	dict_append_u64(builder, "BytesIn", stats_get(&stats->bytes_in));
+	dict_append_u64(builder, "BytesOut", stats_get(&stats->bytes_out));
+	dict_append_u64(builder, "ScoFrames", stats_get(&stats->sco_frames));
+	dict_append_u64(builder, "ScoDropped", stats_get(&stats->sco_dropped));
+}
+
+struct snapshot {
+	struct l_dbus_message_builder *builder;
+	uint32_t queue_depth;
+	uint32_t queue_high_water;
+};
+
+static void sum_session(struct hfp_session *session, void *user_data)
+{
+	struct snapshot *snapshot = user_data;
+	struct tx_queue *txq = &session->txq;
+
+	snapshot->queue_depth += txq->tail - txq->head;
+	if (txq->high_water > snapshot->queue_high_water)
+		snapshot->queue_high_water = txq->high_water;
+}
+
+static void append_session(struct hfp_session *session, void *user_data)
+{
+	struct snapshot *snapshot = user_data;
+	struct l_dbus_message_builder *builder = snapshot->builder;
+	struct tx_queue *txq = &session->txq;
+	struct sco_capture_stats sco;
+
+	sco_capture_get_stats(session->sco, &sco);
+
+	l_dbus_message_builder_enter_dict(builder, "oa{sv}");
+	l_dbus_message_builder_append_basic(builder, 'o', session->path);
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+
+	dict_append(builder, "Address", 's', session->address);
+	append_counters(builder, &session->stats);
+	dict_append_u64(builder, "SlcSetupTime",
+				stats_get(&session->stats.slc_setup_time));
+	dict_append_u32(builder, "WriteQueueDepth", txq->tail - txq->head);
+	dict_append_u32(builder, "WriteQueueHighWater", txq->high_water);
+	dict_append_u64(builder, "WriteQueueDropped", txq->dropped);
+	/* Of the current audio link, the writer outlives sessions. */
+	dict_append_u64(builder, "ScoConcealed", sco.concealed);
+	dict_append_u64(builder, "ScoDuplicates", sco.duplicates);
+	dict_append_u64(builder, "VadBytesSaved", sco.silence_saved);
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static void append_storage(struct l_dbus_message_builder *builder)
+{
+	struct storage_stats storage;
+
+	sco_get_storage_stats(&storage);
+
+	dict_append(builder, "StorageBackend", 's', storage.backend);
+	dict_append_u32(builder, "StorageQueueDepth", storage.queue_depth);
+	dict_append_u32(builder, "StorageQueueDepthMax",
+						storage.queue_depth_max);
+	dict_append_u64(builder, "StorageWrites", storage.writes);
+	dict_append_u64(builder, "StorageErrors", storage.errors);
+	dict_append_u64(builder, "StorageLatencyAvg", storage.latency_avg);
+	dict_append_u64(builder, "StorageLatencyMax", storage.latency_max);
+}
+
+/* EncodeSpeed is seconds of audio one core encodes per second. */
+static void append_encode(struct l_dbus_message_builder *builder)
+{
+	struct encode_stats encode;
+
+	sco_get_encode_stats(&encode);
+	if (!encode.encoder)
+		return;
+
+	dict_append(builder, "Encoder", 's', encode.encoder);
+	dict_append_u32(builder, "EncodeThreads", encode.threads);
+	dict_append_u64(builder, "EncodeJobs", encode.jobs);
+	dict_append_u64(builder, "EncodeAudioTime", encode.audio_time);
+	dict_append_u64(builder, "EncodeCpuTime", encode.cpu_time);
+	dict_append_u64(builder, "EncodeSpeed", encode.cpu_time ?
+				encode.audio_time / encode.cpu_time : 0);
+	dict_append_u64(builder, "EncodeBytesIn", encode.bytes_in);
+	dict_append_u64(builder, "EncodeBytesOut", encode.bytes_out);
+	dict_append_u64(builder, "EncodeStalls", encode.stalls);
+	dict_append_u64(builder, "EncodeErrors", encode.errors);
+}
+
+/*
+ * GetSnapshot() -> (a{sv} total, a{oa{sv}} sessions)
+ *
+ * One message with everything, so monitoring polls with a single call.
+ * Times are usec, except Latency which is the bucket histogram.
+ */
+static struct l_dbus_message *get_snapshot(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *reply;
+	struct snapshot snapshot;
+	uint64_t setups = stats_get(&stats_total.slc_setups);
+
+	reply = l_dbus_message_new_method_return(message);
+	builder = l_dbus_message_builder_new(reply);
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.builder = builder;
+	session_foreach(sum_session, &snapshot);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	dict_append_u32(builder, "Sessions", session_count());
+	append_counters(builder, &stats_total);
+	dict_append_u64(builder, "ScoConcealed",
+				stats_get(&stats_total.sco_concealed));
+	dict_append_u64(builder, "ScoDuplicates",
+				stats_get(&stats_total.sco_duplicates));
+	dict_append_u64(builder, "VadBytesSaved",
+				stats_get(&stats_total.vad_saved));
+	dict_append_u64(builder, "SlcSetups", setups);
+	dict_append_u64(builder, "SlcSetupTimeAvg", setups ?
+			stats_get(&stats_total.slc_setup_time) / setups : 0);
+	dict_append_u32(builder, "WriteQueueDepth", snapshot.queue_depth);
+	dict_append_u32(builder, "WriteQueueHighWater",
+					snapshot.queue_high_water);
+	append_storage(builder);
+	append_encode(builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_enter_array(builder, "{oa{sv}}");
+	session_foreach(append_session, &snapshot);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static void reset_session(struct hfp_session *session, void *user_data)
+{
+	stats_reset(&session->stats);
+	session->txq.high_water = session->txq.tail - session->txq.head;
+}
+
+static struct l_dbus_message *reset(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	struct l_dbus_message *reply;
+
+	stats_reset(&stats_total);
+	session_foreach(reset_session, NULL);
+
+	reply = l_dbus_message_new_method_return(message);
+	l_dbus_message_set_arguments(reply, "");
+
+	return reply;
+}
+
+void stats_interface_setup(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "GetSnapshot", 0, get_snapshot,
+				"a{sv}a{oa{sv}}", "", "total", "sessions");
+
+	l_dbus_interface_method(interface, "Reset", 0, reset, "", "");
+}
@@ -0,0 +1,319 @@
+/*
+ * storage.c
+ *
+ * Backend independent part of the storage layer: the buffer pool,
+ * per-file bookkeeping and metrics. io_uring is used when the kernel
+ * allows it, otherwise a small pool of threads doing pwrite().
+ */
+
+#include "main.h"
+#include "storage.h"
+
+struct storage_file {
+	struct storage *storage;
+	int fd;
+	unsigned int inflight;
+	bool closing;
+	uint64_t errors;
+};
+
+struct storage {
+	const struct storage_backend *backend;
+	void *data;
+
+	uint8_t *pool;
+	struct storage_req reqs[STORAGE_BUFFERS];
+	unsigned int free[STORAGE_BUFFERS];
+
+	/* Written by the owning thread, read by storage_get_stats(). */
+	unsigned int nfree;
+	unsigned int inflight;
+	unsigned int queue_depth_max;
+	uint64_t writes;
+	uint64_t errors;
+	uint64_t latency_total;
+	uint64_t latency_max;
+};
+
+#define STAT_SET(field, val) \
+	__atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+#define STAT_GET(field) \
+	__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static bool storage_backend_init(struct storage *storage,
+				const struct storage_backend *backend,
+				int notify_fd)
+{
+	struct iovec buffers[STORAGE_BUFFERS];
+	unsigned int i;
+
+	for (i = 0; i < STORAGE_BUFFERS; i++) {
+		buffers[i].iov_base = storage->pool + i * STORAGE_BUFFER_SIZE;
+		buffers[i].iov_len = STORAGE_BUFFER_SIZE;
+	}
+
+	storage->data = backend->create(storage, buffers, STORAGE_BUFFERS,
+								notify_fd);
+	if (!storage->data)
+		return false;
+
+	storage->backend = backend;
+	return true;
+}
+
+/**
+ * storage_new:
+ * @notify_fd: eventfd written whenever writes complete
+ *
+ * HFP_RECORDER_STORAGE=pwrite skips io_uring.
+ *
+ * Returns: storage, or NULL if no backend could be started.
+ */
+struct storage *storage_new(int notify_fd)
+{
+	struct storage *storage;
+	const char *name = getenv("HFP_RECORDER_STORAGE");
+	unsigned int i;
+	void *pool;
+
+	/* Page aligned, so buffers are usable for O_DIRECT as well. */
+	if (posix_memalign(&pool, 4096, STORAGE_BUFFERS * STORAGE_BUFFER_SIZE))
+		return NULL;
+
+	storage = l_new(struct storage, 1);
+	storage->pool = pool;
+
+	for (i = 0; i < STORAGE_BUFFERS; i++)
+		storage->free[storage->nfree++] = STORAGE_BUFFERS - 1 - i;
+
+	if ((!name || strcmp(name, storage_pwrite.name)) &&
+			storage_backend_init(storage, &storage_uring, notify_fd))
+		goto done;
+
+	if (storage_backend_init(storage, &storage_pwrite, notify_fd))
+		goto done;
+
+	free(storage->pool);
+	l_free(storage);
+	return NULL;
+
+done:
+	log_info("recording storage: %s", storage->backend->name);
+	return storage;
+}
+
+/* Waits for everything in flight. Files must have been closed. */
+void storage_free(struct storage *storage)
+{
+	if (!storage)
+		return;
+
+	storage->backend->submit(storage->data);
+	while (storage->inflight)
+		storage->backend->reap(storage->data, true);
+
+	storage->backend->destroy(storage->data);
+	free(storage->pool);
+	l_free(storage);
+}
+
+const char *storage_name(struct storage *storage)
+{
+	return storage->backend->name;
+}
+
+/**
+ * storage_buffer_get:
+ * @storage: storage
+ *
+ * Returns: a STORAGE_BUFFER_SIZE buffer to fill and pass to
+ * storage_write(), or NULL if all are in flight.
+ */
+void *storage_buffer_get(struct storage *storage)
+{
+	unsigned int index;
+
+	if (!storage->nfree)
+		storage_reap(storage);
+
+	if (!storage->nfree)
+		return NULL;
+
+	STAT_SET(storage->nfree, storage->nfree - 1);
+	index = storage->free[storage->nfree];
+	return storage->pool + index * STORAGE_BUFFER_SIZE;
+}
+
+static void storage_req_release(struct storage *storage,
+					struct storage_req *req)
+{
+	if (req->buffer >= 0) {
+		storage->free[storage->nfree] = req->buffer;
+		STAT_SET(storage->nfree, storage->nfree + 1);
+		return;
+	}
+
+	l_free(req->data);
+	l_free(req);
+}
+
+struct storage_file *storage_file_open(struct storage *storage, int fd)
+{
+	struct storage_file *file;
+
+	file = l_new(struct storage_file, 1);
+	file->storage = storage;
+	file->fd = fd;
+
+	return file;
+}
+
+static void storage_file_free(struct storage_file *file)
+{
+	close(file->fd);
+	l_free(file);
+}
+
+/* The descriptor is closed, and @file freed, once its writes are done. */
+void storage_file_close(struct storage_file *file)
+{
+	if (!file)
+		return;
+
+	file->closing = true;
+	if (!file->inflight)
+		storage_file_free(file);
+}
+
+/* Failed writes so far, may be read from any thread. */
+uint64_t storage_file_errors(struct storage_file *file)
+{
+	return STAT_GET(file->errors);
+}
+
+/**
+ * storage_write:
+ * @file: destination
+ * @data: a buffer from storage_buffer_get(), or l_malloc'd memory with
+ *	STORAGE_WRITE_FREE
+ * @len: bytes to write
+ * @offset: file offset
+ * @flags: STORAGE_WRITE_*
+ *
+ * Queues a write until the next storage_submit(). Ownership of @data
+ * passes to the storage layer in any case.
+ *
+ * Returns: 0 or a negative errno.
+ */
+int storage_write(struct storage_file *file, void *data, size_t len,
+					uint64_t offset, unsigned int flags)
+{
+	struct storage *storage = file->storage;
+	struct storage_req *req;
+	ptrdiff_t pos;
+
+	if (flags & STORAGE_WRITE_FREE) {
+		req = l_new(struct storage_req, 1);
+		req->buffer = -1;
+	} else {
+		pos = (uint8_t *) data - storage->pool;
+		if (pos < 0 || pos % STORAGE_BUFFER_SIZE ||
+				pos >= STORAGE_BUFFERS * STORAGE_BUFFER_SIZE ||
+				len > STORAGE_BUFFER_SIZE)
+			return -EINVAL;
+
+		req = &storage->reqs[pos / STORAGE_BUFFER_SIZE];
+		req->buffer = pos / STORAGE_BUFFER_SIZE;
+	}
+
+	req->file = file;
+	req->fd = file->fd;
+	req->data = data;
+	req->len = len;
+	req->offset = offset;
+	req->flags = flags;
+	req->result = 0;
+	req->queued = l_time_now();
+
+	if (!storage->backend->queue(storage->data, req)) {
+		storage->backend->submit(storage->data);
+
+		if (!storage->backend->queue(storage->data, req)) {
+			storage_req_release(storage, req);
+			return -EBUSY;
+		}
+	}
+
+	file->inflight++;
+	STAT_SET(storage->inflight, storage->inflight + 1);
+
+	if (storage->inflight > storage->queue_depth_max)
+		STAT_SET(storage->queue_depth_max, storage->inflight);
+
+	return 0;
+}
+
+/* Hands everything queued since the last call to the kernel at once. */
+void storage_submit(struct storage *storage)
+{
+	storage->backend->submit(storage->data);
+}
+
+/* Processes finished writes, never blocks. */
+void storage_reap(struct storage *storage)
+{
+	if (storage->inflight)
+		storage->backend->reap(storage->data, false);
+}
+
+/**
+ * storage_complete:
+ * @storage: storage
+ * @req: finished request
+ * @result: 0 or a negative errno
+ *
+ * Called by backends from storage_reap(), on the owning thread.
+ */
+void storage_complete(struct storage *storage, struct storage_req *req,
+								int result)
+{
+	struct storage_file *file = req->file;
+	uint64_t latency = l_time_now() - req->queued;
+
+	STAT_SET(storage->writes, storage->writes + 1);
+	STAT_SET(storage->latency_total, storage->latency_total + latency);
+	if (latency > storage->latency_max)
+		STAT_SET(storage->latency_max, latency);
+
+	if (result < 0) {
+		STAT_SET(storage->errors, storage->errors + 1);
+		STAT_SET(file->errors, file->errors + 1);
+	}
+
+	STAT_SET(storage->inflight, storage->inflight - 1);
+	storage_req_release(storage, req);
+
+	if (!--file->inflight && file->closing)
+		storage_file_free(file);
+}
+
+void storage_get_stats(struct storage *storage, struct storage_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!storage) {
+		stats->backend = "none";
+		return;
+	}
+
+	stats->backend = storage->backend->name;
+	stats->queue_depth = STAT_GET(storage->inflight);
+	stats->queue_depth_max = STAT_GET(storage->queue_depth_max);
+	stats->buffers_free = STAT_GET(storage->nfree);
+	stats->writes = STAT_GET(storage->writes);
+	stats->errors = STAT_GET(storage->errors);
+	stats->latency_max = STAT_GET(storage->latency_max);
+	if (stats->writes)
+		stats->latency_avg = STAT_GET(storage->latency_total) /
+								stats->writes;
+}
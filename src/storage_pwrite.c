@@ -0,0 +1,204 @@
+/*
+ * storage_pwrite.c
+ *
+ * Fallback backend for kernels without io_uring: a few threads doing
+ * blocking pwrite() and fdatasync(). Submission hands the whole batch
+ * over under one lock; finished requests are collected on a list that
+ * the owning thread takes in storage_reap().
+ */
+
+#include <pthread.h>
+
+#include "main.h"
+#include "storage.h"
+
+/* Enough to keep one slow fdatasync from holding up other files. */
+#define PWRITE_THREADS		2
+
+struct pwrite_pool {
+	struct storage *storage;
+	int notify_fd;
+	pthread_t threads[PWRITE_THREADS];
+	unsigned int nthreads;
+
+	/* Owning thread only, until submitted. */
+	struct storage_req *batch;
+	struct storage_req **batch_tail;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t completed;
+	struct storage_req *queue;
+	struct storage_req **queue_tail;
+	struct storage_req *done;
+	bool stop;
+};
+
+static int pwrite_req(struct storage_req *req)
+{
+	const uint8_t *data = req->data;
+	size_t len = req->len;
+	uint64_t offset = req->offset;
+	ssize_t written;
+
+	while (len) {
+		written = pwrite(req->fd, data, len, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		data += written;
+		len -= written;
+		offset += written;
+	}
+
+	if ((req->flags & STORAGE_WRITE_SYNC) && fdatasync(req->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void *pwrite_thread(void *user_data)
+{
+	struct pwrite_pool *pool = user_data;
+	struct storage_req *req;
+	uint64_t val = 1;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+		while (!pool->queue && !pool->stop)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+
+		req = pool->queue;
+		if (!req)
+			break;
+
+		pool->queue = req->next;
+		if (!pool->queue)
+			pool->queue_tail = &pool->queue;
+
+		pthread_mutex_unlock(&pool->lock);
+		req->result = pwrite_req(req);
+		pthread_mutex_lock(&pool->lock);
+
+		req->next = pool->done;
+		pool->done = req;
+		pthread_cond_signal(&pool->completed);
+
+		if (write(pool->notify_fd, &val, sizeof(val)) < 0 &&
+							errno != EAGAIN)
+			log_error("storage notify failed: %s", strerror(errno));
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pwrite_destroy(void *data)
+{
+	struct pwrite_pool *pool = data;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->completed);
+	pthread_cond_destroy(&pool->queued);
+	pthread_mutex_destroy(&pool->lock);
+	l_free(pool);
+}
+
+static void *pwrite_create(struct storage *storage, const struct iovec *buffers,
+				unsigned int count, int notify_fd)
+{
+	struct pwrite_pool *pool;
+
+	pool = l_new(struct pwrite_pool, 1);
+	pool->storage = storage;
+	pool->notify_fd = notify_fd;
+	pool->batch_tail = &pool->batch;
+	pool->queue_tail = &pool->queue;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->completed, NULL);
+
+	for (; pool->nthreads < PWRITE_THREADS; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+						pwrite_thread, pool))
+			break;
+	}
+
+	if (!pool->nthreads) {
+		log_error("failed to start storage threads");
+		pwrite_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+static bool pwrite_queue(void *data, struct storage_req *req)
+{
+	struct pwrite_pool *pool = data;
+
+	req->next = NULL;
+	*pool->batch_tail = req;
+	pool->batch_tail = &req->next;
+
+	return true;
+}
+
+static void pwrite_submit(void *data)
+{
+	struct pwrite_pool *pool = data;
+
+	if (!pool->batch)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	*pool->queue_tail = pool->batch;
+	pool->queue_tail = pool->batch_tail;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->batch = NULL;
+	pool->batch_tail = &pool->batch;
+}
+
+static void pwrite_reap(void *data, bool wait)
+{
+	struct pwrite_pool *pool = data;
+	struct storage_req *req, *next;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (wait && !pool->done)
+		pthread_cond_wait(&pool->completed, &pool->lock);
+
+	req = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		storage_complete(pool->storage, req, req->result);
+	}
+}
+
+const struct storage_backend storage_pwrite = {
+	.name = "pwrite",
+	.create = pwrite_create,
+	.destroy = pwrite_destroy,
+	.queue = pwrite_queue,
+	.submit = pwrite_submit,
+	.reap = pwrite_reap,
+};
@@ -0,0 +1,315 @@
+/*
+ * storage_uring.c
+ *
+ * io_uring backend, talking to the kernel directly so there is no
+ * library dependency. Pool buffers are registered once and written with
+ * WRITE_FIXED; a write asking for STORAGE_WRITE_SYNC is linked to an
+ * fdatasync so the kernel orders the two without a round trip through
+ * us. Completions are signalled on the notify eventfd.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "main.h"
+#include "storage.h"
+
+/* Two entries per buffer, write and linked fdatasync, plus headroom. */
+#define URING_ENTRIES		128
+
+/* Low bit of user_data marks the fdatasync half of a linked pair. */
+#define URING_SYNC_TAG		1UL
+
+struct uring {
+	struct storage *storage;
+	int fd;
+	bool fixed;
+	unsigned int entries;
+	unsigned int to_submit;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	void *cq_ring;
+	size_t cq_ring_len;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+							flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, const void *arg,
+							unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+					ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+}
+
+static bool uring_map(struct uring *ring, struct io_uring_params *p)
+{
+	uint8_t *sq, *cq;
+
+	ring->sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p->cq_off.cqes +
+				p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = ring->sq_ring_len;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return false;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		return false;
+
+	ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return false;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *) (sq + p->sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p->sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p->sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *) (cq + p->cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p->cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+
+	ring->entries = p->sq_entries;
+	return true;
+}
+
+static void uring_destroy(void *data)
+{
+	struct uring *ring = data;
+
+	uring_unmap(ring);
+	close(ring->fd);
+	l_free(ring);
+}
+
+static void *uring_create(struct storage *storage, const struct iovec *buffers,
+				unsigned int count, int notify_fd)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+
+	memset(&p, 0, sizeof(p));
+
+	ring = l_new(struct uring, 1);
+	ring->storage = storage;
+	ring->fd = uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		log_info("io_uring unavailable: %s", strerror(errno));
+		l_free(ring);
+		return NULL;
+	}
+
+	if (!uring_map(ring, &p)) {
+		log_error("io_uring mmap failed: %s", strerror(errno));
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	if (uring_register(ring->fd, IORING_REGISTER_EVENTFD, &notify_fd, 1)) {
+		log_error("io_uring eventfd: %s", strerror(errno));
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	/* Pinning may exceed RLIMIT_MEMLOCK, plain writes work regardless. */
+	if (!uring_register(ring->fd, IORING_REGISTER_BUFFERS, buffers, count))
+		ring->fixed = true;
+	else
+		log_info("io_uring buffers not registered: %s", strerror(errno));
+
+	return ring;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (tail + ring->to_submit - head >= ring->entries)
+		return NULL;
+
+	tail += ring->to_submit;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	ring->to_submit++;
+
+	return sqe;
+}
+
+static bool uring_queue(void *data, struct storage_req *req)
+{
+	struct uring *ring = data;
+	struct io_uring_sqe *sqe, *sync = NULL;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int needed = req->flags & STORAGE_WRITE_SYNC ? 2 : 1;
+
+	/* A linked pair must go in together. */
+	if (*ring->sq_tail + ring->to_submit + needed - head > ring->entries)
+		return false;
+
+	sqe = uring_get_sqe(ring);
+	sqe->fd = req->fd;
+	sqe->off = req->offset;
+	sqe->user_data = (uintptr_t) req;
+
+	if (ring->fixed && req->buffer >= 0) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->addr = (uintptr_t) req->data;
+		sqe->len = req->len;
+		sqe->buf_index = req->buffer;
+	} else {
+		req->iov.iov_base = req->data;
+		req->iov.iov_len = req->len;
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (uintptr_t) &req->iov;
+		sqe->len = 1;
+	}
+
+	req->parts = 1;
+
+	if (needed == 2) {
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sync = uring_get_sqe(ring);
+		sync->opcode = IORING_OP_FSYNC;
+		sync->fd = sqe->fd;
+		sync->fsync_flags = IORING_FSYNC_DATASYNC;
+		sync->user_data = (uintptr_t) req | URING_SYNC_TAG;
+		req->parts = 2;
+	}
+
+	return true;
+}
+
+static void uring_submit(void *data)
+{
+	struct uring *ring = data;
+	unsigned int tail = *ring->sq_tail + ring->to_submit;
+	unsigned int pending;
+	int ret;
+
+	/* Publish the batch, then one syscall for all of it. */
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	ring->to_submit = 0;
+
+	/* Includes entries a failed earlier submit left behind. */
+	pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (!pending)
+		return;
+
+	do {
+		ret = uring_enter(ring->fd, pending, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		log_error("io_uring submit failed: %s", strerror(errno));
+}
+
+static void uring_reap(void *data, bool wait)
+{
+	struct uring *ring = data;
+	struct storage_req *req;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	uintptr_t user_data;
+	int res;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail && wait) {
+		if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+							errno != EINTR)
+			log_error("io_uring wait failed: %s", strerror(errno));
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+
+		req = (struct storage_req *) (user_data & ~URING_SYNC_TAG);
+
+		if (!(user_data & URING_SYNC_TAG) && res >= 0 &&
+						(size_t) res != req->len)
+			res = -EIO;
+
+		/* The linked fdatasync of a failed write reports -ECANCELED. */
+		if (res < 0 && !req->result)
+			req->result = res;
+
+		if (!--req->parts)
+			storage_complete(ring->storage, req, req->result);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+const struct storage_backend storage_uring = {
+	.name = "io_uring",
+	.create = uring_create,
+	.destroy = uring_destroy,
+	.queue = uring_queue,
+	.submit = uring_submit,
+	.reap = uring_reap,
+};
@@ -2,111 +2,239 @@
  * utils.c
  */
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
 #include "main.h"
 
+const struct scan_set scan_set_eol = {
+	.member = { ['\r'] = true, ['\n'] = true },
+	.chars = { '\r', '\n', '\n', '\n' },
+	.count = 2,
+};
+
+const struct scan_set scan_set_args = {
+	.member = { [':'] = true, ['?'] = true, ['='] = true },
+	.chars = { ':', '?', '=', '=' },
+	.count = 3,
+};
+
+static const char *scan_first(const struct scan_set *set, const char *data,
+								size_t len);
+
+scan_func_t scan_impl = scan_first;
+
 /**
- * strchr_multi_byte:
- * @str: String that contains delimiter characters
- * @delim: String with has delimiter characters
- *
- * This function is similar to string library function strchr,
- * but it works on multiple delimiter functions.
+ * scan_set_init:
+ * @set: set to fill in
+ * @chars: NUL terminated bytes to search for
  *
- * @Returns: Address of any of first delimiter character found.
+ * Returns: false if @chars has more than SCAN_SET_MAX distinct bytes.
  */
-char *strchr_multi_byte(const char *str, const char *delim)
+bool scan_set_init(struct scan_set *set, const char *chars)
 {
-	bool found = false;
-	char *tmp1, *tmp2;
+	const unsigned char *c;
+	unsigned int i;
 
-	if (!str || !delim)
-		return NULL;
+	memset(set, 0, sizeof(*set));
 
-	for (tmp1 = (char *)str; *tmp1 != '\0' ; ++tmp1) {
+	for (c = (const unsigned char *) chars; *c; c++) {
+		if (set->member[*c])
+			continue;
 
-		for (tmp2 = (char *)delim; *tmp2 != '\0'; ++tmp2) {
-			if (*tmp1 == *tmp2) {
-				found = true;
-				goto done;
-			}
-		}
+		if (set->count == SCAN_SET_MAX)
+			return false;
 
+		set->member[*c] = true;
+		set->chars[set->count++] = *c;
 	}
 
-done:
-	return (char *)(found ? tmp1 : NULL);
+	/* The vector scanners always compare against all four. */
+	for (i = set->count; i && i < SCAN_SET_MAX; i++)
+		set->chars[i] = set->chars[i - 1];
+
+	return true;
 }
 
-/**
- * strip_spaces:
- * @str: String that contain spaces.
- * Strips space characters from the string and creates a newly allocated string.
- * Original string is unchanged.
- * Returns: a newly allocated string with out space characters.
- */
-char *strip_spaces(char *str)
+const char *scan_scalar(const struct scan_set *set, const char *data,
+								size_t len)
 {
-	char *p;
-	int i = 0, j = 0;
+	return scan_table(set, data, len);
+}
 
-	p = malloc(strlen(str));
-	if (!p)
-		return NULL;
+/* Below this the broadcasts cost more than the table lookups. */
+#define SCAN_VECTOR_MIN		32
+
+#ifdef HAVE_X86_SIMD
+static const char *scan_sse2(const struct scan_set *set, const char *data,
+								size_t len)
+{
+	__m128i c0, c1, c2, c3, v, m;
+	unsigned int mask;
+	size_t i;
+
+	if (len < SCAN_VECTOR_MIN || !set->count)
+		return scan_table(set, data, len);
+
+	c0 = _mm_set1_epi8(set->chars[0]);
+	c1 = _mm_set1_epi8(set->chars[1]);
+	c2 = _mm_set1_epi8(set->chars[2]);
+	c3 = _mm_set1_epi8(set->chars[3]);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0),
+						_mm_cmpeq_epi8(v, c1)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, c2),
+						_mm_cmpeq_epi8(v, c3)));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return data + i + __builtin_ctz(mask);
+	}
 
-	while(*(str + i) != '\0') {
-		if (*(str + i) != ' ') {
-			*(p + j) = *(str + i);
-			j++;
-		}
+	return scan_table(set, data + i, len - i);
+}
 
-		++i;
+__attribute__((target("avx2")))
+static const char *scan_avx2(const struct scan_set *set, const char *data,
+								size_t len)
+{
+	__m256i c0, c1, c2, c3, v, m;
+	unsigned int mask;
+	size_t i;
+
+	if (len < SCAN_VECTOR_MIN || !set->count)
+		return scan_table(set, data, len);
+
+	c0 = _mm256_set1_epi8(set->chars[0]);
+	c1 = _mm256_set1_epi8(set->chars[1]);
+	c2 = _mm256_set1_epi8(set->chars[2]);
+	c3 = _mm256_set1_epi8(set->chars[3]);
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (data + i));
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0),
+						_mm256_cmpeq_epi8(v, c1)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c2),
+						_mm256_cmpeq_epi8(v, c3)));
+
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return data + i + __builtin_ctz(mask);
 	}
 
-	*(p + j) = '\0';
-	return p;
+	return scan_table(set, data + i, len - i);
 }
+#endif
+
+#ifdef HAVE_NEON
+static const char *scan_neon(const struct scan_set *set, const char *data,
+								size_t len)
+{
+	uint8x16_t c0, c1, c2, c3, v, m;
+	uint64_t mask;
+	size_t i;
+
+	if (len < SCAN_VECTOR_MIN || !set->count)
+		return scan_table(set, data, len);
+
+	c0 = vdupq_n_u8(set->chars[0]);
+	c1 = vdupq_n_u8(set->chars[1]);
+	c2 = vdupq_n_u8(set->chars[2]);
+	c3 = vdupq_n_u8(set->chars[3]);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8((const uint8_t *) data + i);
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, c0), vceqq_u8(v, c1)),
+				vorrq_u8(vceqq_u8(v, c2), vceqq_u8(v, c3)));
+
+		/* Narrow to four bits per byte, there is no movemask. */
+		mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (mask)
+			return data + i + (__builtin_ctzll(mask) >> 2);
+	}
+
+	return scan_table(set, data + i, len - i);
+}
+#endif
+
 /**
- * util_strstrip:
- * @str: String that contain spaces.
- * This function strips spaces from the string passed.
- * No new string is created.
+ * scan_select:
+ *
+ * Picks the widest implementation the CPU we run on supports, the same
+ * way sbc_synth_select() does.
+ *
+ * Returns: scan function, never NULL.
  */
-void util_strstrip(char *str)
+scan_func_t scan_select(void)
 {
-	int i = 0, j = 0;
-	int len = strlen(str);
-	/* Linux kernel banned use of variable length arrays in kernel code.*/
-	char temp[len];
-	memset(temp, 0, len);
-
-	while(*(str + i) != '\0') {
-		if (*(str + i) != ' ') {
-			*(temp + j) = *(str + i);
-			j++;
-		}
-
-		++i;
-	}
+	if (getenv("HFP_RECORDER_NO_SIMD"))
+		return scan_scalar;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_avx2;
+
+	return scan_sse2;
+#elif defined(HAVE_NEON)
+	return scan_neon;
+#else
+	return scan_scalar;
+#endif
+}
 
-	*(temp + j) = '\0';
-	memcpy(str, temp, j + 1);
+scan_func_t scan_lookup(const char *name)
+{
+	if (!strcmp(name, "scalar"))
+		return scan_scalar;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (!strcmp(name, "sse2"))
+		return scan_sse2;
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+		return scan_avx2;
+#endif
+#ifdef HAVE_NEON
+	if (!strcmp(name, "neon"))
+		return scan_neon;
+#endif
+	return NULL;
 }
 
-void util_charstrip(char *str, int c)
+const char *scan_name(scan_func_t func)
 {
-	int i = 0 , j = 0;
-	int len = strlen(str);
-	char temp[len];
-	memset(temp, 0, len);
-
-	while (*(str + i) != '\0') {
-		if (*(str + i) != c) {
-			*(temp + j) = *(str + i);
-			++j;
-		}
-		++i;
-	}
+#ifdef HAVE_X86_SIMD
+	if (func == scan_avx2)
+		return "avx2";
+	if (func == scan_sse2)
+		return "sse2";
+#endif
+#ifdef HAVE_NEON
+	if (func == scan_neon)
+		return "neon";
+#endif
+	return "scalar";
+}
+
+/*
+ * Only the main loop scans, so replacing the pointer on first use needs
+ * no lock.
+ */
+static const char *scan_first(const struct scan_set *set, const char *data,
+								size_t len)
+{
+	scan_impl = scan_select();
+	log_debug("byte scanner: %s", scan_name(scan_impl));
 
-	*(temp + j) = '\0';
-	memcpy(str, temp, j + 1);
+	return scan_impl(set, data, len);
 }
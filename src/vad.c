@@ -0,0 +1,283 @@
+/*
+ * vad.c
+ *
+ * Energy and zero crossings are the only features, which is all the
+ * vector code has to compute; the decision per block is a handful of
+ * scalar compares.
+ */
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#include "main.h"
+#include "vad.h"
+
+/* Mean square per sample below which a block is never speech, -58 dBFS. */
+#define VAD_ENERGY_MIN		(40 * 40)
+/* Speech is this far above the noise floor, 6 dB. */
+#define VAD_SPEECH_RATIO	4
+/* Unvoiced speech: busy zero crossings at a lower ratio, 3 dB. */
+#define VAD_NOISY_RATIO		2
+#define VAD_CROSSINGS_MIN	3000	/* per second */
+
+void vad_analyze_scalar(const int16_t *pcm, unsigned int samples,
+					struct vad_features *features)
+{
+	uint64_t energy = 0;
+	unsigned int crossings = 0, i;
+
+	for (i = 0; i < samples; i++) {
+		energy += (int32_t) pcm[i] * pcm[i];
+		if (i && (pcm[i] ^ pcm[i - 1]) < 0)
+			crossings++;
+	}
+
+	features->energy = energy;
+	features->crossings = crossings;
+}
+
+#ifdef HAVE_SSE2
+static void vad_analyze_sse2(const int16_t *pcm, unsigned int samples,
+					struct vad_features *features)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i energy = zero, crossings = zero, v, next, sq;
+	struct vad_features tail;
+	uint64_t e[2];
+	int16_t c[8];
+	unsigned int i, n;
+
+	/* Eight samples and their successors per step. */
+	for (i = 0; i + 9 <= samples; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (pcm + i));
+		next = _mm_loadu_si128((const __m128i *) (pcm + i + 1));
+
+		/* Pairs of squares fit u32, only -32768 twice needs bit 31. */
+		sq = _mm_madd_epi16(v, v);
+		energy = _mm_add_epi64(energy, _mm_unpacklo_epi32(sq, zero));
+		energy = _mm_add_epi64(energy, _mm_unpackhi_epi32(sq, zero));
+
+		/* -1 in each lane whose sign differs from the next one. */
+		crossings = _mm_sub_epi16(crossings,
+				_mm_srai_epi16(_mm_xor_si128(v, next), 15));
+	}
+
+	_mm_storeu_si128((__m128i *) e, energy);
+	_mm_storeu_si128((__m128i *) c, crossings);
+
+	/* The vector loop counted the crossing into pcm[i] already. */
+	vad_analyze_scalar(pcm + i, samples - i, &tail);
+
+	features->energy = e[0] + e[1] + tail.energy;
+	features->crossings = tail.crossings;
+	for (n = 0; n < 8; n++)
+		features->crossings += (uint16_t) c[n];
+}
+#endif
+
+#ifdef HAVE_NEON
+static void vad_analyze_neon(const int16_t *pcm, unsigned int samples,
+					struct vad_features *features)
+{
+	uint64x2_t energy = vdupq_n_u64(0);
+	int16x8_t crossings = vdupq_n_s16(0), v, next;
+	struct vad_features tail;
+	unsigned int i;
+
+	for (i = 0; i + 9 <= samples; i += 8) {
+		v = vld1q_s16(pcm + i);
+		next = vld1q_s16(pcm + i + 1);
+
+		energy = vpadalq_u32(energy, vreinterpretq_u32_s32(
+				vmull_s16(vget_low_s16(v), vget_low_s16(v))));
+		energy = vpadalq_u32(energy, vreinterpretq_u32_s32(
+				vmull_s16(vget_high_s16(v), vget_high_s16(v))));
+
+		crossings = vsubq_s16(crossings,
+				vshrq_n_s16(veorq_s16(v, next), 15));
+	}
+
+	vad_analyze_scalar(pcm + i, samples - i, &tail);
+
+	features->energy = vaddvq_u64(energy) + tail.energy;
+	features->crossings = vaddlvq_u16(vreinterpretq_u16_s16(crossings)) +
+							tail.crossings;
+}
+#endif
+
+void vad_init(struct vad *vad, unsigned int rate)
+{
+	memset(vad, 0, sizeof(*vad));
+	vad->rate = rate;
+	vad->block = rate * VAD_BLOCK_MS / 1000;
+	vad->analyze = vad_analyze_select();
+	vad->floor = (uint64_t) VAD_ENERGY_MIN << 8;
+}
+
+static uint64_t vad_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Closes a budget window once a second of audio went through. */
+static void vad_budget(struct vad *vad, unsigned int samples)
+{
+	vad->window += samples;
+	if (vad->window < vad->rate)
+		return;
+
+	vad->bypass = vad->spent > VAD_BUDGET_USEC * 1000ull;
+	if (vad->bypass)
+		vad->over_budget++;
+
+	vad->window = 0;
+	vad->spent = 0;
+}
+
+static bool vad_decide(struct vad *vad, const struct vad_features *f,
+							unsigned int samples)
+{
+	uint64_t energy = (f->energy << 8) / samples;
+	uint64_t crossings = (uint64_t) f->crossings * vad->rate / samples;
+	bool active;
+
+	active = energy > (uint64_t) VAD_ENERGY_MIN << 8 &&
+			(energy > vad->floor * VAD_SPEECH_RATIO ||
+			(energy > vad->floor * VAD_NOISY_RATIO &&
+				crossings >= VAD_CROSSINGS_MIN));
+
+	/* The floor drops to quiet blocks fast and creeps up, 3 dB/s. */
+	if (energy < vad->floor)
+		vad->floor -= (vad->floor - energy) >> 2;
+	else
+		vad->floor += L_MIN(energy - vad->floor, vad->floor) >> 7;
+
+	vad->floor = L_MAX(vad->floor, (uint64_t) VAD_ENERGY_MIN << 8);
+
+	if (active)
+		vad->hangover = VAD_HANGOVER_MS / VAD_BLOCK_MS;
+	else if (vad->hangover)
+		vad->hangover--;
+
+	return active || vad->hangover;
+}
+
+/*
+ * Speech rarely starts on a block boundary, and the block it starts in
+ * may hold too little of it to count. The caller keeps the silent block
+ * before an onset as speech, so it is not counted as silent either.
+ */
+static void vad_onset(struct vad *vad, bool speech)
+{
+	vad->onset = speech && vad->silent_last;
+	if (vad->onset)
+		vad->silent--;
+
+	vad->silent_last = !speech;
+}
+
+/**
+ * vad_process:
+ * @vad: detector state
+ * @pcm: the next block of audio
+ * @samples: its length, normally vad->block
+ *
+ * Returns: true if the block is to be stored as speech. If vad->onset
+ * is set as well, so is the block before it.
+ */
+bool vad_process(struct vad *vad, const int16_t *pcm, unsigned int samples)
+{
+	struct vad_features features;
+	uint64_t start;
+	bool speech;
+
+	if (!samples)
+		return false;
+
+	vad->blocks++;
+
+	if (vad->bypass) {
+		vad_budget(vad, samples);
+		vad_onset(vad, true);
+		return true;
+	}
+
+	start = vad_now();
+
+	vad->analyze(pcm, samples, &features);
+	if ((pcm[0] ^ vad->last) < 0)
+		features.crossings++;
+	vad->last = pcm[samples - 1];
+
+	speech = vad_decide(vad, &features, samples);
+	vad_onset(vad, speech);
+	if (!speech)
+		vad->silent++;
+
+	vad->spent += vad_now() - start;
+	vad_budget(vad, samples);
+
+	return speech;
+}
+
+/* RMS of the noise floor, what silence stands in for. */
+unsigned int vad_level(const struct vad *vad)
+{
+	uint64_t energy = vad->floor >> 8;
+	unsigned int level = 0, bit;
+
+	/* Integer square root, bit by bit. */
+	for (bit = 1 << 15; bit; bit >>= 1) {
+		if ((uint64_t) (level | bit) * (level | bit) <= energy)
+			level |= bit;
+	}
+
+	return level;
+}
+
+/**
+ * vad_analyze_select:
+ *
+ * All implementations compute identical features; this only picks the
+ * fastest one for the CPU we run on.
+ *
+ * Returns: analysis function, never NULL.
+ */
+vad_analyze_func_t vad_analyze_select(void)
+{
+	if (getenv("HFP_RECORDER_NO_SIMD"))
+		return vad_analyze_scalar;
+
+#if defined(HAVE_SSE2)
+	return vad_analyze_sse2;
+#elif defined(HAVE_NEON)
+	return vad_analyze_neon;
+#else
+	return vad_analyze_scalar;
+#endif
+}
+
+const char *vad_analyze_name(vad_analyze_func_t func)
+{
+#if defined(HAVE_SSE2)
+	if (func == vad_analyze_sse2)
+		return "sse2";
+#endif
+#if defined(HAVE_NEON)
+	if (func == vad_analyze_neon)
+		return "neon";
+#endif
+	return "scalar";
+}
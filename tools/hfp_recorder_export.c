@@ -0,0 +1,975 @@
+/*
+ * hfp_recorder_export.c
+ *
+ * Bulk export of recordings to WAV, either 16 bit PCM or IMA ADPCM,
+ * optionally resampled between 8 and 16 kHz. Recordings are read in
+ * place through the daemon's mmap reader and decoded by the encoders
+ * that wrote them; silence is filled back in as noise at its level.
+ *
+ * Every file is first scanned, one job, which counts its samples per
+ * chunk and sizes the output. The call is then cut into segments of
+ * whole output blocks that are decoded, resampled and written to their
+ * place in the output on their own, so a long call keeps every core
+ * busy. Jobs go on per thread deques: a thread works its own newest
+ * job first and an idle one steals the oldest job of another.
+ *
+ * Build: make hfp_recorder_export (from src/)
+ * Usage: hfp_recorder_export [-o dir] [-f wav|ima] [-r rate] [-j threads]
+ *		[-s seconds] [-v] recording...
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "main.h"
+#include "recording.h"
+#include "encoder.h"
+#include "adpcm.h"
+
+#define EXPORT_THREADS_MAX	64
+#define EXPORT_SEGMENT_SEC	60
+
+/* Resampling filter half length, in samples at the higher rate. */
+#define RESAMPLE_HALF		16
+
+/* Samples an IMA ADPCM block is trial encoded over for its step size. */
+#define IMA_WARMUP		16
+
+/* Decoded samples one record can hold, ADPCM being the densest. */
+#define RECORD_SAMPLES_MAX	(REC_RECORD_MAX * 2)
+
+enum export_format {
+	FORMAT_WAV,		/* s16le PCM */
+	FORMAT_IMA,		/* IMA ADPCM, Microsoft layout */
+};
+
+struct export_file {
+	const char *path;
+	char *out_path;
+	struct rec_reader *reader;
+	const struct encoder *decoder;	/* NULL when it is all PCM */
+	unsigned int in_rate;
+	unsigned int out_rate;
+	unsigned int chunks;
+	uint64_t *prefix;	/* input samples before each chunk */
+	uint64_t in_samples;
+	uint64_t out_samples;
+	uint64_t data_offset;
+	unsigned int segments;
+	unsigned int remaining;	/* segments, under pool.lock */
+	bool failed;		/* under pool.lock */
+	unsigned int errors;	/* records that did not decode */
+	int fd;
+};
+
+struct export_job {
+	struct export_file *file;
+	bool scan;
+	uint64_t start, end;	/* output samples */
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct export_job **jobs;
+	unsigned int size;	/* power of two */
+	unsigned int head;	/* oldest, taken by thieves */
+	unsigned int tail;	/* newest, taken by the owner */
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	struct deque deque;
+	uint64_t jobs;
+	uint64_t steals;
+	/* Grown as needed, kept across jobs. */
+	int16_t *window;
+	size_t window_len;
+	int16_t *out;
+	size_t out_len;
+	int16_t *blocks;	/* IMA ADPCM, never more than out */
+	size_t blocks_len;
+	int16_t record[RECORD_SAMPLES_MAX];
+};
+
+static struct {
+	const char *dir;
+	enum export_format format;
+	unsigned int rate;	/* 0 keeps the recording's */
+	unsigned int segment;	/* seconds */
+	bool verbose;
+} opts = {
+	.dir = ".",
+	.format = FORMAT_WAV,
+	.segment = EXPORT_SEGMENT_SEC,
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct worker *workers;
+	unsigned int count;
+	uint64_t pushed;	/* bumped on every push, for sleepers */
+	unsigned int outstanding;	/* jobs pushed and not finished */
+
+	unsigned int files;
+	unsigned int failed;
+	uint64_t audio_time;	/* usec, exported */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Lowpass at a quarter of the higher rate, Blackman windowed sinc. */
+static float resample_taps[2 * RESAMPLE_HALF + 1];
+
+static void resample_init(void)
+{
+	double sum = 0, x, w;
+	int j;
+
+	for (j = -RESAMPLE_HALF; j <= RESAMPLE_HALF; j++) {
+		x = M_PI * j / 2;
+		w = 0.42 + 0.5 * cos(M_PI * j / (RESAMPLE_HALF + 1)) +
+				0.08 * cos(2 * M_PI * j / (RESAMPLE_HALF + 1));
+		resample_taps[j + RESAMPLE_HALF] = (j ? sin(x) / x : 1) * w;
+		sum += resample_taps[j + RESAMPLE_HALF];
+	}
+
+	for (j = 0; j <= 2 * RESAMPLE_HALF; j++)
+		resample_taps[j] /= sum;
+}
+
+static int16_t clip(float v)
+{
+	return lrintf(L_MAX(-32768.0f, L_MIN(32767.0f, v)));
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void deque_push(struct deque *dq, struct export_job *job)
+{
+	struct export_job **jobs;
+	unsigned int i;
+
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail - dq->head == dq->size) {
+		jobs = l_new(struct export_job *, dq->size * 2);
+		for (i = dq->head; i != dq->tail; i++)
+			jobs[i & (dq->size * 2 - 1)] =
+					dq->jobs[i & (dq->size - 1)];
+
+		l_free(dq->jobs);
+		dq->jobs = jobs;
+		dq->size *= 2;
+	}
+
+	dq->jobs[dq->tail++ & (dq->size - 1)] = job;
+
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static struct export_job *deque_pop(struct deque *dq)
+{
+	struct export_job *job = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head)
+		job = dq->jobs[--dq->tail & (dq->size - 1)];
+	pthread_mutex_unlock(&dq->lock);
+
+	return job;
+}
+
+static struct export_job *deque_steal(struct deque *dq)
+{
+	struct export_job *job = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head)
+		job = dq->jobs[dq->head++ & (dq->size - 1)];
+	pthread_mutex_unlock(&dq->lock);
+
+	return job;
+}
+
+/* Jobs must be counted as outstanding before they are pushed. */
+static void pool_push(struct worker *worker, struct export_job *job)
+{
+	deque_push(&worker->deque, job);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.pushed++;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_expect(unsigned int jobs)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.outstanding += jobs;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct export_job *pool_take(struct worker *worker)
+{
+	struct export_job *job;
+	unsigned int i;
+
+	job = deque_pop(&worker->deque);
+	if (job)
+		return job;
+
+	for (i = 1; i < pool.count; i++) {
+		job = deque_steal(&pool.workers[(worker->id + i) %
+							pool.count].deque);
+		if (job) {
+			worker->steals++;
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+static bool write_all(int fd, const void *data, size_t len, uint64_t offset)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return true;
+}
+
+/* Bytes per output block, and samples per block. */
+static unsigned int block_align(const struct export_file *file)
+{
+	if (opts.format == FORMAT_WAV)
+		return sizeof(int16_t);
+
+	return file->out_rate > 11025 ? 512 : 256;
+}
+
+static unsigned int block_samples(const struct export_file *file)
+{
+	/* The block header holds the first sample as is. */
+	return opts.format == FORMAT_IMA ?
+			(block_align(file) - 4) * 2 + 1 : 1;
+}
+
+struct wav_header {
+	char riff[4];
+	uint32_t riff_len;
+	char wave[4];
+	char fmt[4];
+	uint32_t fmt_len;
+	uint16_t format;
+	uint16_t channels;
+	uint32_t rate;
+	uint32_t byte_rate;
+	uint16_t block_align;
+	uint16_t bits;
+	/* IMA ADPCM only from here, up to data. */
+	uint16_t extra_len;
+	uint16_t block_samples;
+	char fact[4];
+	uint32_t fact_len;
+	uint32_t samples;
+} __attribute__((packed));
+
+struct wav_data {
+	char data[4];
+	uint32_t len;
+} __attribute__((packed));
+
+static bool file_header(struct export_file *file)
+{
+	struct {
+		struct wav_header wav;
+		struct wav_data data;
+	} __attribute__((packed)) hdr;
+	unsigned int align = block_align(file), per_block = block_samples(file);
+	struct wav_data *data;
+	uint64_t len;
+
+	len = (file->out_samples + per_block - 1) / per_block * align;
+	if (len > UINT32_MAX - sizeof(hdr))
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.wav.riff, "RIFF", 4);
+	memcpy(hdr.wav.wave, "WAVE", 4);
+	memcpy(hdr.wav.fmt, "fmt ", 4);
+	hdr.wav.channels = htole16(1);
+	hdr.wav.rate = htole32(file->out_rate);
+	hdr.wav.block_align = htole16(align);
+
+	if (opts.format == FORMAT_IMA) {
+		hdr.wav.fmt_len = htole32(20);
+		hdr.wav.format = htole16(0x0011);
+		hdr.wav.byte_rate = htole32((uint64_t) file->out_rate *
+							align / per_block);
+		hdr.wav.bits = htole16(4);
+		hdr.wav.extra_len = htole16(2);
+		hdr.wav.block_samples = htole16(per_block);
+		memcpy(hdr.wav.fact, "fact", 4);
+		hdr.wav.fact_len = htole32(4);
+		hdr.wav.samples = htole32(file->out_samples);
+		file->data_offset = sizeof(hdr);
+	} else {
+		hdr.wav.fmt_len = htole32(16);
+		hdr.wav.format = htole16(0x0001);
+		hdr.wav.byte_rate = htole32(file->out_rate * sizeof(int16_t));
+		hdr.wav.bits = htole16(16);
+		file->data_offset = offsetof(struct wav_header, extra_len) +
+						sizeof(struct wav_data);
+	}
+
+	data = (void *) ((uint8_t *) &hdr + file->data_offset -
+						sizeof(struct wav_data));
+	memcpy(data->data, "data", 4);
+	data->len = htole32(len);
+	hdr.wav.riff_len = htole32(file->data_offset - 8 + len);
+
+	return write_all(file->fd, &hdr, file->data_offset, 0) &&
+			!ftruncate(file->fd, file->data_offset + len);
+}
+
+static void file_free(struct export_file *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+
+	rec_reader_close(file->reader);
+	l_free(file->prefix);
+	l_free(file->out_path);
+	l_free(file);
+}
+
+static void file_done(struct export_file *file, bool ok)
+{
+	uint64_t usec = 0;
+
+	if (ok && file->out_rate)
+		usec = file->out_samples * 1000000 / file->out_rate;
+
+	if (!ok && file->fd >= 0)
+		unlink(file->out_path);
+
+	if (!ok)
+		fprintf(stderr, "%s: export failed\n", file->path);
+	else if (opts.verbose)
+		printf("%s -> %s: %.1f s in %u segments%s\n", file->path,
+				file->out_path, usec / 1e6, file->segments,
+				file->errors ? ", with decode errors" : "");
+
+	pthread_mutex_lock(&pool.lock);
+	if (ok) {
+		pool.files++;
+		pool.audio_time += usec;
+		pool.bytes_out += file->data_offset +
+				(file->out_samples + block_samples(file) - 1) /
+				block_samples(file) * block_align(file);
+	} else {
+		pool.failed++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	file_free(file);
+}
+
+static char *output_path(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	size_t len;
+
+	base = base ? base + 1 : path;
+	len = strlen(base);
+	if (len > 4 && !strcmp(base + len - 4, ".hfr"))
+		len -= 4;
+
+	return l_strdup_printf("%s/%.*s.wav", opts.dir, (int) len, base);
+}
+
+/*
+ * Header walk over the whole recording: the input samples before each
+ * chunk, so a segment can start decoding at the right chunk, and the
+ * rate of the call. Audio at any other rate is dropped, it cannot be
+ * placed on the timeline.
+ */
+static bool file_scan(struct export_file *file)
+{
+	const struct rec_record *rec;
+	struct rec_cursor cursor;
+	const void *payload;
+	unsigned int chunk = 0, samples, rate, skipped = 0;
+	uint64_t total = 0;
+
+	file->chunks = rec_reader_chunks(file->reader);
+	file->prefix = l_new(uint64_t, file->chunks + 1);
+
+	rec_cursor_init(&cursor, 0);
+	while ((rec = rec_cursor_next(file->reader, &cursor, &payload))) {
+		while (chunk < cursor.chunk)
+			file->prefix[++chunk] = total;
+
+		samples = rec_record_samples(rec, payload);
+		if (!samples)
+			continue;
+
+		rate = rec_codec_rate(rec->codec);
+		if (!file->in_rate && rate)
+			file->in_rate = rate;
+
+		if (rate != file->in_rate) {
+			skipped++;
+			continue;
+		}
+
+		if (rec->type == REC_AUDIO && rec->codec != REC_CODEC_PCM_8K &&
+				rec->codec != REC_CODEC_PCM_16K &&
+				!file->decoder) {
+			file->decoder = encoder_for_codec(rec->codec);
+			if (!file->decoder) {
+				fprintf(stderr, "%s: codec %u not supported\n",
+						file->path, rec->codec);
+				return false;
+			}
+		}
+
+		total += samples;
+	}
+
+	while (chunk < file->chunks)
+		file->prefix[++chunk] = total;
+
+	if (skipped)
+		fprintf(stderr, "%s: %u records at another rate dropped\n",
+						file->path, skipped);
+
+	file->in_samples = total;
+	if (!file->in_rate)
+		file->in_rate = opts.rate ? opts.rate : 8000;
+
+	file->out_rate = opts.rate ? opts.rate : file->in_rate;
+	if (file->out_rate != file->in_rate &&
+			file->out_rate != file->in_rate * 2 &&
+			file->out_rate * 2 != file->in_rate) {
+		fprintf(stderr, "%s: cannot resample %u Hz to %u Hz\n",
+				file->path, file->in_rate, file->out_rate);
+		return false;
+	}
+
+	file->out_samples = total * file->out_rate / file->in_rate;
+
+	return true;
+}
+
+static void job_scan(struct worker *worker, struct export_job *job)
+{
+	struct export_file *file = job->file;
+	struct export_job *segment;
+	uint64_t len, start;
+	unsigned int per_block;
+	struct stat st;
+
+	file->fd = -1;
+	file->reader = rec_reader_open(file->path);
+	if (!file->reader) {
+		fprintf(stderr, "%s: cannot open recording\n",
+							file->path);
+		goto fail;
+	}
+
+	if (!file_scan(file))
+		goto fail;
+
+	file->out_path = output_path(file->path);
+	file->fd = open(file->out_path, O_WRONLY | O_CREAT | O_TRUNC |
+							O_CLOEXEC, 0644);
+	if (file->fd < 0) {
+		fprintf(stderr, "%s: %s\n", file->out_path, strerror(errno));
+		goto fail;
+	}
+
+	if (!file_header(file))
+		goto fail;
+
+	if (!stat(file->path, &st)) {
+		pthread_mutex_lock(&pool.lock);
+		pool.bytes_in += st.st_size;
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	/* Two blocks per step keep both rates on whole samples. */
+	per_block = block_samples(file) * 2;
+	len = (uint64_t) opts.segment * file->out_rate;
+	len = L_MAX(per_block, len / per_block * per_block);
+
+	file->segments = (file->out_samples + len - 1) / len;
+	file->remaining = file->segments;
+	if (!file->segments) {
+		file_done(file, true);
+		return;
+	}
+
+	pool_expect(file->segments);
+
+	for (start = 0; start < file->out_samples; start += len) {
+		segment = l_new(struct export_job, 1);
+		segment->file = file;
+		segment->start = start;
+		segment->end = L_MIN(start + len, file->out_samples);
+		pool_push(worker, segment);
+	}
+
+	return;
+
+fail:
+	file_done(file, false);
+}
+
+/* Per sample, so the noise does not depend on where segments start. */
+static int16_t comfort_noise(uint64_t sample, unsigned int level)
+{
+	uint64_t x = (sample + 1) * 0x9e3779b97f4a7c15ull;
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	/* Uniform over +-sqrt(3) level has an RMS of level. */
+	return ((int64_t) (x >> 48) - 32768) * level * 1732 / 32768000;
+}
+
+/* First chunk to decode from to have audio from @sample on. */
+static unsigned int segment_chunk(const struct export_file *file,
+							uint64_t sample)
+{
+	unsigned int lo = 0, hi = file->chunks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (file->prefix[mid] <= sample)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int decode_record(struct export_file *file, void *state,
+				const struct rec_record *rec, const void *payload,
+				int16_t *pcm)
+{
+	const uint8_t *in = payload;
+	unsigned int len = le16toh(rec->len), i;
+
+	if (rec->codec == REC_CODEC_PCM_8K || rec->codec == REC_CODEC_PCM_16K) {
+		for (i = 0; i < len / 2; i++)
+			pcm[i] = (int16_t) (in[2 * i] | in[2 * i + 1] << 8);
+
+		return len / 2;
+	}
+
+	if (!state || encoder_for_codec(rec->codec) != file->decoder)
+		return -ENOTSUP;
+
+	return file->decoder->decode(state, payload, len, pcm,
+							RECORD_SAMPLES_MAX);
+}
+
+/*
+ * Decodes input samples [from, to) into @window, zeros where the
+ * recording has none. Decoding starts early enough for the decoder to
+ * have settled by @from.
+ */
+static void segment_decode(struct worker *worker, struct export_file *file,
+					int64_t from, int64_t to)
+{
+	int16_t *window = worker->window;
+	const struct rec_silence *silence;
+	const struct rec_record *rec;
+	struct rec_cursor cursor;
+	const void *payload;
+	uint64_t start, pos;
+	int64_t lo, hi, i;
+	unsigned int samples;
+	void *state = NULL;
+	int ret;
+
+	memset(window, 0, (to - from) * sizeof(int16_t));
+
+	start = L_MAX(from, 0);
+	if (file->decoder) {
+		start -= L_MIN(start, (uint64_t) file->decoder->preroll *
+						file->in_rate / 1000000);
+		state = file->decoder->decoder_new(file->in_rate);
+	}
+
+	rec_cursor_init(&cursor, segment_chunk(file, start));
+	pos = file->prefix[cursor.chunk];
+
+	while ((int64_t) pos < to &&
+			(rec = rec_cursor_next(file->reader, &cursor, &payload))) {
+		samples = rec_record_samples(rec, payload);
+		if (!samples || rec_codec_rate(rec->codec) != file->in_rate)
+			continue;
+
+		if (pos + samples <= start) {
+			pos += samples;
+			continue;
+		}
+
+		lo = L_MAX((int64_t) pos, from);
+		hi = L_MIN((int64_t) (pos + samples), to);
+
+		if (rec->type == REC_SILENCE) {
+			silence = payload;
+			for (i = lo; i < hi; i++)
+				window[i - from] = comfort_noise(i,
+						le16toh(silence->level));
+		} else {
+			ret = decode_record(file, state, rec, payload,
+							worker->record);
+			if (ret < 0)
+				__atomic_add_fetch(&file->errors, 1,
+							__ATOMIC_RELAXED);
+
+			for (i = lo; i < hi && i - (int64_t) pos < ret; i++)
+				window[i - from] = worker->record[i - pos];
+		}
+
+		pos += samples;
+	}
+
+	if (state)
+		file->decoder->decoder_free(state);
+}
+
+/*
+ * Output samples [start, end) from the window starting at input @from.
+ * The filter is halfband: beside the centre only odd taps are not zero,
+ * and it is symmetric, so each output takes RESAMPLE_HALF / 2 pairs.
+ */
+static void segment_resample(const struct export_file *file,
+				const int16_t *window, int64_t from,
+				uint64_t start, uint64_t end, int16_t *out)
+{
+	const float *h = resample_taps + RESAMPLE_HALF;
+	const int16_t *x;
+	uint64_t k;
+	float v;
+	int j;
+
+	if (file->out_rate == file->in_rate) {
+		memcpy(out, window + (start - from),
+					(end - start) * sizeof(int16_t));
+		return;
+	}
+
+	for (k = start; k < end; k++) {
+		if (file->out_rate < file->in_rate) {
+			x = window + (2 * k - from);
+			v = h[0] * x[0];
+			for (j = 1; j < RESAMPLE_HALF; j += 2)
+				v += h[j] * (x[-j] + x[j]);
+		} else if (k & 1) {
+			/* Between x[0] and x[1], zero stuffed input. */
+			x = window + (k / 2 - from);
+			v = 0;
+			for (j = 1; j < RESAMPLE_HALF; j += 2)
+				v += 2 * h[j] * (x[-(j - 1) / 2] +
+							x[(j + 1) / 2]);
+		} else {
+			v = 2 * h[0] * window[k / 2 - from];
+		}
+
+		out[k - start] = clip(v);
+	}
+}
+
+static bool segment_write(struct worker *worker, struct export_file *file,
+					uint64_t start, uint64_t end)
+{
+	unsigned int per_block = block_samples(file), align, blocks, b;
+	struct adpcm_state state;
+	int16_t *out = worker->out, *pcm;
+	uint8_t *dst;
+	uint64_t n;
+
+	if (opts.format == FORMAT_WAV) {
+		for (n = 0; n < end - start; n++)
+			out[n] = htole16(out[n]);
+
+		return write_all(file->fd, out, (end - start) * sizeof(int16_t),
+				file->data_offset + start * sizeof(int16_t));
+	}
+
+	/*
+	 * Each block starts from its own first sample and a step size
+	 * found by a trial encode of its opening samples, rather than the
+	 * one the previous block ended with: the output then does not
+	 * depend on where segments were cut.
+	 */
+	align = block_align(file);
+	blocks = (end - start + per_block - 1) / per_block;
+	memset(out + (end - start), 0,
+			(blocks * per_block - (end - start)) * sizeof(int16_t));
+
+	for (b = 0; b < blocks; b++) {
+		pcm = out + b * per_block;
+		dst = (uint8_t *) worker->blocks + b * align;
+
+		state.predictor = pcm[0];
+		state.index = 0;
+		adpcm_encode(&state, pcm + 1, IMA_WARMUP, dst + 4);
+
+		state.predictor = pcm[0];
+		dst[0] = pcm[0] & 0xff;
+		dst[1] = (uint16_t) pcm[0] >> 8;
+		dst[2] = state.index;
+		dst[3] = 0;
+		adpcm_encode(&state, pcm + 1, per_block - 1, dst + 4);
+	}
+
+	return write_all(file->fd, worker->blocks, (size_t) blocks * align,
+			file->data_offset + start / per_block * align);
+}
+
+static void *grow(void *buf, size_t *len, size_t need)
+{
+	if (need <= *len)
+		return buf;
+
+	*len = need;
+	return l_realloc(buf, need * sizeof(int16_t));
+}
+
+static void job_segment(struct worker *worker, struct export_job *job)
+{
+	struct export_file *file = job->file;
+	unsigned int per_block = block_samples(file);
+	int64_t from, to;
+	uint64_t in_start, in_end, len;
+	bool ok, last;
+
+	in_start = job->start * file->in_rate / file->out_rate;
+	in_end = job->end == file->out_samples ? file->in_samples :
+				job->end * file->in_rate / file->out_rate;
+
+	/* The filter reaches RESAMPLE_HALF samples either way. */
+	from = (int64_t) in_start - RESAMPLE_HALF;
+	to = in_end + RESAMPLE_HALF;
+
+	worker->window = grow(worker->window, &worker->window_len, to - from);
+	len = (job->end - job->start + per_block) / per_block * per_block;
+	worker->out = grow(worker->out, &worker->out_len, len);
+	if (opts.format == FORMAT_IMA)
+		worker->blocks = grow(worker->blocks, &worker->blocks_len,
+									len);
+
+	segment_decode(worker, file, from, to);
+	segment_resample(file, worker->window, from, job->start, job->end,
+								worker->out);
+	ok = segment_write(worker, file, job->start, job->end);
+
+	pthread_mutex_lock(&pool.lock);
+	file->failed |= !ok;
+	last = !--file->remaining;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (last)
+		file_done(file, !file->failed);
+}
+
+static void job_done(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (!--pool.outstanding)
+		pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *worker_thread(void *user_data)
+{
+	struct worker *worker = user_data;
+	struct export_job *job;
+	uint64_t seen;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		seen = pool.pushed;
+		pthread_mutex_unlock(&pool.lock);
+
+		job = pool_take(worker);
+		if (job) {
+			if (job->scan)
+				job_scan(worker, job);
+			else
+				job_segment(worker, job);
+
+			l_free(job);
+			worker->jobs++;
+			job_done();
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while (pool.pushed == seen && pool.outstanding)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		if (!pool.outstanding) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-o dir] [-f wav|ima] [-r rate] "
+			"[-j threads] [-s seconds] [-v] recording...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int threads = sysconf(_SC_NPROCESSORS_ONLN), i;
+	struct export_job *job;
+	struct worker *worker;
+	uint64_t jobs = 0, steals = 0;
+	double wall;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:f:r:j:s:v")) != -1) {
+		switch (opt) {
+		case 'o':
+			opts.dir = optarg;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "wav"))
+				opts.format = FORMAT_WAV;
+			else if (!strcmp(optarg, "ima"))
+				opts.format = FORMAT_IMA;
+			else
+				goto usage;
+			break;
+		case 'r':
+			opts.rate = strtoul(optarg, NULL, 10);
+			if (opts.rate != 8000 && opts.rate != 16000)
+				goto usage;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			opts.segment = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind == argc || !opts.segment)
+		goto usage;
+
+	threads = L_MAX(1u, L_MIN(threads, EXPORT_THREADS_MAX));
+	resample_init();
+
+	pool.count = threads;
+	pool.workers = l_new(struct worker, threads);
+	for (i = 0; i < threads; i++) {
+		worker = &pool.workers[i];
+		worker->id = i;
+		worker->deque.size = 64;
+		worker->deque.jobs = l_new(struct export_job *, 64);
+		pthread_mutex_init(&worker->deque.lock, NULL);
+	}
+
+	/* Files are dealt out evenly, stealing evens out what is left. */
+	for (i = optind; i < (unsigned int) argc; i++) {
+		job = l_new(struct export_job, 1);
+		job->scan = true;
+		job->file = l_new(struct export_file, 1);
+		job->file->path = argv[i];
+		deque_push(&pool.workers[i % threads].deque, job);
+	}
+
+	pool.outstanding = argc - optind;
+	wall = now_seconds();
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL,
+					worker_thread, &pool.workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		worker = &pool.workers[i];
+		pthread_join(worker->thread, NULL);
+
+		if (opts.verbose)
+			printf("thread %u: %llu jobs, %llu stolen\n", i,
+				(unsigned long long) worker->jobs,
+				(unsigned long long) worker->steals);
+
+		jobs += worker->jobs;
+		steals += worker->steals;
+		l_free(worker->window);
+		l_free(worker->out);
+		l_free(worker->blocks);
+		l_free(worker->deque.jobs);
+		pthread_mutex_destroy(&worker->deque.lock);
+	}
+
+	wall = now_seconds() - wall;
+
+	printf("%u files, %u failed, %.2f h of audio in %.2f s on %u "
+			"threads: %.1f files/s, %.2f audio h/s, %.1f MB/s in, "
+			"%llu jobs, %llu stolen\n", pool.files, pool.failed,
+			pool.audio_time / 3.6e9, wall, threads,
+			pool.files / wall, pool.audio_time / 3.6e9 / wall,
+			pool.bytes_in / 1e6 / wall,
+			(unsigned long long) jobs, (unsigned long long) steals);
+
+	l_free(pool.workers);
+
+	return pool.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	usage(argv[0]);
+	return EXIT_FAILURE;
+}
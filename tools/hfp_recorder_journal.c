@@ -0,0 +1,205 @@
+/*
+ * hfp_recorder_journal.c
+ *
+ * Prints the daemon's call event journal, one line per event with its
+ * time of day, record number and session, optionally filtered, and can
+ * follow it as the daemon writes. The journal is only ever read, so
+ * this is safe to run against a live daemon or a crashed one.
+ *
+ * Times of day come from the clock offset the daemon saved when it
+ * started; a JOURNAL_START record further on replaces it for what
+ * follows, as the monotonic clock restarts with every boot.
+ *
+ * Build: make hfp_recorder_journal (from src/)
+ * Usage: hfp_recorder_journal [-f] [-n count] [-s session]
+ *		[-a address] [-t type,...] [journal]
+ */
+
+#include <endian.h>
+#include <time.h>
+
+#include "main.h"
+#include "journal.h"
+
+/* How often to look for new records when following. */
+#define FOLLOW_INTERVAL_MS	100
+
+struct filter {
+	uint32_t session;	/* 0 for any */
+	uint8_t address[6];
+	bool has_address;
+	uint32_t types;		/* bit per type, 0 for any */
+};
+
+static bool parse_types(const char *arg, uint32_t *types)
+{
+	char **names = l_strsplit(arg, ',');
+	unsigned int i;
+	int type;
+	bool ok = true;
+
+	for (i = 0; names[i]; i++) {
+		type = journal_type_from_name(names[i]);
+		if (type < 0) {
+			fprintf(stderr, "unknown event type %s\n", names[i]);
+			ok = false;
+			break;
+		}
+
+		*types |= 1u << type;
+	}
+
+	l_strfreev(names);
+	return ok;
+}
+
+static bool parse_address(const char *arg, uint8_t *address)
+{
+	unsigned int b[6], i;
+
+	if (sscanf(arg, "%2x:%2x:%2x:%2x:%2x:%2x",
+				&b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+		return false;
+
+	/* bdaddr_t is little endian. */
+	for (i = 0; i < 6; i++)
+		address[5 - i] = b[i];
+
+	return true;
+}
+
+static bool matches(const struct filter *filter,
+				const struct journal_record *rec)
+{
+	if (filter->session && le32toh(rec->session) != filter->session)
+		return false;
+
+	if (filter->has_address &&
+			memcmp(rec->address, filter->address, 6))
+		return false;
+
+	return !filter->types ||
+			(filter->types & (1u << le16toh(rec->type)));
+}
+
+static void print_record(const struct journal_record *rec, uint64_t offset)
+{
+	uint64_t ns = le64toh(rec->timestamp) + offset;
+	time_t sec = ns / 1000000000;
+	char text[160], when[32];
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	journal_format(rec, text, sizeof(text));
+
+	printf("%s.%06llu #%llu session %u %s\n", when,
+			(unsigned long long) (ns % 1000000000 / 1000),
+			(unsigned long long) le64toh(rec->seq),
+			le32toh(rec->session), text);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f] [-n count] [-s session] "
+			"[-a address] [-t type,...] [journal]\n"
+			"Types: start connect disconnect brsf ring clip ciev "
+			"answer\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec interval = { 0, FOLLOW_INTERVAL_MS * 1000000 };
+	struct filter filter = { 0 };
+	struct journal_reader *reader;
+	struct journal_record rec;
+	uint64_t first, last, seq, want, offset, count = 0;
+	const char *path = DEFAULT_RECORD_DIR "/" DEFAULT_JOURNAL;
+	bool follow = false, any;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "fn:s:a:t:")) != -1) {
+		switch (opt) {
+		case 'f':
+			follow = true;
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			filter.session = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			if (!parse_address(optarg, filter.address))
+				goto usage;
+			filter.has_address = true;
+			break;
+		case 't':
+			if (!parse_types(optarg, &filter.types))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	reader = journal_reader_open(path);
+	if (!reader) {
+		fprintf(stderr, "%s: not a journal\n", path);
+		return EXIT_FAILURE;
+	}
+
+	offset = le64toh(journal_reader_header(reader)->realtime_offset);
+
+	any = journal_reader_range(reader, &first, &last);
+	if (!any)
+		first = last = 0;
+
+	/* With -n, the last records; a filter makes them fewer. */
+	seq = count && last - first + 1 > count ? last - count + 1 : first;
+	if (!seq)
+		seq = 1;
+
+	for (;;) {
+		want = seq;
+		ret = journal_reader_next(reader, &seq, &rec);
+
+		if (!ret) {
+			if (le16toh(rec.type) == JOURNAL_START &&
+						rec.len >= sizeof(offset)) {
+				memcpy(&offset, rec.payload, sizeof(offset));
+				offset = le64toh(offset);
+			}
+
+			if (matches(&filter, &rec))
+				print_record(&rec, offset);
+			continue;
+		}
+
+		/* Lapped by the daemon while following, or sleeping. */
+		if (ret == -ESTALE) {
+			if (journal_reader_range(reader, &first, &last))
+				seq = L_MAX(seq, first);
+
+			printf("-- %llu records overwritten before being read\n",
+					(unsigned long long) (seq - want));
+			continue;
+		}
+
+		if (!follow)
+			break;
+
+		fflush(stdout);
+		nanosleep(&interval, NULL);
+	}
+
+	journal_reader_close(reader);
+	return EXIT_SUCCESS;
+
+usage:
+	usage(argv[0]);
+	return EXIT_FAILURE;
+}